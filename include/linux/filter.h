@@ -128,11 +128,14 @@ struct sock_fprog	/* Required for SO_ATTACH_FILTER. */
 #define SKF_LL_OFF    (-0x200000)
 
 #ifdef __KERNEL__
+struct sk_filter_image;
+
 struct sk_filter
 {
 	atomic_t		refcnt;
 	unsigned int         	len;	/* Number of filter blocks */
 	struct rcu_head		rcu;
+	struct sk_filter_image	*image;	/* compiled program, NULL if none */
 	struct sock_filter     	insns[0];
 };
 
@@ -150,6 +153,21 @@ extern unsigned int sk_run_filter(struct sk_buff *skb,
 extern int sk_attach_filter(struct sock_fprog *fprog, struct sock *sk);
 extern int sk_detach_filter(struct sock *sk);
 extern int sk_chk_filter(struct sock_filter *filter, int flen);
+
+extern int bpf_jit_enable;
+extern void bpf_jit_compile(struct sk_filter *fp);
+extern void bpf_jit_free(struct sk_filter *fp);
+extern unsigned int sk_run_filter_image(struct sk_buff *skb,
+					const struct sk_filter_image *image);
+
+static inline unsigned int sk_filter_run(struct sk_filter *fp,
+					 struct sk_buff *skb)
+{
+	if (fp->image)
+		return sk_run_filter_image(skb, fp->image);
+	return sk_run_filter(skb, fp->insns, fp->len);
+}
+#define SK_RUN_FILTER(FILTER, SKB) sk_filter_run(FILTER, SKB)
 #endif /* __KERNEL__ */
 
 #endif /* __LINUX_FILTER_H__ */
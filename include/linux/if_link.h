@@ -81,12 +81,39 @@ enum
 #define IFLA_LINKINFO IFLA_LINKINFO
 	IFLA_NET_NS_PID,
 	IFLA_IFALIAS,
+	/* 21-79 are reserved for upstream attributes this tree lacks */
+	IFLA_RX_FILTER = 80,
 	__IFLA_MAX
 };
 
 
 #define IFLA_MAX (__IFLA_MAX - 1)
 
+/* Early receive filter
+ *
+ * A classic BPF program run on every packet received by the device,
+ * before any tap or protocol handler sees it. The program returns 0 to
+ * drop the packet, RX_FILTER_REDIRECT | cpu to continue receive
+ * processing on that CPU, anything else to pass it on.
+ */
+enum {
+	IFLA_RX_FILTER_UNSPEC,
+	IFLA_RX_FILTER_PROG,	/* array of struct sock_filter, empty to detach */
+	IFLA_RX_FILTER_STATS,	/* struct ifla_rx_filter_stats (read only) */
+	__IFLA_RX_FILTER_MAX
+};
+
+#define IFLA_RX_FILTER_MAX (__IFLA_RX_FILTER_MAX - 1)
+
+#define RX_FILTER_REDIRECT	0x80000000
+#define RX_FILTER_CPU_MASK	0x0000ffff
+
+struct ifla_rx_filter_stats {
+	__u64	pass;
+	__u64	drop;
+	__u64	redirect;
+};
+
 /* backwards compatibility for userspace */
 #ifndef __KERNEL__
 #define IFLA_RTA(r)  ((struct rtattr*)(((char*)(r)) + NLMSG_ALIGN(sizeof(struct ifinfomsg))))
@@ -48,6 +48,17 @@ struct sockaddr_ll
 #define PACKET_RESERVE			12
 #define PACKET_TX_RING			13
 #define PACKET_LOSS			14
+#define PACKET_FANOUT			18
+#define PACKET_QDISC_BYPASS		20
+/* Values 15-17, 19 and 21-24 are taken by options this tree lacks. */
+#define PACKET_TX_STATISTICS		25
+
+#define PACKET_FANOUT_HASH		0
+#define PACKET_FANOUT_LB		1
+#define PACKET_FANOUT_CPU		2
+#define PACKET_FANOUT_ROLLOVER		3
+#define PACKET_FANOUT_FLAG_ROLLOVER	0x1000
+#define PACKET_FANOUT_FLAG_DEFRAG	0x8000
 
 struct tpacket_stats
 {
@@ -55,6 +66,20 @@ struct tpacket_stats
 	unsigned int	tp_drops;
 };
 
+struct tpacket_tx_stats
+{
+	unsigned int	tp_sent;
+	unsigned int	tp_dropped;
+	unsigned int	tp_wrong_format;
+};
+
+struct tpacket_stats_v3
+{
+	unsigned int	tp_packets;
+	unsigned int	tp_drops;
+	unsigned int	tp_freeze_q_cnt;	/* times the ring was full */
+};
+
 struct tpacket_auxdata
 {
 	__u32		tp_status;
@@ -72,6 +97,8 @@ struct tpacket_auxdata
 #define TP_STATUS_COPY		0x2
 #define TP_STATUS_LOSING	0x4
 #define TP_STATUS_CSUMNOTREADY	0x8
+#define TP_STATUS_VLAN_VALID	0x10	/* tp_vlan_tci is set */
+#define TP_STATUS_BLK_TMO	0x20	/* block retired by the timer */
 
 /* Tx ring - header status */
 #define TP_STATUS_AVAILABLE	0x0
@@ -109,10 +136,66 @@ struct tpacket2_hdr
 
 #define TPACKET2_HDRLEN		(TPACKET_ALIGN(sizeof(struct tpacket2_hdr)) + sizeof(struct sockaddr_ll))
 
+struct tpacket_hdr_variant1
+{
+	__u32		tp_rxhash;
+	__u32		tp_vlan_tci;
+};
+
+struct tpacket3_hdr
+{
+	__u32		tp_next_offset;	/* to the next packet, 0 if last */
+	__u32		tp_sec;
+	__u32		tp_nsec;
+	__u32		tp_snaplen;
+	__u32		tp_len;
+	__u32		tp_status;
+	__u16		tp_mac;
+	__u16		tp_net;
+	/* pkt_hdr variants */
+	union {
+		struct tpacket_hdr_variant1 hv1;
+	};
+};
+
+#define TPACKET3_HDRLEN		(TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) + sizeof(struct sockaddr_ll))
+
+struct tpacket_bd_ts
+{
+	unsigned int	ts_sec;
+	union {
+		unsigned int	ts_usec;
+		unsigned int	ts_nsec;
+	};
+};
+
+struct tpacket_hdr_v1
+{
+	__u32		block_status;
+	__u32		num_pkts;
+	__u32		offset_to_first_pkt;
+	__u32		blk_len;	/* bytes used, header included */
+	__u64		seq_num __attribute__((aligned(8)));
+	struct tpacket_bd_ts	ts_first_pkt, ts_last_pkt;
+};
+
+union tpacket_bd_header_u
+{
+	struct tpacket_hdr_v1 bh1;
+};
+
+struct tpacket_block_desc
+{
+	__u32		version;
+	__u32		offset_to_priv;
+	union tpacket_bd_header_u hdr;
+};
+
 enum tpacket_versions
 {
 	TPACKET_V1,
 	TPACKET_V2,
+	TPACKET_V3,
 };
 
 /*
@@ -126,6 +209,13 @@ enum tpacket_versions
    - Start+tp_mac: [ Optional MAC header ]
    - Start+tp_net: Packet data, aligned to TPACKET_ALIGNMENT=16.
    - Pad to align to TPACKET_ALIGNMENT=16
+
+   TPACKET_V3 rx rings have no fixed frames. Each block starts with a
+   struct tpacket_block_desc, followed by tp_sizeof_priv bytes for the
+   application, and then holds the packets back to back, each laid out
+   as a frame above with a struct tpacket3_hdr. A block is handed to
+   user space (block_status TP_STATUS_USER) when the next packet does
+   not fit in it or tp_retire_blk_tov msecs after its first packet.
  */
 
 struct tpacket_req
@@ -136,6 +226,26 @@ struct tpacket_req
 	unsigned int	tp_frame_nr;	/* Total number of frames */
 };
 
+struct tpacket_req3
+{
+	unsigned int	tp_block_size;	/* Minimal size of contiguous block */
+	unsigned int	tp_block_nr;	/* Number of blocks */
+	unsigned int	tp_frame_size;	/* Size of frame */
+	unsigned int	tp_frame_nr;	/* Total number of frames */
+	unsigned int	tp_retire_blk_tov; /* block timeout in msecs */
+	unsigned int	tp_sizeof_priv;	/* private area per block */
+	unsigned int	tp_feature_req_word;
+};
+
+union tpacket_req_u
+{
+	struct tpacket_req	req;
+	struct tpacket_req3	req3;
+};
+
+/* tp_feature_req_word bits */
+#define TP_FT_REQ_FILL_RXHASH	0x1
+
 struct packet_mreq
 {
 	int		mr_ifindex;
@@ -467,6 +467,17 @@ enum netdev_queue_state_t
 	__QUEUE_STATE_FROZEN,
 };
 
+struct sk_filter;
+struct sock_filter;
+struct ifla_rx_filter_stats;
+
+/* Early receive filter attached to a device through IFLA_RX_FILTER */
+struct netdev_rx_filter {
+	struct sk_filter		*prog;
+	struct ifla_rx_filter_stats	*stats;		/* per cpu */
+	struct rcu_head			rcu;
+};
+
 struct netdev_queue {
 /*
  * read mostly part
@@ -828,6 +839,9 @@ struct net_device
 
 	struct netdev_queue	rx_queue;
 
+	/* early receive filter, see netif_receive_skb() */
+	struct netdev_rx_filter	*rx_filter;
+
 	struct netdev_queue	*_tx ____cacheline_aligned_in_smp;
 
 	/* Number of TX queues allocated at alloc_netdev_mq() time  */
@@ -1501,6 +1515,11 @@ extern unsigned		dev_get_flags(const struct net_device *);
 extern int		dev_change_flags(struct net_device *, unsigned);
 extern int		dev_change_name(struct net_device *, const char *);
 extern int		dev_set_alias(struct net_device *, const char *, size_t);
+extern int		dev_set_rx_filter(struct net_device *dev,
+					  struct sock_filter *insns,
+					  unsigned int len);
+extern void		dev_get_rx_filter_stats(const struct netdev_rx_filter *f,
+						struct ifla_rx_filter_stats *st);
 extern int		dev_change_net_namespace(struct net_device *,
 						 struct net *, const char *);
 extern int		dev_set_mtu(struct net_device *, int);
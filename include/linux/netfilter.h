@@ -10,6 +10,7 @@
 #include <linux/in6.h>
 #include <linux/wait.h>
 #include <linux/list.h>
+#include <linux/netdevice.h>
 #endif
 #include <linux/types.h>
 #include <linux/compiler.h>
@@ -41,24 +42,7 @@
 #define NFC_ALTERED 0x8000
 #endif
 
-enum nf_inet_hooks {
-	NF_INET_PRE_ROUTING,
-	NF_INET_LOCAL_IN,
-	NF_INET_FORWARD,
-	NF_INET_LOCAL_OUT,
-	NF_INET_POST_ROUTING,
-	NF_INET_NUMHOOKS
-};
-
-enum {
-	NFPROTO_UNSPEC =  0,
-	NFPROTO_IPV4   =  2,
-	NFPROTO_ARP    =  3,
-	NFPROTO_BRIDGE =  7,
-	NFPROTO_IPV6   = 10,
-	NFPROTO_DECNET = 12,
-	NFPROTO_NUMPROTO,
-};
+#include <linux/netfilter_defs.h>
 
 union nf_inet_addr {
 	__u32		all[4];
@@ -82,9 +66,6 @@ static inline int nf_inet_addr_cmp(const union nf_inet_addr *a1,
 
 extern void netfilter_init(void);
 
-/* Largest hook number + 1 */
-#define NF_MAX_HOOKS 8
-
 struct sk_buff;
 
 typedef unsigned int nf_hookfn(unsigned int hooknum,
@@ -129,7 +110,16 @@ struct nf_sockopt_ops
 	struct module *owner;
 };
 
-/* Function to register/unregister hook points. */
+/* Function to register/unregister hook points in a single namespace. */
+int nf_register_net_hook(struct net *net, struct nf_hook_ops *reg);
+void nf_unregister_net_hook(struct net *net, struct nf_hook_ops *reg);
+int nf_register_net_hooks(struct net *net, struct nf_hook_ops *reg,
+			  unsigned int n);
+void nf_unregister_net_hooks(struct net *net, struct nf_hook_ops *reg,
+			     unsigned int n);
+
+/* Function to register/unregister hook points in every namespace,
+   including the ones created later on. */
 int nf_register_hook(struct nf_hook_ops *reg);
 void nf_unregister_hook(struct nf_hook_ops *reg);
 int nf_register_hooks(struct nf_hook_ops *reg, unsigned int n);
@@ -146,7 +136,17 @@ extern struct ctl_path nf_net_netfilter_sysctl_path[];
 extern struct ctl_path nf_net_ipv4_netfilter_sysctl_path[];
 #endif /* CONFIG_SYSCTL */
 
-extern struct list_head nf_hooks[NFPROTO_NUMPROTO][NF_MAX_HOOKS];
+/* The namespace whose hooks see a packet: the one it is received in,
+   or sent from when there is no input device. */
+static inline struct net *nf_hook_net(const struct net_device *indev,
+				      const struct net_device *outdev)
+{
+	if (indev)
+		return dev_net(indev);
+	if (outdev)
+		return dev_net(outdev);
+	return &init_net;
+}
 
 int nf_hook_slow(u_int8_t pf, unsigned int hook, struct sk_buff *skb,
 		 struct net_device *indev, struct net_device *outdev,
@@ -169,7 +169,7 @@ static inline int nf_hook_thresh(u_int8_t pf, unsigned int hook,
 	if (!cond)
 		return 1;
 #ifndef CONFIG_NETFILTER_DEBUG
-	if (list_empty(&nf_hooks[pf][hook]))
+	if (list_empty(&nf_hook_net(indev, outdev)->nf.hooks[pf][hook]))
 		return 1;
 #endif
 	return nf_hook_slow(pf, hook, skb, indev, outdev, okfn, thresh);
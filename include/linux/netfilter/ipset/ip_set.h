@@ -0,0 +1,331 @@
+#ifndef _IP_SET_H
+#define _IP_SET_H
+
+/* IP sets: named, typed collections of addresses, networks and ports
+ * which a single iptables rule can match against.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/types.h>
+
+/* The protocol version */
+#define IPSET_PROTOCOL		1
+
+/* The max length of strings including NUL: set and type identifiers */
+#define IPSET_MAXNAMELEN	32
+
+/* Message types and commands */
+enum ipset_cmd {
+	IPSET_CMD_NONE,
+	IPSET_CMD_PROTOCOL,	/* 1: Return protocol version */
+	IPSET_CMD_CREATE,	/* 2: Create a new (empty) set */
+	IPSET_CMD_DESTROY,	/* 3: Destroy a (empty) set */
+	IPSET_CMD_FLUSH,	/* 4: Remove all elements from a set */
+	IPSET_CMD_RENAME,	/* 5: Rename a set */
+	IPSET_CMD_SWAP,		/* 6: Swap two sets */
+	IPSET_CMD_LIST,		/* 7: List sets */
+	IPSET_CMD_ADD,		/* 8: Add an element to a set */
+	IPSET_CMD_DEL,		/* 9: Delete an element from a set */
+	IPSET_CMD_TEST,		/* 10: Test an element in a set */
+	IPSET_MSG_MAX,
+};
+
+/* Attributes at command level */
+enum {
+	IPSET_ATTR_UNSPEC,
+	IPSET_ATTR_PROTOCOL,	/* 1: Protocol version */
+	IPSET_ATTR_SETNAME,	/* 2: Name of the set */
+	IPSET_ATTR_TYPENAME,	/* 3: Typename */
+	IPSET_ATTR_SETNAME2 = IPSET_ATTR_TYPENAME, /* Setname at rename/swap */
+	IPSET_ATTR_REVISION,	/* 4: Settype revision */
+	IPSET_ATTR_FAMILY,	/* 5: Settype family */
+	IPSET_ATTR_FLAGS,	/* 6: Flags at command level */
+	IPSET_ATTR_DATA,	/* 7: Nested attributes */
+	IPSET_ATTR_ADT,		/* 8: Multiple data containers */
+	__IPSET_ATTR_CMD_MAX,
+};
+#define IPSET_ATTR_CMD_MAX	(__IPSET_ATTR_CMD_MAX - 1)
+
+/* Create, add/del/test and list attributes, nested in IPSET_ATTR_DATA.
+ * Addresses and ports are in network byte order, the rest in host. */
+enum {
+	IPSET_ATTR_IP = IPSET_ATTR_UNSPEC + 1,	/* __be32 */
+	IPSET_ATTR_IP_TO,	/* __be32 */
+	IPSET_ATTR_CIDR,	/* u8 */
+	IPSET_ATTR_PORT,	/* __be16 */
+	IPSET_ATTR_PORT_TO,	/* __be16 */
+	IPSET_ATTR_TIMEOUT,	/* u32, seconds */
+	IPSET_ATTR_PROTO,	/* u8 */
+	IPSET_ATTR_HASHSIZE,	/* u32 */
+	IPSET_ATTR_MAXELEM,	/* u32 */
+	IPSET_ATTR_ELEMENTS,	/* u32, list only */
+	IPSET_ATTR_REFERENCES,	/* u32, list only */
+	IPSET_ATTR_MEMSIZE,	/* u32, list only */
+	__IPSET_ATTR_CADT_MAX,
+};
+#define IPSET_ATTR_CADT_MAX	(__IPSET_ATTR_CADT_MAX - 1)
+
+/* Flags at command level (IPSET_ATTR_FLAGS) */
+enum ipset_cmd_flags {
+	IPSET_FLAG_BIT_EXIST	= 0,
+	IPSET_FLAG_EXIST	= (1 << IPSET_FLAG_BIT_EXIST),
+};
+
+/* Dimensions of the match and target: bit N of the flags selects the
+ * source (set) or the destination (clear) for dimension N + 1. */
+enum ip_set_dim {
+	IPSET_DIM_ZERO = 0,
+	IPSET_DIM_ONE,
+	IPSET_DIM_TWO,
+	IPSET_DIM_THREE,
+	IPSET_DIM_MAX = IPSET_DIM_THREE,
+};
+
+#define IPSET_DIM_ONE_SRC	(1 << 0)
+#define IPSET_DIM_TWO_SRC	(1 << 1)
+#define IPSET_DIM_THREE_SRC	(1 << 2)
+#define IPSET_INV_MATCH		(1 << 7)
+
+/* Option flags, kernel-side: the type handles/needs the feature */
+#define IPSET_TYPE_IP		(1 << 0)
+#define IPSET_TYPE_PORT		(1 << 1)
+
+typedef __u16 ip_set_id_t;
+
+#define IPSET_INVALID_ID	65535
+
+#ifdef __KERNEL__
+
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/netlink.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <net/netlink.h>
+
+enum ipset_adt {
+	IPSET_ADD,
+	IPSET_DEL,
+	IPSET_TEST,
+	IPSET_ADT_MAX,
+};
+
+/* Default, maximal and minimal hash sizes */
+#define IPSET_DEFAULT_HASHSIZE	1024
+#define IPSET_MINIMAL_HASHSIZE	64
+#define IPSET_DEFAULT_MAXELEM	65536
+
+/* Maximal number of elements of a bitmap type set */
+#define IPSET_BITMAP_MAX_RANGE	0x0000FFFF
+
+/* Garbage collection interval of sets with timeouts, in seconds */
+#define IPSET_GC_TIME		(3 * 60)
+#define IPSET_GC_PERIOD(timeout) \
+	((timeout / 3) ? min_t(u32, (timeout) / 3, IPSET_GC_TIME) : 1)
+
+/* Largest timeout in seconds, so that it fits in u32 milliseconds */
+#define IPSET_MAX_TIMEOUT	((UINT_MAX >> 1) / MSEC_PER_SEC)
+
+/* Element timeout stored as an absolute jiffies value, 0: permanent */
+static inline bool ip_set_timeout_expired(unsigned long timeout)
+{
+	return timeout != 0 && time_after_eq(jiffies, timeout);
+}
+
+static inline unsigned long ip_set_timeout_set(u32 seconds)
+{
+	unsigned long t;
+
+	if (seconds == 0)
+		return 0;
+	if (seconds > IPSET_MAX_TIMEOUT)
+		seconds = IPSET_MAX_TIMEOUT;
+	t = msecs_to_jiffies(seconds * MSEC_PER_SEC);
+	if (t > MAX_JIFFY_OFFSET)
+		t = MAX_JIFFY_OFFSET;
+	t += jiffies;
+	return t ? t : 1;
+}
+
+static inline u32 ip_set_timeout_get(unsigned long timeout)
+{
+	if (timeout == 0 || ip_set_timeout_expired(timeout))
+		return 0;
+	return jiffies_to_msecs(timeout - jiffies) / 1000;
+}
+
+struct ip_set;
+
+/* Set type operations, called with the set lock held unless noted */
+struct ip_set_type_variant {
+	/* Kernel side add/del/test: read lock for test, write otherwise */
+	int (*kadt)(struct ip_set *set, const struct sk_buff *skb,
+		    enum ipset_adt adt, u8 dim, u8 flags);
+	/* Userspace add/del/test with the set write locked.  -EAGAIN asks
+	 * the core to call resize() (unlocked) and retry; on the retry
+	 * (@retried) the type must make do with the current size. */
+	int (*uadt)(struct ip_set *set, struct nlattr *tb[],
+		    enum ipset_adt adt, u32 flags, bool retried);
+	/* Grow the set, takes the set lock itself */
+	int (*resize)(struct ip_set *set);
+	/* Remove the expired elements */
+	void (*gc)(struct ip_set *set);
+	/* Destroy the set data, unlocked */
+	void (*destroy)(struct ip_set *set);
+	/* Remove every element */
+	void (*flush)(struct ip_set *set);
+	/* Dump the create parameters and counters, read locked */
+	int (*head)(struct ip_set *set, struct sk_buff *skb);
+	/* Dump elements starting at cb->args[2] and cb->args[4], read
+	 * locked.  Returns 0 when done, -EMSGSIZE when the message is full. */
+	int (*list)(struct ip_set *set, struct sk_buff *skb,
+		    struct netlink_callback *cb);
+};
+
+struct ip_set_type {
+	struct list_head list;
+
+	/* Typename, family, revision */
+	char name[IPSET_MAXNAMELEN];
+	u8 family;
+	u8 revision;
+	/* Number of dimensions the kadt side understands */
+	u8 dimension;
+	u8 features;
+
+	/* Create a set of this type: fill in set->data and set->variant */
+	int (*create)(struct ip_set *set, struct nlattr *tb[]);
+
+	/* Attribute policy of create and add/del/test */
+	const struct nla_policy *create_policy;
+	const struct nla_policy *adt_policy;
+
+	struct module *me;
+};
+
+struct ip_set {
+	/* The name of the set */
+	char name[IPSET_MAXNAMELEN];
+	/* Lock protecting the set data */
+	rwlock_t lock;
+	/* References to the set, protected by the core mutex */
+	u32 ref;
+	const struct ip_set_type *type;
+	const struct ip_set_type_variant *variant;
+	u8 family;
+	/* Default element timeout in seconds, 0: no timeout support */
+	u32 timeout;
+	struct timer_list gc;
+	/* The type specific data */
+	void *data;
+};
+
+extern int ip_set_type_register(struct ip_set_type *set_type);
+extern void ip_set_type_unregister(struct ip_set_type *set_type);
+
+/* Set references from the match/target, process context */
+extern ip_set_id_t ip_set_get_byname(const char *name);
+extern void ip_set_put_byindex(ip_set_id_t index);
+
+/* Packet path API, called under rcu_read_lock() */
+extern int ip_set_test(ip_set_id_t id, const struct sk_buff *skb,
+		       u8 family, u8 dim, u8 flags);
+extern int ip_set_add(ip_set_id_t id, const struct sk_buff *skb,
+		      u8 family, u8 dim, u8 flags);
+extern int ip_set_del(ip_set_id_t id, const struct sk_buff *skb,
+		      u8 family, u8 dim, u8 flags);
+
+/* Helpers for the set types */
+extern void *ip_set_alloc(size_t size);
+extern void ip_set_free(void *members);
+extern int ip_set_get_ip4_port(const struct sk_buff *skb, bool src,
+			       __be16 *port, u8 *proto);
+extern int ip_set_get_timeout(const struct ip_set *set, struct nlattr *tb[],
+			      unsigned long *timeout);
+extern int ip_set_put_head(struct ip_set *set, struct sk_buff *skb,
+			   u32 elements, u32 memsize);
+
+static inline __be32 ip_set_get_ip4(const struct sk_buff *skb, bool src)
+{
+	return src ? ip_hdr(skb)->saddr : ip_hdr(skb)->daddr;
+}
+
+static inline __be32 ip_set_netmask(u8 cidr)
+{
+	return cidr ? htonl(~0U << (32 - cidr)) : 0;
+}
+
+/*
+ * Generic hash with fixed size keys, shared by the hash:* types.  The
+ * caller holds the set lock; lookups are O(1) as long as resize() is
+ * given the chance to keep the load factor at or below one.
+ */
+struct ip_set_hash_elem {
+	struct hlist_node node;
+	unsigned long timeout;
+	u32 key[0];
+};
+
+struct ip_set_hash {
+	struct hlist_head *table;
+	u32 hsize;		/* buckets, power of two */
+	u32 elements;
+	u32 maxelem;
+	u32 initval;
+	u32 keylen;		/* bytes, multiple of four */
+	/* Offset of the prefix length byte in the key, or -1.  When set,
+	 * nets[] counts the elements per prefix length. */
+	int cidr_off;
+	u32 nets[33];
+};
+
+extern int ip_set_hash_init(struct ip_set_hash *h, u32 keylen, int cidr_off,
+			    u32 hashsize, u32 maxelem);
+extern void ip_set_hash_destroy(struct ip_set_hash *h);
+extern void ip_set_hash_flush(struct ip_set_hash *h);
+extern int ip_set_hash_resize(struct ip_set *set, struct ip_set_hash *h);
+extern void ip_set_hash_gc(struct ip_set_hash *h);
+extern struct ip_set_hash_elem *
+ip_set_hash_lookup(const struct ip_set_hash *h, const void *key);
+extern int ip_set_hash_add(struct ip_set_hash *h, const void *key,
+			   unsigned long timeout, bool exist,
+			   bool may_resize, gfp_t gfp);
+extern int ip_set_hash_del(struct ip_set_hash *h, const void *key);
+extern int ip_set_hash_head(struct ip_set *set, const struct ip_set_hash *h,
+			    struct sk_buff *skb);
+extern int ip_set_hash_list(struct ip_set *set, const struct ip_set_hash *h,
+			    struct sk_buff *skb, struct netlink_callback *cb,
+			    int (*put)(struct sk_buff *skb, const void *key));
+
+/* Generic bitmap over a range of at most 64k ids, shared by bitmap:* */
+struct ip_set_bitmap {
+	unsigned long *members;
+	unsigned long *timeouts;	/* only for sets with timeouts */
+	u32 size;			/* number of ids */
+	u32 elements;
+};
+
+extern int ip_set_bitmap_init(struct ip_set_bitmap *b, u32 size,
+			      bool timeouts);
+extern void ip_set_bitmap_destroy(struct ip_set_bitmap *b);
+extern void ip_set_bitmap_flush(struct ip_set_bitmap *b);
+extern void ip_set_bitmap_gc(struct ip_set_bitmap *b);
+extern bool ip_set_bitmap_test(const struct ip_set_bitmap *b, u32 id);
+extern int ip_set_bitmap_add(struct ip_set_bitmap *b, u32 id,
+			     unsigned long timeout, bool exist);
+extern int ip_set_bitmap_del(struct ip_set_bitmap *b, u32 id);
+extern u32 ip_set_bitmap_memsize(const struct ip_set_bitmap *b);
+extern int ip_set_bitmap_list(struct ip_set *set, const struct ip_set_bitmap *b,
+			      struct sk_buff *skb, struct netlink_callback *cb,
+			      int (*put)(struct ip_set *set, struct sk_buff *skb,
+					 u32 id));
+
+#endif /* __KERNEL__ */
+
+#endif /* _IP_SET_H */
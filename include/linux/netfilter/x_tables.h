@@ -348,6 +348,8 @@ struct xt_target
 	u_int8_t revision;
 };
 
+struct nf_hook_ops;
+
 /* Furniture shopping... */
 struct xt_table
 {
@@ -364,6 +366,11 @@ struct xt_table
 
 	u_int8_t af;		/* address/protocol family */
 
+	/* Hooks feeding the table, attached per namespace on demand */
+	struct nf_hook_ops *ops;
+	unsigned int num_ops;
+	bool hooked;
+
 	/* A unique name... */
 	const char name[XT_TABLE_MAXNAMELEN];
 };
@@ -384,6 +391,9 @@ struct xt_table_info
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 	unsigned int underflow[NF_INET_NUMHOOKS];
 
+	/* Rule classifier built at replace time, may be NULL */
+	struct xt_cls *cls;
+
 	/* ipt_entry tables: one per CPU */
 	/* Note : this field MUST be the last one, see XT_TABLE_INFO_SZ */
 	void *entries[1];
@@ -411,6 +421,8 @@ extern struct xt_table *xt_register_table(struct net *net,
 					  struct xt_table_info *bootstrap,
 					  struct xt_table_info *newinfo);
 extern void *xt_unregister_table(struct xt_table *table);
+extern int xt_hook_table(struct net *net, struct xt_table *table);
+extern void xt_unhook_table(struct net *net, struct xt_table *table);
 
 extern struct xt_table_info *xt_replace_table(struct xt_table *table,
 					      unsigned int num_counters,
@@ -434,6 +446,28 @@ extern void xt_proto_fini(struct net *net, u_int8_t af);
 extern struct xt_table_info *xt_alloc_table_info(unsigned int size);
 extern void xt_free_table_info(struct xt_table_info *info);
 
+/*
+ * Tuple space classifier.  Rules are added in table order as runs of
+ * consecutive entries whose leading selectors are a masked compare on a
+ * fixed size key; rules with the same mask share a hash table.  A lookup
+ * returns the offset of the first rule of the current run at or after
+ * the given one whose key matches, or the offset of the entry following
+ * the run.  It only prunes: the caller still evaluates every candidate.
+ */
+#define XT_CLS_MAX_WORDS	8
+#define XT_CLS_MAX_GROUPS	32
+#define XT_CLS_MIN_RUN		8
+
+struct xt_cls;
+
+extern struct xt_cls *xt_cls_alloc(unsigned int words);
+extern void xt_cls_free(struct xt_cls *cls);
+extern int xt_cls_add(struct xt_cls *cls, unsigned int offset,
+		      unsigned int next, const u32 *key, const u32 *mask);
+extern void xt_cls_end_run(struct xt_cls *cls);
+extern unsigned int xt_cls_lookup(const struct xt_cls *cls,
+				  unsigned int offset, const u32 *key);
+
 /*
  * Per-CPU spinlock associated with per-cpu table entries, and
  * with a counter for the "reading" side that allows a recursive
@@ -0,0 +1,27 @@
+#ifndef _XT_SET_H
+#define _XT_SET_H
+
+#include <linux/types.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+/* The set is given by name; the kernel resolves it to its index when
+ * the rule is checked and keeps a reference until the rule goes away. */
+struct xt_set_info {
+	char name[IPSET_MAXNAMELEN];
+	ip_set_id_t index;
+	__u8 dim;		/* IPSET_DIM_ONE .. IPSET_DIM_MAX */
+	__u8 flags;		/* IPSET_DIM_*_SRC, IPSET_INV_MATCH */
+};
+
+/* match info */
+struct xt_set_info_match {
+	struct xt_set_info match_set;
+};
+
+/* target info, an empty name leaves the corresponding set alone */
+struct xt_set_info_target {
+	struct xt_set_info add_set;
+	struct xt_set_info del_set;
+};
+
+#endif /* _XT_SET_H */
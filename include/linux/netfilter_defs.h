@@ -0,0 +1,32 @@
+#ifndef __LINUX_NETFILTER_DEFS_H
+#define __LINUX_NETFILTER_DEFS_H
+
+/* Hook and protocol numbers, kept apart from linux/netfilter.h so that
+ * the namespace headers can size their per-hook tables without pulling
+ * in the hook invocation code (which itself needs struct net). */
+
+enum nf_inet_hooks {
+	NF_INET_PRE_ROUTING,
+	NF_INET_LOCAL_IN,
+	NF_INET_FORWARD,
+	NF_INET_LOCAL_OUT,
+	NF_INET_POST_ROUTING,
+	NF_INET_NUMHOOKS
+};
+
+enum {
+	NFPROTO_UNSPEC =  0,
+	NFPROTO_IPV4   =  2,
+	NFPROTO_ARP    =  3,
+	NFPROTO_BRIDGE =  7,
+	NFPROTO_IPV6   = 10,
+	NFPROTO_DECNET = 12,
+	NFPROTO_NUMPROTO,
+};
+
+#ifdef __KERNEL__
+/* Largest hook number + 1 */
+#define NF_MAX_HOOKS 8
+#endif
+
+#endif /* __LINUX_NETFILTER_DEFS_H */
@@ -109,7 +109,8 @@ struct ipt_entry
 
 #define IPT_SO_SET_REPLACE	(IPT_BASE_CTL)
 #define IPT_SO_SET_ADD_COUNTERS	(IPT_BASE_CTL + 1)
-#define IPT_SO_SET_MAX		IPT_SO_SET_ADD_COUNTERS
+#define IPT_SO_SET_SPLICE	(IPT_BASE_CTL + 2)
+#define IPT_SO_SET_MAX		IPT_SO_SET_SPLICE
 
 #define IPT_SO_GET_INFO			(IPT_BASE_CTL)
 #define IPT_SO_GET_ENTRIES		(IPT_BASE_CTL + 1)
@@ -200,6 +201,36 @@ struct ipt_replace
 	struct ipt_entry entries[0];
 };
 
+/* The argument to IPT_SO_SET_SPLICE: replace the entries in
+ * [offset, offset + del_size) of the current table with new ones, in
+ * place.  Offsets are those of IPT_SO_GET_ENTRIES; jumps in the new
+ * entries are offsets into the resulting table.  Jumps and hook entry
+ * points of the remaining entries are moved along; those pointing at
+ * offset keep pointing there, i.e. at the first new entry.  Untouched
+ * entries keep their counters and are not checked again.  A change
+ * which would make existing entries reachable from other hooks than
+ * before fails with EBUSY: use IPT_SO_SET_REPLACE for it. */
+struct ipt_splice
+{
+	/* Which table. */
+	char name[IPT_TABLE_MAXNAMELEN];
+
+	/* Number and size of the current entries, as seen by the caller. */
+	unsigned int num_counters;
+	unsigned int old_size;
+
+	/* Range of current entries to delete, may be empty. */
+	unsigned int offset;
+	unsigned int del_size;
+
+	/* Number and total size of new entries, may be zero. */
+	unsigned int num_entries;
+	unsigned int size;
+
+	/* The new entries (hang off end: not really an array). */
+	struct ipt_entry entries[0];
+};
+
 /* The argument to IPT_SO_ADD_COUNTERS. */
 #define ipt_counters_info xt_counters_info
 
@@ -244,6 +275,10 @@ ipt_get_target(struct ipt_entry *e)
 #include <linux/init.h>
 extern void ipt_init(void) __init;
 
+/* Kernel internal "flag" bit, never seen by userspace: the entry is part
+ * of a run covered by the table's classifier. */
+#define IPT_F_INDEXED		0x80
+
 extern struct xt_table *ipt_register_table(struct net *net,
 					   const struct xt_table *table,
 					   const struct ipt_replace *repl);
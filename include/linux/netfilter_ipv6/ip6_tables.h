@@ -305,6 +305,10 @@ ip6t_get_target(struct ip6t_entry *e)
 #include <linux/init.h>
 extern void ip6t_init(void) __init;
 
+/* Kernel internal "flag" bit, never seen by userspace: the entry is part
+ * of a run covered by the table's classifier. */
+#define IP6T_F_INDEXED		0x80
+
 extern struct xt_table *ip6t_register_table(struct net *net,
 					    const struct xt_table *table,
 					    const struct ip6t_replace *repl);
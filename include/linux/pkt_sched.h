@@ -466,6 +466,8 @@ enum
 	TCA_NETEM_DELAY_DIST,
 	TCA_NETEM_REORDER,
 	TCA_NETEM_CORRUPT,
+	TCA_NETEM_LOSS,
+	TCA_NETEM_RATE,
 	__TCA_NETEM_MAX,
 };
 
@@ -500,6 +502,14 @@ struct tc_netem_corrupt
 	__u32	correlation;
 };
 
+struct tc_netem_rate
+{
+	__u32	rate;		/* link bandwidth (bytes/s), 0 for unlimited */
+	__s32	packet_overhead; /* added to each packet's length */
+	__u32	cell_size;	/* link layer cell size, 0 for none */
+	__s32	cell_overhead;	/* added to each cell's size */
+};
+
 #define NETEM_DIST_SCALE	8192
 
 /* DRR */
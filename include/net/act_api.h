@@ -8,6 +8,18 @@
 #include <net/sch_generic.h>
 #include <net/pkt_sched.h>
 
+/*
+ * Per-cpu packet counters of an action.  Actions created without a rate
+ * estimator count into these instead of tcfc_bstats/tcfc_qstats, which
+ * are only refreshed from them when the statistics are dumped.
+ */
+struct tcf_cpu_stats {
+	u64				bytes;
+	u32				packets;
+	u32				drops;
+	u32				overlimits;
+};
+
 struct tcf_common {
 	struct tcf_common		*tcfc_next;
 	u32				tcfc_index;
@@ -19,6 +31,8 @@ struct tcf_common {
 	struct gnet_stats_basic_packed	tcfc_bstats;
 	struct gnet_stats_queue		tcfc_qstats;
 	struct gnet_stats_rate_est	tcfc_rate_est;
+	struct tcf_cpu_stats		*tcfc_cpu_stats;
+	struct rcu_head			tcfc_rcu;
 	spinlock_t			tcfc_lock;
 };
 #define tcf_next	common.tcfc_next
@@ -31,20 +45,97 @@ struct tcf_common {
 #define tcf_bstats	common.tcfc_bstats
 #define tcf_qstats	common.tcfc_qstats
 #define tcf_rate_est	common.tcfc_rate_est
+#define tcf_cpu_stats	common.tcfc_cpu_stats
 #define tcf_lock	common.tcfc_lock
 
-struct tcf_police {
-	struct tcf_common	common;
+/*
+ * Configuration read by the packet path without tcf_lock.  Actions embed
+ * this at the start of their parameter block, publish new blocks with
+ * rcu_assign_pointer() and release old ones with tcf_params_free() once
+ * they have been unpublished.  Actions always run with BHs disabled, so
+ * readers only need rcu_dereference().
+ */
+struct tcf_params {
+	struct rcu_head			rcu;
+};
+
+/*
+ * The helpers below must be called without tcf_lock held; they only take
+ * it for actions that still count into the shared statistics.
+ */
+static inline void tcf_stats_update(struct tcf_common *p, unsigned int len)
+{
+	struct tcf_cpu_stats *cs = rcu_dereference(p->tcfc_cpu_stats);
+
+	if (likely(cs)) {
+		cs = per_cpu_ptr(cs, smp_processor_id());
+		cs->bytes += len;
+		cs->packets++;
+		return;
+	}
+	spin_lock(&p->tcfc_lock);
+	p->tcfc_bstats.bytes += len;
+	p->tcfc_bstats.packets++;
+	spin_unlock(&p->tcfc_lock);
+}
+
+static inline void tcf_stats_drop(struct tcf_common *p)
+{
+	struct tcf_cpu_stats *cs = rcu_dereference(p->tcfc_cpu_stats);
+
+	if (likely(cs)) {
+		per_cpu_ptr(cs, smp_processor_id())->drops++;
+		return;
+	}
+	spin_lock(&p->tcfc_lock);
+	p->tcfc_qstats.drops++;
+	spin_unlock(&p->tcfc_lock);
+}
+
+static inline void tcf_stats_overlimit(struct tcf_common *p)
+{
+	struct tcf_cpu_stats *cs = rcu_dereference(p->tcfc_cpu_stats);
+
+	if (likely(cs)) {
+		per_cpu_ptr(cs, smp_processor_id())->overlimits++;
+		return;
+	}
+	spin_lock(&p->tcfc_lock);
+	p->tcfc_qstats.overlimits++;
+	spin_unlock(&p->tcfc_lock);
+}
+
+/* Only dirty the shared cache line once per jiffy. */
+static inline void tcf_lastuse_update(struct tcf_common *p)
+{
+	unsigned long now = jiffies;
+
+	if (p->tcfc_tm.lastuse != now)
+		p->tcfc_tm.lastuse = now;
+}
+
+struct tcf_police_params {
+	struct tcf_params	common;
 	int			tcfp_result;
 	u32			tcfp_ewma_rate;
 	u32			tcfp_burst;
 	u32			tcfp_mtu;
-	u32			tcfp_toks;
-	u32			tcfp_ptoks;
-	psched_time_t		tcfp_t_c;
 	struct qdisc_rate_table	*tcfp_R_tab;
 	struct qdisc_rate_table	*tcfp_P_tab;
 };
+
+/*
+ * Without a peak rate the token bucket is updated with atomic operations
+ * only; tcfp_t_c holds the low bits of the psched clock.  With a peak rate
+ * both buckets are updated together under tcf_lock.
+ */
+struct tcf_police {
+	struct tcf_common		common;
+	struct tcf_police_params	*params;
+	atomic_long_t			tcfp_toks;
+	atomic_long_t			tcfp_t_c;
+	u32				tcfp_ptoks;
+};
 #define to_police(pc)	\
 	container_of(pc, struct tcf_police, common)
 
@@ -109,6 +200,8 @@ extern struct tcf_common *tcf_hash_create(u32 index, struct nlattr *est,
 					  int bind, u32 *idx_gen,
 					  struct tcf_hashinfo *hinfo);
 extern void tcf_hash_insert(struct tcf_common *p, struct tcf_hashinfo *hinfo);
+extern void tcf_cpu_stats_disable(struct tcf_common *p);
+extern void tcf_params_free(struct tcf_params *p);
 
 extern int tcf_register_action(struct tc_action_ops *a);
 extern int tcf_unregister_action(struct tc_action_ops *a);
@@ -18,6 +18,7 @@
 #include <linux/spinlock.h>             /* for struct rwlock_t */
 #include <asm/atomic.h>                 /* for struct atomic_t */
 #include <linux/compiler.h>
+#include <linux/seqlock.h>              /* for seqcount_t */
 #include <linux/timer.h>
 
 #include <net/checksum.h>
@@ -251,12 +252,45 @@ struct ip_vs_estimator {
 	u32			outbps;
 };
 
+/*
+ *	Packet path counters, one copy per CPU so that the datapath never
+ *	shares a cache line or a lock with other CPUs. The 64-bit byte
+ *	counters are guarded by a seqcount where they cannot be read
+ *	atomically.
+ */
+struct ip_vs_cpu_stats {
+	u64			inbytes;
+	u64			outbytes;
+	u32			conns;
+	u32			inpkts;
+	u32			outpkts;
+#if BITS_PER_LONG == 32
+	seqcount_t		syncp;
+#endif
+};
+
+static inline void ip_vs_cpu_stats_begin(struct ip_vs_cpu_stats *s)
+{
+#if BITS_PER_LONG == 32
+	write_seqcount_begin(&s->syncp);
+#endif
+}
+
+static inline void ip_vs_cpu_stats_end(struct ip_vs_cpu_stats *s)
+{
+#if BITS_PER_LONG == 32
+	write_seqcount_end(&s->syncp);
+#endif
+}
+
 struct ip_vs_stats
 {
-	struct ip_vs_stats_user	ustats;         /* statistics */
+	struct ip_vs_stats_user	ustats;         /* rates from the estimator */
+	struct ip_vs_stats_user	ustats0;	/* counter sums at last zeroing */
 	struct ip_vs_estimator	est;		/* estimator */
+	struct ip_vs_cpu_stats	*cpustats;	/* per-CPU counters */
 
-	spinlock_t              lock;           /* spin lock */
+	spinlock_t              lock;           /* protects all but cpustats */
 };
 
 struct dst_entry;
@@ -335,7 +369,7 @@ extern struct ip_vs_protocol * ip_vs_proto_get(unsigned short proto);
  *	IP_VS structure allocated for each dynamically scheduled connection
  */
 struct ip_vs_conn {
-	struct list_head        c_list;         /* hashed list heads */
+	struct hlist_node       c_list;         /* hashed list heads */
 
 	/* Protocol, addresses and port numbers */
 	u16                      af;		/* address family */
@@ -347,9 +381,9 @@ struct ip_vs_conn {
 	__be16                   dport;
 	__u16                   protocol;       /* Which protocol (TCP/UDP) */
 
-	/* counter and timer */
+	/* counter and expiry */
 	atomic_t		refcnt;		/* reference count */
-	struct timer_list	timer;		/* Expiration timer */
+	unsigned long		expires;	/* reaped by the gc after this */
 	volatile unsigned long	timeout;	/* timeout */
 
 	/* Flags and state transition */
@@ -381,6 +415,8 @@ struct ip_vs_conn {
 	void                    *app_data;      /* Application private data */
 	struct ip_vs_seq        in_seq;         /* incoming seq. struct */
 	struct ip_vs_seq        out_seq;        /* outgoing seq. struct */
+
+	struct rcu_head		rcu_head;
 };
 
 
@@ -595,15 +631,14 @@ extern void ip_vs_init_hash_table(struct list_head *table, int rows);
  */
 
 /*
- *     IPVS connection entry hash table
+ *     IPVS connection entry hash table, the conn_tab_bits module
+ *     parameter overrides the default size
  */
 #ifndef CONFIG_IP_VS_TAB_BITS
 #define CONFIG_IP_VS_TAB_BITS   12
 #endif
 
-#define IP_VS_CONN_TAB_BITS	CONFIG_IP_VS_TAB_BITS
-#define IP_VS_CONN_TAB_SIZE     (1 << IP_VS_CONN_TAB_BITS)
-#define IP_VS_CONN_TAB_MASK     (IP_VS_CONN_TAB_SIZE - 1)
+extern int ip_vs_conn_tab_size;
 
 enum {
 	IP_VS_DIR_INPUT = 0,
@@ -624,7 +659,7 @@ extern struct ip_vs_conn *ip_vs_conn_out_get
 (int af, int protocol, const union nf_inet_addr *s_addr, __be16 s_port,
  const union nf_inet_addr *d_addr, __be16 d_port);
 
-/* put back the conn without restarting its timer */
+/* put back the conn without restarting its expiry */
 static inline void __ip_vs_conn_put(struct ip_vs_conn *cp)
 {
 	atomic_dec(&cp->refcnt);
@@ -644,6 +679,8 @@ extern const char * ip_vs_state_name(__u16 proto, int state);
 extern void ip_vs_tcp_conn_listen(struct ip_vs_conn *cp);
 extern int ip_vs_check_template(struct ip_vs_conn *ct);
 extern void ip_vs_random_dropentry(void);
+extern unsigned int ip_vs_conn_sync_chains(unsigned int first,
+					   unsigned int count);
 extern int ip_vs_conn_init(void);
 extern void ip_vs_conn_cleanup(void);
 
@@ -775,6 +812,8 @@ extern int sysctl_ip_vs_cache_bypass;
 extern int sysctl_ip_vs_expire_nodest_conn;
 extern int sysctl_ip_vs_expire_quiescent_template;
 extern int sysctl_ip_vs_sync_threshold[2];
+extern int sysctl_ip_vs_sync_version;
+extern int sysctl_ip_vs_sync_ports;
 extern int sysctl_ip_vs_nat_icmp_send;
 extern struct ip_vs_stats ip_vs_stats;
 extern const struct ctl_path net_vs_ctl_path[];
@@ -806,6 +845,9 @@ extern struct ip_vs_dest *ip_vs_try_bind_dest(struct ip_vs_conn *cp);
  *      IPVS sync daemon data and function prototypes
  *      (from ip_vs_sync.c)
  */
+#define IP_VS_SYNC_PROTO_VER	1	/* 1: send sequenced messages */
+#define IP_VS_SYNC_MAX_PORTS	16	/* max. sync threads per daemon */
+
 extern volatile int ip_vs_sync_state;
 extern volatile int ip_vs_master_syncid;
 extern volatile int ip_vs_backup_syncid;
@@ -824,6 +866,10 @@ extern void ip_vs_estimator_cleanup(void);
 extern void ip_vs_new_estimator(struct ip_vs_stats *stats);
 extern void ip_vs_kill_estimator(struct ip_vs_stats *stats);
 extern void ip_vs_zero_estimator(struct ip_vs_stats *stats);
+extern void ip_vs_read_cpu_stats(struct ip_vs_stats_user *sum,
+				 struct ip_vs_cpu_stats *stats);
+extern void ip_vs_read_stats(struct ip_vs_stats_user *dst,
+			     struct ip_vs_stats *stats);
 
 /*
  *	Various IPVS packet transmitters (from ip_vs_xmit.c)
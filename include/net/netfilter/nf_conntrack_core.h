@@ -13,6 +13,8 @@
 #define _NF_CONNTRACK_CORE_H
 
 #include <linux/netfilter.h>
+#include <linux/mutex.h>
+#include <net/net_namespace.h>
 #include <net/netfilter/nf_conntrack_l3proto.h>
 #include <net/netfilter/nf_conntrack_l4proto.h>
 #include <net/netfilter/nf_conntrack_ecache.h>
@@ -73,6 +75,31 @@ print_tuple(struct seq_file *s, const struct nf_conntrack_tuple *tuple,
             const struct nf_conntrack_l3proto *l3proto,
             const struct nf_conntrack_l4proto *proto);
 
-extern spinlock_t nf_conntrack_lock ;
+/* The conntrack hash is protected by an array of bucket locks, the
+ * expectation table and helper assignment by a single lock of its own. */
+#define CONNTRACK_LOCKS 1024
+
+extern spinlock_t nf_conntrack_locks[CONNTRACK_LOCKS];
+extern void nf_conntrack_lock(spinlock_t *lock);
+
+extern spinlock_t nf_conntrack_expect_lock;
+
+extern struct mutex nf_conntrack_resize_mutex;
+
+/* Snapshot the hash table and its size, a resize changes both.  The
+ * caller must be in an RCU read side section; during a resize, entries
+ * not migrated yet are only reachable via hash lookups. */
+static inline void nf_conntrack_get_ht(const struct net *net,
+				       struct hlist_nulls_head **hash,
+				       unsigned int *hsize)
+{
+	unsigned int sequence;
+
+	do {
+		sequence = read_seqcount_begin(&net->ct.generation);
+		*hash = net->ct.hash;
+		*hsize = net->ct.htable_size;
+	} while (read_seqcount_retry(&net->ct.generation, sequence));
+}
 
 #endif /* _NF_CONNTRACK_CORE_H */
@@ -109,7 +109,9 @@ nf_conntrack_eventmask_report(unsigned int eventmask,
 	if (e == NULL)
 		goto out_unlock;
 
-	if (nf_ct_is_confirmed(ct) && !nf_ct_is_dying(ct)) {
+	/* Once dying, only the destroy event itself is still delivered */
+	if (nf_ct_is_confirmed(ct) &&
+	    (!nf_ct_is_dying(ct) || eventmask & (1 << IPCT_DESTROY))) {
 		struct nf_ct_event item = {
 			.ct 	= ct,
 			.pid	= e->pid ? e->pid : pid,
@@ -0,0 +1,98 @@
+#ifndef _NF_FLOW_TABLE_H
+#define _NF_FLOW_TABLE_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/netdevice.h>
+#include <net/dst.h>
+#include <net/netfilter/nf_conntrack.h>
+
+/*
+ * Software flow table: established, forwarded connections whose egress
+ * route, L2 header and NAT rewrite are known are forwarded straight from
+ * PREROUTING without going through routing, the other hooks and
+ * conntrack/NAT.  One entry per direction is hashed; the key is the
+ * packet as it arrives on the ingress device.
+ */
+struct flow_offload_tuple {
+	__be32				src_v4;
+	__be32				dst_v4;
+	__be16				src_port;
+	__be16				dst_port;
+	int				iifidx;
+	u_int8_t			l3proto;
+	u_int8_t			l4proto;
+
+	/* not part of the lookup key */
+	u_int8_t			dir;
+};
+
+#define FLOW_OFFLOAD_TUPLE_KEYLEN	offsetof(struct flow_offload_tuple, dir)
+
+struct flow_offload_tuple_hash {
+	struct hlist_node		node;
+	struct flow_offload_tuple	tuple;
+	struct dst_entry		*dst_cache;
+	unsigned int			mtu;
+};
+
+struct flow_offload_counter {
+	atomic64_t			packets;
+	atomic64_t			bytes;
+};
+
+enum flow_offload_flags {
+	/* stop using the fast path, the entry goes on the next gc run */
+	NF_FLOW_TEARDOWN,
+};
+
+struct flow_offload {
+	struct flow_offload_tuple_hash	tuplehash[IP_CT_DIR_MAX];
+	struct flow_offload_counter	counter[IP_CT_DIR_MAX];
+	struct nf_conn			*ct;
+	unsigned long			flags;
+	/* jiffies32 of expiry, refreshed by every fast path packet */
+	u32				timeout;
+	/* conntrack timeout of the state the connection was offloaded in */
+	u32				ct_timeout;
+	struct rcu_head			rcu_head;
+};
+
+/* idle time after which a flow falls back to the slow path */
+#define NF_FLOW_TIMEOUT			(30 * HZ)
+
+struct nf_flow_route {
+	struct {
+		struct dst_entry	*dst;
+		int			ifindex;
+	} tuple[IP_CT_DIR_MAX];
+};
+
+static inline struct flow_offload *
+flow_offload_from_hash(struct flow_offload_tuple_hash *thash)
+{
+	return container_of(thash, struct flow_offload,
+			    tuplehash[thash->tuple.dir]);
+}
+
+static inline void flow_offload_teardown(struct flow_offload *flow)
+{
+	set_bit(NF_FLOW_TEARDOWN, &flow->flags);
+}
+
+static inline void flow_offload_account(struct flow_offload *flow,
+					enum ip_conntrack_dir dir,
+					unsigned int len)
+{
+	flow->timeout = nfct_time_stamp + NF_FLOW_TIMEOUT;
+	atomic64_inc(&flow->counter[dir].packets);
+	atomic64_add(len, &flow->counter[dir].bytes);
+}
+
+extern int flow_offload_add(struct nf_conn *ct,
+			    const struct nf_flow_route *route);
+extern struct flow_offload_tuple_hash *
+flow_offload_lookup(const struct flow_offload_tuple *tuple);
+
+#endif /* _NF_FLOW_TABLE_H */
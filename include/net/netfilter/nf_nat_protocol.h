@@ -67,8 +67,7 @@ extern bool nf_nat_proto_in_range(const struct nf_conntrack_tuple *tuple,
 extern bool nf_nat_proto_unique_tuple(struct nf_conntrack_tuple *tuple,
 				      const struct nf_nat_range *range,
 				      enum nf_nat_manip_type maniptype,
-				      const struct nf_conn *ct,
-				      u_int16_t *rover);
+				      const struct nf_conn *ct);
 
 extern int nf_nat_proto_range_to_nlattr(struct sk_buff *skb,
 					const struct nf_nat_range *range);
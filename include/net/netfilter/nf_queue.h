@@ -4,6 +4,7 @@
 /* Each queued (to userspace) skbuff has one of these. */
 struct nf_queue_entry {
 	struct list_head	list;
+	struct hlist_node	hnode;		/* queue handler's id lookup */
 	struct sk_buff		*skb;
 	unsigned int		id;
 
@@ -21,6 +22,8 @@ struct nf_queue_entry {
 struct nf_queue_handler {
 	int			(*outfn)(struct nf_queue_entry *entry,
 					 unsigned int queuenum);
+	/* drop queued packets which would resume at the given hook */
+	void			(*nf_hook_drop)(const struct nf_hook_ops *ops);
 	char			*name;
 };
 
@@ -3,20 +3,39 @@
 
 #include <linux/list.h>
 #include <linux/list_nulls.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 
 struct ctl_table_header;
 struct nf_conntrack_ecache;
 
+/* Per-cpu lists of conntracks that are not in the hash table */
+struct ct_pcpu {
+	spinlock_t		lock;
+	struct hlist_nulls_head	unconfirmed;
+	struct hlist_nulls_head	dying;
+};
+
 struct netns_ct {
 	atomic_t		count;
 	unsigned int		expect_count;
 	unsigned int		htable_size;
+	seqcount_t		generation;
 	struct kmem_cache	*nf_conntrack_cachep;
 	struct hlist_nulls_head	*hash;
+	/* while resizing: old table, buckets below resize_cursor moved */
+	struct hlist_nulls_head	*old_hash;
+	unsigned int		old_htable_size;
+	unsigned int		resize_cursor;
+	struct work_struct	resize_work;
 	struct hlist_head	*expect_hash;
-	struct hlist_nulls_head	unconfirmed;
-	struct hlist_nulls_head	dying;
+	struct ct_pcpu		*pcpu_lists;
+	struct delayed_work	gc_work;
+	unsigned int		gc_bucket;
+	unsigned long		gc_next_run;
+	int			gc_exiting;
 	struct ip_conntrack_stat *stat;
 	int			sysctl_events;
 	unsigned int		sysctl_events_retry_timeout;
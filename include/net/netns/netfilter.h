@@ -0,0 +1,13 @@
+#ifndef __NETNS_NETFILTER_H
+#define __NETNS_NETFILTER_H
+
+#include <linux/list.h>
+#include <linux/netfilter_defs.h>
+
+struct netns_nf {
+	/* hook functions attached in this namespace, by priority */
+	struct list_head hooks[NFPROTO_NUMPROTO][NF_MAX_HOOKS];
+	/* entry in the list of namespaces known to the hook core */
+	struct list_head list;
+};
+#endif
@@ -47,6 +47,7 @@ struct Qdisc
 #define TCQ_F_INGRESS		4
 #define TCQ_F_CAN_BYPASS	8
 #define TCQ_F_MQROOT		16
+#define TCQ_F_MQSHARED		32
 #define TCQ_F_WARN_NONWC	(1 << 16)
 	int			padded;
 	struct Qdisc_ops	*ops;
@@ -183,7 +184,7 @@ struct tcf_proto
 
 struct qdisc_skb_cb {
 	unsigned int		pkt_len;
-	char			data[];
+	long			data[];
 };
 
 static inline int qdisc_qlen(struct Qdisc *q)
@@ -243,14 +244,105 @@ static inline struct net_device *qdisc_dev(struct Qdisc *qdisc)
 	return qdisc->dev_queue->dev;
 }
 
+/*
+ * Ingress qdiscs are run by all receiving CPUs in parallel, so the packet
+ * path does not take their root lock. Each CPU holds its own ingress lock
+ * while it classifies instead. Tree updates on an ingress qdisc raise
+ * ingress_writer after the root lock and wait for every CPU to leave its
+ * ingress lock, see sch_tree_lock(); classifiers back off meanwhile.
+ * Shared state a classifier writes on the packet path needs its own lock.
+ */
+struct ingress_lock {
+	spinlock_t	lock;
+	unsigned char	readers;
+};
+DECLARE_PER_CPU(struct ingress_lock, ingress_locks);
+extern spinlock_t ingress_writer_lock;
+extern int ingress_writer;
+
+/* Must be called with bottom halves disabled */
+static inline void ingress_rdlock(void)
+{
+	struct ingress_lock *lock = &__get_cpu_var(ingress_locks);
+
+	if (lock->readers++)
+		return;
+	spin_lock(&lock->lock);
+	while (unlikely(ingress_writer)) {
+		spin_unlock(&lock->lock);
+		/* pairs with the smp_mb() in ingress_wrlock_all() */
+		smp_rmb();
+		spin_unlock_wait(&ingress_writer_lock);
+		spin_lock(&lock->lock);
+	}
+}
+
+static inline void ingress_rdunlock(void)
+{
+	struct ingress_lock *lock = &__get_cpu_var(ingress_locks);
+
+	if (likely(!--lock->readers))
+		spin_unlock(&lock->lock);
+}
+
+extern void ingress_wrlock_all(void);
+extern void ingress_wrunlock_all(void);
+
+/*
+ * Qdiscs flagged TCQ_F_MQSHARED share their classes and filters with the
+ * qdiscs of all other TX queues of the device. Their private data starts
+ * with a qdisc_shared_lock, held by the packet path of that TX queue
+ * while it uses the shared state. Tree updates take the root lock, then
+ * raise the writer flag of every other TX queue and wait for its lock to
+ * be released, see sch_tree_lock().
+ */
+struct qdisc_shared_lock {
+	spinlock_t	lock;
+	int		writer;
+};
+
+/* Must be called with the qdisc lock of the TX queue held */
+static inline void qdisc_shared_rdlock(struct qdisc_shared_lock *sl)
+{
+	spin_lock(&sl->lock);
+	while (unlikely(sl->writer)) {
+		spin_unlock(&sl->lock);
+		/* pairs with the smp_mb() in qdisc_shared_lock_all() */
+		smp_rmb();
+		while (ACCESS_ONCE(sl->writer))
+			cpu_relax();
+		spin_lock(&sl->lock);
+	}
+}
+
+static inline void qdisc_shared_rdunlock(struct qdisc_shared_lock *sl)
+{
+	spin_unlock(&sl->lock);
+}
+
+extern void qdisc_shared_lock_all(struct Qdisc *root);
+extern void qdisc_shared_unlock_all(struct Qdisc *root);
+
 static inline void sch_tree_lock(struct Qdisc *q)
 {
-	spin_lock_bh(qdisc_root_sleeping_lock(q));
+	struct Qdisc *root = qdisc_root_sleeping(q);
+
+	spin_lock_bh(qdisc_lock(root));
+	if (unlikely(root->flags & TCQ_F_INGRESS))
+		ingress_wrlock_all();
+	else if (unlikely(root->flags & TCQ_F_MQSHARED))
+		qdisc_shared_lock_all(root);
 }
 
 static inline void sch_tree_unlock(struct Qdisc *q)
 {
-	spin_unlock_bh(qdisc_root_sleeping_lock(q));
+	struct Qdisc *root = qdisc_root_sleeping(q);
+
+	if (unlikely(root->flags & TCQ_F_INGRESS))
+		ingress_wrunlock_all();
+	else if (unlikely(root->flags & TCQ_F_MQSHARED))
+		qdisc_shared_unlock_all(root);
+	spin_unlock_bh(qdisc_lock(root));
 }
 
 #define tcf_tree_lock(tp)	sch_tree_lock((tp)->q)
@@ -7,6 +7,7 @@ struct tcf_defact {
 	struct tcf_common	common;
 	u32     		tcfd_datalen;
 	void    		*tcfd_defdata;
+	u32			tcfd_packets;
 };
 #define to_defact(pc) \
 	container_of(pc, struct tcf_defact, common)
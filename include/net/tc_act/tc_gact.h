@@ -3,12 +3,21 @@
 
 #include <net/act_api.h>
 
+struct tcf_gact_params {
+	struct tcf_params	common;
+	int			action;
+#ifdef CONFIG_GACT_PROB
+	u16			ptype;
+	u16			pval;
+	int			paction;
+#endif
+};
+
 struct tcf_gact {
 	struct tcf_common	common;
+	struct tcf_gact_params	*params;
 #ifdef CONFIG_GACT_PROB
-        u16			tcfg_ptype;
-        u16			tcfg_pval;
-        int			tcfg_paction;
+	atomic_t		packets;	/* for deterministic sampling */
 #endif
 };
 #define to_gact(pc) \
@@ -3,12 +3,17 @@
 
 #include <net/act_api.h>
 
+struct tcf_mirred_params {
+	struct tcf_params	common;
+	int			eaction;
+	int			ifindex;
+	int			ok_push;
+	struct net_device	*dev;
+};
+
 struct tcf_mirred {
-	struct tcf_common	common;
-	int			tcfm_eaction;
-	int			tcfm_ifindex;
-	int			tcfm_ok_push;
-	struct net_device	*tcfm_dev;
+	struct tcf_common		common;
+	struct tcf_mirred_params	*params;
 };
 #define to_mirred(pc) \
 	container_of(pc, struct tcf_mirred, common)
@@ -4,8 +4,8 @@
 #include <linux/types.h>
 #include <net/act_api.h>
 
-struct tcf_nat {
-	struct tcf_common common;
+struct tcf_nat_params {
+	struct tcf_params common;
 
 	__be32 old_addr;
 	__be32 new_addr;
@@ -13,6 +13,12 @@ struct tcf_nat {
 	u32 flags;
 };
 
+struct tcf_nat {
+	struct tcf_common common;
+
+	struct tcf_nat_params *params;
+};
+
 static inline struct tcf_nat *to_tcf_nat(struct tcf_common *pc)
 {
 	return container_of(pc, struct tcf_nat, common);
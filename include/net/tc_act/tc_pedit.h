@@ -3,11 +3,16 @@
 
 #include <net/act_api.h>
 
-struct tcf_pedit {
-	struct tcf_common	common;
+struct tcf_pedit_params {
+	struct tcf_params	common;
 	unsigned char		tcfp_nkeys;
 	unsigned char		tcfp_flags;
-	struct tc_pedit_key	*tcfp_keys;
+	struct tc_pedit_key	tcfp_keys[0];
+};
+
+struct tcf_pedit {
+	struct tcf_common	common;
+	struct tcf_pedit_params	*params;
 };
 #define to_pedit(pc) \
 	container_of(pc, struct tcf_pedit, common)
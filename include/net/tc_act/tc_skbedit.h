@@ -22,12 +22,17 @@
 
 #include <net/act_api.h>
 
-struct tcf_skbedit {
-	struct tcf_common	common;
+struct tcf_skbedit_params {
+	struct tcf_params	common;
 	u32			flags;
 	u32     		priority;
 	u16			queue_mapping;
 };
+
+struct tcf_skbedit {
+	struct tcf_common		common;
+	struct tcf_skbedit_params	*params;
+};
 #define to_skbedit(pc) \
 	container_of(pc, struct tcf_skbedit, common)
 
@@ -1789,6 +1789,7 @@ out_kfree_skb:
 	kfree_skb(skb);
 	return NETDEV_TX_OK;
 }
+EXPORT_SYMBOL(dev_hard_start_xmit);
 
 static u32 skb_tx_hashrnd;
 
@@ -2249,12 +2250,13 @@ static int ing_filter(struct sk_buff *skb)
 
 	rxq = &dev->rx_queue;
 
-	q = rxq->qdisc;
+	/* No root lock: the ingress qdisc only classifies, see ingress_lock */
+	q = rcu_dereference(rxq->qdisc);
 	if (q != &noop_qdisc) {
-		spin_lock(qdisc_lock(q));
+		ingress_rdlock();
 		if (likely(!test_bit(__QDISC_STATE_DEACTIVATED, &q->state)))
 			result = qdisc_enqueue_root(skb, q);
-		spin_unlock(qdisc_lock(q));
+		ingress_rdunlock();
 	}
 
 	return result;
@@ -2315,6 +2317,245 @@ void netif_nit_deliver(struct sk_buff *skb)
 	rcu_read_unlock();
 }
 
+/*
+ *	Early receive filter
+ *
+ *	A classic BPF program attached to a device through IFLA_RX_FILTER
+ *	sees every packet the device receives before taps, the ingress qdisc,
+ *	bridging or protocol demux do, starting at the link layer header.
+ *	Its return value is the verdict: 0 drops the packet, a value with
+ *	RX_FILTER_REDIRECT set queues it to the CPU in the low bits, which
+ *	runs the rest of the receive path, anything else passes it on.
+ *
+ *	The filter and its per cpu verdict counters are replaced as a whole
+ *	under RTNL and freed after a grace period, so readers only need
+ *	rcu_read_lock().
+ */
+
+struct rx_steer_queue {
+	struct sk_buff_head	queue;
+	struct napi_struct	napi;
+	struct call_single_data	csd;
+	int			dead;	/* cpu went offline, under queue.lock */
+};
+
+static DEFINE_PER_CPU(struct rx_steer_queue, rx_steer_queues);
+
+static int __netif_receive_skb(struct sk_buff *skb);
+
+static int rx_steer_poll(struct napi_struct *napi, int quota)
+{
+	struct rx_steer_queue *sq = container_of(napi, struct rx_steer_queue,
+						 napi);
+	int work = 0;
+
+	while (work < quota) {
+		struct sk_buff *skb;
+
+		spin_lock_irq(&sq->queue.lock);
+		skb = __skb_dequeue(&sq->queue);
+		if (!skb) {
+			__napi_complete(napi);
+			spin_unlock_irq(&sq->queue.lock);
+			break;
+		}
+		spin_unlock_irq(&sq->queue.lock);
+
+		__netif_receive_skb(skb);
+		work++;
+	}
+
+	return work;
+}
+
+#ifdef CONFIG_USE_GENERIC_SMP_HELPERS
+static void rx_steer_kick(void *data)
+{
+	struct rx_steer_queue *sq = data;
+
+	__napi_schedule(&sq->napi);
+}
+
+#define rx_steer_allowed(cpu)	((cpu) < nr_cpu_ids && cpu_online(cpu))
+#else
+#define rx_steer_allowed(cpu)	((cpu) == smp_processor_id())
+#endif
+
+/*
+ * Returns 1 if the skb was queued or dropped, with *ret set, and 0 if
+ * the target cpu is going away and the caller has to keep the skb.  The
+ * dead flag is checked under the queue lock so that the CPU_DEAD drain
+ * sees every skb queued before it.
+ */
+static int rx_steer_skb(struct sk_buff *skb, unsigned int cpu, int *ret)
+{
+	struct rx_steer_queue *sq = &per_cpu(rx_steer_queues, cpu);
+	unsigned long flags;
+	int kick = 0;
+
+	spin_lock_irqsave(&sq->queue.lock, flags);
+	if (unlikely(sq->dead)) {
+		spin_unlock_irqrestore(&sq->queue.lock, flags);
+		return 0;
+	}
+	if (unlikely(skb_queue_len(&sq->queue) >= netdev_max_backlog)) {
+		spin_unlock_irqrestore(&sq->queue.lock, flags);
+		__get_cpu_var(netdev_rx_stat).dropped++;
+		kfree_skb(skb);
+		*ret = NET_RX_DROP;
+		return 1;
+	}
+	__skb_queue_tail(&sq->queue, skb);
+	if (!test_and_set_bit(NAPI_STATE_SCHED, &sq->napi.state))
+		kick = 1;
+	spin_unlock_irqrestore(&sq->queue.lock, flags);
+
+	if (kick) {
+		if (cpu == smp_processor_id())
+			__napi_schedule(&sq->napi);
+#ifdef CONFIG_USE_GENERIC_SMP_HELPERS
+		else
+			__smp_call_function_single(cpu, &sq->csd, 0);
+#endif
+	}
+	*ret = NET_RX_SUCCESS;
+	return 1;
+}
+
+/* Returns 1 if the filter consumed the skb, with *ret set for the caller */
+static int handle_rx_filter(struct sk_buff *skb, int *ret)
+{
+	struct netdev_rx_filter *f;
+	struct ifla_rx_filter_stats *st;
+	unsigned int res, maclen, cpu;
+
+	rcu_read_lock();
+	f = rcu_dereference(skb->dev->rx_filter);
+	if (!f) {
+		rcu_read_unlock();
+		return 0;
+	}
+
+	maclen = skb->data - skb_mac_header(skb);
+	__skb_push(skb, maclen);
+	res = SK_RUN_FILTER(f->prog, skb);
+	__skb_pull(skb, maclen);
+
+	st = per_cpu_ptr(f->stats, smp_processor_id());
+	if (res == 0) {
+		st->drop++;
+		rcu_read_unlock();
+		kfree_skb(skb);
+		*ret = NET_RX_DROP;
+		return 1;
+	}
+	if (res & RX_FILTER_REDIRECT) {
+		cpu = res & RX_FILTER_CPU_MASK;
+		if (rx_steer_allowed(cpu) && rx_steer_skb(skb, cpu, ret)) {
+			st->redirect++;
+			rcu_read_unlock();
+			return 1;
+		}
+	}
+	st->pass++;
+	rcu_read_unlock();
+	return 0;
+}
+
+static void rx_filter_free_rcu(struct rcu_head *head)
+{
+	struct netdev_rx_filter *f = container_of(head, struct netdev_rx_filter,
+						  rcu);
+
+	sk_filter_release(f->prog);
+	free_percpu(f->stats);
+	kfree(f);
+}
+
+/**
+ *	dev_set_rx_filter - attach an early receive filter to a device
+ *	@dev: device
+ *	@insns: classic BPF program
+ *	@len: number of instructions, 0 detaches the current filter
+ *
+ *	Checks and compiles the program and atomically replaces the filter
+ *	the device runs at the top of netif_receive_skb(). The verdict
+ *	counters start from zero with the new program. Caller must hold RTNL.
+ */
+int dev_set_rx_filter(struct net_device *dev, struct sock_filter *insns,
+		      unsigned int len)
+{
+	struct netdev_rx_filter *f = NULL, *old;
+	unsigned int fsize = sizeof(struct sock_filter) * len;
+	struct sk_filter *fp;
+	int err;
+
+	ASSERT_RTNL();
+
+	if (len) {
+		if (len > BPF_MAXINSNS)
+			return -EINVAL;
+
+		f = kzalloc(sizeof(*f), GFP_KERNEL);
+		if (!f)
+			return -ENOMEM;
+
+		err = -ENOMEM;
+		f->stats = alloc_percpu(struct ifla_rx_filter_stats);
+		if (!f->stats)
+			goto out_free;
+
+		fp = kmalloc(fsize + sizeof(*fp), GFP_KERNEL);
+		if (!fp)
+			goto out_free;
+		memcpy(fp->insns, insns, fsize);
+		atomic_set(&fp->refcnt, 1);
+		fp->len = len;
+		fp->image = NULL;
+		f->prog = fp;
+
+		err = sk_chk_filter(fp->insns, fp->len);
+		if (err)
+			goto out_free;
+		bpf_jit_compile(fp);
+	}
+
+	old = dev->rx_filter;
+	rcu_assign_pointer(dev->rx_filter, f);
+	if (old)
+		call_rcu(&old->rcu, rx_filter_free_rcu);
+	return 0;
+
+out_free:
+	if (f->prog)
+		sk_filter_release(f->prog);
+	free_percpu(f->stats);
+	kfree(f);
+	return err;
+}
+EXPORT_SYMBOL(dev_set_rx_filter);
+
+/**
+ *	dev_get_rx_filter_stats - sum the verdict counters of a filter
+ *	@f: filter
+ *	@st: where to store the totals
+ */
+void dev_get_rx_filter_stats(const struct netdev_rx_filter *f,
+			     struct ifla_rx_filter_stats *st)
+{
+	int cpu;
+
+	memset(st, 0, sizeof(*st));
+	for_each_possible_cpu(cpu) {
+		const struct ifla_rx_filter_stats *s = per_cpu_ptr(f->stats, cpu);
+
+		st->pass += s->pass;
+		st->drop += s->drop;
+		st->redirect += s->redirect;
+	}
+}
+EXPORT_SYMBOL(dev_get_rx_filter_stats);
+
 /**
  *	netif_receive_skb - process receive buffer from network
  *	@skb: buffer to process
@@ -2332,11 +2573,7 @@ void netif_nit_deliver(struct sk_buff *skb)
  */
 int netif_receive_skb(struct sk_buff *skb)
 {
-	struct packet_type *ptype, *pt_prev;
-	struct net_device *orig_dev;
-	struct net_device *null_or_orig;
-	int ret = NET_RX_DROP;
-	__be16 type;
+	int ret;
 
 	if (!skb->tstamp.tv64)
 		net_timestamp(skb);
@@ -2348,6 +2585,21 @@ int netif_receive_skb(struct sk_buff *skb)
 	if (netpoll_receive_skb(skb))
 		return NET_RX_DROP;
 
+	if (skb->dev->rx_filter && handle_rx_filter(skb, &ret))
+		return ret;
+
+	return __netif_receive_skb(skb);
+}
+EXPORT_SYMBOL(netif_receive_skb);
+
+static int __netif_receive_skb(struct sk_buff *skb)
+{
+	struct packet_type *ptype, *pt_prev;
+	struct net_device *orig_dev;
+	struct net_device *null_or_orig;
+	int ret = NET_RX_DROP;
+	__be16 type;
+
 	if (!skb->iif)
 		skb->iif = skb->dev->ifindex;
 
@@ -2426,13 +2678,13 @@ out:
 	rcu_read_unlock();
 	return ret;
 }
-EXPORT_SYMBOL(netif_receive_skb);
 
 /* Network device is going away, flush any packets still pending  */
 static void flush_backlog(void *arg)
 {
 	struct net_device *dev = arg;
 	struct softnet_data *queue = &__get_cpu_var(softnet_data);
+	struct rx_steer_queue *sq = &__get_cpu_var(rx_steer_queues);
 	struct sk_buff *skb, *tmp;
 
 	skb_queue_walk_safe(&queue->input_pkt_queue, skb, tmp)
@@ -2440,6 +2692,15 @@ static void flush_backlog(void *arg)
 			__skb_unlink(skb, &queue->input_pkt_queue);
 			kfree_skb(skb);
 		}
+
+	/* and what the early receive filter steered to this cpu */
+	spin_lock(&sq->queue.lock);
+	skb_queue_walk_safe(&sq->queue, skb, tmp)
+		if (skb->dev == dev) {
+			__skb_unlink(skb, &sq->queue);
+			kfree_skb(skb);
+		}
+	spin_unlock(&sq->queue.lock);
 }
 
 static int napi_gro_complete(struct sk_buff *skb)
@@ -4718,6 +4979,8 @@ static void rollback_registered(struct net_device *dev)
 	/* Shutdown queueing discipline. */
 	dev_shutdown(dev);
 
+	/* Drop the early receive filter. */
+	dev_set_rx_filter(dev, NULL, 0);
 
 	/* Notify protocols, that we are about to destroy
 	   this device. They should clean all the things.
@@ -5479,6 +5742,15 @@ static int dev_cpu_callback(struct notifier_block *nfb,
 	struct sk_buff *skb;
 	unsigned int cpu, oldcpu = (unsigned long)ocpu;
 	struct softnet_data *sd, *oldsd;
+	struct rx_steer_queue *oldsq = &per_cpu(rx_steer_queues, oldcpu);
+	struct sk_buff_head steered;
+
+	if (action == CPU_UP_PREPARE || action == CPU_UP_PREPARE_FROZEN) {
+		spin_lock_irq(&oldsq->queue.lock);
+		oldsq->dead = 0;
+		spin_unlock_irq(&oldsq->queue.lock);
+		return NOTIFY_OK;
+	}
 
 	if (action != CPU_DEAD && action != CPU_DEAD_FROZEN)
 		return NOTIFY_OK;
@@ -5511,6 +5783,22 @@ static int dev_cpu_callback(struct notifier_block *nfb,
 	while ((skb = __skb_dequeue(&oldsd->input_pkt_queue)))
 		netif_rx(skb);
 
+	/*
+	 * Rerun packets the early receive filter steered to the offline CPU.
+	 * Once dead is set nobody queues there any more.
+	 */
+	__skb_queue_head_init(&steered);
+	spin_lock_irq(&oldsq->queue.lock);
+	oldsq->dead = 1;
+	skb_queue_splice_init(&oldsq->queue, &steered);
+	if (test_bit(NAPI_STATE_SCHED, &oldsq->napi.state)) {
+		list_del_init(&oldsq->napi.poll_list);
+		clear_bit(NAPI_STATE_SCHED, &oldsq->napi.state);
+	}
+	spin_unlock_irq(&oldsq->queue.lock);
+	while ((skb = __skb_dequeue(&steered)))
+		netif_rx(skb);
+
 	return NOTIFY_OK;
 }
 
@@ -5717,6 +6005,20 @@ static int __init net_dev_init(void)
 		queue->backlog.gro_count = 0;
 	}
 
+	for_each_possible_cpu(i) {
+		struct rx_steer_queue *sq = &per_cpu(rx_steer_queues, i);
+
+		skb_queue_head_init(&sq->queue);
+		sq->napi.poll = rx_steer_poll;
+		sq->napi.weight = weight_p;
+		INIT_LIST_HEAD(&sq->napi.poll_list);
+#ifdef CONFIG_USE_GENERIC_SMP_HELPERS
+		sq->csd.func = rx_steer_kick;
+		sq->csd.info = sq;
+		sq->csd.flags = 0;
+#endif
+	}
+
 	dev_boot_phase = 0;
 
 	/* The loopback device is special if any other network devices
@@ -64,6 +64,64 @@ static inline void *load_pointer(struct sk_buff *skb, int k,
 	}
 }
 
+/*
+ * Ancillary data, which are impossible (or very difficult) to get
+ * parsing packet contents. Returns 0 when the filter has to return 0.
+ */
+static inline int load_ancillary(struct sk_buff *skb, int anc, u32 *A, u32 X)
+{
+	struct nlattr *nla;
+
+	switch (anc) {
+	case SKF_AD_PROTOCOL:
+		*A = ntohs(skb->protocol);
+		return 1;
+	case SKF_AD_PKTTYPE:
+		*A = skb->pkt_type;
+		return 1;
+	case SKF_AD_IFINDEX:
+		*A = skb->dev->ifindex;
+		return 1;
+	case SKF_AD_NLATTR:
+		if (skb_is_nonlinear(skb))
+			return 0;
+		if (skb->len < sizeof(struct nlattr))
+			return 0;
+
+		if (*A > skb->len - sizeof(struct nlattr))
+			return 0;
+
+		nla = nla_find((struct nlattr *)&skb->data[*A],
+			       skb->len - *A, X);
+		if (nla)
+			*A = (void *)nla - (void *)skb->data;
+		else
+			*A = 0;
+		return 1;
+	case SKF_AD_NLATTR_NEST:
+		if (skb_is_nonlinear(skb))
+			return 0;
+		if (skb->len < sizeof(struct nlattr))
+			return 0;
+
+		if (*A > skb->len - sizeof(struct nlattr))
+			return 0;
+
+		nla = (struct nlattr *)&skb->data[*A];
+		if (nla->nla_len > skb->len - *A)
+			return 0;
+
+		nla = nla_find_nested(nla, X);
+		if (nla)
+			*A = (void *)nla - (void *)skb->data;
+		else
+			*A = 0;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 /**
  *	sk_filter - run a packet through a socket filter
  *	@sk: sock associated with &sk_buff
@@ -88,8 +146,7 @@ int sk_filter(struct sock *sk, struct sk_buff *skb)
 	rcu_read_lock_bh();
 	filter = rcu_dereference(sk->sk_filter);
 	if (filter) {
-		unsigned int pkt_len = sk_run_filter(skb, filter->insns,
-				filter->len);
+		unsigned int pkt_len = SK_RUN_FILTER(filter, skb);
 		err = pkt_len ? pskb_trim(skb, pkt_len) : -EPERM;
 	}
 	rcu_read_unlock_bh();
@@ -297,69 +354,444 @@ load_b:
 			return 0;
 		}
 
-		/*
-		 * Handle ancillary data, which are impossible
-		 * (or very difficult) to get parsing packet contents.
-		 */
-		switch (k-SKF_AD_OFF) {
-		case SKF_AD_PROTOCOL:
-			A = ntohs(skb->protocol);
-			continue;
-		case SKF_AD_PKTTYPE:
-			A = skb->pkt_type;
-			continue;
-		case SKF_AD_IFINDEX:
-			A = skb->dev->ifindex;
-			continue;
-		case SKF_AD_NLATTR: {
-			struct nlattr *nla;
+		/* the load missed, k may name ancillary data */
+		if (!load_ancillary(skb, k - SKF_AD_OFF, &A, X))
+			return 0;
+	}
 
-			if (skb_is_nonlinear(skb))
-				return 0;
-			if (skb->len < sizeof(struct nlattr))
-				return 0;
+	return 0;
+}
+EXPORT_SYMBOL(sk_run_filter);
 
-			if (A > skb->len - sizeof(struct nlattr))
-				return 0;
+/*
+ * Compiled filters.
+ *
+ * With net.core.bpf_jit_enable set, sk_attach_filter() translates the
+ * checked program into an image that sk_run_filter_image() executes by
+ * jumping straight from one instruction's code to the next one's,
+ * instead of going through the switch of sk_run_filter() each time.
+ * Decisions the interpreter takes per packet are taken once here:
+ * absolute loads of ancillary data become their own instructions, and
+ * the scratch memory is cleared up front instead of being tracked.
+ * Packet loads read the linear data directly and only call a helper
+ * for negative offsets, fragments or ancillary data.
+ *
+ * A value of 2 also dumps each image to the kernel log.
+ */
+int bpf_jit_enable __read_mostly;
+
+enum {
+	BPF_I_ADD_X,
+	BPF_I_ADD_K,
+	BPF_I_SUB_X,
+	BPF_I_SUB_K,
+	BPF_I_MUL_X,
+	BPF_I_MUL_K,
+	BPF_I_DIV_X,
+	BPF_I_DIV_K,
+	BPF_I_AND_X,
+	BPF_I_AND_K,
+	BPF_I_OR_X,
+	BPF_I_OR_K,
+	BPF_I_LSH_X,
+	BPF_I_LSH_K,
+	BPF_I_RSH_X,
+	BPF_I_RSH_K,
+	BPF_I_NEG,
+	BPF_I_JA,
+	BPF_I_JGT_K,
+	BPF_I_JGE_K,
+	BPF_I_JEQ_K,
+	BPF_I_JSET_K,
+	BPF_I_JGT_X,
+	BPF_I_JGE_X,
+	BPF_I_JEQ_X,
+	BPF_I_JSET_X,
+	BPF_I_LD_W_ABS,
+	BPF_I_LD_H_ABS,
+	BPF_I_LD_B_ABS,
+	BPF_I_LD_W_IND,
+	BPF_I_LD_H_IND,
+	BPF_I_LD_B_IND,
+	BPF_I_LD_W_LEN,
+	BPF_I_LDX_W_LEN,
+	BPF_I_LDX_B_MSH,
+	BPF_I_LD_IMM,
+	BPF_I_LDX_IMM,
+	BPF_I_LD_MEM,
+	BPF_I_LDX_MEM,
+	BPF_I_TAX,
+	BPF_I_TXA,
+	BPF_I_RET_K,
+	BPF_I_RET_A,
+	BPF_I_ST,
+	BPF_I_STX,
+	BPF_I_ANC_PROTOCOL,
+	BPF_I_ANC_PKTTYPE,
+	BPF_I_ANC_IFINDEX,
+	BPF_I_ANC_NLATTR,
+	BPF_I_ANC_NLATTR_NEST,
+	BPF_I_MAX
+};
+
+struct bpf_image_insn {
+	u16	op;		/* BPF_I_* */
+	u8	jt;
+	u8	jf;
+	u32	k;
+};
+
+struct sk_filter_image {
+	unsigned int		len;
+	unsigned int		uses_mem:1;
+	struct bpf_image_insn	insns[0];
+};
+
+static const u8 bpf_image_ops[] = {
+	[BPF_ALU|BPF_ADD|BPF_X]		= BPF_I_ADD_X,
+	[BPF_ALU|BPF_ADD|BPF_K]		= BPF_I_ADD_K,
+	[BPF_ALU|BPF_SUB|BPF_X]		= BPF_I_SUB_X,
+	[BPF_ALU|BPF_SUB|BPF_K]		= BPF_I_SUB_K,
+	[BPF_ALU|BPF_MUL|BPF_X]		= BPF_I_MUL_X,
+	[BPF_ALU|BPF_MUL|BPF_K]		= BPF_I_MUL_K,
+	[BPF_ALU|BPF_DIV|BPF_X]		= BPF_I_DIV_X,
+	[BPF_ALU|BPF_DIV|BPF_K]		= BPF_I_DIV_K,
+	[BPF_ALU|BPF_AND|BPF_X]		= BPF_I_AND_X,
+	[BPF_ALU|BPF_AND|BPF_K]		= BPF_I_AND_K,
+	[BPF_ALU|BPF_OR|BPF_X]		= BPF_I_OR_X,
+	[BPF_ALU|BPF_OR|BPF_K]		= BPF_I_OR_K,
+	[BPF_ALU|BPF_LSH|BPF_X]		= BPF_I_LSH_X,
+	[BPF_ALU|BPF_LSH|BPF_K]		= BPF_I_LSH_K,
+	[BPF_ALU|BPF_RSH|BPF_X]		= BPF_I_RSH_X,
+	[BPF_ALU|BPF_RSH|BPF_K]		= BPF_I_RSH_K,
+	[BPF_ALU|BPF_NEG]		= BPF_I_NEG,
+	[BPF_JMP|BPF_JA]		= BPF_I_JA,
+	[BPF_JMP|BPF_JGT|BPF_K]		= BPF_I_JGT_K,
+	[BPF_JMP|BPF_JGE|BPF_K]		= BPF_I_JGE_K,
+	[BPF_JMP|BPF_JEQ|BPF_K]		= BPF_I_JEQ_K,
+	[BPF_JMP|BPF_JSET|BPF_K]	= BPF_I_JSET_K,
+	[BPF_JMP|BPF_JGT|BPF_X]		= BPF_I_JGT_X,
+	[BPF_JMP|BPF_JGE|BPF_X]		= BPF_I_JGE_X,
+	[BPF_JMP|BPF_JEQ|BPF_X]		= BPF_I_JEQ_X,
+	[BPF_JMP|BPF_JSET|BPF_X]	= BPF_I_JSET_X,
+	[BPF_LD|BPF_W|BPF_ABS]		= BPF_I_LD_W_ABS,
+	[BPF_LD|BPF_H|BPF_ABS]		= BPF_I_LD_H_ABS,
+	[BPF_LD|BPF_B|BPF_ABS]		= BPF_I_LD_B_ABS,
+	[BPF_LD|BPF_W|BPF_IND]		= BPF_I_LD_W_IND,
+	[BPF_LD|BPF_H|BPF_IND]		= BPF_I_LD_H_IND,
+	[BPF_LD|BPF_B|BPF_IND]		= BPF_I_LD_B_IND,
+	[BPF_LD|BPF_W|BPF_LEN]		= BPF_I_LD_W_LEN,
+	[BPF_LDX|BPF_W|BPF_LEN]		= BPF_I_LDX_W_LEN,
+	[BPF_LDX|BPF_B|BPF_MSH]		= BPF_I_LDX_B_MSH,
+	[BPF_LD|BPF_IMM]		= BPF_I_LD_IMM,
+	[BPF_LDX|BPF_IMM]		= BPF_I_LDX_IMM,
+	[BPF_LD|BPF_MEM]		= BPF_I_LD_MEM,
+	[BPF_LDX|BPF_MEM]		= BPF_I_LDX_MEM,
+	[BPF_MISC|BPF_TAX]		= BPF_I_TAX,
+	[BPF_MISC|BPF_TXA]		= BPF_I_TXA,
+	[BPF_RET|BPF_K]			= BPF_I_RET_K,
+	[BPF_RET|BPF_A]			= BPF_I_RET_A,
+	[BPF_ST]			= BPF_I_ST,
+	[BPF_STX]			= BPF_I_STX,
+};
+
+static const u8 bpf_image_anc_ops[] = {
+	[SKF_AD_PROTOCOL]	= BPF_I_ANC_PROTOCOL,
+	[SKF_AD_PKTTYPE]	= BPF_I_ANC_PKTTYPE,
+	[SKF_AD_IFINDEX]	= BPF_I_ANC_IFINDEX,
+	[SKF_AD_NLATTR]		= BPF_I_ANC_NLATTR,
+	[SKF_AD_NLATTR_NEST]	= BPF_I_ANC_NLATTR_NEST,
+};
 
-			nla = nla_find((struct nlattr *)&skb->data[A],
-				       skb->len - A, X);
-			if (nla)
-				A = (void *)nla - (void *)skb->data;
-			else
-				A = 0;
-			continue;
+/**
+ *	bpf_jit_compile - compile a checked filter
+ *	@fp: filter, already passed through sk_chk_filter()
+ *
+ * Without memory for the image the filter is simply interpreted.
+ */
+void bpf_jit_compile(struct sk_filter *fp)
+{
+	struct sk_filter_image *image;
+	unsigned int pc;
+
+	if (!bpf_jit_enable)
+		return;
+
+	image = kmalloc(sizeof(*image) + fp->len * sizeof(image->insns[0]),
+			GFP_KERNEL);
+	if (image == NULL)
+		return;
+	image->len = fp->len;
+	image->uses_mem = 0;
+
+	for (pc = 0; pc < fp->len; pc++) {
+		const struct sock_filter *f = &fp->insns[pc];
+		struct bpf_image_insn *insn = &image->insns[pc];
+		int k = f->k;
+
+		insn->op = bpf_image_ops[f->code];
+		insn->jt = f->jt;
+		insn->jf = f->jf;
+		insn->k = f->k;
+
+		switch (f->code) {
+		case BPF_LD|BPF_W|BPF_ABS:
+		case BPF_LD|BPF_H|BPF_ABS:
+		case BPF_LD|BPF_B|BPF_ABS:
+			if (k < SKF_AD_OFF || k >= 0)
+				break;
+			k -= SKF_AD_OFF;
+			if (k < SKF_AD_MAX && (k & 3) == 0) {
+				insn->op = bpf_image_anc_ops[k];
+			} else {
+				/* unknown ancillary data, the filter says no */
+				insn->op = BPF_I_RET_K;
+				insn->k = 0;
+			}
+			break;
+		case BPF_LD|BPF_MEM:
+		case BPF_LDX|BPF_MEM:
+			image->uses_mem = 1;
+			break;
 		}
-		case SKF_AD_NLATTR_NEST: {
-			struct nlattr *nla;
+	}
 
-			if (skb_is_nonlinear(skb))
-				return 0;
-			if (skb->len < sizeof(struct nlattr))
-				return 0;
+	if (bpf_jit_enable > 1) {
+		pr_err("bpf image: flen=%u size=%zu\n", fp->len,
+		       fp->len * sizeof(image->insns[0]));
+		print_hex_dump(KERN_ERR, "bpf image: ", DUMP_PREFIX_OFFSET,
+			       16, 1, image->insns,
+			       fp->len * sizeof(image->insns[0]), false);
+	}
 
-			if (A > skb->len - sizeof(struct nlattr))
-				return 0;
+	fp->image = image;
+}
+EXPORT_SYMBOL(bpf_jit_compile);
 
-			nla = (struct nlattr *)&skb->data[A];
-			if (nla->nla_len > skb->len - A)
-				return 0;
+void bpf_jit_free(struct sk_filter *fp)
+{
+	kfree(fp->image);
+}
+EXPORT_SYMBOL(bpf_jit_free);
 
-			nla = nla_find_nested(nla, X);
-			if (nla)
-				A = (void *)nla - (void *)skb->data;
-			else
-				A = 0;
-			continue;
-		}
-		default:
-			return 0;
-		}
+/* Loads that miss the linear data. Returns 0 when the filter returns 0. */
+static noinline int bpf_load_slow(struct sk_buff *skb, int k,
+				  unsigned int size, u32 *A, u32 X)
+{
+	void *ptr;
+	u32 tmp;
+
+	ptr = load_pointer(skb, k, size, &tmp);
+	if (ptr == NULL)
+		return load_ancillary(skb, k - SKF_AD_OFF, A, X);
+
+	switch (size) {
+	case 4:
+		*A = get_unaligned_be32(ptr);
+		break;
+	case 2:
+		*A = get_unaligned_be16(ptr);
+		break;
+	default:
+		*A = *(u8 *)ptr;
+		break;
 	}
+	return 1;
+}
 
-	return 0;
+/**
+ *	sk_run_filter_image - run a compiled filter
+ *	@skb: buffer to run the filter on
+ *	@image: image built by bpf_jit_compile()
+ *
+ * Same result as sk_run_filter() on the program the image came from.
+ * sk_chk_filter() guarantees that every path ends with a return, so
+ * there are no bounds checks on the program counter.
+ */
+unsigned int sk_run_filter_image(struct sk_buff *skb,
+				 const struct sk_filter_image *image)
+{
+	static const void *jumptable[BPF_I_MAX] = {
+		[BPF_I_ADD_X]		= &&add_x,
+		[BPF_I_ADD_K]		= &&add_k,
+		[BPF_I_SUB_X]		= &&sub_x,
+		[BPF_I_SUB_K]		= &&sub_k,
+		[BPF_I_MUL_X]		= &&mul_x,
+		[BPF_I_MUL_K]		= &&mul_k,
+		[BPF_I_DIV_X]		= &&div_x,
+		[BPF_I_DIV_K]		= &&div_k,
+		[BPF_I_AND_X]		= &&and_x,
+		[BPF_I_AND_K]		= &&and_k,
+		[BPF_I_OR_X]		= &&or_x,
+		[BPF_I_OR_K]		= &&or_k,
+		[BPF_I_LSH_X]		= &&lsh_x,
+		[BPF_I_LSH_K]		= &&lsh_k,
+		[BPF_I_RSH_X]		= &&rsh_x,
+		[BPF_I_RSH_K]		= &&rsh_k,
+		[BPF_I_NEG]		= &&neg,
+		[BPF_I_JA]		= &&ja,
+		[BPF_I_JGT_K]		= &&jgt_k,
+		[BPF_I_JGE_K]		= &&jge_k,
+		[BPF_I_JEQ_K]		= &&jeq_k,
+		[BPF_I_JSET_K]		= &&jset_k,
+		[BPF_I_JGT_X]		= &&jgt_x,
+		[BPF_I_JGE_X]		= &&jge_x,
+		[BPF_I_JEQ_X]		= &&jeq_x,
+		[BPF_I_JSET_X]		= &&jset_x,
+		[BPF_I_LD_W_ABS]	= &&ld_w_abs,
+		[BPF_I_LD_H_ABS]	= &&ld_h_abs,
+		[BPF_I_LD_B_ABS]	= &&ld_b_abs,
+		[BPF_I_LD_W_IND]	= &&ld_w_ind,
+		[BPF_I_LD_H_IND]	= &&ld_h_ind,
+		[BPF_I_LD_B_IND]	= &&ld_b_ind,
+		[BPF_I_LD_W_LEN]	= &&ld_w_len,
+		[BPF_I_LDX_W_LEN]	= &&ldx_w_len,
+		[BPF_I_LDX_B_MSH]	= &&ldx_b_msh,
+		[BPF_I_LD_IMM]		= &&ld_imm,
+		[BPF_I_LDX_IMM]		= &&ldx_imm,
+		[BPF_I_LD_MEM]		= &&ld_mem,
+		[BPF_I_LDX_MEM]		= &&ldx_mem,
+		[BPF_I_TAX]		= &&tax,
+		[BPF_I_TXA]		= &&txa,
+		[BPF_I_RET_K]		= &&ret_k,
+		[BPF_I_RET_A]		= &&ret_a,
+		[BPF_I_ST]		= &&st,
+		[BPF_I_STX]		= &&stx,
+		[BPF_I_ANC_PROTOCOL]	= &&anc_protocol,
+		[BPF_I_ANC_PKTTYPE]	= &&anc_pkttype,
+		[BPF_I_ANC_IFINDEX]	= &&anc_ifindex,
+		[BPF_I_ANC_NLATTR]	= &&anc_nlattr,
+		[BPF_I_ANC_NLATTR_NEST]	= &&anc_nlattr,
+	};
+	const struct bpf_image_insn *insn = image->insns;
+	const u8 *data = skb->data;
+	unsigned int hlen = skb_headlen(skb);
+	u32 mem[BPF_MEMWORDS];
+	u32 A = 0, X = 0;
+	void *ptr;
+	u32 tmp;
+	int k;
+
+#define NEXT		({ insn++; goto *jumptable[insn->op]; })
+#define JUMP(off)	({ insn += 1 + (off); goto *jumptable[insn->op]; })
+#define COND(c)		JUMP((c) ? insn->jt : insn->jf)
+
+	if (image->uses_mem)
+		memset(mem, 0, sizeof(mem));
+
+	goto *jumptable[insn->op];
+
+add_x:	A += X;		NEXT;
+add_k:	A += insn->k;	NEXT;
+sub_x:	A -= X;		NEXT;
+sub_k:	A -= insn->k;	NEXT;
+mul_x:	A *= X;		NEXT;
+mul_k:	A *= insn->k;	NEXT;
+div_x:
+	if (X == 0)
+		return 0;
+	A /= X;
+	NEXT;
+div_k:	A /= insn->k;	NEXT;
+and_x:	A &= X;		NEXT;
+and_k:	A &= insn->k;	NEXT;
+or_x:	A |= X;		NEXT;
+or_k:	A |= insn->k;	NEXT;
+lsh_x:	A <<= X;	NEXT;
+lsh_k:	A <<= insn->k;	NEXT;
+rsh_x:	A >>= X;	NEXT;
+rsh_k:	A >>= insn->k;	NEXT;
+neg:	A = -A;		NEXT;
+
+ja:	JUMP(insn->k);
+jgt_k:	COND(A > insn->k);
+jge_k:	COND(A >= insn->k);
+jeq_k:	COND(A == insn->k);
+jset_k:	COND(A & insn->k);
+jgt_x:	COND(A > X);
+jge_x:	COND(A >= X);
+jeq_x:	COND(A == X);
+jset_x:	COND(A & X);
+
+ld_w_ind:
+	k = X + insn->k;
+	goto load_w;
+ld_w_abs:
+	k = insn->k;
+load_w:
+	if (likely(k >= 0 && (unsigned int)k + 4 <= hlen)) {
+		A = get_unaligned_be32(data + k);
+		NEXT;
+	}
+	if (!bpf_load_slow(skb, k, 4, &A, X))
+		return 0;
+	NEXT;
+
+ld_h_ind:
+	k = X + insn->k;
+	goto load_h;
+ld_h_abs:
+	k = insn->k;
+load_h:
+	if (likely(k >= 0 && (unsigned int)k + 2 <= hlen)) {
+		A = get_unaligned_be16(data + k);
+		NEXT;
+	}
+	if (!bpf_load_slow(skb, k, 2, &A, X))
+		return 0;
+	NEXT;
+
+ld_b_ind:
+	k = X + insn->k;
+	goto load_b;
+ld_b_abs:
+	k = insn->k;
+load_b:
+	if (likely(k >= 0 && (unsigned int)k < hlen)) {
+		A = data[k];
+		NEXT;
+	}
+	if (!bpf_load_slow(skb, k, 1, &A, X))
+		return 0;
+	NEXT;
+
+ld_w_len:	A = skb->len;	NEXT;
+ldx_w_len:	X = skb->len;	NEXT;
+ldx_b_msh:
+	k = insn->k;
+	if (likely(k >= 0 && (unsigned int)k < hlen)) {
+		X = (data[k] & 0xf) << 2;
+		NEXT;
+	}
+	ptr = load_pointer(skb, k, 1, &tmp);
+	if (ptr == NULL)
+		return 0;
+	X = (*(u8 *)ptr & 0xf) << 2;
+	NEXT;
+ld_imm:		A = insn->k;		NEXT;
+ldx_imm:	X = insn->k;		NEXT;
+ld_mem:		A = mem[insn->k];	NEXT;
+ldx_mem:	X = mem[insn->k];	NEXT;
+tax:		X = A;			NEXT;
+txa:		A = X;			NEXT;
+st:		mem[insn->k] = A;	NEXT;
+stx:		mem[insn->k] = X;	NEXT;
+ret_k:		return insn->k;
+ret_a:		return A;
+
+anc_protocol:	A = ntohs(skb->protocol);	NEXT;
+anc_pkttype:	A = skb->pkt_type;		NEXT;
+anc_ifindex:	A = skb->dev->ifindex;		NEXT;
+anc_nlattr:
+	if (!load_ancillary(skb, (int)insn->k - SKF_AD_OFF, &A, X))
+		return 0;
+	NEXT;
+
+#undef COND
+#undef JUMP
+#undef NEXT
 }
-EXPORT_SYMBOL(sk_run_filter);
+EXPORT_SYMBOL(sk_run_filter_image);
 
 /**
  *	sk_chk_filter - verify socket filter code
@@ -522,12 +954,16 @@ int sk_attach_filter(struct sock_fprog *fprog, struct sock *sk)
 	atomic_set(&fp->refcnt, 1);
 	fp->len = fprog->len;
 
+	fp->image = NULL;
+
 	err = sk_chk_filter(fp->insns, fp->len);
 	if (err) {
 		sk_filter_uncharge(sk, fp);
 		return err;
 	}
 
+	bpf_jit_compile(fp);
+
 	rcu_read_lock_bh();
 	old_fp = rcu_dereference(sk->sk_filter);
 	rcu_assign_pointer(sk->sk_filter, fp);
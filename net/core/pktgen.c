@@ -169,7 +169,7 @@
 #include <asm/dma.h>
 #include <asm/div64.h>		/* do_div */
 
-#define VERSION 	"2.72"
+#define VERSION 	"2.73"
 #define IP_NAME_SZ 32
 #define MAX_MPLS_LABELS 16 /* This is the max label stack depth */
 #define MPLS_STACK_BOTTOM htonl(0x00000100)
@@ -190,6 +190,7 @@
 #define F_IPSEC_ON    (1<<12)	/* ipsec on for flows */
 #define F_QUEUE_MAP_RND (1<<13)	/* queue map Random */
 #define F_QUEUE_MAP_CPU (1<<14)	/* queue map mirrors smp_processor_id() */
+#define F_FLOW_ZIPF   (1<<15)	/* Zipf distributed flow popularity */
 
 /* Thread control flag bits */
 #define T_STOP        (1<<0)	/* Stop run */
@@ -205,9 +206,19 @@
 #define PKTGEN_MAGIC 0xbe9be955
 #define PG_PROC_DIR "pktgen"
 #define PGCTRL	    "pgctrl"
+#define PGRX	    "pgrx"
 static struct proc_dir_entry *pg_proc_dir;
 
 #define MAX_CFLOWS  65536
+#define ZIPF_SCALE  (1 << 20)	/* weight of the most popular flow */
+
+#define MAX_IMIX_ENTRIES 20
+#define IMIX_PRECISION 100	/* resolution of the IMIX distribution */
+
+struct imix_pkt {
+	__u32 size;
+	__u32 weight;
+};
 
 #define VLAN_TAG_SIZE(x) ((x)->vlan_id == 0xffff ? 0 : 4)
 #define SVLAN_TAG_SIZE(x) ((x)->svlan_id == 0xffff ? 0 : 4)
@@ -369,6 +380,15 @@ struct pktgen_dev {
 	unsigned lflow;		/* Flow length  (config) */
 	unsigned nflows;	/* accumulated flows (stats) */
 	unsigned curfl;		/* current sequenced flow (state)*/
+	__u32 *flow_cdf;	/* cumulative Zipf weights (FLOW_ZIPF) */
+	unsigned zipf_flows;	/* flows covered by flow_cdf */
+
+	/* IMIX: packet sizes picked by weight from imix_entries */
+	unsigned n_imix_entries;
+	struct imix_pkt imix_entries[MAX_IMIX_ENTRIES];
+	__u8 imix_distribution[IMIX_PRECISION];
+
+	__u32 rate_mbps;	/* if set, delay follows the packet size */
 
 	u16 queue_map_min;
 	u16 queue_map_max;
@@ -436,6 +456,10 @@ static void pktgen_stop_all_threads_ifs(void);
 static void pktgen_stop(struct pktgen_thread *t);
 static void pktgen_clear_counters(struct pktgen_dev *pkt_dev);
 
+static int pktgen_rx_start(const char *ifname);
+static void pktgen_rx_stop(void);
+static void pktgen_rx_reset(void);
+
 static unsigned int scan_ip6(const char *s, char ip[16]);
 static unsigned int fmt_ip6(char *s, const char ip[16]);
 
@@ -447,6 +471,7 @@ static int debug  __read_mostly;
 
 static DEFINE_MUTEX(pktgen_thread_lock);
 static LIST_HEAD(pktgen_threads);
+static struct net_device *pg_rx_dev;	/* under pktgen_thread_lock */
 
 static struct notifier_block pktgen_notifier_block = {
 	.notifier_call = pktgen_device_event,
@@ -492,6 +517,21 @@ static ssize_t pgctrl_write(struct file *file, const char __user *buf,
 	else if (!strcmp(data, "reset"))
 		pktgen_reset_all_threads();
 
+	else if (!strncmp(data, "rx ", 3)) {
+		err = pktgen_rx_start(strstrip(data + 3));
+		if (err)
+			goto out;
+	}
+
+	else if (!strcmp(data, "rx_stop")) {
+		mutex_lock(&pktgen_thread_lock);
+		pktgen_rx_stop();
+		mutex_unlock(&pktgen_thread_lock);
+	}
+
+	else if (!strcmp(data, "rx_reset"))
+		pktgen_rx_reset();
+
 	else
 		printk(KERN_WARNING "pktgen: Unknown command: %s\n", data);
 
@@ -534,6 +574,18 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 	seq_printf(seq, "     flows: %u flowlen: %u\n", pkt_dev->cflows,
 		   pkt_dev->lflow);
 
+	if (pkt_dev->n_imix_entries) {
+		unsigned i;
+		seq_printf(seq, "     imix_weights: ");
+		for (i = 0; i < pkt_dev->n_imix_entries; i++)
+			seq_printf(seq, "%u,%u%s", pkt_dev->imix_entries[i].size,
+				   pkt_dev->imix_entries[i].weight,
+				   i == pkt_dev->n_imix_entries-1 ? "\n" : " ");
+	}
+
+	if (pkt_dev->rate_mbps)
+		seq_printf(seq, "     rate: %uMb/sec\n", pkt_dev->rate_mbps);
+
 	seq_printf(seq,
 		   "     queue_map_min: %u  queue_map_max: %u\n",
 		   pkt_dev->queue_map_min,
@@ -639,6 +691,8 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 	if (pkt_dev->cflows) {
 		if (pkt_dev->flags & F_FLOW_SEQ)
 			seq_printf(seq,  "FLOW_SEQ  "); /*in sequence flows*/
+		else if (pkt_dev->flags & F_FLOW_ZIPF)
+			seq_printf(seq,  "FLOW_ZIPF  ");
 		else
 			seq_printf(seq,  "FLOW_RND  ");
 	}
@@ -828,6 +882,78 @@ static ssize_t get_labels(const char __user *buffer, struct pktgen_dev *pkt_dev)
 	return i;
 }
 
+/* Spread IMIX_PRECISION slots over the entries in proportion to weight */
+static void fill_imix_distribution(struct pktgen_dev *pkt_dev)
+{
+	u64 total = 0, cum = 0;
+	unsigned i, j = 0;
+
+	for (i = 0; i < pkt_dev->n_imix_entries; i++)
+		total += pkt_dev->imix_entries[i].weight;
+
+	if (!total) {
+		pkt_dev->n_imix_entries = 0;
+		return;
+	}
+
+	for (i = 0; i < pkt_dev->n_imix_entries; i++) {
+		u64 limit;
+
+		cum += pkt_dev->imix_entries[i].weight;
+		limit = div64_u64(cum * IMIX_PRECISION, total);
+		while (j < limit)
+			pkt_dev->imix_distribution[j++] = i;
+	}
+}
+
+/* "size,weight size,weight ..." - an empty list turns IMIX off */
+static ssize_t get_imix_entries(const char __user *buffer, size_t maxlen,
+				struct pktgen_dev *pkt_dev)
+{
+	unsigned long size, weight;
+	unsigned n = 0;
+	ssize_t i = 0;
+	int len;
+	char c;
+
+	pkt_dev->n_imix_entries = 0;
+	while (i < maxlen) {
+		len = num_arg(&buffer[i], 10, &size);
+		if (len < 0)
+			return len;
+		if (len == 0)
+			break;
+		i += len;
+		if (get_user(c, &buffer[i]))
+			return -EFAULT;
+		if (c != ',')
+			return -EINVAL;
+		i++;
+
+		len = num_arg(&buffer[i], 10, &weight);
+		if (len <= 0)
+			return len ? len : -EINVAL;
+		i += len;
+
+		if (n >= MAX_IMIX_ENTRIES)
+			return -E2BIG;
+		if (size < 14 + 20 + 8)
+			size = 14 + 20 + 8;
+		pkt_dev->imix_entries[n].size = size;
+		pkt_dev->imix_entries[n].weight = weight;
+		n++;
+
+		len = count_trail_chars(&buffer[i], maxlen - i);
+		if (len < 0)
+			return len;
+		i += len;
+	}
+
+	pkt_dev->n_imix_entries = n;
+	fill_imix_distribution(pkt_dev);
+	return i;
+}
+
 static ssize_t pktgen_if_write(struct file *file,
 			       const char __user * user_buffer, size_t count,
 			       loff_t * offset)
@@ -967,11 +1093,52 @@ static ssize_t pktgen_if_write(struct file *file,
 			pkt_dev->delay = ULLONG_MAX;
 		else
 			pkt_dev->delay = (u64)value;
+		pkt_dev->rate_mbps = 0;
 
 		sprintf(pg_result, "OK: delay=%llu",
 			(unsigned long long) pkt_dev->delay);
 		return count;
 	}
+	if (!strcmp(name, "rate")) {
+		len = num_arg(&user_buffer[i], 10, &value);
+		if (len < 0)
+			return len;
+
+		i += len;
+		/* Mb/sec; the delay is recomputed from each packet's size */
+		pkt_dev->rate_mbps = value;
+		if (!value)
+			pkt_dev->delay = 0;
+		sprintf(pg_result, "OK: rate=%uMb/sec", pkt_dev->rate_mbps);
+		return count;
+	}
+	if (!strcmp(name, "ratep")) {
+		len = num_arg(&user_buffer[i], 10, &value);
+		if (len < 0)
+			return len;
+
+		i += len;
+		pkt_dev->rate_mbps = 0;
+		pkt_dev->delay = value ? NSEC_PER_SEC / value : 0;
+		sprintf(pg_result, "OK: ratep=%lu delay=%llu", value,
+			(unsigned long long) pkt_dev->delay);
+		return count;
+	}
+	if (!strcmp(name, "imix_weights")) {
+		unsigned n, cnt;
+
+		len = get_imix_entries(&user_buffer[i], count - i, pkt_dev);
+		if (len < 0)
+			return len;
+		i += len;
+		cnt = sprintf(pg_result, "OK: imix_weights=");
+		for (n = 0; n < pkt_dev->n_imix_entries; n++)
+			cnt += sprintf(pg_result + cnt, "%u,%u%s",
+				       pkt_dev->imix_entries[n].size,
+				       pkt_dev->imix_entries[n].weight,
+				       n == pkt_dev->n_imix_entries-1 ? "" : " ");
+		return count;
+	}
 	if (!strcmp(name, "udp_src_min")) {
 		len = num_arg(&user_buffer[i], 10, &value);
 		if (len < 0)
@@ -1147,6 +1314,18 @@ static ssize_t pktgen_if_write(struct file *file,
 		else if (strcmp(f, "FLOW_SEQ") == 0)
 			pkt_dev->flags |= F_FLOW_SEQ;
 
+		else if (strcmp(f, "FLOW_ZIPF") == 0) {
+			if (!pkt_dev->flow_cdf)
+				pkt_dev->flow_cdf =
+					vmalloc(MAX_CFLOWS * sizeof(__u32));
+			if (!pkt_dev->flow_cdf)
+				return -ENOMEM;
+			pkt_dev->flags |= F_FLOW_ZIPF;
+		}
+
+		else if (strcmp(f, "!FLOW_ZIPF") == 0)
+			pkt_dev->flags &= ~F_FLOW_ZIPF;
+
 		else if (strcmp(f, "QUEUE_MAP_RND") == 0)
 			pkt_dev->flags |= F_QUEUE_MAP_RND;
 
@@ -1171,7 +1350,7 @@ static ssize_t pktgen_if_write(struct file *file,
 				"Flag -:%s:- unknown\nAvailable flags, (prepend ! to un-set flag):\n%s",
 				f,
 				"IPSRC_RND, IPDST_RND, UDPSRC_RND, UDPDST_RND, "
-				"MACSRC_RND, MACDST_RND, TXSIZE_RND, IPV6, MPLS_RND, VID_RND, SVID_RND, FLOW_SEQ, IPSEC\n");
+				"MACSRC_RND, MACDST_RND, TXSIZE_RND, IPV6, MPLS_RND, VID_RND, SVID_RND, FLOW_SEQ, FLOW_ZIPF, IPSEC\n");
 			return count;
 		}
 		sprintf(pg_result, "OK: flags=0x%x", pkt_dev->flags);
@@ -1915,6 +2094,11 @@ static int pktgen_device_event(struct notifier_block *unused,
 
 	case NETDEV_UNREGISTER:
 		pktgen_mark_device(dev->name);
+
+		mutex_lock(&pktgen_thread_lock);
+		if (pg_rx_dev == dev)
+			pktgen_rx_stop();
+		mutex_unlock(&pktgen_thread_lock);
 		break;
 	}
 
@@ -2102,6 +2286,19 @@ static void pktgen_setup_inject(struct pktgen_dev *pkt_dev)
 	pkt_dev->cur_udp_dst = pkt_dev->udp_dst_min;
 	pkt_dev->cur_udp_src = pkt_dev->udp_src_min;
 	pkt_dev->nflows = 0;
+
+	/* Flow i + 1 is picked 1/(i + 1) as often as flow 0 (Zipf, s = 1) */
+	pkt_dev->zipf_flows = 0;
+	if ((pkt_dev->flags & F_FLOW_ZIPF) && pkt_dev->cflows) {
+		__u32 sum = 0;
+		unsigned i;
+
+		for (i = 0; i < pkt_dev->cflows; i++) {
+			sum += ZIPF_SCALE / (i + 1);
+			pkt_dev->flow_cdf[i] = sum;
+		}
+		pkt_dev->zipf_flows = pkt_dev->cflows;
+	}
 }
 
 
@@ -2142,7 +2339,8 @@ static void spin(struct pktgen_dev *pkt_dev, ktime_t spin_until)
 	end_time = ktime_now();
 
 	pkt_dev->idle_acc += ktime_to_ns(ktime_sub(end_time, start_time));
-	pkt_dev->next_tx = ktime_add_ns(end_time, pkt_dev->delay);
+	/* Keep to the schedule rather than adding our wakeup latency */
+	pkt_dev->next_tx = ktime_add_ns(spin_until, pkt_dev->delay);
 }
 
 static inline void set_pkt_overhead(struct pktgen_dev *pkt_dev)
@@ -2158,6 +2356,23 @@ static inline int f_seen(const struct pktgen_dev *pkt_dev, int flow)
 	return !!(pkt_dev->flows[flow].flags & F_INIT);
 }
 
+static int f_pick_zipf(const struct pktgen_dev *pkt_dev)
+{
+	unsigned lo = 0, hi = pkt_dev->zipf_flows - 1;
+	__u32 r = random32() % pkt_dev->flow_cdf[hi];
+
+	/* First flow whose cumulative weight exceeds r */
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+
+		if (pkt_dev->flow_cdf[mid] > r)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
 static inline int f_pick(struct pktgen_dev *pkt_dev)
 {
 	int flow = pkt_dev->curfl;
@@ -2172,7 +2387,10 @@ static inline int f_pick(struct pktgen_dev *pkt_dev)
 				pkt_dev->curfl = 0; /*reset */
 		}
 	} else {
-		flow = random32() % pkt_dev->cflows;
+		if ((pkt_dev->flags & F_FLOW_ZIPF) && pkt_dev->zipf_flows)
+			flow = f_pick_zipf(pkt_dev);
+		else
+			flow = random32() % pkt_dev->cflows;
 		pkt_dev->curfl = flow;
 
 		if (pkt_dev->flows[flow].count > pkt_dev->lflow) {
@@ -2434,6 +2652,13 @@ static void mod_cur_headers(struct pktgen_dev *pkt_dev)
 		pkt_dev->cur_pkt_size = t;
 	}
 
+	if (pkt_dev->n_imix_entries) {
+		__u8 entry = pkt_dev->imix_distribution[random32() %
+							IMIX_PRECISION];
+
+		pkt_dev->cur_pkt_size = pkt_dev->imix_entries[entry].size;
+	}
+
 	set_cur_queue_map(pkt_dev);
 
 	pkt_dev->flows[flow].count++;
@@ -3446,6 +3671,12 @@ static void pktgen_xmit(struct pktgen_dev *pkt_dev)
 
 		pkt_dev->allocated_skbs++;
 		pkt_dev->clone_count = 0;	/* reset counter */
+
+		/* Time the gap after this packet to its size on the wire */
+		if (pkt_dev->rate_mbps)
+			pkt_dev->delay = div_u64((u64)pkt_dev->cur_pkt_size * 8 *
+						 NSEC_PER_USEC,
+						 pkt_dev->rate_mbps);
 	}
 
 	if (pkt_dev->delay && pkt_dev->last_ok)
@@ -3795,10 +4026,217 @@ static int pktgen_remove_device(struct pktgen_thread *t,
 	free_SAs(pkt_dev);
 #endif
 	vfree(pkt_dev->flows);
+	vfree(pkt_dev->flow_cdf);
 	kfree(pkt_dev);
 	return 0;
 }
 
+/*
+ * Receive side
+ *
+ * "rx <ifname>" written to pgctrl hooks an ETH_P_IP handler on that
+ * device which counts pktgen packets (UDP with PKTGEN_MAGIC after the
+ * header) per CPU. Loss and reordering come from the sequence number of
+ * the pktgen header, latency from its send timestamp, so sender and
+ * receiver clocks must agree and each receiving CPU should see a single
+ * stream (one flow per RX queue). Results are read from pgrx.
+ */
+
+#define PG_RX_LAT_BUCKETS 24	/* log2 of latency in usec */
+
+struct pktgen_rx_stats {
+	u64 pkts;
+	u64 bytes;
+	u64 lost;
+	u64 reordered;
+	u64 lat_sum;		/* usec */
+	u64 lat_min;
+	u64 lat_max;
+	u64 lat_hist[PG_RX_LAT_BUCKETS];
+	u32 last_seq;
+};
+
+static DEFINE_PER_CPU(struct pktgen_rx_stats, pktgen_rx_stats);
+
+static int pktgen_rcv(struct sk_buff *skb, struct net_device *dev,
+		      struct packet_type *pt, struct net_device *orig_dev)
+{
+	const struct iphdr *iph;
+	const struct pktgen_hdr *pgh;
+	struct iphdr _iph;
+	struct pktgen_hdr _pgh;
+	struct pktgen_rx_stats *st;
+	struct timeval now;
+	u32 seq;
+	s64 lat;
+
+	/* The skb may be shared with the IP stack, only peek at it */
+	iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
+	if (!iph || iph->protocol != IPPROTO_UDP ||
+	    (iph->frag_off & htons(IP_MF | IP_OFFSET)))
+		goto out;
+
+	pgh = skb_header_pointer(skb, iph->ihl * 4 + sizeof(struct udphdr),
+				 sizeof(_pgh), &_pgh);
+	if (!pgh || pgh->pgh_magic != htonl(PKTGEN_MAGIC))
+		goto out;
+
+	do_gettimeofday(&now);
+	seq = ntohl(pgh->seq_num);
+	st = &__get_cpu_var(pktgen_rx_stats);
+
+	if (!st->pkts)
+		st->last_seq = seq;
+	else if ((s32)(seq - st->last_seq) > 0) {
+		st->lost += seq - st->last_seq - 1;
+		st->last_seq = seq;
+	} else {
+		/* counted as lost when the gap was seen */
+		st->reordered++;
+		if (st->lost)
+			st->lost--;
+	}
+	st->pkts++;
+	st->bytes += skb->len + skb->mac_len;
+
+	lat = (s64)(s32)(now.tv_sec - ntohl(pgh->tv_sec)) * USEC_PER_SEC +
+	      (s64)now.tv_usec - ntohl(pgh->tv_usec);
+	if (lat >= 0) {
+		int b = fls64((u64)lat);
+
+		if (b >= PG_RX_LAT_BUCKETS)
+			b = PG_RX_LAT_BUCKETS - 1;
+		st->lat_hist[b]++;
+		st->lat_sum += lat;
+		if (lat < st->lat_min)
+			st->lat_min = lat;
+		if (lat > st->lat_max)
+			st->lat_max = lat;
+	}
+
+out:
+	kfree_skb(skb);
+	return NET_RX_SUCCESS;
+}
+
+static struct packet_type pktgen_rx_pt __read_mostly = {
+	.type = cpu_to_be16(ETH_P_IP),
+	.func = pktgen_rcv,
+};
+
+static void pktgen_rx_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct pktgen_rx_stats *st = &per_cpu(pktgen_rx_stats, cpu);
+
+		memset(st, 0, sizeof(*st));
+		st->lat_min = ULLONG_MAX;
+	}
+}
+
+static int pktgen_rx_start(const char *ifname)
+{
+	struct net_device *dev;
+
+	dev = dev_get_by_name(&init_net, ifname);
+	if (!dev) {
+		printk(KERN_ERR "pktgen: no such netdevice: \"%s\"\n", ifname);
+		return -ENODEV;
+	}
+
+	mutex_lock(&pktgen_thread_lock);
+	pktgen_rx_stop();
+	pktgen_rx_reset();
+	pktgen_rx_pt.dev = dev;
+	dev_add_pack(&pktgen_rx_pt);
+	pg_rx_dev = dev;
+	mutex_unlock(&pktgen_thread_lock);
+
+	return 0;
+}
+
+/* Caller holds pktgen_thread_lock */
+static void pktgen_rx_stop(void)
+{
+	if (!pg_rx_dev)
+		return;
+
+	dev_remove_pack(&pktgen_rx_pt);
+	dev_put(pg_rx_dev);
+	pg_rx_dev = NULL;
+}
+
+static int pgrx_show(struct seq_file *seq, void *v)
+{
+	struct pktgen_rx_stats sum;
+	u64 nlat = 0, avg = 0;
+	int cpu, b;
+
+	memset(&sum, 0, sizeof(sum));
+	sum.lat_min = ULLONG_MAX;
+	for_each_possible_cpu(cpu) {
+		const struct pktgen_rx_stats *st = &per_cpu(pktgen_rx_stats,
+							    cpu);
+
+		sum.pkts += st->pkts;
+		sum.bytes += st->bytes;
+		sum.lost += st->lost;
+		sum.reordered += st->reordered;
+		sum.lat_sum += st->lat_sum;
+		sum.lat_min = min(sum.lat_min, st->lat_min);
+		sum.lat_max = max(sum.lat_max, st->lat_max);
+		for (b = 0; b < PG_RX_LAT_BUCKETS; b++)
+			sum.lat_hist[b] += st->lat_hist[b];
+	}
+
+	mutex_lock(&pktgen_thread_lock);
+	seq_printf(seq, "RX: %s\n", pg_rx_dev ? pg_rx_dev->name : "off");
+	mutex_unlock(&pktgen_thread_lock);
+
+	seq_printf(seq, "     pkts: %llu  bytes: %llu  lost: %llu  "
+		   "reordered: %llu\n",
+		   (unsigned long long)sum.pkts,
+		   (unsigned long long)sum.bytes,
+		   (unsigned long long)sum.lost,
+		   (unsigned long long)sum.reordered);
+
+	for (b = 0; b < PG_RX_LAT_BUCKETS; b++)
+		nlat += sum.lat_hist[b];
+	if (!nlat)
+		return 0;
+
+	avg = div64_u64(sum.lat_sum, nlat);
+	seq_printf(seq, "     latency: min %lluus  avg %lluus  max %lluus\n",
+		   (unsigned long long)sum.lat_min,
+		   (unsigned long long)avg,
+		   (unsigned long long)sum.lat_max);
+
+	seq_puts(seq, "     histogram:");
+	for (b = 0; b < PG_RX_LAT_BUCKETS; b++)
+		if (sum.lat_hist[b])
+			seq_printf(seq, " <%lluus:%llu",
+				   1ULL << b,
+				   (unsigned long long)sum.lat_hist[b]);
+	seq_puts(seq, "\n");
+
+	return 0;
+}
+
+static int pgrx_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pgrx_show, NULL);
+}
+
+static const struct file_operations pktgen_rx_fops = {
+	.owner   = THIS_MODULE,
+	.open    = pgrx_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
 static int __init pg_init(void)
 {
 	int cpu;
@@ -3818,6 +4256,15 @@ static int __init pg_init(void)
 		return -EINVAL;
 	}
 
+	pe = proc_create(PGRX, 0400, pg_proc_dir, &pktgen_rx_fops);
+	if (pe == NULL) {
+		printk(KERN_ERR "pktgen: ERROR: cannot create %s "
+		       "procfs entry.\n", PGRX);
+		remove_proc_entry(PGCTRL, pg_proc_dir);
+		proc_net_remove(&init_net, PG_PROC_DIR);
+		return -EINVAL;
+	}
+
 	/* Register us to receive netdevice events */
 	register_netdevice_notifier(&pktgen_notifier_block);
 
@@ -3834,6 +4281,7 @@ static int __init pg_init(void)
 		printk(KERN_ERR "pktgen: ERROR: Initialization failed for "
 		       "all threads\n");
 		unregister_netdevice_notifier(&pktgen_notifier_block);
+		remove_proc_entry(PGRX, pg_proc_dir);
 		remove_proc_entry(PGCTRL, pg_proc_dir);
 		proc_net_remove(&init_net, PG_PROC_DIR);
 		return -ENODEV;
@@ -3860,7 +4308,12 @@ static void __exit pg_cleanup(void)
 	/* Un-register us from receiving netdevice events */
 	unregister_netdevice_notifier(&pktgen_notifier_block);
 
+	mutex_lock(&pktgen_thread_lock);
+	pktgen_rx_stop();
+	mutex_unlock(&pktgen_thread_lock);
+
 	/* Clean up proc file system */
+	remove_proc_entry(PGRX, pg_proc_dir);
 	remove_proc_entry(PGCTRL, pg_proc_dir);
 	proc_net_remove(&init_net, PG_PROC_DIR);
 }
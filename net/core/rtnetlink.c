@@ -599,6 +599,8 @@ static inline size_t if_nlmsg_size(const struct net_device *dev)
 	       + nla_total_size(4) /* IFLA_MASTER */
 	       + nla_total_size(1) /* IFLA_OPERSTATE */
 	       + nla_total_size(1) /* IFLA_LINKMODE */
+	       + nla_total_size(0) /* IFLA_RX_FILTER */
+	       + nla_total_size(sizeof(struct ifla_rx_filter_stats))
 	       + rtnl_link_get_size(dev); /* IFLA_LINKINFO */
 }
 
@@ -642,6 +644,18 @@ static int rtnl_fill_ifinfo(struct sk_buff *skb, struct net_device *dev,
 	if (dev->ifalias)
 		NLA_PUT_STRING(skb, IFLA_IFALIAS, dev->ifalias);
 
+	if (dev->rx_filter) {
+		struct ifla_rx_filter_stats st;
+		struct nlattr *filter;
+
+		filter = nla_nest_start(skb, IFLA_RX_FILTER);
+		if (filter == NULL)
+			goto nla_put_failure;
+		dev_get_rx_filter_stats(dev->rx_filter, &st);
+		NLA_PUT(skb, IFLA_RX_FILTER_STATS, sizeof(st), &st);
+		nla_nest_end(skb, filter);
+	}
+
 	if (1) {
 		struct rtnl_link_ifmap map = {
 			.mem_start   = dev->mem_start,
@@ -716,6 +730,13 @@ const struct nla_policy ifla_policy[IFLA_MAX+1] = {
 	[IFLA_LINKINFO]		= { .type = NLA_NESTED },
 	[IFLA_NET_NS_PID]	= { .type = NLA_U32 },
 	[IFLA_IFALIAS]	        = { .type = NLA_STRING, .len = IFALIASZ-1 },
+	[IFLA_RX_FILTER]	= { .type = NLA_NESTED },
+};
+
+static const struct nla_policy ifla_rx_filter_policy[IFLA_RX_FILTER_MAX+1] = {
+	[IFLA_RX_FILTER_PROG]	= { .type = NLA_BINARY,
+				    .len = BPF_MAXINSNS *
+					   sizeof(struct sock_filter) },
 };
 
 static const struct nla_policy ifla_info_policy[IFLA_INFO_MAX+1] = {
@@ -847,6 +868,30 @@ static int do_setlink(struct net_device *dev, struct ifinfomsg *ifm,
 		modified = 1;
 	}
 
+	if (tb[IFLA_RX_FILTER]) {
+		struct nlattr *ftb[IFLA_RX_FILTER_MAX+1];
+		struct nlattr *prog;
+
+		err = nla_parse_nested(ftb, IFLA_RX_FILTER_MAX,
+				       tb[IFLA_RX_FILTER],
+				       ifla_rx_filter_policy);
+		if (err < 0)
+			goto errout;
+
+		prog = ftb[IFLA_RX_FILTER_PROG];
+		if (prog) {
+			err = -EINVAL;
+			if (nla_len(prog) % sizeof(struct sock_filter))
+				goto errout;
+			err = dev_set_rx_filter(dev, nla_data(prog),
+						nla_len(prog) /
+						sizeof(struct sock_filter));
+			if (err < 0)
+				goto errout;
+			modified = 1;
+		}
+	}
+
 	if (tb[IFLA_BROADCAST]) {
 		nla_memcpy(dev->broadcast, tb[IFLA_BROADCAST], dev->addr_len);
 		send_addr_notify = 1;
@@ -202,6 +202,10 @@ static void ip_expire(unsigned long arg)
 	IP_INC_STATS_BH(net, IPSTATS_MIB_REASMTIMEOUT);
 	IP_INC_STATS_BH(net, IPSTATS_MIB_REASMFAILS);
 
+	/* packet sockets only watch the traffic, the datagram is not ours */
+	if (qp->user == IP_DEFRAG_AF_PACKET)
+		goto out;
+
 	if ((qp->q.last_in & INET_FRAG_FIRST_IN) && qp->q.fragments != NULL) {
 		struct sk_buff *head = qp->q.fragments;
 
@@ -17,6 +17,8 @@
 #include <linux/netdevice.h>
 #include <linux/module.h>
 #include <linux/icmp.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 #include <net/ip.h>
 #include <net/compat.h>
 #include <asm/uaccess.h>
@@ -27,6 +29,7 @@
 
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter/xt_tcpudp.h>
 #include <net/netfilter/nf_log.h>
 
 MODULE_LICENSE("GPL");
@@ -194,8 +197,10 @@ get_entry(void *base, unsigned int offset)
 static inline bool unconditional(const struct ipt_ip *ip)
 {
 	static const struct ipt_ip uncond;
+	struct ipt_ip tmp = *ip;
 
-	return memcmp(ip, &uncond, sizeof(uncond)) == 0;
+	tmp.flags &= ~IPT_F_INDEXED;
+	return memcmp(&tmp, &uncond, sizeof(uncond)) == 0;
 #undef FWINV
 }
 
@@ -299,6 +304,46 @@ struct ipt_entry *ipt_next_entry(const struct ipt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+/* Classifier key: source, destination, protocol << 16 | destination port */
+#define IPT_CLS_WORDS	3
+
+/* Returns false if the classifier can't be used for this packet: later
+ * fragments and truncated tcp/udp headers have to go through the rules
+ * one by one, the port matches drop or skip them in ways the key can't
+ * express. */
+static bool ipt_cls_key(const struct sk_buff *skb, const struct iphdr *ip,
+			const struct xt_match_param *par, u32 *key)
+{
+	__be16 _ports[2];
+	const __be16 *ports;
+	unsigned int hlen;
+
+	if (par->fragoff != 0)
+		return false;
+
+	key[0] = (__force u32)ip->saddr;
+	key[1] = (__force u32)ip->daddr;
+	key[2] = ip->protocol << 16;
+
+	switch (ip->protocol) {
+	case IPPROTO_TCP:
+		hlen = sizeof(struct tcphdr);
+		break;
+	case IPPROTO_UDP:
+		hlen = sizeof(struct udphdr);
+		break;
+	default:
+		return true;
+	}
+	if (skb->len < par->thoff + hlen)
+		return false;
+	ports = skb_header_pointer(skb, par->thoff, sizeof(_ports), _ports);
+	if (ports == NULL)
+		return false;
+	key[2] |= ntohs(ports[1]);
+	return true;
+}
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ipt_do_table(struct sk_buff *skb,
@@ -320,6 +365,8 @@ ipt_do_table(struct sk_buff *skb,
 	struct xt_table_info *private;
 	struct xt_match_param mtpar;
 	struct xt_target_param tgpar;
+	u32 key[IPT_CLS_WORDS];
+	int key_state = 0;	/* 0: not built yet, 1: valid, -1: unusable */
 
 	/* Initialization */
 	ip = ip_hdr(skb);
@@ -354,6 +401,18 @@ ipt_do_table(struct sk_buff *skb,
 
 		IP_NF_ASSERT(e);
 		IP_NF_ASSERT(back);
+		if (e->ip.flags & IPT_F_INDEXED) {
+			/* Skip the rules whose addresses, protocol or port
+			 * can't match; the candidate is checked in full. */
+			if (key_state == 0)
+				key_state = ipt_cls_key(skb, ip, &mtpar, key) ?
+					    1 : -1;
+			if (key_state > 0)
+				e = get_entry(table_base,
+					      xt_cls_lookup(private->cls,
+							    (void *)e - table_base,
+							    key));
+		}
 		if (!ip_packet_match(ip, indev, outdev,
 		    &e->ip, mtpar.fragoff) ||
 		    IPT_MATCH_ITERATE(e, do_match, skb, &mtpar) != 0) {
@@ -421,6 +480,7 @@ ipt_do_table(struct sk_buff *skb,
 #endif
 		/* Target might have changed stuff. */
 		ip = ip_hdr(skb);
+		key_state = 0;
 		if (verdict == IPT_CONTINUE)
 			e = ipt_next_entry(e);
 		else
@@ -795,6 +855,138 @@ cleanup_entry(struct ipt_entry *e, unsigned int *i)
 	return 0;
 }
 
+/* Exact single destination port of a tcp/udp match, or -1 */
+static int ipt_cls_dport(const struct ipt_entry *e)
+{
+	const struct ipt_entry_match *m;
+	unsigned int i;
+
+	for (i = sizeof(struct ipt_entry); i < e->target_offset;
+	     i += m->u.match_size) {
+		const char *name;
+
+		m = (void *)e + i;
+		name = m->u.kernel.match->name;
+		if (e->ip.proto == IPPROTO_TCP && strcmp(name, "tcp") == 0) {
+			const struct xt_tcp *tcp = (const void *)m->data;
+
+			if (tcp->dpts[0] == tcp->dpts[1] &&
+			    !(tcp->invflags & XT_TCP_INV_DSTPT))
+				return tcp->dpts[0];
+			return -1;
+		}
+		if (e->ip.proto == IPPROTO_UDP && strcmp(name, "udp") == 0) {
+			const struct xt_udp *udp = (const void *)m->data;
+
+			if (udp->dpts[0] == udp->dpts[1] &&
+			    !(udp->invflags & XT_UDP_INV_DSTPT))
+				return udp->dpts[0];
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/* Rules whose address and protocol selectors are plain compares can go
+ * into the classifier; everything else about them is still checked by
+ * ip_packet_match() and the matches.  Chain heads (ERROR targets) end a
+ * run so runs never span chains. */
+static bool ipt_cls_rule(struct ipt_entry *e, u32 *key, u32 *mask)
+{
+	const struct ipt_entry_target *t = ipt_get_target(e);
+	int dport;
+
+	if (e->ip.invflags & (IPT_INV_SRCIP | IPT_INV_DSTIP | IPT_INV_PROTO))
+		return false;
+	if (strcmp(t->u.kernel.target->name, IPT_ERROR_TARGET) == 0)
+		return false;
+	if (key == NULL)
+		return true;
+
+	key[0]  = (__force u32)e->ip.src.s_addr;
+	mask[0] = (__force u32)e->ip.smsk.s_addr;
+	key[1]  = (__force u32)e->ip.dst.s_addr;
+	mask[1] = (__force u32)e->ip.dmsk.s_addr;
+	key[2]  = 0;
+	mask[2] = 0;
+	if (e->ip.proto) {
+		key[2]  = e->ip.proto << 16;
+		mask[2] = 0xff << 16;
+		dport = ipt_cls_dport(e);
+		if (dport >= 0) {
+			key[2]  |= dport;
+			mask[2] |= 0xffff;
+		}
+	}
+	return true;
+}
+
+static inline int ipt_cls_clear(struct ipt_entry *e)
+{
+	e->ip.flags &= ~IPT_F_INDEXED;
+	return 0;
+}
+
+/* Build the classifier over runs of at least XT_CLS_MIN_RUN indexable
+ * rules and flag their entries.  Failing leaves the table to linear
+ * evaluation, it is not an error. */
+static void
+ipt_build_cls(struct xt_table_info *newinfo, void *entry0)
+{
+	u32 key[IPT_CLS_WORDS], mask[IPT_CLS_WORDS];
+	unsigned int off, end, n, indexed = 0;
+	struct ipt_entry *e;
+	struct xt_cls *cls;
+	int ret = 0;
+
+	cls = xt_cls_alloc(IPT_CLS_WORDS);
+	if (cls == NULL)
+		return;
+
+	off = 0;
+	while (off < newinfo->size) {
+		for (end = off, n = 0; end < newinfo->size; n++) {
+			e = entry0 + end;
+			if (!ipt_cls_rule(e, NULL, NULL))
+				break;
+			end += e->next_offset;
+		}
+
+		if (n >= XT_CLS_MIN_RUN) {
+			for (; off < end; off += e->next_offset) {
+				e = entry0 + off;
+				ipt_cls_rule(e, key, mask);
+				ret = xt_cls_add(cls, off, off + e->next_offset,
+						 key, mask);
+				if (ret < 0)
+					break;
+				e->ip.flags |= IPT_F_INDEXED;
+				indexed++;
+			}
+			xt_cls_end_run(cls);
+			if (ret == -E2BIG) {
+				/* too many masks: this one stays linear */
+				off += e->next_offset;
+				ret = 0;
+				continue;
+			}
+			if (ret < 0)
+				break;
+		}
+
+		off = end;
+		if (off < newinfo->size)
+			off += ((struct ipt_entry *)(entry0 + off))->next_offset;
+	}
+
+	if (ret < 0 || indexed == 0) {
+		IPT_ENTRY_ITERATE(entry0, newinfo->size, ipt_cls_clear);
+		xt_cls_free(cls);
+		return;
+	}
+	newinfo->cls = cls;
+}
+
 /* Checks and translates the user-supplied table segment (held in
    newinfo) */
 static int
@@ -868,6 +1060,8 @@ translate_table(const char *name,
 		return ret;
 	}
 
+	ipt_build_cls(newinfo, entry0);
+
 	/* And one copy for every other CPU */
 	for_each_possible_cpu(i) {
 		if (newinfo->entries[i] && newinfo->entries[i] != entry0)
@@ -1002,6 +1196,14 @@ copy_entries_to_user(unsigned int total_size,
 			goto free_counters;
 		}
 
+		if ((e->ip.flags & IPT_F_INDEXED) &&
+		    put_user(e->ip.flags & ~IPT_F_INDEXED,
+			     (u_int8_t __user *)(userptr + off
+				+ offsetof(struct ipt_entry, ip.flags))) != 0) {
+			ret = -EFAULT;
+			goto free_counters;
+		}
+
 		for (i = sizeof(struct ipt_entry);
 		     i < e->target_offset;
 		     i += m->u.match_size) {
@@ -1238,6 +1440,12 @@ __do_replace(struct net *net, const char *name, unsigned int valid_hooks,
 		goto put_module;
 	}
 
+	/* Tables of other namespaces stay off the packet path until
+	 * they are given rules. */
+	ret = xt_hook_table(net, t);
+	if (ret != 0)
+		goto put_module;
+
 	oldinfo = xt_replace_table(t, num_counters, newinfo, &ret);
 	if (!oldinfo)
 		goto put_module;
@@ -1425,6 +1633,392 @@ do_add_counters(struct net *net, void __user *user, unsigned int len, int compat
 	return ret;
 }
 
+/*
+ * Incremental update (IPT_SO_SET_SPLICE): the new table is the current
+ * one with a range of entries replaced, built from this CPU's copy.
+ * Only the new entries are checked, the others keep their match and
+ * target state and get their counters carried over after the swap.
+ */
+struct ipt_splice_range {
+	unsigned int offset;	/* start of the spliced range */
+	unsigned int old_end;	/* end of the deleted entries, old table */
+	unsigned int new_end;	/* end of the new entries, new table */
+};
+
+/* New position of an entry which was at @pos */
+static inline unsigned int
+ipt_splice_entry_pos(const struct ipt_splice_range *r, unsigned int pos)
+{
+	return pos < r->offset ? pos : pos - r->old_end + r->new_end;
+}
+
+/* New target of a jump to @pos: a jump to the start of the range now
+ * lands on the first new entry. */
+static inline unsigned int
+ipt_splice_jump(const struct ipt_splice_range *r, unsigned int pos)
+{
+	return pos <= r->offset ? pos : ipt_splice_entry_pos(r, pos);
+}
+
+static inline bool
+ipt_splice_deleted(const struct ipt_splice_range *r, unsigned int pos)
+{
+	return pos >= r->offset && pos < r->old_end;
+}
+
+/* Give an entry of the running table its target name back, which is
+ * what mark_source_chains() looks at.  The target pointer is parked in
+ * the byte counter until ipt_splice_bind(). */
+static inline int ipt_unbind_target(struct ipt_entry *e)
+{
+	struct ipt_entry_target *t = ipt_get_target(e);
+	struct xt_target *target = t->u.kernel.target;
+
+	e->counters.bcnt = (unsigned long)target;
+	e->counters.pcnt = 0;
+	e->comefrom = 0;
+	e->ip.flags &= ~IPT_F_INDEXED;
+	strlcpy(t->u.user.name, target->name, sizeof(t->u.user.name));
+	return 0;
+}
+
+static int
+ipt_splice_unbind(struct ipt_entry *e, void *entry0,
+		  const struct ipt_splice_range *r)
+{
+	unsigned int pos = (void *)e - entry0;
+	struct ipt_standard_target *t;
+
+	/* the new entries are still in user form */
+	if (pos >= r->offset && pos < r->new_end)
+		return 0;
+
+	ipt_unbind_target(e);
+	t = (void *)ipt_get_target(e);
+	if (strcmp(t->target.u.user.name, IPT_STANDARD_TARGET) != 0 ||
+	    t->verdict < 0)
+		return 0;
+
+	if (t->verdict > r->offset && t->verdict < r->old_end) {
+		duprintf("ipt_splice: jump into deleted entries (%i)\n",
+			 t->verdict);
+		return -EINVAL;
+	}
+	t->verdict = ipt_splice_jump(r, t->verdict);
+	return 0;
+}
+
+static int
+ipt_splice_bind(struct ipt_entry *e, void *entry0,
+		const struct ipt_splice_range *r)
+{
+	unsigned int pos = (void *)e - entry0;
+
+	if (pos >= r->offset && pos < r->new_end)
+		return 0;
+
+	ipt_get_target(e)->u.kernel.target =
+		(struct xt_target *)(unsigned long)e->counters.bcnt;
+	e->counters.bcnt = 0;
+	return 0;
+}
+
+static int
+ipt_splice_cmp_hooks(struct ipt_entry *old, void *old0, void *entry0,
+		     const struct ipt_splice_range *r)
+{
+	unsigned int pos = (void *)old - old0;
+	const struct ipt_entry *e;
+
+	if (ipt_splice_deleted(r, pos))
+		return 0;
+
+	e = entry0 + ipt_splice_entry_pos(r, pos);
+	if (e->comefrom & ~old->comefrom) {
+		duprintf("ipt_splice: entry %u now reachable from %08X\n",
+			 pos, e->comefrom);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/* The matches and targets of the remaining entries were checked for the
+ * hooks they could be reached from; refuse to make them reachable from
+ * others.  The hook masks of the old table are worked out on a scratch
+ * copy, the running one keeps the jump stack in comefrom. */
+static int
+ipt_splice_check_hooks(struct xt_table_info *private, unsigned int valid_hooks,
+		       const void *old0, void *entry0,
+		       const struct ipt_splice_range *r)
+{
+	void *scratch;
+	int ret = -ELOOP;
+
+	scratch = vmalloc(private->size);
+	if (scratch == NULL)
+		return -ENOMEM;
+	memcpy(scratch, old0, private->size);
+
+	IPT_ENTRY_ITERATE(scratch, private->size, ipt_unbind_target);
+	if (mark_source_chains(private, valid_hooks, scratch))
+		ret = IPT_ENTRY_ITERATE(scratch, private->size,
+					ipt_splice_cmp_hooks, scratch,
+					entry0, r);
+	vfree(scratch);
+	return ret;
+}
+
+struct ipt_splice_count {
+	const struct xt_counters *counters;
+	unsigned int i;		/* old entry number */
+	unsigned int skip;	/* deleted entries, not yet skipped */
+};
+
+static int
+ipt_splice_add_counter(struct ipt_entry *e, void *entry0,
+		       const struct ipt_splice_range *r,
+		       struct ipt_splice_count *c)
+{
+	unsigned int pos = (void *)e - entry0;
+
+	if (pos >= r->offset && pos < r->new_end)
+		return 0;
+	if (pos >= r->new_end && c->skip) {
+		c->i += c->skip;
+		c->skip = 0;
+	}
+	ADD_COUNTER(e->counters, c->counters[c->i].bcnt,
+		    c->counters[c->i].pcnt);
+	c->i++;
+	return 0;
+}
+
+static int
+do_splice(struct net *net, void __user *user, unsigned int len)
+{
+	struct ipt_splice tmp;
+	struct ipt_splice_range r;
+	struct ipt_splice_count count;
+	struct xt_table_info *private, *newinfo, *oldinfo;
+	struct xt_counters *counters;
+	struct ipt_entry *e;
+	struct xt_table *t;
+	unsigned int pos, h, i, size, curcpu, num_delete = 0;
+	bool start = false, end = false, jumps = false;
+	void *old0, *entry0;
+	int ret;
+
+	if (len < sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(&tmp, user, sizeof(tmp)) != 0)
+		return -EFAULT;
+	if (len != sizeof(tmp) + tmp.size || tmp.size >= INT_MAX)
+		return -EINVAL;
+	tmp.name[sizeof(tmp.name)-1] = 0;
+
+	t = xt_find_table_lock(net, AF_INET, tmp.name);
+	if (!t || IS_ERR(t))
+		return t ? PTR_ERR(t) : -ENOENT;
+
+	/* The offsets are only meaningful for the table the caller saw */
+	private = t->private;
+	if (private->number != tmp.num_counters ||
+	    private->size != tmp.old_size) {
+		ret = -EAGAIN;
+		goto put_module;
+	}
+	/* the trailing error entry stays */
+	if (tmp.offset >= private->size ||
+	    tmp.del_size >= private->size - tmp.offset) {
+		ret = -EINVAL;
+		goto put_module;
+	}
+	r.offset = tmp.offset;
+	r.old_end = tmp.offset + tmp.del_size;
+	r.new_end = tmp.offset + tmp.size;
+
+	old0 = private->entries[raw_smp_processor_id()];
+	for (pos = 0; pos < private->size; pos += e->next_offset) {
+		e = old0 + pos;
+		if (pos == r.offset)
+			start = true;
+		if (pos == r.old_end)
+			end = true;
+		if (ipt_splice_deleted(&r, pos))
+			num_delete++;
+	}
+	if (!start || !end) {
+		duprintf("ipt_splice: %u/%u not on entry boundaries\n",
+			 r.offset, r.old_end);
+		ret = -EINVAL;
+		goto put_module;
+	}
+
+	ret = xt_hook_table(net, t);
+	if (ret != 0)
+		goto put_module;
+
+	counters = vmalloc(sizeof(struct xt_counters) * private->number);
+	if (counters == NULL) {
+		ret = -ENOMEM;
+		goto put_module;
+	}
+
+	size = private->size - tmp.del_size + tmp.size;
+	newinfo = xt_alloc_table_info(size);
+	if (newinfo == NULL) {
+		ret = -ENOMEM;
+		goto free_counters;
+	}
+	newinfo->size = size;
+	newinfo->number = private->number - num_delete + tmp.num_entries;
+
+	entry0 = newinfo->entries[raw_smp_processor_id()];
+	memcpy(entry0, old0, r.offset);
+	if (copy_from_user(entry0 + r.offset, user + sizeof(tmp),
+			   tmp.size) != 0) {
+		ret = -EFAULT;
+		goto free_newinfo;
+	}
+	memcpy(entry0 + r.new_end, old0 + r.old_end,
+	       private->size - r.old_end);
+
+	ret = -EINVAL;
+	for (h = 0; h < NF_INET_NUMHOOKS; h++) {
+		newinfo->hook_entry[h] = 0xFFFFFFFF;
+		newinfo->underflow[h] = 0xFFFFFFFF;
+		if (!(t->valid_hooks & (1 << h)))
+			continue;
+		if ((private->hook_entry[h] > r.offset &&
+		     private->hook_entry[h] < r.old_end) ||
+		    ipt_splice_deleted(&r, private->underflow[h]))
+			goto free_newinfo;
+		newinfo->hook_entry[h] = ipt_splice_jump(&r,
+						private->hook_entry[h]);
+		newinfo->underflow[h] = ipt_splice_entry_pos(&r,
+						private->underflow[h]);
+	}
+
+	/* Walk through the new entries, checking offsets */
+	i = 0;
+	for (pos = r.offset; pos < r.new_end; pos += e->next_offset) {
+		struct ipt_standard_target *st;
+
+		e = entry0 + pos;
+		ret = check_entry_size_and_hooks(e, newinfo, entry0,
+						 entry0 + r.new_end,
+						 newinfo->hook_entry,
+						 newinfo->underflow,
+						 t->valid_hooks, &i);
+		if (ret != 0)
+			goto free_newinfo;
+		ret = check_entry(e, tmp.name);
+		if (ret != 0)
+			goto free_newinfo;
+		ret = -EINVAL;
+		if (e->next_offset > r.new_end - pos)
+			goto free_newinfo;
+
+		st = (void *)ipt_get_target(e);
+		if (strcmp(st->target.u.user.name, IPT_STANDARD_TARGET) == 0 &&
+		    st->verdict >= 0)
+			jumps = true;
+	}
+	if (i != tmp.num_entries) {
+		duprintf("ipt_splice: %u not %u entries\n",
+			 i, tmp.num_entries);
+		ret = -EINVAL;
+		goto free_newinfo;
+	}
+
+	ret = IPT_ENTRY_ITERATE(entry0, size, ipt_splice_unbind, entry0, &r);
+	if (ret != 0)
+		goto free_newinfo;
+	if (!mark_source_chains(newinfo, t->valid_hooks, entry0)) {
+		ret = -ELOOP;
+		goto free_newinfo;
+	}
+	IPT_ENTRY_ITERATE(entry0, size, ipt_splice_bind, entry0, &r);
+
+	/* Only deleted entries and new jumps change where rules are
+	 * reached from */
+	if (tmp.del_size || jumps) {
+		ret = ipt_splice_check_hooks(private, t->valid_hooks,
+					     old0, entry0, &r);
+		if (ret != 0)
+			goto free_newinfo;
+	}
+
+	i = 0;
+	for (pos = r.offset; pos < r.new_end; pos += e->next_offset) {
+		e = entry0 + pos;
+		ret = find_check_entry(e, tmp.name, size, &i);
+		if (ret != 0) {
+			IPT_ENTRY_ITERATE(entry0 + r.offset, tmp.size,
+					  cleanup_entry, &i);
+			goto free_newinfo;
+		}
+	}
+
+	ipt_build_cls(newinfo, entry0);
+
+	for_each_possible_cpu(i) {
+		if (newinfo->entries[i] && newinfo->entries[i] != entry0)
+			memcpy(newinfo->entries[i], entry0, size);
+	}
+
+	oldinfo = xt_replace_table(t, tmp.num_counters, newinfo, &ret);
+	if (!oldinfo) {
+		IPT_ENTRY_ITERATE(entry0 + r.offset, tmp.size,
+				  cleanup_entry, NULL);
+		goto free_newinfo;
+	}
+
+	/* Update module usage count based on number of rules */
+	if ((oldinfo->number > oldinfo->initial_entries) ||
+	    (newinfo->number <= oldinfo->initial_entries))
+		module_put(t->me);
+	if ((oldinfo->number > oldinfo->initial_entries) &&
+	    (newinfo->number <= oldinfo->initial_entries))
+		module_put(t->me);
+
+	/* Get the old counters, and synchronize with replace */
+	get_counters(oldinfo, counters);
+
+	/* and carry them over to the entries which stay */
+	count.counters = counters;
+	count.i = 0;
+	count.skip = num_delete;
+	local_bh_disable();
+	curcpu = smp_processor_id();
+	xt_info_wrlock(curcpu);
+	IPT_ENTRY_ITERATE(newinfo->entries[curcpu], size,
+			  ipt_splice_add_counter, newinfo->entries[curcpu],
+			  &r, &count);
+	xt_info_wrunlock(curcpu);
+	local_bh_enable();
+
+	/* Release the deleted entries only, the others live on */
+	old0 = oldinfo->entries[raw_smp_processor_id()];
+	for (pos = r.offset; pos < r.old_end; pos += e->next_offset) {
+		e = old0 + pos;
+		cleanup_entry(e, NULL);
+	}
+	xt_free_table_info(oldinfo);
+	vfree(counters);
+	xt_table_unlock(t);
+	return 0;
+
+ free_newinfo:
+	xt_free_table_info(newinfo);
+ free_counters:
+	vfree(counters);
+ put_module:
+	module_put(t->me);
+	xt_table_unlock(t);
+	return ret;
+}
+
 #ifdef CONFIG_COMPAT
 struct compat_ipt_replace {
 	char			name[IPT_TABLE_MAXNAMELEN];
@@ -1458,6 +2052,9 @@ compat_copy_entry_to_user(struct ipt_entry *e, void __user **dstptr,
 	if (copy_to_user(&ce->counters, &counters[*i], sizeof(counters[*i])))
 		goto out;
 
+	if (put_user(e->ip.flags & ~IPT_F_INDEXED, &ce->ip.flags))
+		goto out;
+
 	*dstptr += sizeof(struct compat_ipt_entry);
 	*size -= sizeof(struct ipt_entry) - sizeof(struct compat_ipt_entry);
 
@@ -1784,6 +2381,8 @@ translate_compat_table(const char *name,
 		return ret;
 	}
 
+	ipt_build_cls(newinfo, entry1);
+
 	/* And one copy for every other CPU */
 	for_each_possible_cpu(i)
 		if (newinfo->entries[i] && newinfo->entries[i] != entry1)
@@ -2008,6 +2607,10 @@ do_ipt_set_ctl(struct sock *sk, int cmd, void __user *user, unsigned int len)
 		ret = do_add_counters(sock_net(sk), user, len, 0);
 		break;
 
+	case IPT_SO_SET_SPLICE:
+		ret = do_splice(sock_net(sk), user, len);
+		break;
+
 	default:
 		duprintf("do_ipt_set_ctl:  unknown request %i\n", cmd);
 		ret = -EINVAL;
@@ -53,13 +53,6 @@ static struct
 	.term = IPT_ERROR_INIT,			/* ERROR */
 };
 
-static const struct xt_table packet_filter = {
-	.name		= "filter",
-	.valid_hooks	= FILTER_VALID_HOOKS,
-	.me		= THIS_MODULE,
-	.af		= NFPROTO_IPV4,
-};
-
 /* The work comes in here from netfilter.c. */
 static unsigned int
 ipt_local_in_hook(unsigned int hook,
@@ -122,22 +115,40 @@ static struct nf_hook_ops ipt_ops[] __read_mostly = {
 	},
 };
 
+static const struct xt_table packet_filter = {
+	.name		= "filter",
+	.valid_hooks	= FILTER_VALID_HOOKS,
+	.me		= THIS_MODULE,
+	.af		= NFPROTO_IPV4,
+	.ops		= ipt_ops,
+	.num_ops	= ARRAY_SIZE(ipt_ops),
+};
+
 /* Default to forward because I got too much mail already. */
 static int forward = NF_ACCEPT;
 module_param(forward, bool, 0000);
 
 static int __net_init iptable_filter_net_init(struct net *net)
 {
+	int ret;
+
 	/* Register table */
 	net->ipv4.iptable_filter =
 		ipt_register_table(net, &packet_filter, &initial_table.repl);
 	if (IS_ERR(net->ipv4.iptable_filter))
 		return PTR_ERR(net->ipv4.iptable_filter);
-	return 0;
+	/* Other namespaces are hooked once they have rules */
+	if (!net_eq(net, &init_net) && forward == NF_ACCEPT)
+		return 0;
+	ret = xt_hook_table(net, net->ipv4.iptable_filter);
+	if (ret < 0)
+		ipt_unregister_table(net->ipv4.iptable_filter);
+	return ret;
 }
 
 static void __net_exit iptable_filter_net_exit(struct net *net)
 {
+	xt_unhook_table(net, net->ipv4.iptable_filter);
 	ipt_unregister_table(net->ipv4.iptable_filter);
 }
 
@@ -148,8 +159,6 @@ static struct pernet_operations iptable_filter_net_ops = {
 
 static int __init iptable_filter_init(void)
 {
-	int ret;
-
 	if (forward < 0 || forward > NF_MAX_VERDICT) {
 		printk("iptables forward must be 0 or 1\n");
 		return -EINVAL;
@@ -158,25 +167,11 @@ static int __init iptable_filter_init(void)
 	/* Entry 1 is the FORWARD hook */
 	initial_table.entries[1].target.verdict = -forward - 1;
 
-	ret = register_pernet_subsys(&iptable_filter_net_ops);
-	if (ret < 0)
-		return ret;
-
-	/* Register hooks */
-	ret = nf_register_hooks(ipt_ops, ARRAY_SIZE(ipt_ops));
-	if (ret < 0)
-		goto cleanup_table;
-
-	return ret;
-
- cleanup_table:
-	unregister_pernet_subsys(&iptable_filter_net_ops);
-	return ret;
+	return register_pernet_subsys(&iptable_filter_net_ops);
 }
 
 static void __exit iptable_filter_fini(void)
 {
-	nf_unregister_hooks(ipt_ops, ARRAY_SIZE(ipt_ops));
 	unregister_pernet_subsys(&iptable_filter_net_ops);
 }
 
@@ -64,13 +64,6 @@ static const struct
 	.term = IPT_ERROR_INIT,			/* ERROR */
 };
 
-static const struct xt_table packet_mangler = {
-	.name		= "mangle",
-	.valid_hooks	= MANGLE_VALID_HOOKS,
-	.me		= THIS_MODULE,
-	.af		= NFPROTO_IPV4,
-};
-
 /* The work comes in here from netfilter.c. */
 static unsigned int
 ipt_pre_routing_hook(unsigned int hook,
@@ -196,18 +189,36 @@ static struct nf_hook_ops ipt_ops[] __read_mostly = {
 	},
 };
 
+static const struct xt_table packet_mangler = {
+	.name		= "mangle",
+	.valid_hooks	= MANGLE_VALID_HOOKS,
+	.me		= THIS_MODULE,
+	.af		= NFPROTO_IPV4,
+	.ops		= ipt_ops,
+	.num_ops	= ARRAY_SIZE(ipt_ops),
+};
+
 static int __net_init iptable_mangle_net_init(struct net *net)
 {
+	int ret;
+
 	/* Register table */
 	net->ipv4.iptable_mangle =
 		ipt_register_table(net, &packet_mangler, &initial_table.repl);
 	if (IS_ERR(net->ipv4.iptable_mangle))
 		return PTR_ERR(net->ipv4.iptable_mangle);
-	return 0;
+	/* Other namespaces are hooked once they have rules */
+	if (!net_eq(net, &init_net))
+		return 0;
+	ret = xt_hook_table(net, net->ipv4.iptable_mangle);
+	if (ret < 0)
+		ipt_unregister_table(net->ipv4.iptable_mangle);
+	return ret;
 }
 
 static void __net_exit iptable_mangle_net_exit(struct net *net)
 {
+	xt_unhook_table(net, net->ipv4.iptable_mangle);
 	ipt_unregister_table(net->ipv4.iptable_mangle);
 }
 
@@ -218,27 +229,11 @@ static struct pernet_operations iptable_mangle_net_ops = {
 
 static int __init iptable_mangle_init(void)
 {
-	int ret;
-
-	ret = register_pernet_subsys(&iptable_mangle_net_ops);
-	if (ret < 0)
-		return ret;
-
-	/* Register hooks */
-	ret = nf_register_hooks(ipt_ops, ARRAY_SIZE(ipt_ops));
-	if (ret < 0)
-		goto cleanup_table;
-
-	return ret;
-
- cleanup_table:
-	unregister_pernet_subsys(&iptable_mangle_net_ops);
-	return ret;
+	return register_pernet_subsys(&iptable_mangle_net_ops);
 }
 
 static void __exit iptable_mangle_fini(void)
 {
-	nf_unregister_hooks(ipt_ops, ARRAY_SIZE(ipt_ops));
 	unregister_pernet_subsys(&iptable_mangle_net_ops);
 }
 
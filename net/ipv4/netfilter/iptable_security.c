@@ -57,13 +57,6 @@ static const struct
 	.term = IPT_ERROR_INIT,			/* ERROR */
 };
 
-static const struct xt_table security_table = {
-	.name		= "security",
-	.valid_hooks	= SECURITY_VALID_HOOKS,
-	.me		= THIS_MODULE,
-	.af		= NFPROTO_IPV4,
-};
-
 static unsigned int
 ipt_local_in_hook(unsigned int hook,
 		  struct sk_buff *skb,
@@ -125,19 +118,37 @@ static struct nf_hook_ops ipt_ops[] __read_mostly = {
 	},
 };
 
+static const struct xt_table security_table = {
+	.name		= "security",
+	.valid_hooks	= SECURITY_VALID_HOOKS,
+	.me		= THIS_MODULE,
+	.af		= NFPROTO_IPV4,
+	.ops		= ipt_ops,
+	.num_ops	= ARRAY_SIZE(ipt_ops),
+};
+
 static int __net_init iptable_security_net_init(struct net *net)
 {
+	int ret;
+
 	net->ipv4.iptable_security =
 		ipt_register_table(net, &security_table, &initial_table.repl);
 
 	if (IS_ERR(net->ipv4.iptable_security))
 		return PTR_ERR(net->ipv4.iptable_security);
 
-	return 0;
+	/* Other namespaces are hooked once they have rules */
+	if (!net_eq(net, &init_net))
+		return 0;
+	ret = xt_hook_table(net, net->ipv4.iptable_security);
+	if (ret < 0)
+		ipt_unregister_table(net->ipv4.iptable_security);
+	return ret;
 }
 
 static void __net_exit iptable_security_net_exit(struct net *net)
 {
+	xt_unhook_table(net, net->ipv4.iptable_security);
 	ipt_unregister_table(net->ipv4.iptable_security);
 }
 
@@ -148,26 +159,11 @@ static struct pernet_operations iptable_security_net_ops = {
 
 static int __init iptable_security_init(void)
 {
-	int ret;
-
-	ret = register_pernet_subsys(&iptable_security_net_ops);
-        if (ret < 0)
-		return ret;
-
-	ret = nf_register_hooks(ipt_ops, ARRAY_SIZE(ipt_ops));
-	if (ret < 0)
-		goto cleanup_table;
-
-	return ret;
-
-cleanup_table:
-	unregister_pernet_subsys(&iptable_security_net_ops);
-	return ret;
+	return register_pernet_subsys(&iptable_security_net_ops);
 }
 
 static void __exit iptable_security_fini(void)
 {
-	nf_unregister_hooks(ipt_ops, ARRAY_SIZE(ipt_ops));
 	unregister_pernet_subsys(&iptable_security_net_ops);
 }
 
@@ -0,0 +1,244 @@
+/*
+ * IPv4 flow offload fast path: forward packets of offloaded connections
+ * straight from PREROUTING.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/types.h>
+#include <linux/module.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <net/ip.h>
+#include <net/route.h>
+#include <net/neighbour.h>
+#include <net/checksum.h>
+#include <net/netfilter/nf_flow_table.h>
+
+static int nf_flow_tuple_ip(struct sk_buff *skb, const struct net_device *in,
+			    struct flow_offload_tuple *tuple)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	const __be16 *ports;
+	__be16 _ports[2];
+	unsigned int thoff;
+
+	/* options and fragments are left to the slow path */
+	if (iph->ihl != 5 || (iph->frag_off & htons(IP_MF | IP_OFFSET)))
+		return -1;
+	if (iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP)
+		return -1;
+
+	thoff = iph->ihl * 4;
+	ports = skb_header_pointer(skb, thoff, sizeof(_ports), _ports);
+	if (ports == NULL)
+		return -1;
+
+	memset(tuple, 0, sizeof(*tuple));
+	tuple->src_v4	= iph->saddr;
+	tuple->dst_v4	= iph->daddr;
+	tuple->src_port	= ports[0];
+	tuple->dst_port	= ports[1];
+	tuple->iifidx	= in->ifindex;
+	tuple->l3proto	= AF_INET;
+	tuple->l4proto	= iph->protocol;
+	return 0;
+}
+
+static void nf_flow_nat_port(struct sk_buff *skb, struct iphdr *iph,
+			     unsigned int thoff, __be16 *port, __be16 new)
+{
+	if (*port == new)
+		return;
+
+	if (iph->protocol == IPPROTO_TCP) {
+		struct tcphdr *tcph = (void *)skb_network_header(skb) + thoff;
+
+		inet_proto_csum_replace2(&tcph->check, skb, *port, new, 0);
+	} else {
+		struct udphdr *udph = (void *)skb_network_header(skb) + thoff;
+
+		if (udph->check || skb->ip_summed == CHECKSUM_PARTIAL) {
+			inet_proto_csum_replace2(&udph->check, skb,
+						 *port, new, 0);
+			if (!udph->check)
+				udph->check = CSUM_MANGLED_0;
+		}
+	}
+	*port = new;
+}
+
+static void nf_flow_nat_addr(struct sk_buff *skb, struct iphdr *iph,
+			     unsigned int thoff, __be32 *addr, __be32 new)
+{
+	if (*addr == new)
+		return;
+
+	if (iph->protocol == IPPROTO_TCP) {
+		struct tcphdr *tcph = (void *)iph + thoff;
+
+		inet_proto_csum_replace4(&tcph->check, skb, *addr, new, 1);
+	} else {
+		struct udphdr *udph = (void *)iph + thoff;
+
+		if (udph->check || skb->ip_summed == CHECKSUM_PARTIAL) {
+			inet_proto_csum_replace4(&udph->check, skb,
+						 *addr, new, 1);
+			if (!udph->check)
+				udph->check = CSUM_MANGLED_0;
+		}
+	}
+	csum_replace4(&iph->check, *addr, new);
+	*addr = new;
+}
+
+/* The packet leaves as the inverse of the other direction's tuple,
+ * which covers SNAT, DNAT and both at once. */
+static void nf_flow_nat_ip(const struct flow_offload *flow,
+			   struct sk_buff *skb, unsigned int thoff,
+			   enum ip_conntrack_dir dir)
+{
+	const struct flow_offload_tuple *other = &flow->tuplehash[!dir].tuple;
+	struct iphdr *iph = ip_hdr(skb);
+	__be16 *ports = (__be16 *)(skb_network_header(skb) + thoff);
+
+	nf_flow_nat_addr(skb, iph, thoff, &iph->saddr, other->dst_v4);
+	nf_flow_nat_addr(skb, iph, thoff, &iph->daddr, other->src_v4);
+	nf_flow_nat_port(skb, iph, thoff, &ports[0], other->dst_port);
+	nf_flow_nat_port(skb, iph, thoff, &ports[1], other->src_port);
+}
+
+static int nf_flow_xmit(struct sk_buff *skb)
+{
+	struct dst_entry *dst = skb_dst(skb);
+	struct net_device *dev = dst->dev;
+
+	if (unlikely(skb_headroom(skb) < LL_RESERVED_SPACE(dev) &&
+		     dev->header_ops)) {
+		struct sk_buff *skb2;
+
+		skb2 = skb_realloc_headroom(skb, LL_RESERVED_SPACE(dev));
+		kfree_skb(skb);
+		if (skb2 == NULL)
+			return -ENOMEM;
+		skb = skb2;
+	}
+
+	skb->dev = dev;
+	skb->protocol = htons(ETH_P_IP);
+	if (dst->hh)
+		return neigh_hh_output(dst->hh, skb);
+	else if (dst->neighbour)
+		return dst->neighbour->output(skb);
+
+	kfree_skb(skb);
+	return -EINVAL;
+}
+
+static unsigned int
+nf_flow_offload_ip_hook(unsigned int hooknum, struct sk_buff *skb,
+			const struct net_device *in,
+			const struct net_device *out,
+			int (*okfn)(struct sk_buff *))
+{
+	struct flow_offload_tuple_hash *thash;
+	struct flow_offload_tuple tuple;
+	enum ip_conntrack_dir dir;
+	struct flow_offload *flow;
+	struct dst_entry *dst;
+	unsigned int thoff;
+	struct iphdr *iph;
+
+	if (skb->pkt_type != PACKET_HOST || skb->nfct != NULL)
+		return NF_ACCEPT;
+
+	if (nf_flow_tuple_ip(skb, in, &tuple) < 0)
+		return NF_ACCEPT;
+
+	/* nf_hook_slow() runs us under rcu_read_lock() */
+	thash = flow_offload_lookup(&tuple);
+	if (thash == NULL)
+		return NF_ACCEPT;
+
+	dir = thash->tuple.dir;
+	flow = flow_offload_from_hash(thash);
+	if (unlikely(test_bit(NF_FLOW_TEARDOWN, &flow->flags) ||
+		     nf_ct_is_dying(flow->ct) ||
+		     !net_eq(dev_net(in), nf_ct_net(flow->ct))))
+		return NF_ACCEPT;
+
+	dst = thash->dst_cache;
+	if (unlikely(dst->obsolete)) {
+		flow_offload_teardown(flow);
+		return NF_ACCEPT;
+	}
+
+	/* let the slow path fragment or send the ICMP error */
+	if (skb->len > thash->mtu && !skb_is_gso(skb))
+		return NF_ACCEPT;
+
+	iph = ip_hdr(skb);
+	if (iph->ttl <= 1)
+		return NF_ACCEPT;
+
+	thoff = iph->ihl * 4;
+	if (!skb_make_writable(skb, thoff + (iph->protocol == IPPROTO_TCP ?
+					     sizeof(struct tcphdr) :
+					     sizeof(struct udphdr))))
+		return NF_DROP;
+
+	if (iph->protocol == IPPROTO_TCP) {
+		const struct tcphdr *tcph = (void *)skb_network_header(skb) +
+					    thoff;
+
+		/* conntrack has to see the connection being torn down */
+		if (unlikely(tcph->fin || tcph->rst)) {
+			flow_offload_teardown(flow);
+			return NF_ACCEPT;
+		}
+	}
+
+	flow_offload_account(flow, dir, skb->len);
+
+	nf_flow_nat_ip(flow, skb, thoff, dir);
+	iph = ip_hdr(skb);
+	ip_decrease_ttl(iph);
+	skb->priority = rt_tos2priority(iph->tos);
+	skb_forward_csum(skb);
+
+	skb_dst_drop(skb);
+	skb_dst_set(skb, dst_clone(dst));
+	nf_flow_xmit(skb);
+	return NF_STOLEN;
+}
+
+static struct nf_hook_ops nf_flow_offload_ip_ops __read_mostly = {
+	.hook		= nf_flow_offload_ip_hook,
+	.owner		= THIS_MODULE,
+	.pf		= NFPROTO_IPV4,
+	.hooknum	= NF_INET_PRE_ROUTING,
+	.priority	= NF_IP_PRI_FIRST,
+};
+
+static int __init nf_flow_ipv4_init(void)
+{
+	return nf_register_hook(&nf_flow_offload_ip_ops);
+}
+
+static void __exit nf_flow_ipv4_fini(void)
+{
+	nf_unregister_hook(&nf_flow_offload_ip_ops);
+}
+
+module_init(nf_flow_ipv4_init);
+module_exit(nf_flow_ipv4_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Netfilter flow offload IPv4 fast path");
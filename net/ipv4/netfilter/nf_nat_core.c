@@ -33,6 +33,11 @@
 
 static DEFINE_SPINLOCK(nf_nat_lock);
 
+/* Serialise bysource hash chain updates; hashed like the buckets so
+ * that NAT setup on different CPUs rarely contends. */
+#define NF_NAT_LOCKS 1024
+static __cacheline_aligned_in_smp spinlock_t nf_nat_locks[NF_NAT_LOCKS];
+
 static struct nf_conntrack_l3proto *l3proto __read_mostly;
 
 #define MAX_IP_NAT_PROTO 256
@@ -326,15 +331,17 @@ nf_nat_setup_info(struct nf_conn *ct,
 	/* Place in source hash if this is the first time. */
 	if (have_to_hash) {
 		unsigned int srchash;
+		spinlock_t *lock;
 
 		srchash = hash_by_src(net, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-		spin_lock_bh(&nf_nat_lock);
+		lock = &nf_nat_locks[srchash % NF_NAT_LOCKS];
+		spin_lock_bh(lock);
 		/* nf_conntrack_alter_reply might re-allocate exntension aera */
 		nat = nfct_nat(ct);
 		nat->ct = ct;
 		hlist_add_head_rcu(&nat->bysource,
 				   &net->ipv4.nat_bysource[srchash]);
-		spin_unlock_bh(&nf_nat_lock);
+		spin_unlock_bh(lock);
 	}
 
 	/* It's done. */
@@ -543,19 +550,30 @@ void nf_nat_protocol_unregister(const struct nf_nat_protocol *proto)
 }
 EXPORT_SYMBOL(nf_nat_protocol_unregister);
 
+/* The original tuple, and so the bysource chain, never changes */
+static spinlock_t *nf_nat_bysource_lock(const struct nf_conn *ct)
+{
+	unsigned int h;
+
+	h = hash_by_src(nf_ct_net(ct), &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+	return &nf_nat_locks[h % NF_NAT_LOCKS];
+}
+
 /* Noone using conntrack by the time this called. */
 static void nf_nat_cleanup_conntrack(struct nf_conn *ct)
 {
 	struct nf_conn_nat *nat = nf_ct_ext_find(ct, NF_CT_EXT_NAT);
+	spinlock_t *lock;
 
 	if (nat == NULL || nat->ct == NULL)
 		return;
 
 	NF_CT_ASSERT(nat->ct->status & IPS_NAT_DONE_MASK);
 
-	spin_lock_bh(&nf_nat_lock);
+	lock = nf_nat_bysource_lock(ct);
+	spin_lock_bh(lock);
 	hlist_del_rcu(&nat->bysource);
-	spin_unlock_bh(&nf_nat_lock);
+	spin_unlock_bh(lock);
 }
 
 static void nf_nat_move_storage(void *new, void *old)
@@ -563,14 +581,16 @@ static void nf_nat_move_storage(void *new, void *old)
 	struct nf_conn_nat *new_nat = new;
 	struct nf_conn_nat *old_nat = old;
 	struct nf_conn *ct = old_nat->ct;
+	spinlock_t *lock;
 
 	if (!ct || !(ct->status & IPS_NAT_DONE_MASK))
 		return;
 
-	spin_lock_bh(&nf_nat_lock);
+	lock = nf_nat_bysource_lock(ct);
+	spin_lock_bh(lock);
 	new_nat->ct = ct;
 	hlist_replace_rcu(&old_nat->bysource, &new_nat->bysource);
-	spin_unlock_bh(&nf_nat_lock);
+	spin_unlock_bh(lock);
 }
 
 static struct nf_ct_ext_type nat_extend __read_mostly = {
@@ -717,6 +737,9 @@ static int __init nf_nat_init(void)
 
 	need_ipv4_conntrack();
 
+	for (i = 0; i < NF_NAT_LOCKS; i++)
+		spin_lock_init(&nf_nat_locks[i]);
+
 	ret = nf_ct_extend_register(&nat_extend);
 	if (ret < 0) {
 		printk(KERN_ERR "nf_nat_core: Unable to register extension\n");
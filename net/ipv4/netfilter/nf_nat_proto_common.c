@@ -9,6 +9,8 @@
 
 #include <linux/types.h>
 #include <linux/random.h>
+#include <linux/jhash.h>
+#include <linux/net.h>
 #include <linux/ip.h>
 
 #include <linux/netfilter.h>
@@ -35,13 +37,56 @@ bool nf_nat_proto_in_range(const struct nf_conntrack_tuple *tuple,
 }
 EXPORT_SYMBOL_GPL(nf_nat_proto_in_range);
 
+/* Where the last search for a given destination ended.  A slot may be
+ * shared by several destinations and is updated without locking: it is
+ * only a hint of where free ports are likely to be found. */
+#define NF_NAT_PORT_HINTS	1024
+static u_int16_t nf_nat_port_hints[NF_NAT_PORT_HINTS];
+static u_int32_t nf_nat_port_hint_rnd __read_mostly;
+static bool nf_nat_port_hint_rnd_initted __read_mostly;
+
+/* Length of the first run of port probes; each further run is half as
+ * long, and the search gives up after a run of NF_NAT_MIN_ATTEMPTS. */
+#define NF_NAT_MAX_ATTEMPTS	128
+#define NF_NAT_MIN_ATTEMPTS	16
+
+static u_int16_t *
+nf_nat_port_hint(const struct nf_conntrack_tuple *tuple,
+		 enum nf_nat_manip_type maniptype)
+{
+	__be32 addr, peer;
+	__be16 port;
+	u_int32_t h;
+
+	if (unlikely(!nf_nat_port_hint_rnd_initted)) {
+		get_random_bytes(&nf_nat_port_hint_rnd,
+				 sizeof(nf_nat_port_hint_rnd));
+		nf_nat_port_hint_rnd_initted = true;
+	}
+
+	/* the address being mapped, and the side it talks to */
+	if (maniptype == IP_NAT_MANIP_SRC) {
+		addr = tuple->src.u3.ip;
+		peer = tuple->dst.u3.ip;
+		port = tuple->dst.u.all;
+	} else {
+		addr = tuple->dst.u3.ip;
+		peer = tuple->src.u3.ip;
+		port = tuple->src.u.all;
+	}
+	h = jhash_3words((__force u32)addr, (__force u32)peer,
+			 (__force u32)port | (tuple->dst.protonum << 16),
+			 nf_nat_port_hint_rnd);
+	return &nf_nat_port_hints[((u64)h * NF_NAT_PORT_HINTS) >> 32];
+}
+
 bool nf_nat_proto_unique_tuple(struct nf_conntrack_tuple *tuple,
 			       const struct nf_nat_range *range,
 			       enum nf_nat_manip_type maniptype,
-			       const struct nf_conn *ct,
-			       u_int16_t *rover)
+			       const struct nf_conn *ct)
 {
-	unsigned int range_size, min, i;
+	unsigned int range_size, min, i, attempts;
+	u_int16_t *hint = NULL;
 	__be16 *portptr;
 	u_int16_t off;
 
@@ -79,18 +124,34 @@ bool nf_nat_proto_unique_tuple(struct nf_conntrack_tuple *tuple,
 						 maniptype == IP_NAT_MANIP_SRC
 						 ? tuple->dst.u.all
 						 : tuple->src.u.all);
-	else
-		off = *rover;
-
-	for (i = 0; i < range_size; i++, off++) {
-		*portptr = htons(min + off % range_size);
-		if (nf_nat_used_tuple(tuple, ct))
-			continue;
-		if (!(range->flags & IP_NAT_RANGE_PROTO_RANDOM))
-			*rover = off;
-		return true;
+	else {
+		hint = nf_nat_port_hint(tuple, maniptype);
+		off = *hint;
+	}
+
+	/*
+	 * We are in softirq context: scanning the whole range of a
+	 * destination which has nearly all of its ports in use would take
+	 * thousands of lookups per new connection.  Probe a bounded run of
+	 * ports, and when it is all taken, restart at a random offset with
+	 * half the window, so that a free port is found with a few probes
+	 * as long as there are some left.
+	 */
+	attempts = min_t(unsigned int, range_size, NF_NAT_MAX_ATTEMPTS);
+	for (;;) {
+		for (i = 0; i < attempts; i++, off++) {
+			*portptr = htons(min + off % range_size);
+			if (nf_nat_used_tuple(tuple, ct))
+				continue;
+			if (hint)
+				*hint = off + 1;
+			return true;
+		}
+		if (attempts >= range_size || attempts <= NF_NAT_MIN_ATTEMPTS)
+			return false;
+		attempts /= 2;
+		off = net_random();
 	}
-	return false;
 }
 EXPORT_SYMBOL_GPL(nf_nat_proto_unique_tuple);
 
@@ -16,16 +16,13 @@
 #include <net/netfilter/nf_nat.h>
 #include <net/netfilter/nf_nat_protocol.h>
 
-static u_int16_t udplite_port_rover;
-
 static bool
 udplite_unique_tuple(struct nf_conntrack_tuple *tuple,
 		     const struct nf_nat_range *range,
 		     enum nf_nat_manip_type maniptype,
 		     const struct nf_conn *ct)
 {
-	return nf_nat_proto_unique_tuple(tuple, range, maniptype, ct,
-					 &udplite_port_rover);
+	return nf_nat_proto_unique_tuple(tuple, range, maniptype, ct);
 }
 
 static bool
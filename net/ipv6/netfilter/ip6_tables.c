@@ -225,8 +225,10 @@ get_entry(void *base, unsigned int offset)
 static inline bool unconditional(const struct ip6t_ip6 *ipv6)
 {
 	static const struct ip6t_ip6 uncond;
+	struct ip6t_ip6 tmp = *ipv6;
 
-	return memcmp(ipv6, &uncond, sizeof(uncond)) == 0;
+	tmp.flags &= ~IP6T_F_INDEXED;
+	return memcmp(&tmp, &uncond, sizeof(uncond)) == 0;
 }
 
 #if defined(CONFIG_NETFILTER_XT_TARGET_TRACE) || \
@@ -330,6 +332,18 @@ ip6t_next_entry(const struct ip6t_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+/* Classifier key: source and destination address.  The protocol is left
+ * to ip6_packet_match(), finding it means walking extension headers. */
+#define IP6T_CLS_WORDS	8
+
+static void ip6t_cls_key(const struct sk_buff *skb, u32 *key)
+{
+	const struct ipv6hdr *ipv6 = ipv6_hdr(skb);
+
+	memcpy(&key[0], &ipv6->saddr, sizeof(ipv6->saddr));
+	memcpy(&key[4], &ipv6->daddr, sizeof(ipv6->daddr));
+}
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ip6t_do_table(struct sk_buff *skb,
@@ -350,6 +364,8 @@ ip6t_do_table(struct sk_buff *skb,
 	struct xt_table_info *private;
 	struct xt_match_param mtpar;
 	struct xt_target_param tgpar;
+	u32 key[IP6T_CLS_WORDS];
+	bool key_valid = false;
 
 	/* Initialization */
 	indev = in ? in->name : nulldevname;
@@ -382,6 +398,17 @@ ip6t_do_table(struct sk_buff *skb,
 
 		IP_NF_ASSERT(e);
 		IP_NF_ASSERT(back);
+		if (e->ipv6.flags & IP6T_F_INDEXED) {
+			/* Skip the rules whose addresses can't match;
+			 * the candidate is checked in full. */
+			if (!key_valid) {
+				ip6t_cls_key(skb, key);
+				key_valid = true;
+			}
+			e = get_entry(table_base,
+				      xt_cls_lookup(private->cls,
+						    (void *)e - table_base, key));
+		}
 		if (!ip6_packet_match(skb, indev, outdev, &e->ipv6,
 		    &mtpar.thoff, &mtpar.fragoff, &hotdrop) ||
 		    IP6T_MATCH_ITERATE(e, do_match, skb, &mtpar) != 0) {
@@ -449,6 +476,8 @@ ip6t_do_table(struct sk_buff *skb,
 		}
 		tb_comefrom = 0x57acc001;
 #endif
+		/* Target might have changed stuff. */
+		key_valid = false;
 		if (verdict == IP6T_CONTINUE)
 			e = ip6t_next_entry(e);
 		else
@@ -827,6 +856,99 @@ cleanup_entry(struct ip6t_entry *e, unsigned int *i)
 	return 0;
 }
 
+/* Rules whose address selectors are plain compares can go into the
+ * classifier; everything else about them is still checked by
+ * ip6_packet_match() and the matches.  Chain heads (ERROR targets) end
+ * a run so runs never span chains. */
+static bool ip6t_cls_rule(struct ip6t_entry *e, u32 *key, u32 *mask)
+{
+	const struct ip6t_entry_target *t = ip6t_get_target(e);
+	unsigned int i;
+
+	if (e->ipv6.invflags & (IP6T_INV_SRCIP | IP6T_INV_DSTIP))
+		return false;
+	if (strcmp(t->u.kernel.target->name, IP6T_ERROR_TARGET) == 0)
+		return false;
+	if (key == NULL)
+		return true;
+
+	/* ip6_packet_match() masks both sides of the compare */
+	for (i = 0; i < 4; i++) {
+		mask[i]     = (__force u32)e->ipv6.smsk.s6_addr32[i];
+		key[i]      = (__force u32)e->ipv6.src.s6_addr32[i] & mask[i];
+		mask[i + 4] = (__force u32)e->ipv6.dmsk.s6_addr32[i];
+		key[i + 4]  = (__force u32)e->ipv6.dst.s6_addr32[i] &
+			      mask[i + 4];
+	}
+	return true;
+}
+
+static inline int ip6t_cls_clear(struct ip6t_entry *e)
+{
+	e->ipv6.flags &= ~IP6T_F_INDEXED;
+	return 0;
+}
+
+/* Build the classifier over runs of at least XT_CLS_MIN_RUN indexable
+ * rules and flag their entries.  Failing leaves the table to linear
+ * evaluation, it is not an error. */
+static void
+ip6t_build_cls(struct xt_table_info *newinfo, void *entry0)
+{
+	u32 key[IP6T_CLS_WORDS], mask[IP6T_CLS_WORDS];
+	unsigned int off, end, n, indexed = 0;
+	struct ip6t_entry *e;
+	struct xt_cls *cls;
+	int ret = 0;
+
+	cls = xt_cls_alloc(IP6T_CLS_WORDS);
+	if (cls == NULL)
+		return;
+
+	off = 0;
+	while (off < newinfo->size) {
+		for (end = off, n = 0; end < newinfo->size; n++) {
+			e = entry0 + end;
+			if (!ip6t_cls_rule(e, NULL, NULL))
+				break;
+			end += e->next_offset;
+		}
+
+		if (n >= XT_CLS_MIN_RUN) {
+			for (; off < end; off += e->next_offset) {
+				e = entry0 + off;
+				ip6t_cls_rule(e, key, mask);
+				ret = xt_cls_add(cls, off, off + e->next_offset,
+						 key, mask);
+				if (ret < 0)
+					break;
+				e->ipv6.flags |= IP6T_F_INDEXED;
+				indexed++;
+			}
+			xt_cls_end_run(cls);
+			if (ret == -E2BIG) {
+				/* too many masks: this one stays linear */
+				off += e->next_offset;
+				ret = 0;
+				continue;
+			}
+			if (ret < 0)
+				break;
+		}
+
+		off = end;
+		if (off < newinfo->size)
+			off += ((struct ip6t_entry *)(entry0 + off))->next_offset;
+	}
+
+	if (ret < 0 || indexed == 0) {
+		IP6T_ENTRY_ITERATE(entry0, newinfo->size, ip6t_cls_clear);
+		xt_cls_free(cls);
+		return;
+	}
+	newinfo->cls = cls;
+}
+
 /* Checks and translates the user-supplied table segment (held in
    newinfo) */
 static int
@@ -900,6 +1022,8 @@ translate_table(const char *name,
 		return ret;
 	}
 
+	ip6t_build_cls(newinfo, entry0);
+
 	/* And one copy for every other CPU */
 	for_each_possible_cpu(i) {
 		if (newinfo->entries[i] && newinfo->entries[i] != entry0)
@@ -1034,6 +1158,14 @@ copy_entries_to_user(unsigned int total_size,
 			goto free_counters;
 		}
 
+		if ((e->ipv6.flags & IP6T_F_INDEXED) &&
+		    put_user(e->ipv6.flags & ~IP6T_F_INDEXED,
+			     (u_int8_t __user *)(userptr + off
+				+ offsetof(struct ip6t_entry, ipv6.flags))) != 0) {
+			ret = -EFAULT;
+			goto free_counters;
+		}
+
 		for (i = sizeof(struct ip6t_entry);
 		     i < e->target_offset;
 		     i += m->u.match_size) {
@@ -1271,6 +1403,12 @@ __do_replace(struct net *net, const char *name, unsigned int valid_hooks,
 		goto put_module;
 	}
 
+	/* Tables of other namespaces stay off the packet path until
+	 * they are given rules. */
+	ret = xt_hook_table(net, t);
+	if (ret != 0)
+		goto put_module;
+
 	oldinfo = xt_replace_table(t, num_counters, newinfo, &ret);
 	if (!oldinfo)
 		goto put_module;
@@ -1494,6 +1632,9 @@ compat_copy_entry_to_user(struct ip6t_entry *e, void __user **dstptr,
 	if (copy_to_user(&ce->counters, &counters[*i], sizeof(counters[*i])))
 		goto out;
 
+	if (put_user(e->ipv6.flags & ~IP6T_F_INDEXED, &ce->ipv6.flags))
+		goto out;
+
 	*dstptr += sizeof(struct compat_ip6t_entry);
 	*size -= sizeof(struct ip6t_entry) - sizeof(struct compat_ip6t_entry);
 
@@ -1819,6 +1960,8 @@ translate_compat_table(const char *name,
 		return ret;
 	}
 
+	ip6t_build_cls(newinfo, entry1);
+
 	/* And one copy for every other CPU */
 	for_each_possible_cpu(i)
 		if (newinfo->entries[i] && newinfo->entries[i] != entry1)
@@ -51,13 +51,6 @@ static struct
 	.term = IP6T_ERROR_INIT,		/* ERROR */
 };
 
-static const struct xt_table packet_filter = {
-	.name		= "filter",
-	.valid_hooks	= FILTER_VALID_HOOKS,
-	.me		= THIS_MODULE,
-	.af		= NFPROTO_IPV6,
-};
-
 /* The work comes in here from netfilter.c. */
 static unsigned int
 ip6t_in_hook(unsigned int hook,
@@ -115,22 +108,40 @@ static struct nf_hook_ops ip6t_ops[] __read_mostly = {
 	},
 };
 
+static const struct xt_table packet_filter = {
+	.name		= "filter",
+	.valid_hooks	= FILTER_VALID_HOOKS,
+	.me		= THIS_MODULE,
+	.af		= NFPROTO_IPV6,
+	.ops		= ip6t_ops,
+	.num_ops	= ARRAY_SIZE(ip6t_ops),
+};
+
 /* Default to forward because I got too much mail already. */
 static int forward = NF_ACCEPT;
 module_param(forward, bool, 0000);
 
 static int __net_init ip6table_filter_net_init(struct net *net)
 {
+	int ret;
+
 	/* Register table */
 	net->ipv6.ip6table_filter =
 		ip6t_register_table(net, &packet_filter, &initial_table.repl);
 	if (IS_ERR(net->ipv6.ip6table_filter))
 		return PTR_ERR(net->ipv6.ip6table_filter);
-	return 0;
+	/* Other namespaces are hooked once they have rules */
+	if (!net_eq(net, &init_net) && forward == NF_ACCEPT)
+		return 0;
+	ret = xt_hook_table(net, net->ipv6.ip6table_filter);
+	if (ret < 0)
+		ip6t_unregister_table(net->ipv6.ip6table_filter);
+	return ret;
 }
 
 static void __net_exit ip6table_filter_net_exit(struct net *net)
 {
+	xt_unhook_table(net, net->ipv6.ip6table_filter);
 	ip6t_unregister_table(net->ipv6.ip6table_filter);
 }
 
@@ -141,8 +152,6 @@ static struct pernet_operations ip6table_filter_net_ops = {
 
 static int __init ip6table_filter_init(void)
 {
-	int ret;
-
 	if (forward < 0 || forward > NF_MAX_VERDICT) {
 		printk("iptables forward must be 0 or 1\n");
 		return -EINVAL;
@@ -151,25 +160,11 @@ static int __init ip6table_filter_init(void)
 	/* Entry 1 is the FORWARD hook */
 	initial_table.entries[1].target.verdict = -forward - 1;
 
-	ret = register_pernet_subsys(&ip6table_filter_net_ops);
-	if (ret < 0)
-		return ret;
-
-	/* Register hooks */
-	ret = nf_register_hooks(ip6t_ops, ARRAY_SIZE(ip6t_ops));
-	if (ret < 0)
-		goto cleanup_table;
-
-	return ret;
-
- cleanup_table:
-	unregister_pernet_subsys(&ip6table_filter_net_ops);
-	return ret;
+	return register_pernet_subsys(&ip6table_filter_net_ops);
 }
 
 static void __exit ip6table_filter_fini(void)
 {
-	nf_unregister_hooks(ip6t_ops, ARRAY_SIZE(ip6t_ops));
 	unregister_pernet_subsys(&ip6table_filter_net_ops);
 }
 
@@ -35,13 +35,6 @@ static const struct
 	.term = IP6T_ERROR_INIT,		/* ERROR */
 };
 
-static const struct xt_table packet_raw = {
-	.name = "raw",
-	.valid_hooks = RAW_VALID_HOOKS,
-	.me = THIS_MODULE,
-	.af = NFPROTO_IPV6,
-};
-
 /* The work comes in here from netfilter.c. */
 static unsigned int
 ip6t_pre_routing_hook(unsigned int hook,
@@ -82,18 +75,36 @@ static struct nf_hook_ops ip6t_ops[] __read_mostly = {
 	},
 };
 
+static const struct xt_table packet_raw = {
+	.name = "raw",
+	.valid_hooks = RAW_VALID_HOOKS,
+	.me = THIS_MODULE,
+	.af = NFPROTO_IPV6,
+	.ops		= ip6t_ops,
+	.num_ops	= ARRAY_SIZE(ip6t_ops),
+};
+
 static int __net_init ip6table_raw_net_init(struct net *net)
 {
+	int ret;
+
 	/* Register table */
 	net->ipv6.ip6table_raw =
 		ip6t_register_table(net, &packet_raw, &initial_table.repl);
 	if (IS_ERR(net->ipv6.ip6table_raw))
 		return PTR_ERR(net->ipv6.ip6table_raw);
-	return 0;
+	/* Other namespaces are hooked once they have rules */
+	if (!net_eq(net, &init_net))
+		return 0;
+	ret = xt_hook_table(net, net->ipv6.ip6table_raw);
+	if (ret < 0)
+		ip6t_unregister_table(net->ipv6.ip6table_raw);
+	return ret;
 }
 
 static void __net_exit ip6table_raw_net_exit(struct net *net)
 {
+	xt_unhook_table(net, net->ipv6.ip6table_raw);
 	ip6t_unregister_table(net->ipv6.ip6table_raw);
 }
 
@@ -104,27 +115,11 @@ static struct pernet_operations ip6table_raw_net_ops = {
 
 static int __init ip6table_raw_init(void)
 {
-	int ret;
-
-	ret = register_pernet_subsys(&ip6table_raw_net_ops);
-	if (ret < 0)
-		return ret;
-
-	/* Register hooks */
-	ret = nf_register_hooks(ip6t_ops, ARRAY_SIZE(ip6t_ops));
-	if (ret < 0)
-		goto cleanup_table;
-
-	return ret;
-
- cleanup_table:
-	unregister_pernet_subsys(&ip6table_raw_net_ops);
-	return ret;
+	return register_pernet_subsys(&ip6table_raw_net_ops);
 }
 
 static void __exit ip6table_raw_fini(void)
 {
-	nf_unregister_hooks(ip6t_ops, ARRAY_SIZE(ip6t_ops));
 	unregister_pernet_subsys(&ip6table_raw_net_ops);
 }
 
@@ -56,13 +56,6 @@ static const struct
 	.term = IP6T_ERROR_INIT,		/* ERROR */
 };
 
-static const struct xt_table security_table = {
-	.name		= "security",
-	.valid_hooks	= SECURITY_VALID_HOOKS,
-	.me		= THIS_MODULE,
-	.af		= NFPROTO_IPV6,
-};
-
 static unsigned int
 ip6t_local_in_hook(unsigned int hook,
 		   struct sk_buff *skb,
@@ -121,19 +114,37 @@ static struct nf_hook_ops ip6t_ops[] __read_mostly = {
 	},
 };
 
+static const struct xt_table security_table = {
+	.name		= "security",
+	.valid_hooks	= SECURITY_VALID_HOOKS,
+	.me		= THIS_MODULE,
+	.af		= NFPROTO_IPV6,
+	.ops		= ip6t_ops,
+	.num_ops	= ARRAY_SIZE(ip6t_ops),
+};
+
 static int __net_init ip6table_security_net_init(struct net *net)
 {
+	int ret;
+
 	net->ipv6.ip6table_security =
 		ip6t_register_table(net, &security_table, &initial_table.repl);
 
 	if (IS_ERR(net->ipv6.ip6table_security))
 		return PTR_ERR(net->ipv6.ip6table_security);
 
-	return 0;
+	/* Other namespaces are hooked once they have rules */
+	if (!net_eq(net, &init_net))
+		return 0;
+	ret = xt_hook_table(net, net->ipv6.ip6table_security);
+	if (ret < 0)
+		ip6t_unregister_table(net->ipv6.ip6table_security);
+	return ret;
 }
 
 static void __net_exit ip6table_security_net_exit(struct net *net)
 {
+	xt_unhook_table(net, net->ipv6.ip6table_security);
 	ip6t_unregister_table(net->ipv6.ip6table_security);
 }
 
@@ -144,26 +155,11 @@ static struct pernet_operations ip6table_security_net_ops = {
 
 static int __init ip6table_security_init(void)
 {
-	int ret;
-
-	ret = register_pernet_subsys(&ip6table_security_net_ops);
-	if (ret < 0)
-		return ret;
-
-	ret = nf_register_hooks(ip6t_ops, ARRAY_SIZE(ip6t_ops));
-	if (ret < 0)
-		goto cleanup_table;
-
-	return ret;
-
-cleanup_table:
-	unregister_pernet_subsys(&ip6table_security_net_ops);
-	return ret;
+	return register_pernet_subsys(&ip6table_security_net_ops);
 }
 
 static void __exit ip6table_security_fini(void)
 {
-	nf_unregister_hooks(ip6t_ops, ARRAY_SIZE(ip6t_ops));
 	unregister_pernet_subsys(&ip6table_security_net_ops);
 }
 
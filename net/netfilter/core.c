@@ -19,6 +19,7 @@
 #include <linux/inetdevice.h>
 #include <linux/proc_fs.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
 #include <net/net_namespace.h>
 #include <net/sock.h>
 
@@ -51,35 +52,201 @@ void nf_unregister_afinfo(const struct nf_afinfo *afinfo)
 }
 EXPORT_SYMBOL_GPL(nf_unregister_afinfo);
 
-struct list_head nf_hooks[NFPROTO_NUMPROTO][NF_MAX_HOOKS] __read_mostly;
-EXPORT_SYMBOL(nf_hooks);
+/*
+ * Every namespace has its own hook lists, so that packets of a namespace
+ * without any rules do not even enter nf_hook_slow().  A namespace gets
+ * a private copy of each nf_hook_ops registered in it: the same ops may
+ * be attached to any number of namespaces.  Hooks registered through
+ * nf_register_hook() go into all of them, present and future.
+ */
+struct nf_hook_entry {
+	const struct nf_hook_ops	*orig_ops;
+	struct nf_hook_ops		ops;
+	/* for freeing once readers are gone */
+	struct list_head		gc_list;
+};
+
+static LIST_HEAD(nf_hook_list);		/* ops registered in all namespaces */
+static LIST_HEAD(nf_net_list);		/* namespaces with hook lists */
 static DEFINE_MUTEX(nf_hook_mutex);
 
-int nf_register_hook(struct nf_hook_ops *reg)
+static int __nf_register_net_hook(struct net *net,
+				  const struct nf_hook_ops *reg)
+{
+	struct nf_hook_entry *entry;
+	struct nf_hook_ops *elem;
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (entry == NULL)
+		return -ENOMEM;
+	entry->orig_ops = reg;
+	entry->ops = *reg;
+
+	list_for_each_entry(elem, &net->nf.hooks[reg->pf][reg->hooknum], list) {
+		if (reg->priority < elem->priority)
+			break;
+	}
+	list_add_rcu(&entry->ops.list, elem->list.prev);
+	return 0;
+}
+
+static struct nf_hook_entry *
+__nf_unregister_net_hook(struct net *net, const struct nf_hook_ops *reg)
 {
+	struct nf_hook_entry *entry;
 	struct nf_hook_ops *elem;
+
+	list_for_each_entry(elem, &net->nf.hooks[reg->pf][reg->hooknum], list) {
+		entry = container_of(elem, struct nf_hook_entry, ops);
+		if (entry->orig_ops == reg) {
+			list_del_rcu(&elem->list);
+			return entry;
+		}
+	}
+	WARN(1, "nf_unregister_net_hook: hook not found!\n");
+	return NULL;
+}
+
+/* Free unlinked hook entries.  Packets may still traverse them until the
+ * end of the grace period, and queued packets would resume at them. */
+static void nf_hook_entries_free(struct list_head *gc)
+{
+	struct nf_hook_entry *entry, *next;
+
+	if (list_empty(gc))
+		return;
+
+	synchronize_net();
+	list_for_each_entry(entry, gc, gc_list)
+		nf_queue_nf_hook_drop(&entry->ops);
+	/* a verdict may have dequeued a packet before the drop */
+	synchronize_net();
+
+	list_for_each_entry_safe(entry, next, gc, gc_list)
+		kfree(entry);
+}
+
+int nf_register_net_hook(struct net *net, struct nf_hook_ops *reg)
+{
 	int err;
 
 	err = mutex_lock_interruptible(&nf_hook_mutex);
 	if (err < 0)
 		return err;
-	list_for_each_entry(elem, &nf_hooks[reg->pf][reg->hooknum], list) {
-		if (reg->priority < elem->priority)
-			break;
+	err = __nf_register_net_hook(net, reg);
+	mutex_unlock(&nf_hook_mutex);
+	return err;
+}
+EXPORT_SYMBOL(nf_register_net_hook);
+
+void nf_unregister_net_hook(struct net *net, struct nf_hook_ops *reg)
+{
+	struct nf_hook_entry *entry;
+	LIST_HEAD(gc);
+
+	mutex_lock(&nf_hook_mutex);
+	entry = __nf_unregister_net_hook(net, reg);
+	if (entry)
+		list_add(&entry->gc_list, &gc);
+	mutex_unlock(&nf_hook_mutex);
+
+	nf_hook_entries_free(&gc);
+}
+EXPORT_SYMBOL(nf_unregister_net_hook);
+
+int nf_register_net_hooks(struct net *net, struct nf_hook_ops *reg,
+			  unsigned int n)
+{
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		err = nf_register_net_hook(net, &reg[i]);
+		if (err)
+			goto err;
+	}
+	return err;
+
+err:
+	if (i > 0)
+		nf_unregister_net_hooks(net, reg, i);
+	return err;
+}
+EXPORT_SYMBOL(nf_register_net_hooks);
+
+void nf_unregister_net_hooks(struct net *net, struct nf_hook_ops *reg,
+			     unsigned int n)
+{
+	struct nf_hook_entry *entry;
+	unsigned int i;
+	LIST_HEAD(gc);
+
+	/* one grace period for the whole batch */
+	mutex_lock(&nf_hook_mutex);
+	for (i = 0; i < n; i++) {
+		entry = __nf_unregister_net_hook(net, &reg[i]);
+		if (entry)
+			list_add(&entry->gc_list, &gc);
 	}
-	list_add_rcu(&reg->list, elem->list.prev);
+	mutex_unlock(&nf_hook_mutex);
+
+	nf_hook_entries_free(&gc);
+}
+EXPORT_SYMBOL(nf_unregister_net_hooks);
+
+int nf_register_hook(struct nf_hook_ops *reg)
+{
+	struct nf_hook_entry *entry;
+	struct net *net;
+	LIST_HEAD(gc);
+	int err;
+
+	err = mutex_lock_interruptible(&nf_hook_mutex);
+	if (err < 0)
+		return err;
+	list_for_each_entry(net, &nf_net_list, nf.list) {
+		err = __nf_register_net_hook(net, reg);
+		if (err)
+			goto rollback;
+	}
+	list_add_tail(&reg->list, &nf_hook_list);
 	mutex_unlock(&nf_hook_mutex);
 	return 0;
+
+rollback:
+	list_for_each_entry_continue_reverse(net, &nf_net_list, nf.list) {
+		entry = __nf_unregister_net_hook(net, reg);
+		if (entry)
+			list_add(&entry->gc_list, &gc);
+	}
+	mutex_unlock(&nf_hook_mutex);
+	nf_hook_entries_free(&gc);
+	return err;
 }
 EXPORT_SYMBOL(nf_register_hook);
 
+static void __nf_unregister_hook(struct nf_hook_ops *reg, struct list_head *gc)
+{
+	struct nf_hook_entry *entry;
+	struct net *net;
+
+	list_del(&reg->list);
+	list_for_each_entry(net, &nf_net_list, nf.list) {
+		entry = __nf_unregister_net_hook(net, reg);
+		if (entry)
+			list_add(&entry->gc_list, gc);
+	}
+}
+
 void nf_unregister_hook(struct nf_hook_ops *reg)
 {
+	LIST_HEAD(gc);
+
 	mutex_lock(&nf_hook_mutex);
-	list_del_rcu(&reg->list);
+	__nf_unregister_hook(reg, &gc);
 	mutex_unlock(&nf_hook_mutex);
 
-	synchronize_net();
+	nf_hook_entries_free(&gc);
 }
 EXPORT_SYMBOL(nf_unregister_hook);
 
@@ -105,12 +272,81 @@ EXPORT_SYMBOL(nf_register_hooks);
 void nf_unregister_hooks(struct nf_hook_ops *reg, unsigned int n)
 {
 	unsigned int i;
+	LIST_HEAD(gc);
 
+	mutex_lock(&nf_hook_mutex);
 	for (i = 0; i < n; i++)
-		nf_unregister_hook(&reg[i]);
+		__nf_unregister_hook(&reg[i], &gc);
+	mutex_unlock(&nf_hook_mutex);
+
+	nf_hook_entries_free(&gc);
 }
 EXPORT_SYMBOL(nf_unregister_hooks);
 
+/* Unlink all hooks of a namespace on its way out */
+static void nf_hook_flush_net(struct net *net, struct list_head *gc)
+{
+	struct nf_hook_ops *elem, *next;
+	struct nf_hook_entry *entry;
+	int i, h;
+
+	for (i = 0; i < ARRAY_SIZE(net->nf.hooks); i++) {
+		for (h = 0; h < NF_MAX_HOOKS; h++) {
+			list_for_each_entry_safe(elem, next,
+						 &net->nf.hooks[i][h], list) {
+				entry = container_of(elem, struct nf_hook_entry,
+						     ops);
+				list_del_rcu(&elem->list);
+				list_add(&entry->gc_list, gc);
+			}
+		}
+	}
+}
+
+static int __net_init netfilter_net_init(struct net *net)
+{
+	struct nf_hook_ops *reg;
+	LIST_HEAD(gc);
+	int i, h, err = 0;
+
+	for (i = 0; i < ARRAY_SIZE(net->nf.hooks); i++) {
+		for (h = 0; h < NF_MAX_HOOKS; h++)
+			INIT_LIST_HEAD(&net->nf.hooks[i][h]);
+	}
+
+	mutex_lock(&nf_hook_mutex);
+	list_for_each_entry(reg, &nf_hook_list, list) {
+		err = __nf_register_net_hook(net, reg);
+		if (err) {
+			nf_hook_flush_net(net, &gc);
+			break;
+		}
+	}
+	if (!err)
+		list_add_tail(&net->nf.list, &nf_net_list);
+	mutex_unlock(&nf_hook_mutex);
+
+	nf_hook_entries_free(&gc);
+	return err;
+}
+
+static void __net_exit netfilter_net_exit(struct net *net)
+{
+	LIST_HEAD(gc);
+
+	mutex_lock(&nf_hook_mutex);
+	list_del(&net->nf.list);
+	nf_hook_flush_net(net, &gc);
+	mutex_unlock(&nf_hook_mutex);
+
+	nf_hook_entries_free(&gc);
+}
+
+static struct pernet_operations netfilter_net_ops = {
+	.init = netfilter_net_init,
+	.exit = netfilter_net_exit,
+};
+
 unsigned int nf_iterate(struct list_head *head,
 			struct sk_buff *skb,
 			unsigned int hook,
@@ -161,16 +397,17 @@ int nf_hook_slow(u_int8_t pf, unsigned int hook, struct sk_buff *skb,
 		 int (*okfn)(struct sk_buff *),
 		 int hook_thresh)
 {
-	struct list_head *elem;
+	struct list_head *head, *elem;
 	unsigned int verdict;
 	int ret = 0;
 
 	/* We may already have this, but read-locks nest anyway */
 	rcu_read_lock();
 
-	elem = &nf_hooks[pf][hook];
+	head = &nf_hook_net(indev, outdev)->nf.hooks[pf][hook];
+	elem = head;
 next_hook:
-	verdict = nf_iterate(&nf_hooks[pf][hook], skb, hook, indev,
+	verdict = nf_iterate(head, skb, hook, indev,
 			     outdev, &elem, okfn, hook_thresh);
 	if (verdict == NF_ACCEPT || verdict == NF_STOP) {
 		ret = 1;
@@ -253,11 +490,8 @@ EXPORT_SYMBOL(proc_net_netfilter);
 
 void __init netfilter_init(void)
 {
-	int i, h;
-	for (i = 0; i < ARRAY_SIZE(nf_hooks); i++) {
-		for (h = 0; h < NF_MAX_HOOKS; h++)
-			INIT_LIST_HEAD(&nf_hooks[i][h]);
-	}
+	if (register_pernet_subsys(&netfilter_net_ops) < 0)
+		panic("cannot create netfilter hook lists");
 
 #ifdef CONFIG_PROC_FS
 	proc_net_netfilter = proc_mkdir("netfilter", init_net.proc_net);
@@ -0,0 +1,273 @@
+/*
+ * bitmap:ip, one bit per IPv4 address of a range of at most 64k.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <net/netlink.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("bitmap:ip type of IP sets");
+MODULE_ALIAS("ip_set_bitmap:ip");
+
+struct bitmap_ip {
+	struct ip_set_bitmap map;
+	u32 first_ip;		/* host byte order, included in range */
+	u32 last_ip;		/* host byte order, included in range */
+};
+
+/* Range operations report per-element errors only for a single element */
+static int bitmap_ip_range_ret(int ret, u32 from, u32 to)
+{
+	if (from != to && (ret == -EEXIST || ret == -ENOENT))
+		return 0;
+	return ret;
+}
+
+static int
+bitmap_ip_kadt(struct ip_set *set, const struct sk_buff *skb,
+	       enum ipset_adt adt, u8 dim, u8 flags)
+{
+	struct bitmap_ip *b = set->data;
+	u32 ip = ntohl(ip_set_get_ip4(skb, flags & IPSET_DIM_ONE_SRC));
+
+	if (ip < b->first_ip || ip > b->last_ip)
+		return adt == IPSET_TEST ? 0 : -ERANGE;
+	ip -= b->first_ip;
+
+	switch (adt) {
+	case IPSET_TEST:
+		return ip_set_bitmap_test(&b->map, ip);
+	case IPSET_ADD:
+		return ip_set_bitmap_add(&b->map, ip,
+					 ip_set_timeout_set(set->timeout),
+					 true);
+	case IPSET_DEL:
+		return ip_set_bitmap_del(&b->map, ip);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int
+bitmap_ip_uadt(struct ip_set *set, struct nlattr *tb[],
+	       enum ipset_adt adt, u32 flags, bool retried)
+{
+	struct bitmap_ip *b = set->data;
+	unsigned long timeout;
+	u32 ip, ip_to, id;
+	int ret = 0;
+
+	if (tb[IPSET_ATTR_IP] == NULL)
+		return -EPROTO;
+	ip = ntohl(nla_get_be32(tb[IPSET_ATTR_IP]));
+	ip_to = ip;
+
+	if (tb[IPSET_ATTR_IP_TO]) {
+		ip_to = ntohl(nla_get_be32(tb[IPSET_ATTR_IP_TO]));
+		if (ip > ip_to)
+			swap(ip, ip_to);
+	} else if (tb[IPSET_ATTR_CIDR]) {
+		u8 cidr = nla_get_u8(tb[IPSET_ATTR_CIDR]);
+
+		if (cidr == 0 || cidr > 32)
+			return -EINVAL;
+		ip &= ntohl(ip_set_netmask(cidr));
+		ip_to = ip | ~ntohl(ip_set_netmask(cidr));
+	}
+	if (ip < b->first_ip || ip_to > b->last_ip)
+		return -ERANGE;
+
+	if (adt == IPSET_TEST) {
+		if (ip != ip_to)
+			return -EINVAL;
+		return ip_set_bitmap_test(&b->map, ip - b->first_ip);
+	}
+
+	ret = ip_set_get_timeout(set, tb, &timeout);
+	if (ret < 0)
+		return ret;
+
+	for (id = ip - b->first_ip; id <= ip_to - b->first_ip; id++) {
+		if (adt == IPSET_ADD)
+			ret = ip_set_bitmap_add(&b->map, id, timeout,
+						flags & IPSET_FLAG_EXIST);
+		else
+			ret = ip_set_bitmap_del(&b->map, id);
+		ret = bitmap_ip_range_ret(ret, ip, ip_to);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int bitmap_ip_resize(struct ip_set *set)
+{
+	return -EINVAL;
+}
+
+static void bitmap_ip_gc(struct ip_set *set)
+{
+	struct bitmap_ip *b = set->data;
+
+	ip_set_bitmap_gc(&b->map);
+}
+
+static void bitmap_ip_destroy(struct ip_set *set)
+{
+	struct bitmap_ip *b = set->data;
+
+	ip_set_bitmap_destroy(&b->map);
+	kfree(b);
+}
+
+static void bitmap_ip_flush(struct ip_set *set)
+{
+	struct bitmap_ip *b = set->data;
+
+	ip_set_bitmap_flush(&b->map);
+}
+
+static int bitmap_ip_head(struct ip_set *set, struct sk_buff *skb)
+{
+	struct bitmap_ip *b = set->data;
+
+	NLA_PUT_BE32(skb, IPSET_ATTR_IP, htonl(b->first_ip));
+	NLA_PUT_BE32(skb, IPSET_ATTR_IP_TO, htonl(b->last_ip));
+	return ip_set_put_head(set, skb, b->map.elements,
+			       sizeof(*b) + ip_set_bitmap_memsize(&b->map));
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int bitmap_ip_put(struct ip_set *set, struct sk_buff *skb, u32 id)
+{
+	const struct bitmap_ip *b = set->data;
+
+	NLA_PUT_BE32(skb, IPSET_ATTR_IP, htonl(b->first_ip + id));
+	return 0;
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int bitmap_ip_list(struct ip_set *set, struct sk_buff *skb,
+			  struct netlink_callback *cb)
+{
+	struct bitmap_ip *b = set->data;
+
+	return ip_set_bitmap_list(set, &b->map, skb, cb, bitmap_ip_put);
+}
+
+static const struct ip_set_type_variant bitmap_ip_variant = {
+	.kadt		= bitmap_ip_kadt,
+	.uadt		= bitmap_ip_uadt,
+	.resize		= bitmap_ip_resize,
+	.gc		= bitmap_ip_gc,
+	.destroy	= bitmap_ip_destroy,
+	.flush		= bitmap_ip_flush,
+	.head		= bitmap_ip_head,
+	.list		= bitmap_ip_list,
+};
+
+static int bitmap_ip_create(struct ip_set *set, struct nlattr *tb[])
+{
+	struct bitmap_ip *b;
+	u32 first_ip, last_ip;
+	u32 timeout = 0;
+	int ret;
+
+	if (set->family != AF_INET)
+		return -EAFNOSUPPORT;
+	if (tb[IPSET_ATTR_IP] == NULL)
+		return -EPROTO;
+
+	first_ip = ntohl(nla_get_be32(tb[IPSET_ATTR_IP]));
+	if (tb[IPSET_ATTR_IP_TO]) {
+		last_ip = ntohl(nla_get_be32(tb[IPSET_ATTR_IP_TO]));
+		if (first_ip > last_ip)
+			swap(first_ip, last_ip);
+	} else if (tb[IPSET_ATTR_CIDR]) {
+		u8 cidr = nla_get_u8(tb[IPSET_ATTR_CIDR]);
+
+		if (cidr == 0 || cidr > 32)
+			return -EINVAL;
+		first_ip &= ntohl(ip_set_netmask(cidr));
+		last_ip = first_ip | ~ntohl(ip_set_netmask(cidr));
+	} else
+		return -EPROTO;
+
+	if (last_ip - first_ip > IPSET_BITMAP_MAX_RANGE)
+		return -ERANGE;
+	if (tb[IPSET_ATTR_TIMEOUT])
+		timeout = nla_get_u32(tb[IPSET_ATTR_TIMEOUT]);
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (b == NULL)
+		return -ENOMEM;
+
+	ret = ip_set_bitmap_init(&b->map, last_ip - first_ip + 1,
+				 timeout != 0);
+	if (ret < 0) {
+		kfree(b);
+		return ret;
+	}
+	b->first_ip = first_ip;
+	b->last_ip = last_ip;
+
+	set->timeout = timeout;
+	set->data = b;
+	set->variant = &bitmap_ip_variant;
+	return 0;
+}
+
+static const struct nla_policy
+bitmap_ip_create_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_IP]		= { .type = NLA_U32 },
+	[IPSET_ATTR_IP_TO]	= { .type = NLA_U32 },
+	[IPSET_ATTR_CIDR]	= { .type = NLA_U8 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static const struct nla_policy
+bitmap_ip_adt_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_IP]		= { .type = NLA_U32 },
+	[IPSET_ATTR_IP_TO]	= { .type = NLA_U32 },
+	[IPSET_ATTR_CIDR]	= { .type = NLA_U8 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static struct ip_set_type bitmap_ip_type __read_mostly = {
+	.name		= "bitmap:ip",
+	.family		= AF_INET,
+	.revision	= 0,
+	.dimension	= IPSET_DIM_ONE,
+	.features	= IPSET_TYPE_IP,
+	.create		= bitmap_ip_create,
+	.create_policy	= bitmap_ip_create_policy,
+	.adt_policy	= bitmap_ip_adt_policy,
+	.me		= THIS_MODULE,
+};
+
+static int __init bitmap_ip_init(void)
+{
+	return ip_set_type_register(&bitmap_ip_type);
+}
+
+static void __exit bitmap_ip_fini(void)
+{
+	ip_set_type_unregister(&bitmap_ip_type);
+}
+
+module_init(bitmap_ip_init);
+module_exit(bitmap_ip_fini);
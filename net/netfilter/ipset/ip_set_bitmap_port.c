@@ -0,0 +1,249 @@
+/*
+ * bitmap:port, one bit per TCP/UDP/SCTP port of a range.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <net/netlink.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("bitmap:port type of IP sets");
+MODULE_ALIAS("ip_set_bitmap:port");
+
+struct bitmap_port {
+	struct ip_set_bitmap map;
+	u16 first_port;		/* host byte order, included in range */
+	u16 last_port;		/* host byte order, included in range */
+};
+
+static int
+bitmap_port_kadt(struct ip_set *set, const struct sk_buff *skb,
+		 enum ipset_adt adt, u8 dim, u8 flags)
+{
+	struct bitmap_port *b = set->data;
+	__be16 __port;
+	u16 port;
+	u8 proto;
+
+	if (ip_set_get_ip4_port(skb, flags & IPSET_DIM_ONE_SRC,
+				&__port, &proto) < 0)
+		return adt == IPSET_TEST ? 0 : -EINVAL;
+
+	port = ntohs(__port);
+	if (port < b->first_port || port > b->last_port)
+		return adt == IPSET_TEST ? 0 : -ERANGE;
+	port -= b->first_port;
+
+	switch (adt) {
+	case IPSET_TEST:
+		return ip_set_bitmap_test(&b->map, port);
+	case IPSET_ADD:
+		return ip_set_bitmap_add(&b->map, port,
+					 ip_set_timeout_set(set->timeout),
+					 true);
+	case IPSET_DEL:
+		return ip_set_bitmap_del(&b->map, port);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int
+bitmap_port_uadt(struct ip_set *set, struct nlattr *tb[],
+		 enum ipset_adt adt, u32 flags, bool retried)
+{
+	struct bitmap_port *b = set->data;
+	unsigned long timeout;
+	u32 port, port_to, id;
+	int ret;
+
+	if (tb[IPSET_ATTR_PORT] == NULL)
+		return -EPROTO;
+	port = ntohs(nla_get_be16(tb[IPSET_ATTR_PORT]));
+	port_to = port;
+	if (tb[IPSET_ATTR_PORT_TO]) {
+		port_to = ntohs(nla_get_be16(tb[IPSET_ATTR_PORT_TO]));
+		if (port > port_to)
+			swap(port, port_to);
+	}
+	if (port < b->first_port || port_to > b->last_port)
+		return -ERANGE;
+
+	if (adt == IPSET_TEST) {
+		if (port != port_to)
+			return -EINVAL;
+		return ip_set_bitmap_test(&b->map, port - b->first_port);
+	}
+
+	ret = ip_set_get_timeout(set, tb, &timeout);
+	if (ret < 0)
+		return ret;
+
+	/* only a single element reports that it was (not) there */
+	for (id = port - b->first_port; id <= port_to - b->first_port; id++) {
+		if (adt == IPSET_ADD)
+			ret = ip_set_bitmap_add(&b->map, id, timeout,
+						flags & IPSET_FLAG_EXIST);
+		else
+			ret = ip_set_bitmap_del(&b->map, id);
+		if (port != port_to && (ret == -EEXIST || ret == -ENOENT))
+			ret = 0;
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int bitmap_port_resize(struct ip_set *set)
+{
+	return -EINVAL;
+}
+
+static void bitmap_port_gc(struct ip_set *set)
+{
+	struct bitmap_port *b = set->data;
+
+	ip_set_bitmap_gc(&b->map);
+}
+
+static void bitmap_port_destroy(struct ip_set *set)
+{
+	struct bitmap_port *b = set->data;
+
+	ip_set_bitmap_destroy(&b->map);
+	kfree(b);
+}
+
+static void bitmap_port_flush(struct ip_set *set)
+{
+	struct bitmap_port *b = set->data;
+
+	ip_set_bitmap_flush(&b->map);
+}
+
+static int bitmap_port_head(struct ip_set *set, struct sk_buff *skb)
+{
+	struct bitmap_port *b = set->data;
+
+	NLA_PUT_BE16(skb, IPSET_ATTR_PORT, htons(b->first_port));
+	NLA_PUT_BE16(skb, IPSET_ATTR_PORT_TO, htons(b->last_port));
+	return ip_set_put_head(set, skb, b->map.elements,
+			       sizeof(*b) + ip_set_bitmap_memsize(&b->map));
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int bitmap_port_put(struct ip_set *set, struct sk_buff *skb, u32 id)
+{
+	const struct bitmap_port *b = set->data;
+
+	NLA_PUT_BE16(skb, IPSET_ATTR_PORT, htons(b->first_port + id));
+	return 0;
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int bitmap_port_list(struct ip_set *set, struct sk_buff *skb,
+			    struct netlink_callback *cb)
+{
+	struct bitmap_port *b = set->data;
+
+	return ip_set_bitmap_list(set, &b->map, skb, cb, bitmap_port_put);
+}
+
+static const struct ip_set_type_variant bitmap_port_variant = {
+	.kadt		= bitmap_port_kadt,
+	.uadt		= bitmap_port_uadt,
+	.resize		= bitmap_port_resize,
+	.gc		= bitmap_port_gc,
+	.destroy	= bitmap_port_destroy,
+	.flush		= bitmap_port_flush,
+	.head		= bitmap_port_head,
+	.list		= bitmap_port_list,
+};
+
+static int bitmap_port_create(struct ip_set *set, struct nlattr *tb[])
+{
+	struct bitmap_port *b;
+	u16 first_port, last_port;
+	u32 timeout = 0;
+	int ret;
+
+	if (tb[IPSET_ATTR_PORT] == NULL || tb[IPSET_ATTR_PORT_TO] == NULL)
+		return -EPROTO;
+
+	first_port = ntohs(nla_get_be16(tb[IPSET_ATTR_PORT]));
+	last_port = ntohs(nla_get_be16(tb[IPSET_ATTR_PORT_TO]));
+	if (first_port > last_port)
+		swap(first_port, last_port);
+	if (tb[IPSET_ATTR_TIMEOUT])
+		timeout = nla_get_u32(tb[IPSET_ATTR_TIMEOUT]);
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (b == NULL)
+		return -ENOMEM;
+
+	ret = ip_set_bitmap_init(&b->map, last_port - first_port + 1,
+				 timeout != 0);
+	if (ret < 0) {
+		kfree(b);
+		return ret;
+	}
+	b->first_port = first_port;
+	b->last_port = last_port;
+
+	set->timeout = timeout;
+	set->data = b;
+	set->variant = &bitmap_port_variant;
+	return 0;
+}
+
+static const struct nla_policy
+bitmap_port_create_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_PORT]	= { .type = NLA_U16 },
+	[IPSET_ATTR_PORT_TO]	= { .type = NLA_U16 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static const struct nla_policy
+bitmap_port_adt_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_PORT]	= { .type = NLA_U16 },
+	[IPSET_ATTR_PORT_TO]	= { .type = NLA_U16 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static struct ip_set_type bitmap_port_type __read_mostly = {
+	.name		= "bitmap:port",
+	.family		= AF_INET,
+	.revision	= 0,
+	.dimension	= IPSET_DIM_ONE,
+	.features	= IPSET_TYPE_PORT,
+	.create		= bitmap_port_create,
+	.create_policy	= bitmap_port_create_policy,
+	.adt_policy	= bitmap_port_adt_policy,
+	.me		= THIS_MODULE,
+};
+
+static int __init bitmap_port_init(void)
+{
+	return ip_set_type_register(&bitmap_port_type);
+}
+
+static void __exit bitmap_port_fini(void)
+{
+	ip_set_type_unregister(&bitmap_port_type);
+}
+
+module_init(bitmap_port_init);
+module_exit(bitmap_port_fini);
@@ -0,0 +1,1438 @@
+/*
+ * IP set core: set type registry, the nfnetlink interface and the
+ * packet path API used by the set match and target.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <net/netlink.h>
+
+static LIST_HEAD(ip_set_type_list);	/* all registered set types */
+
+/* Protects the set type list, the set array and the set references */
+static DEFINE_MUTEX(ip_set_mutex);
+
+static struct ip_set **ip_set_list;	/* all individual sets */
+static ip_set_id_t ip_set_max = CONFIG_IP_SET_MAX; /* max number of sets */
+
+module_param_named(max_sets, ip_set_max, ushort, 0400);
+MODULE_PARM_DESC(max_sets, "maximal number of sets");
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("core IP set support");
+MODULE_ALIAS_NFNL_SUBSYS(NFNL_SUBSYS_IPSET);
+
+/*
+ * The set types are implemented in modules and registered set types
+ * can be found in ip_set_type_list.  Adding/deleting types is
+ * serialized by ip_set_mutex.
+ */
+
+static struct ip_set_type *
+find_set_type(const char *name, u8 family, u8 revision)
+{
+	struct ip_set_type *type;
+
+	list_for_each_entry(type, &ip_set_type_list, list)
+		if (strncmp(type->name, name, IPSET_MAXNAMELEN) == 0 &&
+		    type->family == family && type->revision == revision)
+			return type;
+	return NULL;
+}
+
+/* Find a set type and take a reference on its module, loading it if
+ * needed.  Called without ip_set_mutex. */
+static int
+find_set_type_get(const char *name, u8 family, u8 revision,
+		  const struct ip_set_type **found)
+{
+	struct ip_set_type *type;
+	bool retried = false;
+
+retry:
+	mutex_lock(&ip_set_mutex);
+	type = find_set_type(name, family, revision);
+	if (type != NULL && !try_module_get(type->me))
+		type = NULL;
+	mutex_unlock(&ip_set_mutex);
+
+	if (type == NULL) {
+		if (retried)
+			return -ENOENT;
+		request_module("ip_set_%s", name);
+		retried = true;
+		goto retry;
+	}
+	*found = type;
+	return 0;
+}
+
+int ip_set_type_register(struct ip_set_type *type)
+{
+	int ret = 0;
+
+	mutex_lock(&ip_set_mutex);
+	if (find_set_type(type->name, type->family, type->revision)) {
+		pr_warning("ip_set: type %s, family %u, revision %u "
+			   "already registered!\n",
+			   type->name, type->family, type->revision);
+		ret = -EINVAL;
+		goto unlock;
+	}
+	list_add(&type->list, &ip_set_type_list);
+unlock:
+	mutex_unlock(&ip_set_mutex);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ip_set_type_register);
+
+void ip_set_type_unregister(struct ip_set_type *type)
+{
+	mutex_lock(&ip_set_mutex);
+	list_del(&type->list);
+	mutex_unlock(&ip_set_mutex);
+}
+EXPORT_SYMBOL_GPL(ip_set_type_unregister);
+
+/* Utility functions */
+
+void *ip_set_alloc(size_t size)
+{
+	void *members = NULL;
+
+	if (size < KMALLOC_MAX_SIZE)
+		members = kzalloc(size, GFP_KERNEL | __GFP_NOWARN);
+
+	if (members == NULL) {
+		members = vmalloc(size);
+		if (members != NULL)
+			memset(members, 0, size);
+	}
+	return members;
+}
+EXPORT_SYMBOL_GPL(ip_set_alloc);
+
+void ip_set_free(void *members)
+{
+	if (is_vmalloc_addr(members))
+		vfree(members);
+	else
+		kfree(members);
+}
+EXPORT_SYMBOL_GPL(ip_set_free);
+
+/* Port and protocol of the packet; later fragments have no ports */
+int ip_set_get_ip4_port(const struct sk_buff *skb, bool src,
+			__be16 *port, u8 *proto)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	__be16 _ports[2];
+	const __be16 *ports;
+
+	if (iph->frag_off & htons(IP_OFFSET))
+		return -EINVAL;
+
+	switch (iph->protocol) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	ports = skb_header_pointer(skb, skb_network_offset(skb) +
+				   ip_hdrlen(skb), sizeof(_ports), _ports);
+	if (ports == NULL)
+		return -EINVAL;
+
+	*port = src ? ports[0] : ports[1];
+	*proto = iph->protocol;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_get_ip4_port);
+
+/* Element timeout of an add command: the set default unless given */
+int ip_set_get_timeout(const struct ip_set *set, struct nlattr *tb[],
+		       unsigned long *timeout)
+{
+	u32 seconds = set->timeout;
+
+	if (tb[IPSET_ATTR_TIMEOUT]) {
+		if (!set->timeout)
+			return -EINVAL;
+		seconds = nla_get_u32(tb[IPSET_ATTR_TIMEOUT]);
+		if (seconds > IPSET_MAX_TIMEOUT)
+			return -ERANGE;
+	}
+	*timeout = ip_set_timeout_set(seconds);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_get_timeout);
+
+/* Counters common to every set type, inside IPSET_ATTR_DATA */
+int ip_set_put_head(struct ip_set *set, struct sk_buff *skb,
+		    u32 elements, u32 memsize)
+{
+	if (set->timeout)
+		NLA_PUT_U32(skb, IPSET_ATTR_TIMEOUT, set->timeout);
+	NLA_PUT_U32(skb, IPSET_ATTR_ELEMENTS, elements);
+	/* the dump in progress holds one reference */
+	NLA_PUT_U32(skb, IPSET_ATTR_REFERENCES, set->ref - 1);
+	NLA_PUT_U32(skb, IPSET_ATTR_MEMSIZE, memsize);
+	return 0;
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+EXPORT_SYMBOL_GPL(ip_set_put_head);
+
+/*
+ * Generic hash of fixed size keys.  Elements hang off hlist buckets;
+ * the table doubles from process context when the load factor would
+ * exceed one, adds from the packet path never resize.
+ */
+
+static inline u32 ip_set_hash_bucket(const struct ip_set_hash *h,
+				     const void *key, u32 hsize)
+{
+	return jhash2(key, h->keylen / sizeof(u32), h->initval) & (hsize - 1);
+}
+
+static inline u8 ip_set_hash_cidr(const struct ip_set_hash *h,
+				  const struct ip_set_hash_elem *e)
+{
+	return ((const u8 *)e->key)[h->cidr_off];
+}
+
+static struct hlist_head *ip_set_hash_alloc_table(u32 hsize)
+{
+	struct hlist_head *table;
+	u32 i;
+
+	table = ip_set_alloc(hsize * sizeof(struct hlist_head));
+	if (table == NULL)
+		return NULL;
+	for (i = 0; i < hsize; i++)
+		INIT_HLIST_HEAD(&table[i]);
+	return table;
+}
+
+int ip_set_hash_init(struct ip_set_hash *h, u32 keylen, int cidr_off,
+		     u32 hashsize, u32 maxelem)
+{
+	if (hashsize < IPSET_MINIMAL_HASHSIZE)
+		hashsize = IPSET_MINIMAL_HASHSIZE;
+	if (hashsize > (1U << 30))
+		return -ERANGE;
+	hashsize = roundup_pow_of_two(hashsize);
+
+	memset(h, 0, sizeof(*h));
+	h->table = ip_set_hash_alloc_table(hashsize);
+	if (h->table == NULL)
+		return -ENOMEM;
+	h->hsize = hashsize;
+	h->maxelem = maxelem;
+	h->keylen = keylen;
+	h->cidr_off = cidr_off;
+	get_random_bytes(&h->initval, sizeof(h->initval));
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_init);
+
+static void ip_set_hash_free_elem(struct ip_set_hash *h,
+				  struct ip_set_hash_elem *e)
+{
+	hlist_del(&e->node);
+	if (h->cidr_off >= 0)
+		h->nets[ip_set_hash_cidr(h, e)]--;
+	h->elements--;
+	kfree(e);
+}
+
+void ip_set_hash_flush(struct ip_set_hash *h)
+{
+	struct ip_set_hash_elem *e;
+	struct hlist_node *n, *tmp;
+	u32 i;
+
+	for (i = 0; i < h->hsize; i++)
+		hlist_for_each_entry_safe(e, n, tmp, &h->table[i], node)
+			ip_set_hash_free_elem(h, e);
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_flush);
+
+void ip_set_hash_destroy(struct ip_set_hash *h)
+{
+	ip_set_hash_flush(h);
+	ip_set_free(h->table);
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_destroy);
+
+void ip_set_hash_gc(struct ip_set_hash *h)
+{
+	struct ip_set_hash_elem *e;
+	struct hlist_node *n, *tmp;
+	u32 i;
+
+	for (i = 0; i < h->hsize; i++)
+		hlist_for_each_entry_safe(e, n, tmp, &h->table[i], node)
+			if (ip_set_timeout_expired(e->timeout))
+				ip_set_hash_free_elem(h, e);
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_gc);
+
+/* Double the table.  The rehash runs with the set write locked, the
+ * allocation outside of it. */
+int ip_set_hash_resize(struct ip_set *set, struct ip_set_hash *h)
+{
+	struct hlist_head *table, *old;
+	struct ip_set_hash_elem *e;
+	struct hlist_node *n, *tmp;
+	u32 hsize, i;
+
+	read_lock_bh(&set->lock);
+	hsize = h->hsize;
+	read_unlock_bh(&set->lock);
+
+	if (hsize >= (1U << 30))
+		return -ERANGE;
+	table = ip_set_hash_alloc_table(hsize * 2);
+	if (table == NULL)
+		return -ENOMEM;
+
+	write_lock_bh(&set->lock);
+	if (h->hsize != hsize) {
+		/* somebody else was faster */
+		write_unlock_bh(&set->lock);
+		ip_set_free(table);
+		return 0;
+	}
+	for (i = 0; i < hsize; i++) {
+		hlist_for_each_entry_safe(e, n, tmp, &h->table[i], node) {
+			hlist_del(&e->node);
+			hlist_add_head(&e->node,
+				&table[ip_set_hash_bucket(h, e->key, hsize * 2)]);
+		}
+	}
+	old = h->table;
+	h->table = table;
+	h->hsize = hsize * 2;
+	write_unlock_bh(&set->lock);
+
+	ip_set_free(old);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_resize);
+
+static struct ip_set_hash_elem *
+__ip_set_hash_find(const struct ip_set_hash *h, const void *key)
+{
+	struct ip_set_hash_elem *e;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(e, n,
+			     &h->table[ip_set_hash_bucket(h, key, h->hsize)],
+			     node)
+		if (memcmp(e->key, key, h->keylen) == 0)
+			return e;
+	return NULL;
+}
+
+struct ip_set_hash_elem *
+ip_set_hash_lookup(const struct ip_set_hash *h, const void *key)
+{
+	struct ip_set_hash_elem *e = __ip_set_hash_find(h, key);
+
+	if (e == NULL || ip_set_timeout_expired(e->timeout))
+		return NULL;
+	return e;
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_lookup);
+
+int ip_set_hash_add(struct ip_set_hash *h, const void *key,
+		    unsigned long timeout, bool exist,
+		    bool may_resize, gfp_t gfp)
+{
+	struct ip_set_hash_elem *e;
+
+	e = __ip_set_hash_find(h, key);
+	if (e != NULL) {
+		if (!ip_set_timeout_expired(e->timeout) && !exist)
+			return -EEXIST;
+		e->timeout = timeout;
+		return 0;
+	}
+
+	if (h->elements >= h->maxelem)
+		return -ENOSPC;
+	if (may_resize && h->elements >= h->hsize)
+		return -EAGAIN;
+
+	e = kmalloc(sizeof(*e) + h->keylen, gfp);
+	if (e == NULL)
+		return -ENOMEM;
+	memcpy(e->key, key, h->keylen);
+	e->timeout = timeout;
+	hlist_add_head(&e->node,
+		       &h->table[ip_set_hash_bucket(h, key, h->hsize)]);
+	if (h->cidr_off >= 0)
+		h->nets[ip_set_hash_cidr(h, e)]++;
+	h->elements++;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_add);
+
+int ip_set_hash_del(struct ip_set_hash *h, const void *key)
+{
+	struct ip_set_hash_elem *e;
+
+	e = __ip_set_hash_find(h, key);
+	if (e == NULL)
+		return -ENOENT;
+	if (ip_set_timeout_expired(e->timeout)) {
+		ip_set_hash_free_elem(h, e);
+		return -ENOENT;
+	}
+	ip_set_hash_free_elem(h, e);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_del);
+
+int ip_set_hash_head(struct ip_set *set, const struct ip_set_hash *h,
+		     struct sk_buff *skb)
+{
+	u32 memsize = sizeof(*h) + h->hsize * sizeof(struct hlist_head) +
+		      h->elements * (sizeof(struct ip_set_hash_elem) +
+				     h->keylen);
+
+	NLA_PUT_U32(skb, IPSET_ATTR_HASHSIZE, h->hsize);
+	NLA_PUT_U32(skb, IPSET_ATTR_MAXELEM, h->maxelem);
+	return ip_set_put_head(set, skb, h->elements, memsize);
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_head);
+
+/* Dump the elements bucket by bucket, cb->args[2] is the next bucket
+ * and cb->args[4] the number of its entries already passed, so that a
+ * bucket which does not fit is continued in the next message. */
+int ip_set_hash_list(struct ip_set *set, const struct ip_set_hash *h,
+		     struct sk_buff *skb, struct netlink_callback *cb,
+		     int (*put)(struct sk_buff *skb, const void *key))
+{
+	struct nlattr *atd, *nested, *elem = NULL;
+	struct ip_set_hash_elem *e;
+	struct hlist_node *n;
+	long i;
+
+	atd = nla_nest_start(skb, IPSET_ATTR_ADT);
+	if (atd == NULL)
+		return -EMSGSIZE;
+
+	for (; cb->args[2] < h->hsize; cb->args[2]++, cb->args[4] = 0) {
+		i = 0;
+		hlist_for_each_entry(e, n, &h->table[cb->args[2]], node) {
+			if (i++ < cb->args[4])
+				continue;
+			if (ip_set_timeout_expired(e->timeout))
+				continue;
+			elem = (struct nlattr *)skb_tail_pointer(skb);
+			nested = nla_nest_start(skb, IPSET_ATTR_DATA);
+			if (nested == NULL)
+				goto nla_put_failure;
+			if (put(skb, e->key) < 0)
+				goto nla_put_failure;
+			if (set->timeout)
+				NLA_PUT_U32(skb, IPSET_ATTR_TIMEOUT,
+					    ip_set_timeout_get(e->timeout));
+			nla_nest_end(skb, nested);
+			cb->args[4] = i;
+		}
+	}
+	nla_nest_end(skb, atd);
+	return 0;
+
+nla_put_failure:
+	nla_nest_cancel(skb, elem);
+	nla_nest_end(skb, atd);
+	return -EMSGSIZE;
+}
+EXPORT_SYMBOL_GPL(ip_set_hash_list);
+
+/*
+ * Generic bitmap of at most 64k ids.  Sets with timeouts keep an
+ * absolute expiry per id next to the membership bits.
+ */
+
+int ip_set_bitmap_init(struct ip_set_bitmap *b, u32 size, bool timeouts)
+{
+	memset(b, 0, sizeof(*b));
+	b->members = ip_set_alloc(BITS_TO_LONGS(size) * sizeof(unsigned long));
+	if (b->members == NULL)
+		return -ENOMEM;
+	if (timeouts) {
+		b->timeouts = ip_set_alloc(size * sizeof(unsigned long));
+		if (b->timeouts == NULL) {
+			ip_set_free(b->members);
+			return -ENOMEM;
+		}
+	}
+	b->size = size;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_init);
+
+void ip_set_bitmap_destroy(struct ip_set_bitmap *b)
+{
+	ip_set_free(b->members);
+	if (b->timeouts)
+		ip_set_free(b->timeouts);
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_destroy);
+
+void ip_set_bitmap_flush(struct ip_set_bitmap *b)
+{
+	memset(b->members, 0, BITS_TO_LONGS(b->size) * sizeof(unsigned long));
+	b->elements = 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_flush);
+
+static inline bool ip_set_bitmap_expired(const struct ip_set_bitmap *b,
+					 u32 id)
+{
+	return b->timeouts && ip_set_timeout_expired(b->timeouts[id]);
+}
+
+void ip_set_bitmap_gc(struct ip_set_bitmap *b)
+{
+	u32 id;
+
+	for (id = find_first_bit(b->members, b->size); id < b->size;
+	     id = find_next_bit(b->members, b->size, id + 1)) {
+		if (ip_set_bitmap_expired(b, id)) {
+			clear_bit(id, b->members);
+			b->elements--;
+		}
+	}
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_gc);
+
+bool ip_set_bitmap_test(const struct ip_set_bitmap *b, u32 id)
+{
+	return test_bit(id, b->members) && !ip_set_bitmap_expired(b, id);
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_test);
+
+int ip_set_bitmap_add(struct ip_set_bitmap *b, u32 id,
+		      unsigned long timeout, bool exist)
+{
+	if (test_bit(id, b->members)) {
+		if (!ip_set_bitmap_expired(b, id) && !exist)
+			return -EEXIST;
+	} else {
+		set_bit(id, b->members);
+		b->elements++;
+	}
+	if (b->timeouts)
+		b->timeouts[id] = timeout;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_add);
+
+int ip_set_bitmap_del(struct ip_set_bitmap *b, u32 id)
+{
+	bool expired = ip_set_bitmap_expired(b, id);
+
+	if (!test_and_clear_bit(id, b->members))
+		return -ENOENT;
+	b->elements--;
+	return expired ? -ENOENT : 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_del);
+
+u32 ip_set_bitmap_memsize(const struct ip_set_bitmap *b)
+{
+	u32 memsize = BITS_TO_LONGS(b->size) * sizeof(unsigned long);
+
+	if (b->timeouts)
+		memsize += b->size * sizeof(unsigned long);
+	return memsize;
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_memsize);
+
+/* Dump the members, cb->args[2] is the next id */
+int ip_set_bitmap_list(struct ip_set *set, const struct ip_set_bitmap *b,
+		       struct sk_buff *skb, struct netlink_callback *cb,
+		       int (*put)(struct ip_set *set, struct sk_buff *skb,
+				  u32 id))
+{
+	struct nlattr *atd, *nested;
+	u32 id;
+
+	atd = nla_nest_start(skb, IPSET_ATTR_ADT);
+	if (atd == NULL)
+		return -EMSGSIZE;
+
+	for (; cb->args[2] < b->size; cb->args[2]++) {
+		id = cb->args[2];
+		if (!ip_set_bitmap_test(b, id))
+			continue;
+		nested = nla_nest_start(skb, IPSET_ATTR_DATA);
+		if (nested == NULL)
+			goto out;
+		if (put(set, skb, id) < 0)
+			goto nla_put_failure;
+		if (b->timeouts)
+			NLA_PUT_U32(skb, IPSET_ATTR_TIMEOUT,
+				    ip_set_timeout_get(b->timeouts[id]));
+		nla_nest_end(skb, nested);
+	}
+	nla_nest_end(skb, atd);
+	return 0;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nested);
+out:
+	nla_nest_end(skb, atd);
+	return -EMSGSIZE;
+}
+EXPORT_SYMBOL_GPL(ip_set_bitmap_list);
+
+/*
+ * Packet path API.  The set array is read under RCU (netfilter hooks
+ * run in rcu_read_lock sections); a referenced set is never destroyed
+ * and destroy waits for a grace period before freeing.
+ */
+
+static inline struct ip_set *ip_set_rcu_get(ip_set_id_t index)
+{
+	if (index >= ip_set_max)
+		return NULL;
+	return rcu_dereference(ip_set_list[index]);
+}
+
+int ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
+		u8 family, u8 dim, u8 flags)
+{
+	struct ip_set *set = ip_set_rcu_get(index);
+	int ret;
+
+	if (set == NULL || dim < set->type->dimension ||
+	    family != set->family)
+		return 0;
+
+	read_lock_bh(&set->lock);
+	ret = set->variant->kadt(set, skb, IPSET_TEST, dim, flags);
+	read_unlock_bh(&set->lock);
+
+	return ret > 0;
+}
+EXPORT_SYMBOL_GPL(ip_set_test);
+
+static int ip_set_kadt(ip_set_id_t index, const struct sk_buff *skb,
+		       enum ipset_adt adt, u8 family, u8 dim, u8 flags)
+{
+	struct ip_set *set = ip_set_rcu_get(index);
+	int ret;
+
+	if (set == NULL || dim < set->type->dimension ||
+	    family != set->family)
+		return -EINVAL;
+
+	write_lock_bh(&set->lock);
+	ret = set->variant->kadt(set, skb, adt, dim, flags);
+	write_unlock_bh(&set->lock);
+
+	return ret;
+}
+
+int ip_set_add(ip_set_id_t index, const struct sk_buff *skb,
+	       u8 family, u8 dim, u8 flags)
+{
+	return ip_set_kadt(index, skb, IPSET_ADD, family, dim, flags);
+}
+EXPORT_SYMBOL_GPL(ip_set_add);
+
+int ip_set_del(ip_set_id_t index, const struct sk_buff *skb,
+	       u8 family, u8 dim, u8 flags)
+{
+	return ip_set_kadt(index, skb, IPSET_DEL, family, dim, flags);
+}
+EXPORT_SYMBOL_GPL(ip_set_del);
+
+/* Find a set by name, ip_set_mutex held */
+static ip_set_id_t find_set_id(const char *name)
+{
+	ip_set_id_t i;
+
+	for (i = 0; i < ip_set_max; i++)
+		if (ip_set_list[i] != NULL &&
+		    strncmp(ip_set_list[i]->name, name, IPSET_MAXNAMELEN) == 0)
+			return i;
+	return IPSET_INVALID_ID;
+}
+
+/* Find a set by name and take a reference on it.  The match and target
+ * keep the index: swapping two sets moves the references with the
+ * names, so rules always follow the name they were created with. */
+ip_set_id_t ip_set_get_byname(const char *name)
+{
+	ip_set_id_t index;
+
+	mutex_lock(&ip_set_mutex);
+	index = find_set_id(name);
+	if (index != IPSET_INVALID_ID)
+		ip_set_list[index]->ref++;
+	mutex_unlock(&ip_set_mutex);
+
+	return index;
+}
+EXPORT_SYMBOL_GPL(ip_set_get_byname);
+
+void ip_set_put_byindex(ip_set_id_t index)
+{
+	mutex_lock(&ip_set_mutex);
+	if (index < ip_set_max && ip_set_list[index] != NULL) {
+		BUG_ON(ip_set_list[index]->ref == 0);
+		ip_set_list[index]->ref--;
+	}
+	mutex_unlock(&ip_set_mutex);
+}
+EXPORT_SYMBOL_GPL(ip_set_put_byindex);
+
+/* Garbage collection of sets with timeouts */
+static void ip_set_gc(unsigned long ul_set)
+{
+	struct ip_set *set = (struct ip_set *)ul_set;
+
+	write_lock_bh(&set->lock);
+	set->variant->gc(set);
+	write_unlock_bh(&set->lock);
+
+	mod_timer(&set->gc, jiffies + IPSET_GC_PERIOD(set->timeout) * HZ);
+}
+
+static void ip_set_destroy_set(struct ip_set *set)
+{
+	if (set->timeout)
+		del_timer_sync(&set->gc);
+	set->variant->destroy(set);
+	module_put(set->type->me);
+	kfree(set);
+}
+
+/*
+ * Communication protocol with userspace over netlink.
+ *
+ * Every command is serialized by the nfnetlink mutex, set lookups and
+ * reference changes in addition by ip_set_mutex since the match/target
+ * and the dumps run outside of it.
+ */
+
+static const struct nla_policy ip_set_policy[IPSET_ATTR_CMD_MAX + 1] = {
+	[IPSET_ATTR_PROTOCOL]	= { .type = NLA_U8 },
+	[IPSET_ATTR_SETNAME]	= { .type = NLA_NUL_STRING,
+				    .len = IPSET_MAXNAMELEN - 1 },
+	[IPSET_ATTR_TYPENAME]	= { .type = NLA_NUL_STRING,
+				    .len = IPSET_MAXNAMELEN - 1 },
+	[IPSET_ATTR_REVISION]	= { .type = NLA_U8 },
+	[IPSET_ATTR_FAMILY]	= { .type = NLA_U8 },
+	[IPSET_ATTR_FLAGS]	= { .type = NLA_U32 },
+	[IPSET_ATTR_DATA]	= { .type = NLA_NESTED },
+};
+
+static inline bool protocol_failed(const struct nlattr * const tb[])
+{
+	return tb[IPSET_ATTR_PROTOCOL] == NULL ||
+	       nla_get_u8(tb[IPSET_ATTR_PROTOCOL]) != IPSET_PROTOCOL;
+}
+
+static struct nlmsghdr *
+start_msg(struct sk_buff *skb, u32 pid, u32 seq, unsigned int flags,
+	  enum ipset_cmd cmd)
+{
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfmsg;
+
+	nlh = nlmsg_put(skb, pid, seq, cmd | (NFNL_SUBSYS_IPSET << 8),
+			sizeof(*nfmsg), flags);
+	if (nlh == NULL)
+		return NULL;
+
+	nfmsg = nlmsg_data(nlh);
+	nfmsg->nfgen_family = AF_INET;
+	nfmsg->version = NFNETLINK_V0;
+	nfmsg->res_id = 0;
+
+	return nlh;
+}
+
+static int
+ip_set_none(struct sock *ctnl, struct sk_buff *skb,
+	    const struct nlmsghdr *nlh,
+	    const struct nlattr * const attr[])
+{
+	return -EOPNOTSUPP;
+}
+
+static int
+ip_set_create(struct sock *ctnl, struct sk_buff *skb,
+	      const struct nlmsghdr *nlh,
+	      const struct nlattr * const attr[])
+{
+	struct nlattr *tb[IPSET_ATTR_CADT_MAX + 1] = {};
+	struct ip_set *set;
+	ip_set_id_t i, index = IPSET_INVALID_ID;
+	const char *name, *typename;
+	u8 family, revision = 0;
+	int ret;
+
+	if (protocol_failed(attr) ||
+	    attr[IPSET_ATTR_SETNAME] == NULL ||
+	    attr[IPSET_ATTR_TYPENAME] == NULL ||
+	    attr[IPSET_ATTR_FAMILY] == NULL)
+		return -EPROTO;
+
+	name = nla_data(attr[IPSET_ATTR_SETNAME]);
+	typename = nla_data(attr[IPSET_ATTR_TYPENAME]);
+	family = nla_get_u8(attr[IPSET_ATTR_FAMILY]);
+	if (attr[IPSET_ATTR_REVISION])
+		revision = nla_get_u8(attr[IPSET_ATTR_REVISION]);
+
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	if (set == NULL)
+		return -ENOMEM;
+	rwlock_init(&set->lock);
+	strlcpy(set->name, name, IPSET_MAXNAMELEN);
+	set->family = family;
+
+	ret = find_set_type_get(typename, family, revision, &set->type);
+	if (ret < 0)
+		goto out;
+
+	if (attr[IPSET_ATTR_DATA] &&
+	    nla_parse_nested(tb, IPSET_ATTR_CADT_MAX, attr[IPSET_ATTR_DATA],
+			     set->type->create_policy)) {
+		ret = -EPROTO;
+		goto put_out;
+	}
+	if (tb[IPSET_ATTR_TIMEOUT] &&
+	    nla_get_u32(tb[IPSET_ATTR_TIMEOUT]) > IPSET_MAX_TIMEOUT) {
+		ret = -ERANGE;
+		goto put_out;
+	}
+
+	ret = set->type->create(set, tb);
+	if (ret != 0)
+		goto put_out;
+
+	mutex_lock(&ip_set_mutex);
+	if (find_set_id(set->name) != IPSET_INVALID_ID) {
+		ret = -EEXIST;
+		goto cleanup;
+	}
+	for (i = 0; i < ip_set_max; i++) {
+		if (ip_set_list[i] == NULL) {
+			index = i;
+			break;
+		}
+	}
+	if (index == IPSET_INVALID_ID) {
+		ret = -ENOSPC;
+		goto cleanup;
+	}
+
+	if (set->timeout) {
+		setup_timer(&set->gc, ip_set_gc, (unsigned long)set);
+		mod_timer(&set->gc,
+			  jiffies + IPSET_GC_PERIOD(set->timeout) * HZ);
+	}
+	rcu_assign_pointer(ip_set_list[index], set);
+	mutex_unlock(&ip_set_mutex);
+	return 0;
+
+cleanup:
+	mutex_unlock(&ip_set_mutex);
+	set->variant->destroy(set);
+put_out:
+	module_put(set->type->me);
+out:
+	kfree(set);
+	return ret;
+}
+
+static int
+ip_set_destroy(struct sock *ctnl, struct sk_buff *skb,
+	       const struct nlmsghdr *nlh,
+	       const struct nlattr * const attr[])
+{
+	struct ip_set *set;
+	ip_set_id_t i, index;
+
+	if (protocol_failed(attr))
+		return -EPROTO;
+
+	mutex_lock(&ip_set_mutex);
+	if (attr[IPSET_ATTR_SETNAME] == NULL) {
+		/* all sets, if none of them is in use */
+		for (i = 0; i < ip_set_max; i++) {
+			if (ip_set_list[i] != NULL && ip_set_list[i]->ref) {
+				mutex_unlock(&ip_set_mutex);
+				return -EBUSY;
+			}
+		}
+		for (i = 0; i < ip_set_max; i++) {
+			set = ip_set_list[i];
+			if (set == NULL)
+				continue;
+			rcu_assign_pointer(ip_set_list[i], NULL);
+			mutex_unlock(&ip_set_mutex);
+			synchronize_net();
+			ip_set_destroy_set(set);
+			mutex_lock(&ip_set_mutex);
+		}
+		mutex_unlock(&ip_set_mutex);
+		return 0;
+	}
+
+	index = find_set_id(nla_data(attr[IPSET_ATTR_SETNAME]));
+	if (index == IPSET_INVALID_ID) {
+		mutex_unlock(&ip_set_mutex);
+		return -ENOENT;
+	}
+	set = ip_set_list[index];
+	if (set->ref) {
+		mutex_unlock(&ip_set_mutex);
+		return -EBUSY;
+	}
+	rcu_assign_pointer(ip_set_list[index], NULL);
+	mutex_unlock(&ip_set_mutex);
+
+	synchronize_net();
+	ip_set_destroy_set(set);
+	return 0;
+}
+
+static void ip_set_flush_set(struct ip_set *set)
+{
+	write_lock_bh(&set->lock);
+	set->variant->flush(set);
+	write_unlock_bh(&set->lock);
+}
+
+static int
+ip_set_flush(struct sock *ctnl, struct sk_buff *skb,
+	     const struct nlmsghdr *nlh,
+	     const struct nlattr * const attr[])
+{
+	ip_set_id_t i;
+	int ret = 0;
+
+	if (protocol_failed(attr))
+		return -EPROTO;
+
+	mutex_lock(&ip_set_mutex);
+	if (attr[IPSET_ATTR_SETNAME] == NULL) {
+		for (i = 0; i < ip_set_max; i++)
+			if (ip_set_list[i] != NULL)
+				ip_set_flush_set(ip_set_list[i]);
+	} else {
+		i = find_set_id(nla_data(attr[IPSET_ATTR_SETNAME]));
+		if (i == IPSET_INVALID_ID)
+			ret = -ENOENT;
+		else
+			ip_set_flush_set(ip_set_list[i]);
+	}
+	mutex_unlock(&ip_set_mutex);
+	return ret;
+}
+
+static int
+ip_set_rename(struct sock *ctnl, struct sk_buff *skb,
+	      const struct nlmsghdr *nlh,
+	      const struct nlattr * const attr[])
+{
+	const char *name2;
+	ip_set_id_t index;
+	int ret = 0;
+
+	if (protocol_failed(attr) ||
+	    attr[IPSET_ATTR_SETNAME] == NULL ||
+	    attr[IPSET_ATTR_SETNAME2] == NULL)
+		return -EPROTO;
+
+	name2 = nla_data(attr[IPSET_ATTR_SETNAME2]);
+
+	mutex_lock(&ip_set_mutex);
+	index = find_set_id(nla_data(attr[IPSET_ATTR_SETNAME]));
+	if (index == IPSET_INVALID_ID) {
+		ret = -ENOENT;
+		goto out;
+	}
+	/* rules refer to the set by its name */
+	if (ip_set_list[index]->ref) {
+		ret = -EBUSY;
+		goto out;
+	}
+	if (find_set_id(name2) != IPSET_INVALID_ID) {
+		ret = -EEXIST;
+		goto out;
+	}
+	strlcpy(ip_set_list[index]->name, name2, IPSET_MAXNAMELEN);
+out:
+	mutex_unlock(&ip_set_mutex);
+	return ret;
+}
+
+/* Swap two sets so that one can be filled in the background and then
+ * put in service atomically.  The names and references stay with the
+ * slots, i.e. with the rules using them; only the contents move. */
+static int
+ip_set_swap(struct sock *ctnl, struct sk_buff *skb,
+	    const struct nlmsghdr *nlh,
+	    const struct nlattr * const attr[])
+{
+	char from_name[IPSET_MAXNAMELEN];
+	struct ip_set *from, *to;
+	ip_set_id_t from_id, to_id;
+	u32 from_ref;
+	int ret = 0;
+
+	if (protocol_failed(attr) ||
+	    attr[IPSET_ATTR_SETNAME] == NULL ||
+	    attr[IPSET_ATTR_SETNAME2] == NULL)
+		return -EPROTO;
+
+	mutex_lock(&ip_set_mutex);
+	from_id = find_set_id(nla_data(attr[IPSET_ATTR_SETNAME]));
+	to_id = find_set_id(nla_data(attr[IPSET_ATTR_SETNAME2]));
+	if (from_id == IPSET_INVALID_ID || to_id == IPSET_INVALID_ID) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	from = ip_set_list[from_id];
+	to = ip_set_list[to_id];
+	/* the match/target only know the dimension and family */
+	if (strcmp(from->type->name, to->type->name) != 0 ||
+	    from->family != to->family) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	strlcpy(from_name, from->name, IPSET_MAXNAMELEN);
+	strlcpy(from->name, to->name, IPSET_MAXNAMELEN);
+	strlcpy(to->name, from_name, IPSET_MAXNAMELEN);
+	from_ref = from->ref;
+	from->ref = to->ref;
+	to->ref = from_ref;
+
+	rcu_assign_pointer(ip_set_list[from_id], to);
+	rcu_assign_pointer(ip_set_list[to_id], from);
+out:
+	mutex_unlock(&ip_set_mutex);
+	return ret;
+}
+
+/* List/save set data: one message per set and per filled skb.
+ *
+ * cb->args[0]: DUMP_ALL or DUMP_ONE
+ * cb->args[1]: index of the set being dumped
+ * cb->args[2]: set type cursor
+ * cb->args[3]: set referenced and its header sent
+ * cb->args[4]: set type cursor within cb->args[2]
+ */
+enum {
+	DUMP_INIT = 0,
+	DUMP_ALL,
+	DUMP_ONE,
+};
+
+static int ip_set_dump_done(struct netlink_callback *cb)
+{
+	if (cb->args[3])
+		ip_set_put_byindex(cb->args[1]);
+	return 0;
+}
+
+static int dump_init(struct netlink_callback *cb)
+{
+	struct nlattr *cda[IPSET_ATTR_CMD_MAX + 1];
+	ip_set_id_t index;
+	int ret;
+
+	ret = nlmsg_parse(cb->nlh, sizeof(struct nfgenmsg), cda,
+			  IPSET_ATTR_CMD_MAX, ip_set_policy);
+	if (ret < 0)
+		return ret;
+
+	cb->args[0] = DUMP_ALL;
+	cb->args[1] = 0;
+	if (cda[IPSET_ATTR_SETNAME] == NULL)
+		return 0;
+
+	mutex_lock(&ip_set_mutex);
+	index = find_set_id(nla_data(cda[IPSET_ATTR_SETNAME]));
+	mutex_unlock(&ip_set_mutex);
+	if (index == IPSET_INVALID_ID)
+		return -ENOENT;
+
+	cb->args[0] = DUMP_ONE;
+	cb->args[1] = index;
+	return 0;
+}
+
+static int
+ip_set_dump_start(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	unsigned int flags = NETLINK_CB(cb->skb).pid ? NLM_F_MULTI : 0;
+	struct nlmsghdr *nlh;
+	struct ip_set *set = NULL;
+	struct nlattr *attr;
+	ip_set_id_t max;
+	int ret;
+
+	if (cb->args[0] == DUMP_INIT) {
+		ret = dump_init(cb);
+		if (ret < 0)
+			return ret;
+	}
+
+	max = cb->args[0] == DUMP_ONE ? cb->args[1] + 1 : ip_set_max;
+
+	mutex_lock(&ip_set_mutex);
+	for (; cb->args[1] < max; cb->args[1]++) {
+		set = ip_set_list[cb->args[1]];
+		if (set == NULL) {
+			if (cb->args[0] == DUMP_ONE) {
+				ret = -ENOENT;
+				goto out;
+			}
+			continue;
+		}
+		break;
+	}
+	if (cb->args[1] >= max) {
+		ret = 0;
+		goto out;
+	}
+
+	nlh = start_msg(skb, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
+			flags, IPSET_CMD_LIST);
+	if (nlh == NULL) {
+		ret = -EMSGSIZE;
+		goto release_refcount;
+	}
+	NLA_PUT_U8(skb, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+	NLA_PUT_STRING(skb, IPSET_ATTR_SETNAME, set->name);
+
+	if (!cb->args[3]) {
+		/* first message of this set: reference it, send header */
+		set->ref++;
+		cb->args[3] = 1;
+		cb->args[2] = 0;
+		cb->args[4] = 0;
+		NLA_PUT_STRING(skb, IPSET_ATTR_TYPENAME, set->type->name);
+		NLA_PUT_U8(skb, IPSET_ATTR_FAMILY, set->family);
+		NLA_PUT_U8(skb, IPSET_ATTR_REVISION, set->type->revision);
+		attr = nla_nest_start(skb, IPSET_ATTR_DATA);
+		if (attr == NULL)
+			goto nla_put_failure;
+		read_lock_bh(&set->lock);
+		ret = set->variant->head(set, skb);
+		read_unlock_bh(&set->lock);
+		if (ret < 0)
+			goto nla_put_failure;
+		nla_nest_end(skb, attr);
+	}
+
+	read_lock_bh(&set->lock);
+	ret = set->variant->list(set, skb, cb);
+	read_unlock_bh(&set->lock);
+	nlmsg_end(skb, nlh);
+
+	if (ret == -EMSGSIZE) {
+		/* continue with this set in the next message */
+		mutex_unlock(&ip_set_mutex);
+		return skb->len;
+	}
+
+	/* this set is done */
+	set->ref--;
+	cb->args[3] = 0;
+	if (cb->args[0] == DUMP_ONE)
+		cb->args[1] = max;
+	else
+		cb->args[1]++;
+	mutex_unlock(&ip_set_mutex);
+	return skb->len;
+
+nla_put_failure:
+	ret = -EMSGSIZE;
+	nlmsg_cancel(skb, nlh);
+release_refcount:
+	if (cb->args[3]) {
+		set->ref--;
+		cb->args[3] = 0;
+	}
+out:
+	mutex_unlock(&ip_set_mutex);
+	return ret < 0 ? ret : skb->len;
+}
+
+static int
+ip_set_dump(struct sock *ctnl, struct sk_buff *skb,
+	    const struct nlmsghdr *nlh,
+	    const struct nlattr * const attr[])
+{
+	if (protocol_failed(attr))
+		return -EPROTO;
+
+	return netlink_dump_start(ctnl, skb, nlh, ip_set_dump_start,
+				  ip_set_dump_done);
+}
+
+/* Add, del and test */
+
+static int
+ip_set_uadt(struct ip_set *set, struct nlattr *tb[], enum ipset_adt adt,
+	    u32 flags)
+{
+	bool retried = false;
+	int ret;
+
+	do {
+		write_lock_bh(&set->lock);
+		ret = set->variant->uadt(set, tb, adt, flags, retried);
+		write_unlock_bh(&set->lock);
+
+		if (ret != -EAGAIN || retried)
+			break;
+		/* a failed resize just means a longer chain */
+		set->variant->resize(set);
+		retried = true;
+	} while (1);
+
+	return ret;
+}
+
+static int
+ip_set_adt(const struct nlattr * const attr[], enum ipset_adt adt)
+{
+	struct nlattr *tb[IPSET_ATTR_CADT_MAX + 1] = {};
+	struct ip_set *set;
+	ip_set_id_t index;
+	u32 flags = 0;
+	int ret;
+
+	if (protocol_failed(attr) ||
+	    attr[IPSET_ATTR_SETNAME] == NULL ||
+	    attr[IPSET_ATTR_DATA] == NULL)
+		return -EPROTO;
+
+	if (attr[IPSET_ATTR_FLAGS])
+		flags = nla_get_u32(attr[IPSET_ATTR_FLAGS]);
+
+	mutex_lock(&ip_set_mutex);
+	index = find_set_id(nla_data(attr[IPSET_ATTR_SETNAME]));
+	if (index == IPSET_INVALID_ID) {
+		ret = -ENOENT;
+		goto out;
+	}
+	set = ip_set_list[index];
+
+	if (nla_parse_nested(tb, IPSET_ATTR_CADT_MAX, attr[IPSET_ATTR_DATA],
+			     set->type->adt_policy)) {
+		ret = -EPROTO;
+		goto out;
+	}
+	ret = ip_set_uadt(set, tb, adt, flags);
+out:
+	mutex_unlock(&ip_set_mutex);
+	return ret;
+}
+
+static int
+ip_set_uadd(struct sock *ctnl, struct sk_buff *skb,
+	    const struct nlmsghdr *nlh,
+	    const struct nlattr * const attr[])
+{
+	return ip_set_adt(attr, IPSET_ADD);
+}
+
+static int
+ip_set_udel(struct sock *ctnl, struct sk_buff *skb,
+	    const struct nlmsghdr *nlh,
+	    const struct nlattr * const attr[])
+{
+	return ip_set_adt(attr, IPSET_DEL);
+}
+
+/* 0 if the element is in the set, -ENOENT otherwise */
+static int
+ip_set_utest(struct sock *ctnl, struct sk_buff *skb,
+	     const struct nlmsghdr *nlh,
+	     const struct nlattr * const attr[])
+{
+	int ret = ip_set_adt(attr, IPSET_TEST);
+
+	if (ret > 0)
+		return 0;
+	return ret < 0 ? ret : -ENOENT;
+}
+
+static int
+ip_set_protocol(struct sock *ctnl, struct sk_buff *skb,
+		const struct nlmsghdr *nlh,
+		const struct nlattr * const attr[])
+{
+	struct sk_buff *skb2;
+	struct nlmsghdr *nlh2;
+	int ret;
+
+	if (attr[IPSET_ATTR_PROTOCOL] == NULL)
+		return -EPROTO;
+
+	skb2 = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (skb2 == NULL)
+		return -ENOMEM;
+
+	nlh2 = start_msg(skb2, NETLINK_CB(skb).pid, nlh->nlmsg_seq, 0,
+			 IPSET_CMD_PROTOCOL);
+	if (nlh2 == NULL)
+		goto nlmsg_failure;
+	NLA_PUT_U8(skb2, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+	nlmsg_end(skb2, nlh2);
+
+	ret = netlink_unicast(ctnl, skb2, NETLINK_CB(skb).pid, MSG_DONTWAIT);
+	if (ret < 0)
+		return ret;
+	return 0;
+
+nla_put_failure:
+	nlmsg_cancel(skb2, nlh2);
+nlmsg_failure:
+	kfree_skb(skb2);
+	return -EMSGSIZE;
+}
+
+static const struct nfnl_callback ip_set_netlink_subsys_cb[IPSET_MSG_MAX] = {
+	[IPSET_CMD_NONE]	= {
+		.call		= ip_set_none,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+	},
+	[IPSET_CMD_PROTOCOL]	= {
+		.call		= ip_set_protocol,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_CREATE]	= {
+		.call		= ip_set_create,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_DESTROY]	= {
+		.call		= ip_set_destroy,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_FLUSH]	= {
+		.call		= ip_set_flush,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_RENAME]	= {
+		.call		= ip_set_rename,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_SWAP]	= {
+		.call		= ip_set_swap,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_LIST]	= {
+		.call		= ip_set_dump,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_ADD]	= {
+		.call		= ip_set_uadd,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_DEL]	= {
+		.call		= ip_set_udel,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+	[IPSET_CMD_TEST]	= {
+		.call		= ip_set_utest,
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_policy,
+	},
+};
+
+static const struct nfnetlink_subsystem ip_set_netlink_subsys = {
+	.name		= "ip_set",
+	.subsys_id	= NFNL_SUBSYS_IPSET,
+	.cb_count	= IPSET_MSG_MAX,
+	.cb		= ip_set_netlink_subsys_cb,
+};
+
+static int __init ip_set_init(void)
+{
+	int ret;
+
+	if (ip_set_max == 0 || ip_set_max >= IPSET_INVALID_ID)
+		ip_set_max = IPSET_INVALID_ID - 1;
+
+	ip_set_list = kzalloc(sizeof(struct ip_set *) * ip_set_max,
+			      GFP_KERNEL);
+	if (ip_set_list == NULL)
+		return -ENOMEM;
+
+	ret = nfnetlink_subsys_register(&ip_set_netlink_subsys);
+	if (ret != 0) {
+		pr_err("ip_set: cannot register with nfnetlink.\n");
+		kfree(ip_set_list);
+		return ret;
+	}
+
+	pr_notice("ip_set: protocol %u\n", IPSET_PROTOCOL);
+	return 0;
+}
+
+static void __exit ip_set_fini(void)
+{
+	/* There can't be any existing set: the set type modules hold a
+	 * reference on us and sets hold one on their type module */
+	nfnetlink_subsys_unregister(&ip_set_netlink_subsys);
+	kfree(ip_set_list);
+}
+
+module_init(ip_set_init);
+module_exit(ip_set_fini);
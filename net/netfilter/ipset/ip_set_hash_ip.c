@@ -0,0 +1,224 @@
+/*
+ * hash:ip, a hash of IPv4 addresses.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <net/netlink.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("hash:ip type of IP sets");
+MODULE_ALIAS("ip_set_hash:ip");
+
+struct hash_ip {
+	struct ip_set_hash hash;
+	u8 netmask;		/* store addresses masked to this prefix */
+};
+
+static int
+hash_ip_kadt(struct ip_set *set, const struct sk_buff *skb,
+	     enum ipset_adt adt, u8 dim, u8 flags)
+{
+	struct hash_ip *h = set->data;
+	__be32 ip;
+
+	ip = ip_set_get_ip4(skb, flags & IPSET_DIM_ONE_SRC) &
+	     ip_set_netmask(h->netmask);
+
+	switch (adt) {
+	case IPSET_TEST:
+		return ip_set_hash_lookup(&h->hash, &ip) != NULL;
+	case IPSET_ADD:
+		return ip_set_hash_add(&h->hash, &ip,
+				       ip_set_timeout_set(set->timeout),
+				       true, false, GFP_ATOMIC);
+	case IPSET_DEL:
+		return ip_set_hash_del(&h->hash, &ip);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int
+hash_ip_uadt(struct ip_set *set, struct nlattr *tb[],
+	     enum ipset_adt adt, u32 flags, bool retried)
+{
+	struct hash_ip *h = set->data;
+	unsigned long timeout;
+	__be32 ip;
+	int ret;
+
+	if (tb[IPSET_ATTR_IP] == NULL)
+		return -EPROTO;
+	ip = nla_get_be32(tb[IPSET_ATTR_IP]) & ip_set_netmask(h->netmask);
+
+	switch (adt) {
+	case IPSET_TEST:
+		return ip_set_hash_lookup(&h->hash, &ip) != NULL;
+	case IPSET_ADD:
+		ret = ip_set_get_timeout(set, tb, &timeout);
+		if (ret < 0)
+			return ret;
+		return ip_set_hash_add(&h->hash, &ip, timeout,
+				       flags & IPSET_FLAG_EXIST, !retried,
+				       GFP_ATOMIC);
+	case IPSET_DEL:
+		return ip_set_hash_del(&h->hash, &ip);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hash_ip_resize(struct ip_set *set)
+{
+	struct hash_ip *h = set->data;
+
+	return ip_set_hash_resize(set, &h->hash);
+}
+
+static void hash_ip_gc(struct ip_set *set)
+{
+	struct hash_ip *h = set->data;
+
+	ip_set_hash_gc(&h->hash);
+}
+
+static void hash_ip_destroy(struct ip_set *set)
+{
+	struct hash_ip *h = set->data;
+
+	ip_set_hash_destroy(&h->hash);
+	kfree(h);
+}
+
+static void hash_ip_flush(struct ip_set *set)
+{
+	struct hash_ip *h = set->data;
+
+	ip_set_hash_flush(&h->hash);
+}
+
+static int hash_ip_head(struct ip_set *set, struct sk_buff *skb)
+{
+	struct hash_ip *h = set->data;
+
+	if (h->netmask != 32)
+		NLA_PUT_U8(skb, IPSET_ATTR_CIDR, h->netmask);
+	return ip_set_hash_head(set, &h->hash, skb);
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int hash_ip_put(struct sk_buff *skb, const void *key)
+{
+	NLA_PUT_BE32(skb, IPSET_ATTR_IP, *(const __be32 *)key);
+	return 0;
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int hash_ip_list(struct ip_set *set, struct sk_buff *skb,
+			struct netlink_callback *cb)
+{
+	struct hash_ip *h = set->data;
+
+	return ip_set_hash_list(set, &h->hash, skb, cb, hash_ip_put);
+}
+
+static const struct ip_set_type_variant hash_ip_variant = {
+	.kadt		= hash_ip_kadt,
+	.uadt		= hash_ip_uadt,
+	.resize		= hash_ip_resize,
+	.gc		= hash_ip_gc,
+	.destroy	= hash_ip_destroy,
+	.flush		= hash_ip_flush,
+	.head		= hash_ip_head,
+	.list		= hash_ip_list,
+};
+
+static int hash_ip_create(struct ip_set *set, struct nlattr *tb[])
+{
+	u32 hashsize = IPSET_DEFAULT_HASHSIZE, maxelem = IPSET_DEFAULT_MAXELEM;
+	u8 netmask = 32;
+	struct hash_ip *h;
+	int ret;
+
+	if (set->family != AF_INET)
+		return -EAFNOSUPPORT;
+
+	if (tb[IPSET_ATTR_HASHSIZE])
+		hashsize = nla_get_u32(tb[IPSET_ATTR_HASHSIZE]);
+	if (tb[IPSET_ATTR_MAXELEM])
+		maxelem = nla_get_u32(tb[IPSET_ATTR_MAXELEM]);
+	if (tb[IPSET_ATTR_CIDR]) {
+		netmask = nla_get_u8(tb[IPSET_ATTR_CIDR]);
+		if (netmask == 0 || netmask > 32)
+			return -EINVAL;
+	}
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (h == NULL)
+		return -ENOMEM;
+
+	ret = ip_set_hash_init(&h->hash, sizeof(__be32), -1,
+			       hashsize, maxelem);
+	if (ret < 0) {
+		kfree(h);
+		return ret;
+	}
+	h->netmask = netmask;
+
+	if (tb[IPSET_ATTR_TIMEOUT])
+		set->timeout = nla_get_u32(tb[IPSET_ATTR_TIMEOUT]);
+	set->data = h;
+	set->variant = &hash_ip_variant;
+	return 0;
+}
+
+static const struct nla_policy hash_ip_create_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
+	[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
+	[IPSET_ATTR_CIDR]	= { .type = NLA_U8 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static const struct nla_policy hash_ip_adt_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_IP]		= { .type = NLA_U32 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static struct ip_set_type hash_ip_type __read_mostly = {
+	.name		= "hash:ip",
+	.family		= AF_INET,
+	.revision	= 0,
+	.dimension	= IPSET_DIM_ONE,
+	.features	= IPSET_TYPE_IP,
+	.create		= hash_ip_create,
+	.create_policy	= hash_ip_create_policy,
+	.adt_policy	= hash_ip_adt_policy,
+	.me		= THIS_MODULE,
+};
+
+static int __init hash_ip_init(void)
+{
+	return ip_set_type_register(&hash_ip_type);
+}
+
+static void __exit hash_ip_fini(void)
+{
+	ip_set_type_unregister(&hash_ip_type);
+}
+
+module_init(hash_ip_init);
+module_exit(hash_ip_fini);
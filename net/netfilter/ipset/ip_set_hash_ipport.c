@@ -0,0 +1,229 @@
+/*
+ * hash:ip,port, a hash of IPv4 address, protocol and port triples.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <net/netlink.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("hash:ip,port type of IP sets");
+MODULE_ALIAS("ip_set_hash:ip,port");
+
+struct hash_ipport_key {
+	__be32 ip;
+	__be16 port;
+	u8 proto;
+	u8 pad;
+};
+
+static int
+hash_ipport_kadt(struct ip_set *set, const struct sk_buff *skb,
+		 enum ipset_adt adt, u8 dim, u8 flags)
+{
+	struct ip_set_hash *h = set->data;
+	struct hash_ipport_key key;
+
+	memset(&key, 0, sizeof(key));
+	if (ip_set_get_ip4_port(skb, flags & IPSET_DIM_TWO_SRC,
+				&key.port, &key.proto) < 0)
+		return adt == IPSET_TEST ? 0 : -EINVAL;
+	key.ip = ip_set_get_ip4(skb, flags & IPSET_DIM_ONE_SRC);
+
+	switch (adt) {
+	case IPSET_TEST:
+		return ip_set_hash_lookup(h, &key) != NULL;
+	case IPSET_ADD:
+		return ip_set_hash_add(h, &key,
+				       ip_set_timeout_set(set->timeout),
+				       true, false, GFP_ATOMIC);
+	case IPSET_DEL:
+		return ip_set_hash_del(h, &key);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int
+hash_ipport_uadt(struct ip_set *set, struct nlattr *tb[],
+		 enum ipset_adt adt, u32 flags, bool retried)
+{
+	struct ip_set_hash *h = set->data;
+	struct hash_ipport_key key;
+	unsigned long timeout;
+	int ret;
+
+	if (tb[IPSET_ATTR_IP] == NULL || tb[IPSET_ATTR_PORT] == NULL)
+		return -EPROTO;
+
+	memset(&key, 0, sizeof(key));
+	key.ip = nla_get_be32(tb[IPSET_ATTR_IP]);
+	key.port = nla_get_be16(tb[IPSET_ATTR_PORT]);
+	key.proto = IPPROTO_TCP;
+	if (tb[IPSET_ATTR_PROTO])
+		key.proto = nla_get_u8(tb[IPSET_ATTR_PROTO]);
+
+	switch (key.proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (adt) {
+	case IPSET_TEST:
+		return ip_set_hash_lookup(h, &key) != NULL;
+	case IPSET_ADD:
+		ret = ip_set_get_timeout(set, tb, &timeout);
+		if (ret < 0)
+			return ret;
+		return ip_set_hash_add(h, &key, timeout,
+				       flags & IPSET_FLAG_EXIST, !retried,
+				       GFP_ATOMIC);
+	case IPSET_DEL:
+		return ip_set_hash_del(h, &key);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hash_ipport_resize(struct ip_set *set)
+{
+	return ip_set_hash_resize(set, set->data);
+}
+
+static void hash_ipport_gc(struct ip_set *set)
+{
+	ip_set_hash_gc(set->data);
+}
+
+static void hash_ipport_destroy(struct ip_set *set)
+{
+	ip_set_hash_destroy(set->data);
+	kfree(set->data);
+}
+
+static void hash_ipport_flush(struct ip_set *set)
+{
+	ip_set_hash_flush(set->data);
+}
+
+static int hash_ipport_head(struct ip_set *set, struct sk_buff *skb)
+{
+	return ip_set_hash_head(set, set->data, skb);
+}
+
+static int hash_ipport_put(struct sk_buff *skb, const void *data)
+{
+	const struct hash_ipport_key *key = data;
+
+	NLA_PUT_BE32(skb, IPSET_ATTR_IP, key->ip);
+	NLA_PUT_BE16(skb, IPSET_ATTR_PORT, key->port);
+	NLA_PUT_U8(skb, IPSET_ATTR_PROTO, key->proto);
+	return 0;
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int hash_ipport_list(struct ip_set *set, struct sk_buff *skb,
+			    struct netlink_callback *cb)
+{
+	return ip_set_hash_list(set, set->data, skb, cb, hash_ipport_put);
+}
+
+static const struct ip_set_type_variant hash_ipport_variant = {
+	.kadt		= hash_ipport_kadt,
+	.uadt		= hash_ipport_uadt,
+	.resize		= hash_ipport_resize,
+	.gc		= hash_ipport_gc,
+	.destroy	= hash_ipport_destroy,
+	.flush		= hash_ipport_flush,
+	.head		= hash_ipport_head,
+	.list		= hash_ipport_list,
+};
+
+static int hash_ipport_create(struct ip_set *set, struct nlattr *tb[])
+{
+	u32 hashsize = IPSET_DEFAULT_HASHSIZE, maxelem = IPSET_DEFAULT_MAXELEM;
+	struct ip_set_hash *h;
+	int ret;
+
+	if (set->family != AF_INET)
+		return -EAFNOSUPPORT;
+
+	if (tb[IPSET_ATTR_HASHSIZE])
+		hashsize = nla_get_u32(tb[IPSET_ATTR_HASHSIZE]);
+	if (tb[IPSET_ATTR_MAXELEM])
+		maxelem = nla_get_u32(tb[IPSET_ATTR_MAXELEM]);
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (h == NULL)
+		return -ENOMEM;
+
+	ret = ip_set_hash_init(h, sizeof(struct hash_ipport_key), -1,
+			       hashsize, maxelem);
+	if (ret < 0) {
+		kfree(h);
+		return ret;
+	}
+
+	if (tb[IPSET_ATTR_TIMEOUT])
+		set->timeout = nla_get_u32(tb[IPSET_ATTR_TIMEOUT]);
+	set->data = h;
+	set->variant = &hash_ipport_variant;
+	return 0;
+}
+
+static const struct nla_policy
+hash_ipport_create_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
+	[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static const struct nla_policy
+hash_ipport_adt_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_IP]		= { .type = NLA_U32 },
+	[IPSET_ATTR_PORT]	= { .type = NLA_U16 },
+	[IPSET_ATTR_PROTO]	= { .type = NLA_U8 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static struct ip_set_type hash_ipport_type __read_mostly = {
+	.name		= "hash:ip,port",
+	.family		= AF_INET,
+	.revision	= 0,
+	.dimension	= IPSET_DIM_TWO,
+	.features	= IPSET_TYPE_IP | IPSET_TYPE_PORT,
+	.create		= hash_ipport_create,
+	.create_policy	= hash_ipport_create_policy,
+	.adt_policy	= hash_ipport_adt_policy,
+	.me		= THIS_MODULE,
+};
+
+static int __init hash_ipport_init(void)
+{
+	return ip_set_type_register(&hash_ipport_type);
+}
+
+static void __exit hash_ipport_fini(void)
+{
+	ip_set_type_unregister(&hash_ipport_type);
+}
+
+module_init(hash_ipport_init);
+module_exit(hash_ipport_fini);
@@ -0,0 +1,245 @@
+/*
+ * hash:net, a hash of IPv4 networks of any prefix length.
+ *
+ * A packet is matched by probing one hash lookup per prefix length
+ * which is present in the set, longest first.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <net/netlink.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("hash:net type of IP sets");
+MODULE_ALIAS("ip_set_hash:net");
+
+struct hash_net_key {
+	__be32 ip;
+	u8 cidr;
+	u8 pad[3];
+};
+
+static inline void hash_net_key_set(struct hash_net_key *key, __be32 ip,
+				    u8 cidr)
+{
+	memset(key, 0, sizeof(*key));
+	key->ip = ip & ip_set_netmask(cidr);
+	key->cidr = cidr;
+}
+
+/* Longest prefix in the set containing ip */
+static bool hash_net_match(const struct ip_set_hash *h, __be32 ip)
+{
+	struct hash_net_key key;
+	int cidr;
+
+	for (cidr = 32; cidr > 0; cidr--) {
+		if (h->nets[cidr] == 0)
+			continue;
+		hash_net_key_set(&key, ip, cidr);
+		if (ip_set_hash_lookup(h, &key) != NULL)
+			return true;
+	}
+	return false;
+}
+
+/* Packets add and delete host entries */
+static int
+hash_net_kadt(struct ip_set *set, const struct sk_buff *skb,
+	      enum ipset_adt adt, u8 dim, u8 flags)
+{
+	struct ip_set_hash *h = set->data;
+	struct hash_net_key key;
+	__be32 ip = ip_set_get_ip4(skb, flags & IPSET_DIM_ONE_SRC);
+
+	switch (adt) {
+	case IPSET_TEST:
+		return hash_net_match(h, ip);
+	case IPSET_ADD:
+		hash_net_key_set(&key, ip, 32);
+		return ip_set_hash_add(h, &key,
+				       ip_set_timeout_set(set->timeout),
+				       true, false, GFP_ATOMIC);
+	case IPSET_DEL:
+		hash_net_key_set(&key, ip, 32);
+		return ip_set_hash_del(h, &key);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int
+hash_net_uadt(struct ip_set *set, struct nlattr *tb[],
+	      enum ipset_adt adt, u32 flags, bool retried)
+{
+	struct ip_set_hash *h = set->data;
+	struct hash_net_key key;
+	unsigned long timeout;
+	u8 cidr = 32;
+	__be32 ip;
+	int ret;
+
+	if (tb[IPSET_ATTR_IP] == NULL)
+		return -EPROTO;
+	ip = nla_get_be32(tb[IPSET_ATTR_IP]);
+
+	if (tb[IPSET_ATTR_CIDR]) {
+		cidr = nla_get_u8(tb[IPSET_ATTR_CIDR]);
+		if (cidr == 0 || cidr > 32)
+			return -EINVAL;
+	} else if (adt == IPSET_TEST) {
+		/* test an address against the networks */
+		return hash_net_match(h, ip);
+	}
+	hash_net_key_set(&key, ip, cidr);
+
+	switch (adt) {
+	case IPSET_TEST:
+		return ip_set_hash_lookup(h, &key) != NULL;
+	case IPSET_ADD:
+		ret = ip_set_get_timeout(set, tb, &timeout);
+		if (ret < 0)
+			return ret;
+		return ip_set_hash_add(h, &key, timeout,
+				       flags & IPSET_FLAG_EXIST, !retried,
+				       GFP_ATOMIC);
+	case IPSET_DEL:
+		return ip_set_hash_del(h, &key);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hash_net_resize(struct ip_set *set)
+{
+	return ip_set_hash_resize(set, set->data);
+}
+
+static void hash_net_gc(struct ip_set *set)
+{
+	ip_set_hash_gc(set->data);
+}
+
+static void hash_net_destroy(struct ip_set *set)
+{
+	ip_set_hash_destroy(set->data);
+	kfree(set->data);
+}
+
+static void hash_net_flush(struct ip_set *set)
+{
+	ip_set_hash_flush(set->data);
+}
+
+static int hash_net_head(struct ip_set *set, struct sk_buff *skb)
+{
+	return ip_set_hash_head(set, set->data, skb);
+}
+
+static int hash_net_put(struct sk_buff *skb, const void *data)
+{
+	const struct hash_net_key *key = data;
+
+	NLA_PUT_BE32(skb, IPSET_ATTR_IP, key->ip);
+	NLA_PUT_U8(skb, IPSET_ATTR_CIDR, key->cidr);
+	return 0;
+
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int hash_net_list(struct ip_set *set, struct sk_buff *skb,
+			 struct netlink_callback *cb)
+{
+	return ip_set_hash_list(set, set->data, skb, cb, hash_net_put);
+}
+
+static const struct ip_set_type_variant hash_net_variant = {
+	.kadt		= hash_net_kadt,
+	.uadt		= hash_net_uadt,
+	.resize		= hash_net_resize,
+	.gc		= hash_net_gc,
+	.destroy	= hash_net_destroy,
+	.flush		= hash_net_flush,
+	.head		= hash_net_head,
+	.list		= hash_net_list,
+};
+
+static int hash_net_create(struct ip_set *set, struct nlattr *tb[])
+{
+	u32 hashsize = IPSET_DEFAULT_HASHSIZE, maxelem = IPSET_DEFAULT_MAXELEM;
+	struct ip_set_hash *h;
+	int ret;
+
+	if (set->family != AF_INET)
+		return -EAFNOSUPPORT;
+
+	if (tb[IPSET_ATTR_HASHSIZE])
+		hashsize = nla_get_u32(tb[IPSET_ATTR_HASHSIZE]);
+	if (tb[IPSET_ATTR_MAXELEM])
+		maxelem = nla_get_u32(tb[IPSET_ATTR_MAXELEM]);
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (h == NULL)
+		return -ENOMEM;
+
+	ret = ip_set_hash_init(h, sizeof(struct hash_net_key),
+			       offsetof(struct hash_net_key, cidr),
+			       hashsize, maxelem);
+	if (ret < 0) {
+		kfree(h);
+		return ret;
+	}
+
+	if (tb[IPSET_ATTR_TIMEOUT])
+		set->timeout = nla_get_u32(tb[IPSET_ATTR_TIMEOUT]);
+	set->data = h;
+	set->variant = &hash_net_variant;
+	return 0;
+}
+
+static const struct nla_policy hash_net_create_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
+	[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static const struct nla_policy hash_net_adt_policy[IPSET_ATTR_CADT_MAX + 1] = {
+	[IPSET_ATTR_IP]		= { .type = NLA_U32 },
+	[IPSET_ATTR_CIDR]	= { .type = NLA_U8 },
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+};
+
+static struct ip_set_type hash_net_type __read_mostly = {
+	.name		= "hash:net",
+	.family		= AF_INET,
+	.revision	= 0,
+	.dimension	= IPSET_DIM_ONE,
+	.features	= IPSET_TYPE_IP,
+	.create		= hash_net_create,
+	.create_policy	= hash_net_create_policy,
+	.adt_policy	= hash_net_adt_policy,
+	.me		= THIS_MODULE,
+};
+
+static int __init hash_net_init(void)
+{
+	return ip_set_type_register(&hash_net_type);
+}
+
+static void __exit hash_net_fini(void)
+{
+	ip_set_type_unregister(&hash_net_type);
+}
+
+module_init(hash_net_init);
+module_exit(hash_net_fini);
@@ -35,15 +35,34 @@
 #include <linux/seq_file.h>
 #include <linux/jhash.h>
 #include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 
 #include <net/net_namespace.h>
 #include <net/ip_vs.h>
 
 
 /*
- *  Connection hash table: for input and output packets lookups of IPVS
+ *  Connection hash table size, the table is allocated at load time
  */
-static struct list_head *ip_vs_conn_tab;
+static int ip_vs_conn_tab_bits = CONFIG_IP_VS_TAB_BITS;
+module_param_named(conn_tab_bits, ip_vs_conn_tab_bits, int, 0444);
+MODULE_PARM_DESC(conn_tab_bits, "Set connections' hash size");
+
+int ip_vs_conn_tab_size __read_mostly;
+static int ip_vs_conn_tab_mask __read_mostly;
+
+/*
+ *  Connection hash table: for input and output packets lookups of IPVS.
+ *  Lookups walk the chains under RCU, each bucket has its own lock to
+ *  serialise inserts and deletes.
+ */
+struct ip_vs_conn_bucket {
+	struct hlist_head	head;
+	spinlock_t		lock;
+};
+
+static struct ip_vs_conn_bucket *ip_vs_conn_tab __read_mostly;
 
 /*  SLAB cache for IPVS connections */
 static struct kmem_cache *ip_vs_conn_cachep __read_mostly;
@@ -57,60 +76,20 @@ static atomic_t ip_vs_conn_no_cport_cnt = ATOMIC_INIT(0);
 /* random value for IPVS connection hash */
 static unsigned int ip_vs_conn_rnd;
 
-/*
- *  Fine locking granularity for big connection hash table
- */
-#define CT_LOCKARRAY_BITS  4
-#define CT_LOCKARRAY_SIZE  (1<<CT_LOCKARRAY_BITS)
-#define CT_LOCKARRAY_MASK  (CT_LOCKARRAY_SIZE-1)
+/* expired connections are reaped by this worker */
+static void ip_vs_conn_gc_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(ip_vs_conn_gc_work, ip_vs_conn_gc_worker);
+static unsigned int ip_vs_conn_gc_bucket;
+static unsigned long ip_vs_conn_gc_next_run;
 
-struct ip_vs_aligned_lock
+static inline void ct_lock_bh(unsigned key)
 {
-	rwlock_t	l;
-} __attribute__((__aligned__(SMP_CACHE_BYTES)));
-
-/* lock array for conn table */
-static struct ip_vs_aligned_lock
-__ip_vs_conntbl_lock_array[CT_LOCKARRAY_SIZE] __cacheline_aligned;
-
-static inline void ct_read_lock(unsigned key)
-{
-	read_lock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_unlock(unsigned key)
-{
-	read_unlock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_lock_bh(&ip_vs_conn_tab[key].lock);
 }
 
-static inline void ct_write_lock(unsigned key)
+static inline void ct_unlock_bh(unsigned key)
 {
-	write_lock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_write_unlock(unsigned key)
-{
-	write_unlock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_lock_bh(unsigned key)
-{
-	read_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_unlock_bh(unsigned key)
-{
-	read_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_write_lock_bh(unsigned key)
-{
-	write_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_write_unlock_bh(unsigned key)
-{
-	write_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_unlock_bh(&ip_vs_conn_tab[key].lock);
 }
 
 
@@ -125,11 +104,11 @@ static unsigned int ip_vs_conn_hashkey(int af, unsigned proto,
 	if (af == AF_INET6)
 		return jhash_3words(jhash(addr, 16, ip_vs_conn_rnd),
 				    (__force u32)port, proto, ip_vs_conn_rnd)
-			& IP_VS_CONN_TAB_MASK;
+			& ip_vs_conn_tab_mask;
 #endif
 	return jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
 			    ip_vs_conn_rnd)
-		& IP_VS_CONN_TAB_MASK;
+		& ip_vs_conn_tab_mask;
 }
 
 
@@ -145,11 +124,11 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	/* Hash by protocol, client address and port */
 	hash = ip_vs_conn_hashkey(cp->af, cp->protocol, &cp->caddr, cp->cport);
 
-	ct_write_lock(hash);
+	ct_lock_bh(hash);
 	spin_lock(&cp->lock);
 
 	if (!(cp->flags & IP_VS_CONN_F_HASHED)) {
-		list_add(&cp->c_list, &ip_vs_conn_tab[hash]);
+		hlist_add_head_rcu(&cp->c_list, &ip_vs_conn_tab[hash].head);
 		cp->flags |= IP_VS_CONN_F_HASHED;
 		atomic_inc(&cp->refcnt);
 		ret = 1;
@@ -160,7 +139,7 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	}
 
 	spin_unlock(&cp->lock);
-	ct_write_unlock(hash);
+	ct_unlock_bh(hash);
 
 	return ret;
 }
@@ -178,11 +157,11 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 	/* unhash it and decrease its reference counter */
 	hash = ip_vs_conn_hashkey(cp->af, cp->protocol, &cp->caddr, cp->cport);
 
-	ct_write_lock(hash);
+	ct_lock_bh(hash);
 	spin_lock(&cp->lock);
 
 	if (cp->flags & IP_VS_CONN_F_HASHED) {
-		list_del(&cp->c_list);
+		hlist_del_rcu(&cp->c_list);
 		cp->flags &= ~IP_VS_CONN_F_HASHED;
 		atomic_dec(&cp->refcnt);
 		ret = 1;
@@ -190,7 +169,38 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 		ret = 0;
 
 	spin_unlock(&cp->lock);
-	ct_write_unlock(hash);
+	ct_unlock_bh(hash);
+
+	return ret;
+}
+
+
+/*
+ *	Unhash a connection only when the table and the caller hold the
+ *	last two references, and drop both. Dropping them to zero under
+ *	the bucket lock stops lookups that still see the entry under RCU
+ *	from taking a new reference, and on failure the entry keeps its
+ *	place in the chain, so walkers do not meet it again.
+ */
+static inline int ip_vs_conn_unhash_last(struct ip_vs_conn *cp)
+{
+	unsigned hash;
+	int ret = 0;
+
+	hash = ip_vs_conn_hashkey(cp->af, cp->protocol, &cp->caddr, cp->cport);
+
+	ct_lock_bh(hash);
+	spin_lock(&cp->lock);
+
+	if ((cp->flags & IP_VS_CONN_F_HASHED) &&
+	    atomic_cmpxchg(&cp->refcnt, 2, 0) == 2) {
+		hlist_del_rcu(&cp->c_list);
+		cp->flags &= ~IP_VS_CONN_F_HASHED;
+		ret = 1;
+	}
+
+	spin_unlock(&cp->lock);
+	ct_unlock_bh(hash);
 
 	return ret;
 }
@@ -208,26 +218,28 @@ static inline struct ip_vs_conn *__ip_vs_conn_in_get
 {
 	unsigned hash;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
 	hash = ip_vs_conn_hashkey(af, protocol, s_addr, s_port);
 
-	ct_read_lock(hash);
+	rcu_read_lock();
 
-	list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash].head, c_list) {
 		if (cp->af == af &&
 		    ip_vs_addr_equal(af, s_addr, &cp->caddr) &&
 		    ip_vs_addr_equal(af, d_addr, &cp->vaddr) &&
 		    s_port == cp->cport && d_port == cp->vport &&
 		    ((!s_port) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
 		    protocol == cp->protocol) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
-			ct_read_unlock(hash);
+			/* HIT, unless it is being freed */
+			if (!atomic_inc_not_zero(&cp->refcnt))
+				continue;
+			rcu_read_unlock();
 			return cp;
 		}
 	}
 
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	return NULL;
 }
@@ -259,12 +271,13 @@ struct ip_vs_conn *ip_vs_ct_in_get
 {
 	unsigned hash;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
 	hash = ip_vs_conn_hashkey(af, protocol, s_addr, s_port);
 
-	ct_read_lock(hash);
+	rcu_read_lock();
 
-	list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash].head, c_list) {
 		if (cp->af == af &&
 		    ip_vs_addr_equal(af, s_addr, &cp->caddr) &&
 		    /* protocol should only be IPPROTO_IP if
@@ -274,15 +287,15 @@ struct ip_vs_conn *ip_vs_ct_in_get
 		    s_port == cp->cport && d_port == cp->vport &&
 		    cp->flags & IP_VS_CONN_F_TEMPLATE &&
 		    protocol == cp->protocol) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
-			goto out;
+			/* HIT, unless it is being freed */
+			if (atomic_inc_not_zero(&cp->refcnt))
+				goto out;
 		}
 	}
 	cp = NULL;
 
   out:
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "template lookup/in %s %s:%d->%s:%d %s\n",
 		      ip_vs_proto_name(protocol),
@@ -305,28 +318,30 @@ struct ip_vs_conn *ip_vs_conn_out_get
 {
 	unsigned hash;
 	struct ip_vs_conn *cp, *ret=NULL;
+	struct hlist_node *n;
 
 	/*
 	 *	Check for "full" addressed entries
 	 */
 	hash = ip_vs_conn_hashkey(af, protocol, d_addr, d_port);
 
-	ct_read_lock(hash);
+	rcu_read_lock();
 
-	list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash].head, c_list) {
 		if (cp->af == af &&
 		    ip_vs_addr_equal(af, d_addr, &cp->caddr) &&
 		    ip_vs_addr_equal(af, s_addr, &cp->daddr) &&
 		    d_port == cp->cport && s_port == cp->dport &&
 		    protocol == cp->protocol) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
+			/* HIT, unless it is being freed */
+			if (!atomic_inc_not_zero(&cp->refcnt))
+				continue;
 			ret = cp;
 			break;
 		}
 	}
 
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "lookup/out %s %s:%d->%s:%d %s\n",
 		      ip_vs_proto_name(protocol),
@@ -339,12 +354,12 @@ struct ip_vs_conn *ip_vs_conn_out_get
 
 
 /*
- *      Put back the conn and restart its timer with its timeout
+ *      Put back the conn and restart its expiry with its timeout
  */
 void ip_vs_conn_put(struct ip_vs_conn *cp)
 {
 	/* reset it expire in its timeout */
-	mod_timer(&cp->timer, jiffies+cp->timeout);
+	cp->expires = jiffies + cp->timeout;
 
 	__ip_vs_conn_put(cp);
 }
@@ -609,7 +624,7 @@ int ip_vs_check_template(struct ip_vs_conn *ct)
 
 		/*
 		 * Simply decrease the refcnt of the template,
-		 * don't restart its timer.
+		 * don't restart its expiry.
 		 */
 		atomic_dec(&ct->refcnt);
 		return 0;
@@ -617,56 +632,67 @@ int ip_vs_check_template(struct ip_vs_conn *ct)
 	return 1;
 }
 
-static void ip_vs_conn_expire(unsigned long data)
+static void ip_vs_conn_rcu_free(struct rcu_head *head)
 {
-	struct ip_vs_conn *cp = (struct ip_vs_conn *)data;
-
-	cp->timeout = 60*HZ;
+	struct ip_vs_conn *cp = container_of(head, struct ip_vs_conn,
+					     rcu_head);
 
-	/*
-	 *	hey, I'm using it
-	 */
-	atomic_inc(&cp->refcnt);
+	kmem_cache_free(ip_vs_conn_cachep, cp);
+}
 
+/*
+ *	Take a connection the caller holds a reference on out of the
+ *	table and free it once RCU readers are done with it. Fails,
+ *	leaving the entry hashed, while it controls other connections
+ *	or somebody else still holds a reference.
+ */
+static int ip_vs_conn_release(struct ip_vs_conn *cp)
+{
 	/*
 	 *	do I control anybody?
 	 */
 	if (atomic_read(&cp->n_control))
-		goto expire_later;
+		return 0;
 
 	/*
-	 *	unhash it if it is hashed in the conn table
+	 *	unhash it if it is hashed and nobody else uses it
 	 */
-	if (!ip_vs_conn_unhash(cp))
-		goto expire_later;
+	if (!ip_vs_conn_unhash_last(cp))
+		return 0;
+
+	/* does anybody control me? */
+	if (cp->control)
+		ip_vs_control_del(cp);
+
+	if (unlikely(cp->app != NULL))
+		ip_vs_unbind_app(cp);
+	ip_vs_unbind_dest(cp);
+	if (cp->flags & IP_VS_CONN_F_NO_CPORT)
+		atomic_dec(&ip_vs_conn_no_cport_cnt);
+	atomic_dec(&ip_vs_conn_count);
+
+	call_rcu(&cp->rcu_head, ip_vs_conn_rcu_free);
+	return 1;
+}
 
+/*
+ *	Release a connection whose timeout has passed, or give it another
+ *	60 seconds if it is still in use. Called by the gc in an RCU
+ *	read-side section.
+ */
+static void ip_vs_conn_expire(struct ip_vs_conn *cp)
+{
 	/*
-	 *	refcnt==1 implies I'm the only one referrer
+	 *	hey, I'm using it
 	 */
-	if (likely(atomic_read(&cp->refcnt) == 1)) {
-		/* delete the timer if it is activated by other users */
-		if (timer_pending(&cp->timer))
-			del_timer(&cp->timer);
-
-		/* does anybody control me? */
-		if (cp->control)
-			ip_vs_control_del(cp);
-
-		if (unlikely(cp->app != NULL))
-			ip_vs_unbind_app(cp);
-		ip_vs_unbind_dest(cp);
-		if (cp->flags & IP_VS_CONN_F_NO_CPORT)
-			atomic_dec(&ip_vs_conn_no_cport_cnt);
-		atomic_dec(&ip_vs_conn_count);
-
-		kmem_cache_free(ip_vs_conn_cachep, cp);
+	if (!atomic_inc_not_zero(&cp->refcnt))
 		return;
-	}
 
-	/* hash it back to the table */
-	ip_vs_conn_hash(cp);
+	cp->timeout = 60*HZ;
+
+	if (ip_vs_conn_release(cp))
+		return;
 
-  expire_later:
 	IP_VS_DBG(7, "delayed: conn->refcnt-1=%d conn->n_control=%d\n",
 		  atomic_read(&cp->refcnt)-1,
 		  atomic_read(&cp->n_control));
@@ -675,10 +701,21 @@ static void ip_vs_conn_expire(unsigned long data)
 }
 
 
+/*
+ *	Release the connection right away. If it is still in use, leave
+ *	it expired so that the gc retries on its next pass over it.
+ *	Must be called in an RCU read-side section.
+ */
 void ip_vs_conn_expire_now(struct ip_vs_conn *cp)
 {
-	if (del_timer(&cp->timer))
-		mod_timer(&cp->timer, jiffies);
+	if (!atomic_inc_not_zero(&cp->refcnt))
+		return;
+
+	if (ip_vs_conn_release(cp))
+		return;
+
+	cp->expires = jiffies;
+	__ip_vs_conn_put(cp);
 }
 
 
@@ -700,8 +737,6 @@ ip_vs_conn_new(int af, int proto, const union nf_inet_addr *caddr, __be16 cport,
 		return NULL;
 	}
 
-	INIT_LIST_HEAD(&cp->c_list);
-	setup_timer(&cp->timer, ip_vs_conn_expire, (unsigned long)cp);
 	cp->af		   = af;
 	cp->protocol	   = proto;
 	ip_vs_addr_copy(af, &cp->caddr, caddr);
@@ -735,6 +770,7 @@ ip_vs_conn_new(int af, int proto, const union nf_inet_addr *caddr, __be16 cport,
 	/* Set its state and timeout */
 	cp->state = 0;
 	cp->timeout = 3*HZ;
+	cp->expires = jiffies + cp->timeout;
 
 	/* Bind its packet transmitter */
 #ifdef CONFIG_IP_VS_IPV6
@@ -763,31 +799,34 @@ static void *ip_vs_conn_array(struct seq_file *seq, loff_t pos)
 {
 	int idx;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
-	for(idx = 0; idx < IP_VS_CONN_TAB_SIZE; idx++) {
-		ct_read_lock_bh(idx);
-		list_for_each_entry(cp, &ip_vs_conn_tab[idx], c_list) {
+	for(idx = 0; idx < ip_vs_conn_tab_size; idx++) {
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[idx].head,
+					 c_list) {
 			if (pos-- == 0) {
 				seq->private = &ip_vs_conn_tab[idx];
 				return cp;
 			}
 		}
-		ct_read_unlock_bh(idx);
 	}
 
 	return NULL;
 }
 
 static void *ip_vs_conn_seq_start(struct seq_file *seq, loff_t *pos)
+	__acquires(RCU)
 {
 	seq->private = NULL;
+	rcu_read_lock();
 	return *pos ? ip_vs_conn_array(seq, *pos - 1) :SEQ_START_TOKEN;
 }
 
 static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 {
 	struct ip_vs_conn *cp = v;
-	struct list_head *e, *l = seq->private;
+	struct ip_vs_conn_bucket *b = seq->private;
+	struct hlist_node *e, *n;
 	int idx;
 
 	++*pos;
@@ -795,30 +834,25 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 		return ip_vs_conn_array(seq, 0);
 
 	/* more on same hash chain? */
-	if ((e = cp->c_list.next) != l)
-		return list_entry(e, struct ip_vs_conn, c_list);
+	if ((e = rcu_dereference(cp->c_list.next)))
+		return hlist_entry(e, struct ip_vs_conn, c_list);
 
-	idx = l - ip_vs_conn_tab;
-	ct_read_unlock_bh(idx);
-
-	while (++idx < IP_VS_CONN_TAB_SIZE) {
-		ct_read_lock_bh(idx);
-		list_for_each_entry(cp, &ip_vs_conn_tab[idx], c_list) {
+	idx = b - ip_vs_conn_tab;
+	while (++idx < ip_vs_conn_tab_size) {
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[idx].head,
+					 c_list) {
 			seq->private = &ip_vs_conn_tab[idx];
 			return cp;
 		}
-		ct_read_unlock_bh(idx);
 	}
 	seq->private = NULL;
 	return NULL;
 }
 
 static void ip_vs_conn_seq_stop(struct seq_file *seq, void *v)
+	__releases(RCU)
 {
-	struct list_head *l = seq->private;
-
-	if (l)
-		ct_read_unlock_bh(l - ip_vs_conn_tab);
+	rcu_read_unlock();
 }
 
 static int ip_vs_conn_seq_show(struct seq_file *seq, void *v)
@@ -838,7 +872,7 @@ static int ip_vs_conn_seq_show(struct seq_file *seq, void *v)
 				&cp->vaddr.in6, ntohs(cp->vport),
 				&cp->daddr.in6, ntohs(cp->dport),
 				ip_vs_state_name(cp->protocol, cp->state),
-				(cp->timer.expires-jiffies)/HZ);
+				(cp->expires-jiffies)/HZ);
 		else
 #endif
 			seq_printf(seq,
@@ -849,7 +883,7 @@ static int ip_vs_conn_seq_show(struct seq_file *seq, void *v)
 				ntohl(cp->vaddr.ip), ntohs(cp->vport),
 				ntohl(cp->daddr.ip), ntohs(cp->dport),
 				ip_vs_state_name(cp->protocol, cp->state),
-				(cp->timer.expires-jiffies)/HZ);
+				(cp->expires-jiffies)/HZ);
 	}
 	return 0;
 }
@@ -900,7 +934,7 @@ static int ip_vs_conn_sync_seq_show(struct seq_file *seq, void *v)
 				&cp->daddr.in6, ntohs(cp->dport),
 				ip_vs_state_name(cp->protocol, cp->state),
 				ip_vs_origin_name(cp->flags),
-				(cp->timer.expires-jiffies)/HZ);
+				(cp->expires-jiffies)/HZ);
 		else
 #endif
 			seq_printf(seq,
@@ -912,7 +946,7 @@ static int ip_vs_conn_sync_seq_show(struct seq_file *seq, void *v)
 				ntohl(cp->daddr.ip), ntohs(cp->dport),
 				ip_vs_state_name(cp->protocol, cp->state),
 				ip_vs_origin_name(cp->flags),
-				(cp->timer.expires-jiffies)/HZ);
+				(cp->expires-jiffies)/HZ);
 	}
 	return 0;
 }
@@ -947,7 +981,7 @@ static inline int todrop_entry(struct ip_vs_conn *cp)
 {
 	/*
 	 * The drop rate array needs tuning for real environments.
-	 * Called from timer bh only => no locking
+	 * Called from the defense work only => no locking
 	 */
 	static const char todrop_rate[9] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
 	static char todrop_counter[9] = {0};
@@ -956,7 +990,7 @@ static inline int todrop_entry(struct ip_vs_conn *cp)
 	/* if the conn entry hasn't lasted for 60 seconds, don't drop it.
 	   This will leave enough time for normal connection to get
 	   through. */
-	if (time_before(cp->timeout + jiffies, cp->timer.expires + 60*HZ))
+	if (time_before(cp->timeout + jiffies, cp->expires + 60*HZ))
 		return 0;
 
 	/* Don't drop the entry if its number of incoming packets is not
@@ -976,19 +1010,18 @@ void ip_vs_random_dropentry(void)
 {
 	int idx;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
 	/*
 	 * Randomly scan 1/32 of the whole table every second
 	 */
-	for (idx = 0; idx < (IP_VS_CONN_TAB_SIZE>>5); idx++) {
-		unsigned hash = net_random() & IP_VS_CONN_TAB_MASK;
+	for (idx = 0; idx < (ip_vs_conn_tab_size>>5); idx++) {
+		unsigned hash = net_random() & ip_vs_conn_tab_mask;
 
-		/*
-		 *  Lock is actually needed in this loop.
-		 */
-		ct_write_lock_bh(hash);
+		rcu_read_lock();
 
-		list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash].head,
+					 c_list) {
 			if (cp->flags & IP_VS_CONN_F_TEMPLATE)
 				/* connection template */
 				continue;
@@ -1019,11 +1052,115 @@ void ip_vs_random_dropentry(void)
 				ip_vs_conn_expire_now(cp->control);
 			}
 		}
-		ct_write_unlock_bh(hash);
+		rcu_read_unlock();
 	}
 }
 
 
+/*
+ *	Pass the connections of up to count hash chains, starting with
+ *	chain first, to the sync daemon. Returns the chain to continue
+ *	with, or 0 when the end of the table has been reached.
+ *	Called from the master sync thread when a backup asks for a resync.
+ */
+unsigned int ip_vs_conn_sync_chains(unsigned int first, unsigned int count)
+{
+	unsigned int idx;
+	struct ip_vs_conn *cp;
+	struct hlist_node *n;
+
+	for (idx = first; idx < ip_vs_conn_tab_size && count; idx++, count--) {
+		/* ip_vs_sync_conn fills this cpu's buffer, which is
+		   shared with the packet path */
+		local_bh_disable();
+		rcu_read_lock();
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[idx].head,
+					 c_list) {
+			/* templates go out with the connections they control */
+			if (cp->flags & IP_VS_CONN_F_TEMPLATE)
+				continue;
+			ip_vs_sync_conn(cp);
+		}
+		rcu_read_unlock();
+		local_bh_enable();
+	}
+
+	return idx < ip_vs_conn_tab_size ? idx : 0;
+}
+
+
+/*
+ *	Release the expired connections of one hash chain.
+ *	Returns the number of entries scanned, *expired counts the
+ *	expired ones.
+ */
+static unsigned int ip_vs_conn_gc_chain(unsigned int hash,
+					unsigned int *expired)
+{
+	struct ip_vs_conn *cp;
+	struct hlist_node *n;
+	unsigned int scanned = 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash].head, c_list) {
+		scanned++;
+		if (time_before(jiffies, cp->expires))
+			continue;
+		/* entries still in use are put back with a later expiry,
+		   so they are not seen again on this walk */
+		ip_vs_conn_expire(cp);
+		(*expired)++;
+	}
+	rcu_read_unlock();
+
+	return scanned;
+}
+
+/*
+ * Each run scans a slice of the table. The worker runs more often while
+ * the slices it sees are mostly expired and backs off to a full pass
+ * every IP_VS_GC_MAX_SCAN_JIFFIES when the table is mostly alive.
+ */
+#define IP_VS_GC_MAX_BUCKETS_DIV	128u
+#define IP_VS_GC_MAX_BUCKETS		8192u
+#define IP_VS_GC_MAX_SCAN_JIFFIES	(16u * HZ)
+#define IP_VS_GC_MAX_EVICTS		256u
+#define IP_VS_GC_EVICT_RATIO		50u
+
+static void ip_vs_conn_gc_worker(struct work_struct *work)
+{
+	unsigned int min_interval = max(HZ / IP_VS_GC_MAX_BUCKETS_DIV, 1u);
+	unsigned int i, goal, buckets = 0, expired = 0;
+	unsigned int ratio, scanned = 0;
+
+	goal = clamp((unsigned int)ip_vs_conn_tab_size /
+		     IP_VS_GC_MAX_BUCKETS_DIV, 1u, IP_VS_GC_MAX_BUCKETS);
+	i = ip_vs_conn_gc_bucket;
+
+	do {
+		if (++i >= ip_vs_conn_tab_size)
+			i = 0;
+		scanned += ip_vs_conn_gc_chain(i, &expired);
+		cond_resched();
+	} while (++buckets < goal && expired < IP_VS_GC_MAX_EVICTS);
+
+	ratio = scanned ? expired * 100 / scanned : 0;
+	if (ratio > IP_VS_GC_EVICT_RATIO || expired >= IP_VS_GC_MAX_EVICTS) {
+		ip_vs_conn_gc_next_run = 0;
+	} else {
+		unsigned long max_interval =
+			IP_VS_GC_MAX_SCAN_JIFFIES / IP_VS_GC_MAX_BUCKETS_DIV;
+
+		ip_vs_conn_gc_next_run += min_interval;
+		if (ip_vs_conn_gc_next_run > max_interval)
+			ip_vs_conn_gc_next_run = max_interval;
+	}
+
+	ip_vs_conn_gc_bucket = i;
+	schedule_delayed_work(&ip_vs_conn_gc_work, ip_vs_conn_gc_next_run);
+}
+
+
 /*
  *      Flush all the connection entries in the ip_vs_conn_tab
  */
@@ -1031,15 +1168,14 @@ static void ip_vs_conn_flush(void)
 {
 	int idx;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
+	unsigned int expired;
 
   flush_again:
-	for (idx=0; idx<IP_VS_CONN_TAB_SIZE; idx++) {
-		/*
-		 *  Lock is actually needed in this loop.
-		 */
-		ct_write_lock_bh(idx);
-
-		list_for_each_entry(cp, &ip_vs_conn_tab[idx], c_list) {
+	for (idx=0; idx<ip_vs_conn_tab_size; idx++) {
+		rcu_read_lock();
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[idx].head,
+					 c_list) {
 
 			IP_VS_DBG(4, "del connection\n");
 			ip_vs_conn_expire_now(cp);
@@ -1048,11 +1184,15 @@ static void ip_vs_conn_flush(void)
 				ip_vs_conn_expire_now(cp->control);
 			}
 		}
-		ct_write_unlock_bh(idx);
+		rcu_read_unlock();
 	}
 
+	expired = 0;
+	for (idx=0; idx<ip_vs_conn_tab_size; idx++)
+		ip_vs_conn_gc_chain(idx, &expired);
+
 	/* the counter may be not NULL, because maybe some conn entries
-	   are run by slow timer handler or unhashed but still referred */
+	   are unhashed but still referred */
 	if (atomic_read(&ip_vs_conn_count) != 0) {
 		schedule();
 		goto flush_again;
@@ -1064,10 +1204,19 @@ int __init ip_vs_conn_init(void)
 {
 	int idx;
 
+	/* Compute size and mask */
+	if (ip_vs_conn_tab_bits < 8 || ip_vs_conn_tab_bits > 20) {
+		pr_info("conn_tab_bits not in [8, 20]. Using default value\n");
+		ip_vs_conn_tab_bits = CONFIG_IP_VS_TAB_BITS;
+	}
+	ip_vs_conn_tab_size = 1 << ip_vs_conn_tab_bits;
+	ip_vs_conn_tab_mask = ip_vs_conn_tab_size - 1;
+
 	/*
-	 * Allocate the connection hash table and initialize its list heads
+	 * Allocate the connection hash table and initialize its buckets
 	 */
-	ip_vs_conn_tab = vmalloc(IP_VS_CONN_TAB_SIZE*sizeof(struct list_head));
+	ip_vs_conn_tab = vmalloc(ip_vs_conn_tab_size *
+				 sizeof(struct ip_vs_conn_bucket));
 	if (!ip_vs_conn_tab)
 		return -ENOMEM;
 
@@ -1082,17 +1231,14 @@ int __init ip_vs_conn_init(void)
 
 	pr_info("Connection hash table configured "
 		"(size=%d, memory=%ldKbytes)\n",
-		IP_VS_CONN_TAB_SIZE,
-		(long)(IP_VS_CONN_TAB_SIZE*sizeof(struct list_head))/1024);
+		ip_vs_conn_tab_size,
+		(long)(ip_vs_conn_tab_size*sizeof(struct ip_vs_conn_bucket))/1024);
 	IP_VS_DBG(0, "Each connection entry needs %Zd bytes at least\n",
 		  sizeof(struct ip_vs_conn));
 
-	for (idx = 0; idx < IP_VS_CONN_TAB_SIZE; idx++) {
-		INIT_LIST_HEAD(&ip_vs_conn_tab[idx]);
-	}
-
-	for (idx = 0; idx < CT_LOCKARRAY_SIZE; idx++)  {
-		rwlock_init(&__ip_vs_conntbl_lock_array[idx].l);
+	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
+		INIT_HLIST_HEAD(&ip_vs_conn_tab[idx].head);
+		spin_lock_init(&ip_vs_conn_tab[idx].lock);
 	}
 
 	proc_net_fops_create(&init_net, "ip_vs_conn", 0, &ip_vs_conn_fops);
@@ -1101,15 +1247,22 @@ int __init ip_vs_conn_init(void)
 	/* calculate the random value for connection hash */
 	get_random_bytes(&ip_vs_conn_rnd, sizeof(ip_vs_conn_rnd));
 
+	schedule_delayed_work(&ip_vs_conn_gc_work, HZ);
+
 	return 0;
 }
 
 
 void ip_vs_conn_cleanup(void)
 {
+	cancel_delayed_work_sync(&ip_vs_conn_gc_work);
+
 	/* flush all the connection entries first */
 	ip_vs_conn_flush();
 
+	/* wait for the RCU callbacks freeing the entries */
+	rcu_barrier();
+
 	/* Release the empty cache */
 	kmem_cache_destroy(ip_vs_conn_cachep);
 	proc_net_remove(&init_net, "ip_vs_conn");
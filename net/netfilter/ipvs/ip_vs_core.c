@@ -99,25 +99,49 @@ void ip_vs_init_hash_table(struct list_head *table, int rows)
 		INIT_LIST_HEAD(&table[rows]);
 }
 
+/*
+ *	Counters are kept per CPU and only summed when read, so the packet
+ *	path touches neither a lock nor a cache line shared with other CPUs.
+ *	All callers run in softirq context.
+ */
+static inline void
+ip_vs_stats_in(struct ip_vs_stats *stats, int cpu, unsigned int len)
+{
+	struct ip_vs_cpu_stats *s = per_cpu_ptr(stats->cpustats, cpu);
+
+	ip_vs_cpu_stats_begin(s);
+	s->inpkts++;
+	s->inbytes += len;
+	ip_vs_cpu_stats_end(s);
+}
+
+static inline void
+ip_vs_stats_out(struct ip_vs_stats *stats, int cpu, unsigned int len)
+{
+	struct ip_vs_cpu_stats *s = per_cpu_ptr(stats->cpustats, cpu);
+
+	ip_vs_cpu_stats_begin(s);
+	s->outpkts++;
+	s->outbytes += len;
+	ip_vs_cpu_stats_end(s);
+}
+
+static inline void
+ip_vs_stats_conn(struct ip_vs_stats *stats, int cpu)
+{
+	per_cpu_ptr(stats->cpustats, cpu)->conns++;
+}
+
 static inline void
 ip_vs_in_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
 {
 	struct ip_vs_dest *dest = cp->dest;
 	if (dest && (dest->flags & IP_VS_DEST_F_AVAILABLE)) {
-		spin_lock(&dest->stats.lock);
-		dest->stats.ustats.inpkts++;
-		dest->stats.ustats.inbytes += skb->len;
-		spin_unlock(&dest->stats.lock);
-
-		spin_lock(&dest->svc->stats.lock);
-		dest->svc->stats.ustats.inpkts++;
-		dest->svc->stats.ustats.inbytes += skb->len;
-		spin_unlock(&dest->svc->stats.lock);
-
-		spin_lock(&ip_vs_stats.lock);
-		ip_vs_stats.ustats.inpkts++;
-		ip_vs_stats.ustats.inbytes += skb->len;
-		spin_unlock(&ip_vs_stats.lock);
+		int cpu = smp_processor_id();
+
+		ip_vs_stats_in(&dest->stats, cpu, skb->len);
+		ip_vs_stats_in(&dest->svc->stats, cpu, skb->len);
+		ip_vs_stats_in(&ip_vs_stats, cpu, skb->len);
 	}
 }
 
@@ -127,20 +151,11 @@ ip_vs_out_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
 {
 	struct ip_vs_dest *dest = cp->dest;
 	if (dest && (dest->flags & IP_VS_DEST_F_AVAILABLE)) {
-		spin_lock(&dest->stats.lock);
-		dest->stats.ustats.outpkts++;
-		dest->stats.ustats.outbytes += skb->len;
-		spin_unlock(&dest->stats.lock);
-
-		spin_lock(&dest->svc->stats.lock);
-		dest->svc->stats.ustats.outpkts++;
-		dest->svc->stats.ustats.outbytes += skb->len;
-		spin_unlock(&dest->svc->stats.lock);
-
-		spin_lock(&ip_vs_stats.lock);
-		ip_vs_stats.ustats.outpkts++;
-		ip_vs_stats.ustats.outbytes += skb->len;
-		spin_unlock(&ip_vs_stats.lock);
+		int cpu = smp_processor_id();
+
+		ip_vs_stats_out(&dest->stats, cpu, skb->len);
+		ip_vs_stats_out(&dest->svc->stats, cpu, skb->len);
+		ip_vs_stats_out(&ip_vs_stats, cpu, skb->len);
 	}
 }
 
@@ -148,17 +163,11 @@ ip_vs_out_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
 static inline void
 ip_vs_conn_stats(struct ip_vs_conn *cp, struct ip_vs_service *svc)
 {
-	spin_lock(&cp->dest->stats.lock);
-	cp->dest->stats.ustats.conns++;
-	spin_unlock(&cp->dest->stats.lock);
-
-	spin_lock(&svc->stats.lock);
-	svc->stats.ustats.conns++;
-	spin_unlock(&svc->stats.lock);
+	int cpu = smp_processor_id();
 
-	spin_lock(&ip_vs_stats.lock);
-	ip_vs_stats.ustats.conns++;
-	spin_unlock(&ip_vs_stats.lock);
+	ip_vs_stats_conn(&cp->dest->stats, cpu);
+	ip_vs_stats_conn(&svc->stats, cpu);
+	ip_vs_stats_conn(&ip_vs_stats, cpu);
 }
 
 
@@ -1331,13 +1340,14 @@ ip_vs_in(unsigned int hooknum, struct sk_buff *skb,
 	if (cp->dest && !(cp->dest->flags & IP_VS_DEST_F_AVAILABLE)) {
 		/* the destination server is not available */
 
-		if (sysctl_ip_vs_expire_nodest_conn) {
-			/* try to expire the connection immediately */
-			ip_vs_conn_expire_now(cp);
-		}
 		/* don't restart its timer, and silently
 		   drop the packet. */
 		__ip_vs_conn_put(cp);
+		if (sysctl_ip_vs_expire_nodest_conn) {
+			/* try to expire the connection immediately, cp
+			   stays valid until the hook leaves RCU */
+			ip_vs_conn_expire_now(cp);
+		}
 		return NF_DROP;
 	}
 
@@ -86,6 +86,8 @@ int sysctl_ip_vs_cache_bypass = 0;
 int sysctl_ip_vs_expire_nodest_conn = 0;
 int sysctl_ip_vs_expire_quiescent_template = 0;
 int sysctl_ip_vs_sync_threshold[2] = { 3, 50 };
+int sysctl_ip_vs_sync_version = IP_VS_SYNC_PROTO_VER;
+int sysctl_ip_vs_sync_ports = 1;
 int sysctl_ip_vs_nat_icmp_send = 0;
 
 
@@ -498,6 +500,18 @@ ip_vs_service_get(int af, __u32 fwmark, __u16 protocol,
 }
 
 
+static void ip_vs_service_free(struct ip_vs_service *svc)
+{
+	free_percpu(svc->stats.cpustats);
+	kfree(svc);
+}
+
+static void ip_vs_dest_free(struct ip_vs_dest *dest)
+{
+	free_percpu(dest->stats.cpustats);
+	kfree(dest);
+}
+
 static inline void
 __ip_vs_bind_svc(struct ip_vs_dest *dest, struct ip_vs_service *svc)
 {
@@ -512,7 +526,7 @@ __ip_vs_unbind_svc(struct ip_vs_dest *dest)
 
 	dest->svc = NULL;
 	if (atomic_dec_and_test(&svc->refcnt))
-		kfree(svc);
+		ip_vs_service_free(svc);
 }
 
 
@@ -712,7 +726,7 @@ ip_vs_trash_get_dest(struct ip_vs_service *svc, const union nf_inet_addr *daddr,
 			list_del(&dest->n_list);
 			ip_vs_dst_reset(dest);
 			__ip_vs_unbind_svc(dest);
-			kfree(dest);
+			ip_vs_dest_free(dest);
 		}
 	}
 
@@ -737,7 +751,7 @@ static void ip_vs_trash_cleanup(void)
 		list_del(&dest->n_list);
 		ip_vs_dst_reset(dest);
 		__ip_vs_unbind_svc(dest);
-		kfree(dest);
+		ip_vs_dest_free(dest);
 	}
 }
 
@@ -745,8 +759,14 @@ static void ip_vs_trash_cleanup(void)
 static void
 ip_vs_zero_stats(struct ip_vs_stats *stats)
 {
+	struct ip_vs_stats_user sum;
+
+	ip_vs_read_cpu_stats(&sum, stats->cpustats);
+
 	spin_lock_bh(&stats->lock);
 
+	/* the per-CPU counters keep running, remember where we reset them */
+	memcpy(&stats->ustats0, &sum, sizeof(sum));
 	memset(&stats->ustats, 0, sizeof(stats->ustats));
 	ip_vs_zero_estimator(stats);
 
@@ -847,6 +867,12 @@ ip_vs_new_dest(struct ip_vs_service *svc, struct ip_vs_dest_user_kern *udest,
 		pr_err("%s(): no memory.\n", __func__);
 		return -ENOMEM;
 	}
+	dest->stats.cpustats = alloc_percpu(struct ip_vs_cpu_stats);
+	if (dest->stats.cpustats == NULL) {
+		pr_err("%s(): no memory.\n", __func__);
+		kfree(dest);
+		return -ENOMEM;
+	}
 
 	dest->af = svc->af;
 	dest->protocol = svc->protocol;
@@ -1068,7 +1094,7 @@ static void __ip_vs_del_dest(struct ip_vs_dest *dest)
 		   and only one user context can update virtual service at a
 		   time, so the operation here is OK */
 		atomic_dec(&dest->svc->refcnt);
-		kfree(dest);
+		ip_vs_dest_free(dest);
 	} else {
 		IP_VS_DBG_BUF(3, "Moving dest %s:%u into trash, "
 			      "dest->refcnt=%d\n",
@@ -1182,6 +1208,12 @@ ip_vs_add_service(struct ip_vs_service_user_kern *u,
 		ret = -ENOMEM;
 		goto out_err;
 	}
+	svc->stats.cpustats = alloc_percpu(struct ip_vs_cpu_stats);
+	if (svc->stats.cpustats == NULL) {
+		IP_VS_DBG(1, "%s(): no memory\n", __func__);
+		ret = -ENOMEM;
+		goto out_err;
+	}
 
 	/* I'm the first user of the service */
 	atomic_set(&svc->usecnt, 1);
@@ -1235,7 +1267,7 @@ ip_vs_add_service(struct ip_vs_service_user_kern *u,
 			ip_vs_app_inc_put(svc->inc);
 			local_bh_enable();
 		}
-		kfree(svc);
+		ip_vs_service_free(svc);
 	}
 	ip_vs_scheduler_put(sched);
 
@@ -1378,7 +1410,7 @@ static void __ip_vs_del_service(struct ip_vs_service *svc)
 	 *    Free the service if nobody refers to it
 	 */
 	if (atomic_read(&svc->refcnt) == 0)
-		kfree(svc);
+		ip_vs_service_free(svc);
 
 	/* decrease the module use count */
 	ip_vs_use_count_dec();
@@ -1536,6 +1568,13 @@ proc_do_sync_threshold(ctl_table *table, int write,
 }
 
 
+/* limits of sync_version and sync_ports */
+static int ip_vs_sync_version_min = 0;
+static int ip_vs_sync_version_max = IP_VS_SYNC_PROTO_VER;
+static int ip_vs_sync_ports_min = 1;
+static int ip_vs_sync_ports_max = IP_VS_SYNC_MAX_PORTS;
+
+
 /*
  *	IPVS sysctl table (under the /proc/sys/net/ipv4/vs/)
  */
@@ -1699,6 +1738,24 @@ static struct ctl_table vs_vars[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_do_sync_threshold,
 	},
+	{
+		.procname	= "sync_version",
+		.data		= &sysctl_ip_vs_sync_version,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &ip_vs_sync_version_min,
+		.extra2		= &ip_vs_sync_version_max,
+	},
+	{
+		.procname	= "sync_ports",
+		.data		= &sysctl_ip_vs_sync_ports,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &ip_vs_sync_ports_min,
+		.extra2		= &ip_vs_sync_ports_max,
+	},
 	{
 		.procname	= "nat_icmp_send",
 		.data		= &sysctl_ip_vs_nat_icmp_send,
@@ -1843,7 +1900,7 @@ static int ip_vs_info_seq_show(struct seq_file *seq, void *v)
 	if (v == SEQ_START_TOKEN) {
 		seq_printf(seq,
 			"IP Virtual Server version %d.%d.%d (size=%d)\n",
-			NVERSION(IP_VS_VERSION_CODE), IP_VS_CONN_TAB_SIZE);
+			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
 		seq_puts(seq,
 			 "Prot LocalAddress:Port Scheduler Flags\n");
 		seq_puts(seq,
@@ -1939,6 +1996,9 @@ struct ip_vs_stats ip_vs_stats = {
 #ifdef CONFIG_PROC_FS
 static int ip_vs_stats_show(struct seq_file *seq, void *v)
 {
+	struct ip_vs_stats_user u;
+
+	ip_vs_read_stats(&u, &ip_vs_stats);
 
 /*               01234567 01234567 01234567 0123456701234567 0123456701234567 */
 	seq_puts(seq,
@@ -1946,22 +2006,16 @@ static int ip_vs_stats_show(struct seq_file *seq, void *v)
 	seq_printf(seq,
 		   "   Conns  Packets  Packets            Bytes            Bytes\n");
 
-	spin_lock_bh(&ip_vs_stats.lock);
-	seq_printf(seq, "%8X %8X %8X %16LX %16LX\n\n", ip_vs_stats.ustats.conns,
-		   ip_vs_stats.ustats.inpkts, ip_vs_stats.ustats.outpkts,
-		   (unsigned long long) ip_vs_stats.ustats.inbytes,
-		   (unsigned long long) ip_vs_stats.ustats.outbytes);
+	seq_printf(seq, "%8X %8X %8X %16LX %16LX\n\n", u.conns,
+		   u.inpkts, u.outpkts,
+		   (unsigned long long) u.inbytes,
+		   (unsigned long long) u.outbytes);
 
 /*                 01234567 01234567 01234567 0123456701234567 0123456701234567 */
 	seq_puts(seq,
 		   " Conns/s   Pkts/s   Pkts/s          Bytes/s          Bytes/s\n");
 	seq_printf(seq,"%8X %8X %8X %16X %16X\n",
-			ip_vs_stats.ustats.cps,
-			ip_vs_stats.ustats.inpps,
-			ip_vs_stats.ustats.outpps,
-			ip_vs_stats.ustats.inbps,
-			ip_vs_stats.ustats.outbps);
-	spin_unlock_bh(&ip_vs_stats.lock);
+			u.cps, u.inpps, u.outpps, u.inbps, u.outbps);
 
 	return 0;
 }
@@ -2197,9 +2251,7 @@ do_ip_vs_set_ctl(struct sock *sk, int cmd, void __user *user, unsigned int len)
 static void
 ip_vs_copy_stats(struct ip_vs_stats_user *dst, struct ip_vs_stats *src)
 {
-	spin_lock_bh(&src->lock);
-	memcpy(dst, &src->ustats, sizeof(*dst));
-	spin_unlock_bh(&src->lock);
+	ip_vs_read_stats(dst, src);
 }
 
 static void
@@ -2374,7 +2426,7 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 		char buf[64];
 
 		sprintf(buf, "IP Virtual Server version %d.%d.%d (size=%d)",
-			NVERSION(IP_VS_VERSION_CODE), IP_VS_CONN_TAB_SIZE);
+			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
 		if (copy_to_user(user, buf, strlen(buf)+1) != 0) {
 			ret = -EFAULT;
 			goto out;
@@ -2387,7 +2439,7 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 	{
 		struct ip_vs_getinfo info;
 		info.version = IP_VS_VERSION_CODE;
-		info.size = IP_VS_CONN_TAB_SIZE;
+		info.size = ip_vs_conn_tab_size;
 		info.num_services = ip_vs_num_services;
 		if (copy_to_user(user, &info, sizeof(info)) != 0)
 			ret = -EFAULT;
@@ -2569,31 +2621,29 @@ static const struct nla_policy ip_vs_dest_policy[IPVS_DEST_ATTR_MAX + 1] = {
 static int ip_vs_genl_fill_stats(struct sk_buff *skb, int container_type,
 				 struct ip_vs_stats *stats)
 {
+	struct ip_vs_stats_user u;
 	struct nlattr *nl_stats = nla_nest_start(skb, container_type);
 	if (!nl_stats)
 		return -EMSGSIZE;
 
-	spin_lock_bh(&stats->lock);
+	ip_vs_read_stats(&u, stats);
 
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_CONNS, stats->ustats.conns);
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_INPKTS, stats->ustats.inpkts);
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_OUTPKTS, stats->ustats.outpkts);
-	NLA_PUT_U64(skb, IPVS_STATS_ATTR_INBYTES, stats->ustats.inbytes);
-	NLA_PUT_U64(skb, IPVS_STATS_ATTR_OUTBYTES, stats->ustats.outbytes);
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_CPS, stats->ustats.cps);
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_INPPS, stats->ustats.inpps);
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_OUTPPS, stats->ustats.outpps);
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_INBPS, stats->ustats.inbps);
-	NLA_PUT_U32(skb, IPVS_STATS_ATTR_OUTBPS, stats->ustats.outbps);
-
-	spin_unlock_bh(&stats->lock);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_CONNS, u.conns);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_INPKTS, u.inpkts);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_OUTPKTS, u.outpkts);
+	NLA_PUT_U64(skb, IPVS_STATS_ATTR_INBYTES, u.inbytes);
+	NLA_PUT_U64(skb, IPVS_STATS_ATTR_OUTBYTES, u.outbytes);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_CPS, u.cps);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_INPPS, u.inpps);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_OUTPPS, u.outpps);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_INBPS, u.inbps);
+	NLA_PUT_U32(skb, IPVS_STATS_ATTR_OUTBPS, u.outbps);
 
 	nla_nest_end(skb, nl_stats);
 
 	return 0;
 
 nla_put_failure:
-	spin_unlock_bh(&stats->lock);
 	nla_nest_cancel(skb, nl_stats);
 	return -EMSGSIZE;
 }
@@ -3232,7 +3282,7 @@ static int ip_vs_genl_get_cmd(struct sk_buff *skb, struct genl_info *info)
 	case IPVS_CMD_GET_INFO:
 		NLA_PUT_U32(msg, IPVS_INFO_ATTR_VERSION, IP_VS_VERSION_CODE);
 		NLA_PUT_U32(msg, IPVS_INFO_ATTR_CONN_TAB_SIZE,
-			    IP_VS_CONN_TAB_SIZE);
+			    ip_vs_conn_tab_size);
 		break;
 	}
 
@@ -3370,9 +3420,16 @@ int __init ip_vs_control_init(void)
 
 	EnterFunction(2);
 
+	ip_vs_stats.cpustats = alloc_percpu(struct ip_vs_cpu_stats);
+	if (ip_vs_stats.cpustats == NULL) {
+		pr_err("cannot allocate statistics.\n");
+		return -ENOMEM;
+	}
+
 	ret = nf_register_sockopt(&ip_vs_sockopts);
 	if (ret) {
 		pr_err("cannot register sockopt.\n");
+		free_percpu(ip_vs_stats.cpustats);
 		return ret;
 	}
 
@@ -3380,6 +3437,7 @@ int __init ip_vs_control_init(void)
 	if (ret) {
 		pr_err("cannot register Generic Netlink interface.\n");
 		nf_unregister_sockopt(&ip_vs_sockopts);
+		free_percpu(ip_vs_stats.cpustats);
 		return ret;
 	}
 
@@ -3419,5 +3477,6 @@ void ip_vs_control_cleanup(void)
 	proc_net_remove(&init_net, "ip_vs");
 	ip_vs_genl_unregister();
 	nf_unregister_sockopt(&ip_vs_sockopts);
+	free_percpu(ip_vs_stats.cpustats);
 	LeaveFunction(2);
 }
@@ -22,6 +22,7 @@
 #include <linux/interrupt.h>
 #include <linux/sysctl.h>
 #include <linux/list.h>
+#include <linux/percpu.h>
 
 #include <net/ip_vs.h>
 
@@ -46,6 +47,11 @@
     rate is ~2.15Gbits/s, average pps and cps are scaled by 2^10.
 
   * A lot code is taken from net/sched/estimator.c
+
+  * The packet path only bumps per-CPU counters (see ip_vs_core.c); the
+    estimator sums them here, so it never contends with the datapath.
+    The sums are never reset: zeroing the statistics records the current
+    sums in ustats0 and readers report the difference.
  */
 
 
@@ -55,49 +61,95 @@ static LIST_HEAD(est_list);
 static DEFINE_SPINLOCK(est_lock);
 static DEFINE_TIMER(est_timer, estimation_timer, 0, 0);
 
+/*
+ * Sum the per-CPU counters of a statistics object into sum.
+ * The rate fields of sum are cleared.
+ */
+void ip_vs_read_cpu_stats(struct ip_vs_stats_user *sum,
+			  struct ip_vs_cpu_stats *stats)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(i) {
+		struct ip_vs_cpu_stats *s = per_cpu_ptr(stats, i);
+		u64 inbytes, outbytes;
+#if BITS_PER_LONG == 32
+		unsigned int start;
+
+		do {
+			start = read_seqcount_begin(&s->syncp);
+			inbytes = s->inbytes;
+			outbytes = s->outbytes;
+		} while (read_seqcount_retry(&s->syncp, start));
+#else
+		inbytes = s->inbytes;
+		outbytes = s->outbytes;
+#endif
+		sum->conns += s->conns;
+		sum->inpkts += s->inpkts;
+		sum->outpkts += s->outpkts;
+		sum->inbytes += inbytes;
+		sum->outbytes += outbytes;
+	}
+}
+
+/*
+ * Current counters, relative to the last zeroing, and estimated rates.
+ */
+void ip_vs_read_stats(struct ip_vs_stats_user *dst, struct ip_vs_stats *stats)
+{
+	struct ip_vs_stats_user sum;
+
+	ip_vs_read_cpu_stats(&sum, stats->cpustats);
+
+	spin_lock_bh(&stats->lock);
+	memcpy(dst, &stats->ustats, sizeof(*dst));
+	dst->conns = sum.conns - stats->ustats0.conns;
+	dst->inpkts = sum.inpkts - stats->ustats0.inpkts;
+	dst->outpkts = sum.outpkts - stats->ustats0.outpkts;
+	dst->inbytes = sum.inbytes - stats->ustats0.inbytes;
+	dst->outbytes = sum.outbytes - stats->ustats0.outbytes;
+	spin_unlock_bh(&stats->lock);
+}
+
 static void estimation_timer(unsigned long arg)
 {
 	struct ip_vs_estimator *e;
 	struct ip_vs_stats *s;
-	u32 n_conns;
-	u32 n_inpkts, n_outpkts;
-	u64 n_inbytes, n_outbytes;
+	struct ip_vs_stats_user sum;
 	u32 rate;
 
 	spin_lock(&est_lock);
 	list_for_each_entry(e, &est_list, list) {
 		s = container_of(e, struct ip_vs_stats, est);
 
-		spin_lock(&s->lock);
-		n_conns = s->ustats.conns;
-		n_inpkts = s->ustats.inpkts;
-		n_outpkts = s->ustats.outpkts;
-		n_inbytes = s->ustats.inbytes;
-		n_outbytes = s->ustats.outbytes;
+		ip_vs_read_cpu_stats(&sum, s->cpustats);
 
+		spin_lock(&s->lock);
 		/* scaled by 2^10, but divided 2 seconds */
-		rate = (n_conns - e->last_conns)<<9;
-		e->last_conns = n_conns;
+		rate = (sum.conns - e->last_conns)<<9;
+		e->last_conns = sum.conns;
 		e->cps += ((long)rate - (long)e->cps)>>2;
 		s->ustats.cps = (e->cps+0x1FF)>>10;
 
-		rate = (n_inpkts - e->last_inpkts)<<9;
-		e->last_inpkts = n_inpkts;
+		rate = (sum.inpkts - e->last_inpkts)<<9;
+		e->last_inpkts = sum.inpkts;
 		e->inpps += ((long)rate - (long)e->inpps)>>2;
 		s->ustats.inpps = (e->inpps+0x1FF)>>10;
 
-		rate = (n_outpkts - e->last_outpkts)<<9;
-		e->last_outpkts = n_outpkts;
+		rate = (sum.outpkts - e->last_outpkts)<<9;
+		e->last_outpkts = sum.outpkts;
 		e->outpps += ((long)rate - (long)e->outpps)>>2;
 		s->ustats.outpps = (e->outpps+0x1FF)>>10;
 
-		rate = (n_inbytes - e->last_inbytes)<<4;
-		e->last_inbytes = n_inbytes;
+		rate = (sum.inbytes - e->last_inbytes)<<4;
+		e->last_inbytes = sum.inbytes;
 		e->inbps += ((long)rate - (long)e->inbps)>>2;
 		s->ustats.inbps = (e->inbps+0xF)>>5;
 
-		rate = (n_outbytes - e->last_outbytes)<<4;
-		e->last_outbytes = n_outbytes;
+		rate = (sum.outbytes - e->last_outbytes)<<4;
+		e->last_outbytes = sum.outbytes;
 		e->outbps += ((long)rate - (long)e->outbps)>>2;
 		s->ustats.outbps = (e->outbps+0xF)>>5;
 		spin_unlock(&s->lock);
@@ -109,22 +161,25 @@ static void estimation_timer(unsigned long arg)
 void ip_vs_new_estimator(struct ip_vs_stats *stats)
 {
 	struct ip_vs_estimator *est = &stats->est;
+	struct ip_vs_stats_user sum;
 
 	INIT_LIST_HEAD(&est->list);
 
-	est->last_conns = stats->ustats.conns;
+	ip_vs_read_cpu_stats(&sum, stats->cpustats);
+
+	est->last_conns = sum.conns;
 	est->cps = stats->ustats.cps<<10;
 
-	est->last_inpkts = stats->ustats.inpkts;
+	est->last_inpkts = sum.inpkts;
 	est->inpps = stats->ustats.inpps<<10;
 
-	est->last_outpkts = stats->ustats.outpkts;
+	est->last_outpkts = sum.outpkts;
 	est->outpps = stats->ustats.outpps<<10;
 
-	est->last_inbytes = stats->ustats.inbytes;
+	est->last_inbytes = sum.inbytes;
 	est->inbps = stats->ustats.inbps<<5;
 
-	est->last_outbytes = stats->ustats.outbytes;
+	est->last_outbytes = sum.outbytes;
 	est->outbps = stats->ustats.outbps<<5;
 
 	spin_lock_bh(&est_lock);
@@ -145,12 +200,10 @@ void ip_vs_zero_estimator(struct ip_vs_stats *stats)
 {
 	struct ip_vs_estimator *est = &stats->est;
 
-	/* set counters zero, caller must hold the stats->lock lock */
-	est->last_inbytes = 0;
-	est->last_outbytes = 0;
-	est->last_conns = 0;
-	est->last_inpkts = 0;
-	est->last_outpkts = 0;
+	/*
+	 * Reset the rates, caller must hold the stats->lock lock. The
+	 * last_* snapshots follow the per-CPU sums, which are not reset.
+	 */
 	est->cps = 0;
 	est->inpps = 0;
 	est->outpps = 0;
@@ -0,0 +1,364 @@
+/*
+ * IPVS:        Maglev Hashing scheduling module
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Changes:
+ *
+ */
+
+/*
+ * The mh algorithm selects a server by the hash of the source IP address,
+ * like sh, but fills its lookup table with the Maglev scheme:
+ *
+ *   Every server gets a permutation of the table slots, derived from a
+ *   hash of its address and port only:
+ *
+ *       offset <- h1(server) mod M
+ *       skip   <- h2(server) mod (M - 1) + 1
+ *       permutation[j] = (offset + j * skip) mod M
+ *
+ *   The servers then take turns claiming the next free slot of their
+ *   own permutation until the table is full; a server with weight w
+ *   claims w / gcd(weights) slots per turn.
+ *
+ * M is prime so every permutation visits every slot. Since a server's
+ * preferences do not depend on the other servers, adding or removing
+ * one only moves a small share of the slots, and directors with the
+ * same configuration build the same table whatever order the servers
+ * were added in.
+ *
+ * Servers with zero weight do not get slots. When the server found for
+ * a client is unavailable or overloaded, further slots are probed by
+ * rehashing, so such clients spread over the remaining servers while
+ * the others keep their server.
+ */
+
+#define KMSG_COMPONENT "IPVS"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/ip.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/gcd.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
+
+#include <net/ip_vs.h>
+
+
+/*
+ *      IPVS MH bucket
+ */
+struct ip_vs_mh_bucket {
+	struct ip_vs_dest       *dest;          /* real server (cache) */
+};
+
+/*
+ *      Table sizes, the largest prime below each power of two
+ */
+#ifndef CONFIG_IP_VS_MH_TAB_INDEX
+#define CONFIG_IP_VS_MH_TAB_INDEX       12
+#endif
+static const unsigned int ip_vs_mh_primes[] = {
+	251, 509, 1021, 2039, 4093, 8191, 16381, 32749,
+};
+#define IP_VS_MH_TAB_SIZE       ip_vs_mh_primes[CONFIG_IP_VS_MH_TAB_INDEX - 8]
+
+/*
+ * Fixed seeds: the table must come out the same on every director.
+ */
+#define IP_VS_MH_SEED_OFFSET    0x4d61676cU
+#define IP_VS_MH_SEED_SKIP      0x65764c42U
+#define IP_VS_MH_SEED_CLIENT    0x49505653U
+
+/* Slots probed for a client whose server is not usable */
+#define IP_VS_MH_FALLBACK_TRIES 32
+
+/*
+ *      Per server state while filling the table
+ */
+struct ip_vs_mh_perm {
+	struct ip_vs_dest       *dest;
+	unsigned int            next;           /* next preferred slot */
+	unsigned int            skip;
+	int                     turns;          /* slots per round */
+};
+
+
+static inline u32 ip_vs_mh_hashkey(int af, const union nf_inet_addr *addr,
+				   __be16 port, u32 seed)
+{
+#ifdef CONFIG_IP_VS_IPV6
+	if (af == AF_INET6)
+		return jhash2((const u32 *)addr->ip6, 4,
+			      seed ^ (__force u32)port);
+#endif
+	return jhash_2words((__force u32)addr->ip, (__force u32)port, seed);
+}
+
+
+/*
+ *      Order servers by address and port so that ties in the filling
+ *      rounds are broken the same way on every director.
+ */
+static int ip_vs_mh_perm_cmp(const void *a, const void *b)
+{
+	const struct ip_vs_dest *da = ((const struct ip_vs_mh_perm *)a)->dest;
+	const struct ip_vs_dest *db = ((const struct ip_vs_mh_perm *)b)->dest;
+	int ret;
+
+	ret = memcmp(&da->addr, &db->addr, sizeof(da->addr));
+	if (ret)
+		return ret;
+	return (int)ntohs(da->port) - (int)ntohs(db->port);
+}
+
+
+/*
+ *      Flush all the hash buckets of the specified table.
+ */
+static void ip_vs_mh_flush(struct ip_vs_mh_bucket *tbl)
+{
+	int i;
+	struct ip_vs_mh_bucket *b;
+
+	b = tbl;
+	for (i=0; i<IP_VS_MH_TAB_SIZE; i++) {
+		if (b->dest) {
+			atomic_dec(&b->dest->refcnt);
+			b->dest = NULL;
+		}
+		b++;
+	}
+}
+
+
+/*
+ *      Fill the table of the service with the Maglev permutations of its
+ *      servers. On allocation failure the old table is left in place.
+ */
+static int
+ip_vs_mh_assign(struct ip_vs_mh_bucket *tbl, struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_perm *perm, *p;
+	struct ip_vs_dest *dest;
+	unsigned int size = IP_VS_MH_TAB_SIZE;
+	unsigned int filled, slot, turns;
+	int n = 0, i, t, g = 0, w;
+
+	list_for_each_entry(dest, &svc->destinations, n_list) {
+		w = atomic_read(&dest->weight);
+		if (w > 0) {
+			g = g ? gcd(g, w) : w;
+			n++;
+		}
+	}
+
+	perm = NULL;
+	if (n) {
+		perm = kmalloc(n * sizeof(*perm), GFP_ATOMIC);
+		if (perm == NULL) {
+			pr_err("%s(): no memory\n", __func__);
+			return -ENOMEM;
+		}
+	}
+
+	ip_vs_mh_flush(tbl);
+	if (!n)
+		return 0;
+
+	p = perm;
+	turns = 0;
+	list_for_each_entry(dest, &svc->destinations, n_list) {
+		w = atomic_read(&dest->weight);
+		if (w <= 0)
+			continue;
+		p->dest = dest;
+		p->turns = w / g;
+		turns += p->turns;
+		p++;
+	}
+	/* keep one round within the table, every server still gets a turn */
+	while (turns > size && turns > n) {
+		turns = 0;
+		for (i = 0; i < n; i++) {
+			perm[i].turns = max(perm[i].turns >> 1, 1);
+			turns += perm[i].turns;
+		}
+	}
+	sort(perm, n, sizeof(*perm), ip_vs_mh_perm_cmp, NULL);
+
+	for (i = 0; i < n; i++) {
+		p = &perm[i];
+		p->next = ip_vs_mh_hashkey(svc->af, &p->dest->addr,
+					   p->dest->port, IP_VS_MH_SEED_OFFSET);
+		p->next %= size;
+		p->skip = ip_vs_mh_hashkey(svc->af, &p->dest->addr,
+					   p->dest->port, IP_VS_MH_SEED_SKIP);
+		p->skip = p->skip % (size - 1) + 1;
+	}
+
+	filled = 0;
+	while (filled < size) {
+		for (i = 0; i < n && filled < size; i++) {
+			p = &perm[i];
+			for (t = 0; t < p->turns && filled < size; t++) {
+				slot = p->next;
+				while (tbl[slot].dest) {
+					slot += p->skip;
+					if (slot >= size)
+						slot -= size;
+				}
+				p->next = slot + p->skip;
+				if (p->next >= size)
+					p->next -= size;
+
+				atomic_inc(&p->dest->refcnt);
+				tbl[slot].dest = p->dest;
+				filled++;
+			}
+		}
+	}
+
+	kfree(perm);
+	return 0;
+}
+
+
+static int ip_vs_mh_init_svc(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_bucket *tbl;
+
+	/* allocate the MH table for this service */
+	tbl = kzalloc(sizeof(struct ip_vs_mh_bucket)*IP_VS_MH_TAB_SIZE,
+		      GFP_ATOMIC);
+	if (tbl == NULL) {
+		pr_err("%s(): no memory\n", __func__);
+		return -ENOMEM;
+	}
+	svc->sched_data = tbl;
+	IP_VS_DBG(6, "MH lookup table (memory=%Zdbytes) allocated for "
+		  "current service\n",
+		  sizeof(struct ip_vs_mh_bucket)*IP_VS_MH_TAB_SIZE);
+
+	/* assign the lookup table with the updated service */
+	ip_vs_mh_assign(tbl, svc);
+
+	return 0;
+}
+
+
+static int ip_vs_mh_done_svc(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_bucket *tbl = svc->sched_data;
+
+	/* got to clean up hash buckets here */
+	ip_vs_mh_flush(tbl);
+
+	/* release the table itself */
+	kfree(svc->sched_data);
+	IP_VS_DBG(6, "MH lookup table (memory=%Zdbytes) released\n",
+		  sizeof(struct ip_vs_mh_bucket)*IP_VS_MH_TAB_SIZE);
+
+	return 0;
+}
+
+
+static int ip_vs_mh_update_svc(struct ip_vs_service *svc)
+{
+	/* refill the lookup table with the updated service */
+	return ip_vs_mh_assign(svc->sched_data, svc);
+}
+
+
+/*
+ *      A server that is removed, quiesced or overloaded takes no
+ *      new connections.
+ */
+static inline int is_unavailable(struct ip_vs_dest *dest)
+{
+	return !(dest->flags & IP_VS_DEST_F_AVAILABLE) ||
+	       atomic_read(&dest->weight) <= 0 ||
+	       dest->flags & IP_VS_DEST_F_OVERLOAD;
+}
+
+
+/*
+ *      Maglev Hashing scheduling
+ */
+static struct ip_vs_dest *
+ip_vs_mh_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
+{
+	struct ip_vs_dest *dest;
+	struct ip_vs_mh_bucket *tbl;
+	struct ip_vs_iphdr iph;
+	u32 hash;
+	int i;
+
+	ip_vs_fill_iphdr(svc->af, skb_network_header(skb), &iph);
+
+	IP_VS_DBG(6, "ip_vs_mh_schedule(): Scheduling...\n");
+
+	tbl = (struct ip_vs_mh_bucket *)svc->sched_data;
+	hash = ip_vs_mh_hashkey(svc->af, &iph.saddr, 0, IP_VS_MH_SEED_CLIENT);
+	dest = tbl[hash % IP_VS_MH_TAB_SIZE].dest;
+
+	/* probe other slots, deterministically for this client */
+	for (i = 1; dest && is_unavailable(dest); i++) {
+		if (i > IP_VS_MH_FALLBACK_TRIES) {
+			dest = NULL;
+			break;
+		}
+		dest = tbl[jhash_2words(hash, i, IP_VS_MH_SEED_CLIENT) %
+			   IP_VS_MH_TAB_SIZE].dest;
+	}
+	if (!dest) {
+		IP_VS_ERR_RL("MH: no destination available\n");
+		return NULL;
+	}
+
+	IP_VS_DBG_BUF(6, "MH: source IP address %s --> server %s:%d\n",
+		      IP_VS_DBG_ADDR(svc->af, &iph.saddr),
+		      IP_VS_DBG_ADDR(svc->af, &dest->addr),
+		      ntohs(dest->port));
+
+	return dest;
+}
+
+
+/*
+ *      IPVS MH Scheduler structure
+ */
+static struct ip_vs_scheduler ip_vs_mh_scheduler =
+{
+	.name =			"mh",
+	.refcnt =		ATOMIC_INIT(0),
+	.module =		THIS_MODULE,
+	.n_list	 =		LIST_HEAD_INIT(ip_vs_mh_scheduler.n_list),
+	.init_service =		ip_vs_mh_init_svc,
+	.done_service =		ip_vs_mh_done_svc,
+	.update_service =	ip_vs_mh_update_svc,
+	.schedule =		ip_vs_mh_schedule,
+};
+
+
+static int __init ip_vs_mh_init(void)
+{
+	return register_ip_vs_scheduler(&ip_vs_mh_scheduler);
+}
+
+
+static void __exit ip_vs_mh_cleanup(void)
+{
+	unregister_ip_vs_scheduler(&ip_vs_mh_scheduler);
+}
+
+
+module_init(ip_vs_mh_init);
+module_exit(ip_vs_mh_cleanup);
+MODULE_LICENSE("GPL");
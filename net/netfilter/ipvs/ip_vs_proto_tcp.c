@@ -687,7 +687,7 @@ tcp_app_conn_bind(struct ip_vs_conn *cp)
 
 
 /*
- *	Set LISTEN timeout. (ip_vs_conn_put will setup timer)
+ *	Set LISTEN timeout. (ip_vs_conn_put will setup expiry)
  */
 void ip_vs_tcp_conn_listen(struct ip_vs_conn *cp)
 {
@@ -41,7 +41,7 @@
 #include <net/ip_vs.h>
 
 #define IP_VS_SYNC_GROUP 0xe0000051    /* multicast addr - 224.0.0.81 */
-#define IP_VS_SYNC_PORT  8848          /* multicast port */
+#define IP_VS_SYNC_PORT  8848          /* multicast port of sync thread 0 */
 
 
 /*
@@ -74,6 +74,19 @@ struct ip_vs_sync_conn_options {
 struct ip_vs_sync_thread_data {
 	struct socket *sock;
 	char *buf;
+	int id;				/* thread number, port offset */
+	struct sockaddr_in mcast;	/* group and port of this thread */
+
+	/* master: sequence number of the next message */
+	u32 seq;
+
+	/* backup: the stream received from the current master */
+	struct socket *rsock;		/* for resync requests */
+	struct sockaddr_in peer;
+	u32 next_seq;
+	int seq_valid;
+	int resync_wanted;
+	unsigned long resync_sent;
 };
 
 #define SIMPLE_CONN_SIZE  (sizeof(struct ip_vs_sync_conn))
@@ -85,6 +98,7 @@ struct ip_vs_sync_thread_data {
   The master mulitcasts messages to the backup load balancers in the
   following format.
 
+  Version 0:
        0                   1                   2                   3
        0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
       +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
@@ -100,6 +114,28 @@ struct ip_vs_sync_thread_data {
       |                                                               |
       |                    IPVS Sync Connection (n)                   |
       +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+  Sequenced messages (version 2):
+       0                   1                   2                   3
+       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |   Reserved    |    SyncID     |            Size               |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |     Type      |    Version    |          Count Conns          |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |                       Sequence Number                         |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |                    IPVS Sync Connection (1)                   |
+      |                            .                                  |
+
+  The reserved byte is always zero, so a version 0 backup takes a
+  sequenced message for an empty one and ignores it. The version byte
+  sits where the upstream version 1 format keeps its own, and 1 is
+  never used here: the two formats are incompatible, and each side
+  drops the other's messages. Every sync thread numbers its messages;
+  a backup that sees a gap in the numbers sends a RESYNC message (a
+  bare sequenced header) back to the master, which then sends its
+  whole connection table again.
 */
 
 #define SYNC_MESG_HEADER_LEN	4
@@ -113,28 +149,86 @@ struct ip_vs_sync_mesg {
 	/* ip_vs_sync_conn entries start here */
 };
 
+#define SYNC_MESG_SEQ_VERSION		2
+#define SYNC_MESG_SEQ_HEADER_LEN	12
+#define MAX_CONNS_PER_SYNCBUFF_SEQ	65535
+
+/* types of sequenced messages */
+#define SYNC_MESG_CONNS		0	/* connection entries follow */
+#define SYNC_MESG_RESYNC	1	/* backup asks for the whole table */
+
+struct ip_vs_sync_mesg_seq {
+	__u8                    reserved;       /* always 0 */
+	__u8                    syncid;
+	__be16                  size;
+	__u8                    type;
+	__u8                    version;
+	__be16                  nr_conns;
+	__be32                  seq;
+
+	/* ip_vs_sync_conn entries start here */
+};
+
 /* the maximum length of sync (sending/receiving) message */
 static int sync_send_mesg_maxlen;
 static int sync_recv_mesg_maxlen;
 
+/* message version sent by the running master */
+static int sync_send_version;
+
 struct ip_vs_sync_buff {
 	struct list_head        list;
 	unsigned long           firstuse;
+	unsigned int            nr_conns;
+	unsigned int            size;           /* header included */
 
 	/* pointers for the message data */
-	struct ip_vs_sync_mesg  *mesg;
+	unsigned char           *mesg;
 	unsigned char           *head;
 	unsigned char           *end;
 };
 
 
-/* the sync_buff list head and the lock */
-static LIST_HEAD(ip_vs_sync_queue);
+/*
+ *	Filled sync_buffs wait in the queue of one of the master threads,
+ *	the CPU that filled them picks the thread.
+ */
+struct ip_vs_sync_queue {
+	struct list_head        list;
+	unsigned int            len;
+	struct task_struct      *task;
+};
+
+/* queued sync_buffs per master thread, the rest is dropped */
+#define IP_VS_SYNC_QLEN_MAX	1024
+
+static struct ip_vs_sync_queue ip_vs_sync_queues[IP_VS_SYNC_MAX_PORTS];
 static DEFINE_SPINLOCK(ip_vs_sync_lock);
 
-/* current sync_buff for accepting new conn entries */
-static struct ip_vs_sync_buff   *curr_sb = NULL;
-static DEFINE_SPINLOCK(curr_sb_lock);
+/* current sync_buff of each CPU for accepting new conn entries */
+struct ip_vs_sync_cpu {
+	spinlock_t              lock;
+	struct ip_vs_sync_buff  *sb;
+};
+
+static DEFINE_PER_CPU(struct ip_vs_sync_cpu, ip_vs_sync_cpus) = {
+	.lock = __SPIN_LOCK_UNLOCKED(ip_vs_sync_cpus.lock),
+};
+
+/* entries wait at most that long in the buffer of a CPU */
+#define IP_VS_SYNC_FLUSH_TIME	HZ
+
+/*
+ *	A resync walks the connection table in steps of
+ *	IP_VS_SYNC_RESYNC_CHAINS hash chains, at most once per
+ *	IP_VS_SYNC_RESYNC_PERIOD. Backups ask at most that often, too.
+ */
+#define IP_VS_SYNC_RESYNC_CHAINS	256
+#define IP_VS_SYNC_RESYNC_PERIOD	(10 * HZ)
+
+static int resync_active;
+static unsigned int resync_chain;
+static unsigned long resync_last;
 
 /* ipvs sync daemon state */
 volatile int ip_vs_sync_state = IP_VS_STATE_NONE;
@@ -146,29 +240,25 @@ char ip_vs_master_mcast_ifn[IP_VS_IFNAME_MAXLEN];
 char ip_vs_backup_mcast_ifn[IP_VS_IFNAME_MAXLEN];
 
 /* sync daemon tasks */
-static struct task_struct *sync_master_thread;
-static struct task_struct *sync_backup_thread;
-
-/* multicast addr */
-static struct sockaddr_in mcast_addr = {
-	.sin_family		= AF_INET,
-	.sin_port		= cpu_to_be16(IP_VS_SYNC_PORT),
-	.sin_addr.s_addr	= cpu_to_be32(IP_VS_SYNC_GROUP),
-};
+static struct task_struct *sync_master_threads[IP_VS_SYNC_MAX_PORTS];
+static struct task_struct *sync_backup_threads[IP_VS_SYNC_MAX_PORTS];
+static int sync_master_nthreads;
+static int sync_backup_nthreads;
 
 
-static inline struct ip_vs_sync_buff *sb_dequeue(void)
+static inline struct ip_vs_sync_buff *sb_dequeue(struct ip_vs_sync_queue *q)
 {
 	struct ip_vs_sync_buff *sb;
 
 	spin_lock_bh(&ip_vs_sync_lock);
-	if (list_empty(&ip_vs_sync_queue)) {
+	if (list_empty(&q->list)) {
 		sb = NULL;
 	} else {
-		sb = list_entry(ip_vs_sync_queue.next,
+		sb = list_entry(q->list.next,
 				struct ip_vs_sync_buff,
 				list);
 		list_del(&sb->list);
+		q->len--;
 	}
 	spin_unlock_bh(&ip_vs_sync_lock);
 
@@ -178,6 +268,7 @@ static inline struct ip_vs_sync_buff *sb_dequeue(void)
 static inline struct ip_vs_sync_buff * ip_vs_sync_buff_create(void)
 {
 	struct ip_vs_sync_buff *sb;
+	unsigned int hlen;
 
 	if (!(sb=kmalloc(sizeof(struct ip_vs_sync_buff), GFP_ATOMIC)))
 		return NULL;
@@ -186,11 +277,12 @@ static inline struct ip_vs_sync_buff * ip_vs_sync_buff_create(void)
 		kfree(sb);
 		return NULL;
 	}
-	sb->mesg->nr_conns = 0;
-	sb->mesg->syncid = ip_vs_master_syncid;
-	sb->mesg->size = 4;
-	sb->head = (unsigned char *)sb->mesg + 4;
-	sb->end = (unsigned char *)sb->mesg + sync_send_mesg_maxlen;
+	hlen = sync_send_version ? SYNC_MESG_SEQ_HEADER_LEN :
+		SYNC_MESG_HEADER_LEN;
+	sb->nr_conns = 0;
+	sb->size = hlen;
+	sb->head = sb->mesg + hlen;
+	sb->end = sb->mesg + sync_send_mesg_maxlen;
 	sb->firstuse = jiffies;
 	return sb;
 }
@@ -201,62 +293,121 @@ static inline void ip_vs_sync_buff_release(struct ip_vs_sync_buff *sb)
 	kfree(sb);
 }
 
-static inline void sb_queue_tail(struct ip_vs_sync_buff *sb)
+/*
+ *	Queue a filled sync_buff to the master thread serving the CPU.
+ */
+static inline void sb_queue_tail(struct ip_vs_sync_buff *sb, int cpu)
 {
-	spin_lock(&ip_vs_sync_lock);
-	if (ip_vs_sync_state & IP_VS_STATE_MASTER)
-		list_add_tail(&sb->list, &ip_vs_sync_queue);
-	else
+	struct ip_vs_sync_queue *q;
+
+	spin_lock_bh(&ip_vs_sync_lock);
+	if (!(ip_vs_sync_state & IP_VS_STATE_MASTER)) {
 		ip_vs_sync_buff_release(sb);
-	spin_unlock(&ip_vs_sync_lock);
+		goto out;
+	}
+	q = &ip_vs_sync_queues[cpu % sync_master_nthreads];
+	if (q->len >= IP_VS_SYNC_QLEN_MAX) {
+		ip_vs_sync_buff_release(sb);
+		IP_VS_ERR_RL("sync queue full, dropping sync message\n");
+		goto out;
+	}
+	list_add_tail(&sb->list, &q->list);
+	q->len++;
+	wake_up_process(q->task);
+  out:
+	spin_unlock_bh(&ip_vs_sync_lock);
 }
 
 /*
- *	Get the current sync buffer if it has been created for more
- *	than the specified time or the specified time is zero.
+ *	Queue the sync_buffs of the CPUs served by the master thread id
+ *	which have been in use for the specified time, or all of them
+ *	when the time is zero.
  */
-static inline struct ip_vs_sync_buff *
-get_curr_sync_buff(unsigned long time)
+static void ip_vs_sync_flush_cpus(int id, unsigned long time)
 {
+	struct ip_vs_sync_cpu *sc;
 	struct ip_vs_sync_buff *sb;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (cpu % sync_master_nthreads != id)
+			continue;
+
+		sc = &per_cpu(ip_vs_sync_cpus, cpu);
+		spin_lock_bh(&sc->lock);
+		sb = sc->sb;
+		if (sb && (time == 0 ||
+			   time_after_eq(jiffies, sb->firstuse + time)))
+			sc->sb = NULL;
+		else
+			sb = NULL;
+		spin_unlock_bh(&sc->lock);
 
-	spin_lock_bh(&curr_sb_lock);
-	if (curr_sb && (time == 0 ||
-			time_before(jiffies - curr_sb->firstuse, time))) {
-		sb = curr_sb;
-		curr_sb = NULL;
-	} else
-		sb = NULL;
-	spin_unlock_bh(&curr_sb_lock);
-	return sb;
+		if (sb)
+			sb_queue_tail(sb, cpu);
+	}
+}
+
+/*
+ *	Release the sync_buffs of all CPUs, the master is stopped.
+ */
+static void ip_vs_sync_release_cpus(void)
+{
+	struct ip_vs_sync_cpu *sc;
+	struct ip_vs_sync_buff *sb;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		sc = &per_cpu(ip_vs_sync_cpus, cpu);
+		spin_lock_bh(&sc->lock);
+		sb = sc->sb;
+		sc->sb = NULL;
+		spin_unlock_bh(&sc->lock);
+
+		if (sb)
+			ip_vs_sync_buff_release(sb);
+	}
 }
 
 
 /*
- *      Add an ip_vs_conn information into the current sync_buff.
- *      Called by ip_vs_in.
+ *      Add an ip_vs_conn information into the sync_buff of this CPU.
+ *      Called by ip_vs_in, and by the master thread during a resync,
+ *      both with bottom halves disabled.
  */
 void ip_vs_sync_conn(struct ip_vs_conn *cp)
 {
-	struct ip_vs_sync_mesg *m;
+	struct ip_vs_sync_cpu *sc;
+	struct ip_vs_sync_buff *sb;
 	struct ip_vs_sync_conn *s;
-	int len;
+	unsigned int max_conns;
+	int cpu, len;
+
+	cpu = smp_processor_id();
+	sc = &per_cpu(ip_vs_sync_cpus, cpu);
 
-	spin_lock(&curr_sb_lock);
-	if (!curr_sb) {
-		if (!(curr_sb=ip_vs_sync_buff_create())) {
-			spin_unlock(&curr_sb_lock);
+	spin_lock(&sc->lock);
+	/* stop_sync_thread() releases the buffers after this is cleared */
+	if (!(ip_vs_sync_state & IP_VS_STATE_MASTER)) {
+		spin_unlock(&sc->lock);
+		return;
+	}
+	sb = sc->sb;
+	if (!sb) {
+		if (!(sb=ip_vs_sync_buff_create())) {
+			spin_unlock(&sc->lock);
 			pr_err("ip_vs_sync_buff_create failed.\n");
 			return;
 		}
+		sc->sb = sb;
 	}
 
 	len = (cp->flags & IP_VS_CONN_F_SEQ_MASK) ? FULL_CONN_SIZE :
 		SIMPLE_CONN_SIZE;
-	m = curr_sb->mesg;
-	s = (struct ip_vs_sync_conn *)curr_sb->head;
+	s = (struct ip_vs_sync_conn *)sb->head;
 
 	/* copy members */
+	s->reserved = 0;
 	s->protocol = cp->protocol;
 	s->cport = cp->cport;
 	s->vport = cp->vport;
@@ -272,16 +423,20 @@ void ip_vs_sync_conn(struct ip_vs_conn *cp)
 		memcpy(opt, &cp->in_seq, sizeof(*opt));
 	}
 
-	m->nr_conns++;
-	m->size += len;
-	curr_sb->head += len;
+	sb->nr_conns++;
+	sb->size += len;
+	sb->head += len;
 
 	/* check if there is a space for next one */
-	if (curr_sb->head+FULL_CONN_SIZE > curr_sb->end) {
-		sb_queue_tail(curr_sb);
-		curr_sb = NULL;
-	}
-	spin_unlock(&curr_sb_lock);
+	max_conns = sync_send_version ? MAX_CONNS_PER_SYNCBUFF_SEQ :
+		MAX_CONNS_PER_SYNCBUFF;
+	if (sb->head + FULL_CONN_SIZE > sb->end ||
+	    sb->nr_conns >= max_conns) {
+		sc->sb = NULL;
+		spin_unlock(&sc->lock);
+		sb_queue_tail(sb, cpu);
+	} else
+		spin_unlock(&sc->lock);
 
 	/* synchronize its controller if it has */
 	if (cp->control)
@@ -290,42 +445,20 @@ void ip_vs_sync_conn(struct ip_vs_conn *cp)
 
 
 /*
- *      Process received multicast message and create the corresponding
- *      ip_vs_conn entries.
+ *      Process the connection entries of a received message and create
+ *      the corresponding ip_vs_conn entries.
  */
-static void ip_vs_process_message(const char *buffer, const size_t buflen)
+static void ip_vs_process_conns(const char *buffer, const size_t buflen,
+				char *p, unsigned int nr_conns)
 {
-	struct ip_vs_sync_mesg *m = (struct ip_vs_sync_mesg *)buffer;
 	struct ip_vs_sync_conn *s;
 	struct ip_vs_sync_conn_options *opt;
 	struct ip_vs_conn *cp;
 	struct ip_vs_protocol *pp;
 	struct ip_vs_dest *dest;
-	char *p;
-	int i;
+	unsigned int i;
 
-	if (buflen < sizeof(struct ip_vs_sync_mesg)) {
-		IP_VS_ERR_RL("sync message header too short\n");
-		return;
-	}
-
-	/* Convert size back to host byte order */
-	m->size = ntohs(m->size);
-
-	if (buflen != m->size) {
-		IP_VS_ERR_RL("bogus sync message size\n");
-		return;
-	}
-
-	/* SyncID sanity check */
-	if (ip_vs_backup_syncid != 0 && m->syncid != ip_vs_backup_syncid) {
-		IP_VS_DBG(7, "Ignoring incoming msg with syncid = %d\n",
-			  m->syncid);
-		return;
-	}
-
-	p = (char *)buffer + sizeof(struct ip_vs_sync_mesg);
-	for (i=0; i<m->nr_conns; i++) {
+	for (i=0; i<nr_conns; i++) {
 		unsigned flags, state;
 
 		if (p + SIMPLE_CONN_SIZE > buffer+buflen) {
@@ -456,6 +589,79 @@ static void ip_vs_process_message(const char *buffer, const size_t buflen)
 }
 
 
+/*
+ *      Check the sequence number of a sequenced message. A gap, or a
+ *      master we have not heard from before, asks for a resync.
+ */
+static void ip_vs_sync_check_seq(struct ip_vs_sync_thread_data *tinfo,
+				 const struct sockaddr_in *from, u32 seq)
+{
+	if (!tinfo->seq_valid ||
+	    tinfo->peer.sin_addr.s_addr != from->sin_addr.s_addr ||
+	    tinfo->peer.sin_port != from->sin_port) {
+		tinfo->peer = *from;
+		tinfo->seq_valid = 1;
+		tinfo->resync_wanted = 1;
+	} else if (seq != tinfo->next_seq) {
+		IP_VS_DBG(2, "sync thread %d lost %u messages from %pI4\n",
+			  tinfo->id, seq - tinfo->next_seq,
+			  &from->sin_addr.s_addr);
+		tinfo->resync_wanted = 1;
+	}
+	tinfo->next_seq = seq + 1;
+}
+
+
+/*
+ *      Process received multicast message and create the corresponding
+ *      ip_vs_conn entries.
+ */
+static void ip_vs_process_message(struct ip_vs_sync_thread_data *tinfo,
+				  const char *buffer, const size_t buflen,
+				  const struct sockaddr_in *from)
+{
+	struct ip_vs_sync_mesg *m = (struct ip_vs_sync_mesg *)buffer;
+	struct ip_vs_sync_mesg_seq *m1 = (struct ip_vs_sync_mesg_seq *)buffer;
+	unsigned int nr_conns, hlen;
+
+	if (buflen < sizeof(struct ip_vs_sync_mesg)) {
+		IP_VS_ERR_RL("sync message header too short\n");
+		return;
+	}
+
+	/* the size is at the same place in all versions */
+	if (buflen != ntohs(m->size)) {
+		IP_VS_ERR_RL("bogus sync message size\n");
+		return;
+	}
+
+	/* SyncID sanity check */
+	if (ip_vs_backup_syncid != 0 && m->syncid != ip_vs_backup_syncid) {
+		IP_VS_DBG(7, "Ignoring incoming msg with syncid = %d\n",
+			  m->syncid);
+		return;
+	}
+
+	if (m->nr_conns == 0) {
+		if (buflen < SYNC_MESG_SEQ_HEADER_LEN ||
+		    m1->version != SYNC_MESG_SEQ_VERSION) {
+			IP_VS_ERR_RL("unsupported sync message version\n");
+			return;
+		}
+		if (m1->type != SYNC_MESG_CONNS)
+			return;
+		ip_vs_sync_check_seq(tinfo, from, ntohl(m1->seq));
+		nr_conns = ntohs(m1->nr_conns);
+		hlen = SYNC_MESG_SEQ_HEADER_LEN;
+	} else {
+		nr_conns = m->nr_conns;
+		hlen = SYNC_MESG_HEADER_LEN;
+	}
+
+	ip_vs_process_conns(buffer, buflen, (char *)buffer + hlen, nr_conns);
+}
+
+
 /*
  *      Setup loopback of outgoing multicasts on a sending socket
  */
@@ -512,17 +718,23 @@ static int set_mcast_if(struct sock *sk, char *ifname)
 static int set_sync_mesg_maxlen(int sync_state)
 {
 	struct net_device *dev;
-	int num;
+	int num, hlen, max_conns;
 
 	if (sync_state == IP_VS_STATE_MASTER) {
 		if ((dev = __dev_get_by_name(&init_net, ip_vs_master_mcast_ifn)) == NULL)
 			return -ENODEV;
 
+		if (sync_send_version) {
+			hlen = SYNC_MESG_SEQ_HEADER_LEN;
+			max_conns = MAX_CONNS_PER_SYNCBUFF_SEQ;
+		} else {
+			hlen = SYNC_MESG_HEADER_LEN;
+			max_conns = MAX_CONNS_PER_SYNCBUFF;
+		}
 		num = (dev->mtu - sizeof(struct iphdr) -
-		       sizeof(struct udphdr) -
-		       SYNC_MESG_HEADER_LEN - 20) / SIMPLE_CONN_SIZE;
-		sync_send_mesg_maxlen = SYNC_MESG_HEADER_LEN +
-			SIMPLE_CONN_SIZE * min(num, MAX_CONNS_PER_SYNCBUFF);
+		       sizeof(struct udphdr) - hlen - 20) / SIMPLE_CONN_SIZE;
+		sync_send_mesg_maxlen = hlen +
+			SIMPLE_CONN_SIZE * min(num, max_conns);
 		IP_VS_DBG(7, "setting the maximum length of sync sending "
 			  "message %d.\n", sync_send_mesg_maxlen);
 	} else if (sync_state == IP_VS_STATE_BACKUP) {
@@ -596,6 +808,9 @@ static int bind_mcastif_addr(struct socket *sock, char *ifname)
 
 /*
  *      Set up sending multicast socket over UDP
+ *
+ *      The socket is not connected: the master sends to the port of each
+ *      thread and receives the resync requests of the backups on it.
  */
 static struct socket * make_send_sock(void)
 {
@@ -624,13 +839,6 @@ static struct socket * make_send_sock(void)
 		goto error;
 	}
 
-	result = sock->ops->connect(sock, (struct sockaddr *) &mcast_addr,
-			sizeof(struct sockaddr), 0);
-	if (result < 0) {
-		pr_err("Error connecting to the multicast addr\n");
-		goto error;
-	}
-
 	return sock;
 
   error:
@@ -642,7 +850,7 @@ static struct socket * make_send_sock(void)
 /*
  *      Set up receiving multicast socket over UDP
  */
-static struct socket * make_receive_sock(void)
+static struct socket * make_receive_sock(struct sockaddr_in *mcast)
 {
 	struct socket *sock;
 	int result;
@@ -657,7 +865,7 @@ static struct socket * make_receive_sock(void)
 	/* it is equivalent to the REUSEADDR option in user-space */
 	sock->sk->sk_reuse = 1;
 
-	result = sock->ops->bind(sock, (struct sockaddr *) &mcast_addr,
+	result = sock->ops->bind(sock, (struct sockaddr *) mcast,
 			sizeof(struct sockaddr));
 	if (result < 0) {
 		pr_err("Error binding to the multicast addr\n");
@@ -666,7 +874,7 @@ static struct socket * make_receive_sock(void)
 
 	/* join the multicast group */
 	result = join_mcast_group(sock->sk,
-			(struct in_addr *) &mcast_addr.sin_addr,
+			(struct in_addr *) &mcast->sin_addr,
 			ip_vs_backup_mcast_ifn);
 	if (result < 0) {
 		pr_err("Error joining to the multicast group\n");
@@ -681,14 +889,42 @@ static struct socket * make_receive_sock(void)
 }
 
 
+/*
+ *      Set up the UDP socket a backup sends its resync requests from
+ */
+static struct socket * make_resync_sock(void)
+{
+	struct socket *sock;
+	int result;
+
+	result = sock_create_kern(PF_INET, SOCK_DGRAM, IPPROTO_UDP, &sock);
+	if (result < 0) {
+		pr_err("Error during creation of socket; terminating\n");
+		return ERR_PTR(result);
+	}
+
+	result = bind_mcastif_addr(sock, ip_vs_backup_mcast_ifn);
+	if (result < 0) {
+		pr_err("Error binding address of the mcast interface\n");
+		sock_release(sock);
+		return ERR_PTR(result);
+	}
+
+	return sock;
+}
+
+
 static int
-ip_vs_send_async(struct socket *sock, const char *buffer, const size_t length)
+ip_vs_send_async(struct socket *sock, struct sockaddr_in *to,
+		 const char *buffer, const size_t length)
 {
 	struct msghdr	msg = {.msg_flags = MSG_DONTWAIT|MSG_NOSIGNAL};
 	struct kvec	iov;
 	int		len;
 
 	EnterFunction(7);
+	msg.msg_name     = to;
+	msg.msg_namelen  = sizeof(*to);
 	iov.iov_base     = (void *)buffer;
 	iov.iov_len      = length;
 
@@ -698,22 +934,41 @@ ip_vs_send_async(struct socket *sock, const char *buffer, const size_t length)
 	return len;
 }
 
+/*
+ *      Fill in the message header of a sync_buff and send it to the
+ *      backups.
+ */
 static void
-ip_vs_send_sync_msg(struct socket *sock, struct ip_vs_sync_mesg *msg)
+ip_vs_send_sync_buff(struct ip_vs_sync_thread_data *tinfo,
+		     struct ip_vs_sync_buff *sb)
 {
-	int msize;
-
-	msize = msg->size;
+	if (sync_send_version) {
+		struct ip_vs_sync_mesg_seq *m =
+			(struct ip_vs_sync_mesg_seq *)sb->mesg;
+
+		m->reserved = 0;
+		m->syncid = ip_vs_master_syncid;
+		m->size = htons(sb->size);
+		m->version = SYNC_MESG_SEQ_VERSION;
+		m->type = SYNC_MESG_CONNS;
+		m->nr_conns = htons(sb->nr_conns);
+		m->seq = htonl(tinfo->seq++);
+	} else {
+		struct ip_vs_sync_mesg *m = (struct ip_vs_sync_mesg *)sb->mesg;
 
-	/* Put size in network byte order */
-	msg->size = htons(msg->size);
+		m->nr_conns = sb->nr_conns;
+		m->syncid = ip_vs_master_syncid;
+		m->size = htons(sb->size);
+	}
 
-	if (ip_vs_send_async(sock, (char *)msg, msize) != msize)
+	if (ip_vs_send_async(tinfo->sock, &tinfo->mcast, sb->mesg,
+			     sb->size) != sb->size)
 		pr_err("ip_vs_send_async error\n");
 }
 
 static int
-ip_vs_receive(struct socket *sock, char *buffer, const size_t buflen)
+ip_vs_receive(struct socket *sock, char *buffer, const size_t buflen,
+	      struct sockaddr_in *from, int flags)
 {
 	struct msghdr		msg = {NULL,};
 	struct kvec		iov;
@@ -722,10 +977,12 @@ ip_vs_receive(struct socket *sock, char *buffer, const size_t buflen)
 	EnterFunction(7);
 
 	/* Receive a packet */
+	msg.msg_name     = from;
+	msg.msg_namelen  = sizeof(*from);
 	iov.iov_base     = buffer;
 	iov.iov_len      = (size_t)buflen;
 
-	len = kernel_recvmsg(sock, &msg, &iov, 1, buflen, 0);
+	len = kernel_recvmsg(sock, &msg, &iov, 1, buflen, flags);
 
 	if (len < 0)
 		return -1;
@@ -735,38 +992,143 @@ ip_vs_receive(struct socket *sock, char *buffer, const size_t buflen)
 }
 
 
+/*
+ *      Start a resync unless one is running or the last one is recent.
+ */
+static void ip_vs_sync_request_resync(void)
+{
+	spin_lock_bh(&ip_vs_sync_lock);
+	if (!resync_active &&
+	    time_after_eq(jiffies, resync_last + IP_VS_SYNC_RESYNC_PERIOD)) {
+		resync_active = 1;
+		resync_chain = 0;
+		resync_last = jiffies;
+		wake_up_process(ip_vs_sync_queues[0].task);
+	}
+	spin_unlock_bh(&ip_vs_sync_lock);
+}
+
+/*
+ *      Read the resync requests the backups sent to a master thread.
+ */
+static void ip_vs_sync_read_requests(struct ip_vs_sync_thread_data *tinfo)
+{
+	struct ip_vs_sync_mesg_seq req;
+	struct sockaddr_in from;
+	int len;
+
+	while (!skb_queue_empty(&tinfo->sock->sk->sk_receive_queue)) {
+		len = ip_vs_receive(tinfo->sock, (char *)&req, sizeof(req),
+				    &from, MSG_DONTWAIT);
+		if (len < 0)
+			break;
+
+		if (len != sizeof(req) || ntohs(req.size) != sizeof(req) ||
+		    req.reserved != 0 ||
+		    req.version != SYNC_MESG_SEQ_VERSION ||
+		    req.type != SYNC_MESG_RESYNC)
+			continue;
+		if (req.syncid != 0 && req.syncid != ip_vs_master_syncid)
+			continue;
+
+		IP_VS_DBG(2, "resync requested by %pI4\n",
+			  &from.sin_addr.s_addr);
+		ip_vs_sync_request_resync();
+	}
+}
+
+/*
+ *      Pass the next hash chains of a running resync to the sync daemon,
+ *      unless the queues are still busy with the last step.
+ *      Returns 1 when a step was done.
+ */
+static int ip_vs_sync_resync_step(void)
+{
+	unsigned int qlen = 0;
+	int i;
+
+	spin_lock_bh(&ip_vs_sync_lock);
+	if (resync_active) {
+		for (i = 0; i < sync_master_nthreads; i++)
+			qlen += ip_vs_sync_queues[i].len;
+	}
+	spin_unlock_bh(&ip_vs_sync_lock);
+
+	if (!resync_active || qlen >= IP_VS_SYNC_QLEN_MAX / 4)
+		return 0;
+
+	resync_chain = ip_vs_conn_sync_chains(resync_chain,
+					      IP_VS_SYNC_RESYNC_CHAINS);
+	if (!resync_chain) {
+		spin_lock_bh(&ip_vs_sync_lock);
+		resync_active = 0;
+		spin_unlock_bh(&ip_vs_sync_lock);
+		IP_VS_DBG(2, "resync done\n");
+	}
+	return 1;
+}
+
+/*
+ *      Ask the master for its whole connection table. Requests are sent
+ *      at most once per IP_VS_SYNC_RESYNC_PERIOD, a pending one waits
+ *      for the next message.
+ */
+static void ip_vs_sync_send_resync(struct ip_vs_sync_thread_data *tinfo)
+{
+	struct ip_vs_sync_mesg_seq req;
+
+	if (time_before(jiffies,
+			tinfo->resync_sent + IP_VS_SYNC_RESYNC_PERIOD))
+		return;
+
+	memset(&req, 0, sizeof(req));
+	req.syncid = ip_vs_backup_syncid;
+	req.size = htons(sizeof(req));
+	req.version = SYNC_MESG_SEQ_VERSION;
+	req.type = SYNC_MESG_RESYNC;
+
+	tinfo->resync_sent = jiffies;
+	tinfo->resync_wanted = 0;
+	if (ip_vs_send_async(tinfo->rsock, &tinfo->peer, (char *)&req,
+			     sizeof(req)) != sizeof(req))
+		IP_VS_ERR_RL("sending resync request failed\n");
+}
+
+
 static int sync_thread_master(void *data)
 {
 	struct ip_vs_sync_thread_data *tinfo = data;
+	struct ip_vs_sync_queue *q = &ip_vs_sync_queues[tinfo->id];
 	struct ip_vs_sync_buff *sb;
 
-	pr_info("sync thread started: state = MASTER, mcast_ifn = %s, "
-		"syncid = %d\n",
-		ip_vs_master_mcast_ifn, ip_vs_master_syncid);
+	pr_info("sync thread %d started: state = MASTER, mcast_ifn = %s, "
+		"syncid = %d, version = %d\n", tinfo->id,
+		ip_vs_master_mcast_ifn, ip_vs_master_syncid,
+		sync_send_version);
 
 	while (!kthread_should_stop()) {
-		while ((sb = sb_dequeue())) {
-			ip_vs_send_sync_msg(tinfo->sock, sb->mesg);
+		while ((sb = sb_dequeue(q))) {
+			ip_vs_send_sync_buff(tinfo, sb);
 			ip_vs_sync_buff_release(sb);
 		}
 
-		/* check if entries stay in curr_sb for 2 seconds */
-		sb = get_curr_sync_buff(2 * HZ);
-		if (sb) {
-			ip_vs_send_sync_msg(tinfo->sock, sb->mesg);
-			ip_vs_sync_buff_release(sb);
+		/* send the entries which stay in the CPU buffers too long */
+		ip_vs_sync_flush_cpus(tinfo->id, IP_VS_SYNC_FLUSH_TIME);
+
+		ip_vs_sync_read_requests(tinfo);
+		if (tinfo->id == 0 && ip_vs_sync_resync_step()) {
+			cond_resched();
+			continue;
 		}
 
-		schedule_timeout_interruptible(HZ);
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (list_empty(&q->list) && !kthread_should_stop())
+			schedule_timeout(resync_active ? 1 : HZ);
+		__set_current_state(TASK_RUNNING);
 	}
 
 	/* clean up the sync_buff queue */
-	while ((sb=sb_dequeue())) {
-		ip_vs_sync_buff_release(sb);
-	}
-
-	/* clean up the current sync_buff */
-	if ((sb = get_curr_sync_buff(0))) {
+	while ((sb=sb_dequeue(q))) {
 		ip_vs_sync_buff_release(sb);
 	}
 
@@ -781,10 +1143,11 @@ static int sync_thread_master(void *data)
 static int sync_thread_backup(void *data)
 {
 	struct ip_vs_sync_thread_data *tinfo = data;
+	struct sockaddr_in from;
 	int len;
 
-	pr_info("sync thread started: state = BACKUP, mcast_ifn = %s, "
-		"syncid = %d\n",
+	pr_info("sync thread %d started: state = BACKUP, mcast_ifn = %s, "
+		"syncid = %d\n", tinfo->id,
 		ip_vs_backup_mcast_ifn, ip_vs_backup_syncid);
 
 	while (!kthread_should_stop()) {
@@ -795,7 +1158,7 @@ static int sync_thread_backup(void *data)
 		/* do we have data now? */
 		while (!skb_queue_empty(&(tinfo->sock->sk->sk_receive_queue))) {
 			len = ip_vs_receive(tinfo->sock, tinfo->buf,
-					sync_recv_mesg_maxlen);
+					sync_recv_mesg_maxlen, &from, 0);
 			if (len <= 0) {
 				pr_err("receiving message error\n");
 				break;
@@ -804,12 +1167,16 @@ static int sync_thread_backup(void *data)
 			/* disable bottom half, because it accesses the data
 			   shared by softirq while getting/creating conns */
 			local_bh_disable();
-			ip_vs_process_message(tinfo->buf, len);
+			ip_vs_process_message(tinfo, tinfo->buf, len, &from);
 			local_bh_enable();
+
+			if (tinfo->resync_wanted)
+				ip_vs_sync_send_resync(tinfo);
 		}
 	}
 
-	/* release the sending multicast socket */
+	/* release the sockets */
+	sock_release(tinfo->rsock);
 	sock_release(tinfo->sock);
 	kfree(tinfo->buf);
 	kfree(tinfo);
@@ -818,126 +1185,212 @@ static int sync_thread_backup(void *data)
 }
 
 
-int start_sync_thread(int state, char *mcast_ifn, __u8 syncid)
+/*
+ *      Allocate the data of sync thread id with its sockets
+ */
+static struct ip_vs_sync_thread_data *
+ip_vs_sync_thread_data_alloc(int state, int id)
 {
 	struct ip_vs_sync_thread_data *tinfo;
-	struct task_struct **realtask, *task;
 	struct socket *sock;
-	char *name, *buf = NULL;
-	int (*threadfn)(void *data);
 	int result = -ENOMEM;
 
+	tinfo = kzalloc(sizeof(*tinfo), GFP_KERNEL);
+	if (!tinfo)
+		goto out;
+
+	tinfo->id = id;
+	tinfo->mcast.sin_family = AF_INET;
+	tinfo->mcast.sin_port = htons(IP_VS_SYNC_PORT + id);
+	tinfo->mcast.sin_addr.s_addr = htonl(IP_VS_SYNC_GROUP);
+
+	if (state == IP_VS_STATE_MASTER) {
+		sock = make_send_sock();
+		if (IS_ERR(sock)) {
+			result = PTR_ERR(sock);
+			goto outtinfo;
+		}
+		tinfo->sock = sock;
+		return tinfo;
+	}
+
+	tinfo->buf = kmalloc(sync_recv_mesg_maxlen, GFP_KERNEL);
+	if (!tinfo->buf)
+		goto outtinfo;
+
+	sock = make_receive_sock(&tinfo->mcast);
+	if (IS_ERR(sock)) {
+		result = PTR_ERR(sock);
+		goto outbuf;
+	}
+	tinfo->sock = sock;
+
+	sock = make_resync_sock();
+	if (IS_ERR(sock)) {
+		result = PTR_ERR(sock);
+		goto outsocket;
+	}
+	tinfo->rsock = sock;
+	tinfo->resync_sent = jiffies - IP_VS_SYNC_RESYNC_PERIOD;
+	return tinfo;
+
+outsocket:
+	sock_release(tinfo->sock);
+outbuf:
+	kfree(tinfo->buf);
+outtinfo:
+	kfree(tinfo);
+out:
+	return ERR_PTR(result);
+}
+
+
+int start_sync_thread(int state, char *mcast_ifn, __u8 syncid)
+{
+	struct ip_vs_sync_thread_data *tinfo;
+	struct task_struct **tasks, *task;
+	int *nthreads;
+	char *name;
+	int (*threadfn)(void *data);
+	int id, n, result;
+
 	IP_VS_DBG(7, "%s(): pid %d\n", __func__, task_pid_nr(current));
 	IP_VS_DBG(7, "Each ip_vs_sync_conn entry needs %Zd bytes\n",
 		  sizeof(struct ip_vs_sync_conn));
 
+	/* the number of threads is taken when the daemon starts */
+	n = clamp(sysctl_ip_vs_sync_ports, 1, IP_VS_SYNC_MAX_PORTS);
+
 	if (state == IP_VS_STATE_MASTER) {
-		if (sync_master_thread)
+		if (sync_master_nthreads)
 			return -EEXIST;
 
 		strlcpy(ip_vs_master_mcast_ifn, mcast_ifn,
 			sizeof(ip_vs_master_mcast_ifn));
 		ip_vs_master_syncid = syncid;
-		realtask = &sync_master_thread;
+		sync_send_version = sysctl_ip_vs_sync_version;
+		tasks = sync_master_threads;
+		nthreads = &sync_master_nthreads;
 		name = "ipvs_syncmaster";
 		threadfn = sync_thread_master;
-		sock = make_send_sock();
+
+		resync_active = 0;
+		resync_last = jiffies - IP_VS_SYNC_RESYNC_PERIOD;
+		for (id = 0; id < n; id++) {
+			INIT_LIST_HEAD(&ip_vs_sync_queues[id].list);
+			ip_vs_sync_queues[id].len = 0;
+		}
 	} else if (state == IP_VS_STATE_BACKUP) {
-		if (sync_backup_thread)
+		if (sync_backup_nthreads)
 			return -EEXIST;
 
 		strlcpy(ip_vs_backup_mcast_ifn, mcast_ifn,
 			sizeof(ip_vs_backup_mcast_ifn));
 		ip_vs_backup_syncid = syncid;
-		realtask = &sync_backup_thread;
+		tasks = sync_backup_threads;
+		nthreads = &sync_backup_nthreads;
 		name = "ipvs_syncbackup";
 		threadfn = sync_thread_backup;
-		sock = make_receive_sock();
 	} else {
 		return -EINVAL;
 	}
 
-	if (IS_ERR(sock)) {
-		result = PTR_ERR(sock);
-		goto out;
-	}
+	result = set_sync_mesg_maxlen(state);
+	if (result < 0)
+		return result;
 
-	set_sync_mesg_maxlen(state);
-	if (state == IP_VS_STATE_BACKUP) {
-		buf = kmalloc(sync_recv_mesg_maxlen, GFP_KERNEL);
-		if (!buf)
-			goto outsocket;
-	}
+	/* the master threads map the CPUs to their queues with this */
+	*nthreads = n;
 
-	tinfo = kmalloc(sizeof(*tinfo), GFP_KERNEL);
-	if (!tinfo)
-		goto outbuf;
-
-	tinfo->sock = sock;
-	tinfo->buf = buf;
+	for (id = 0; id < n; id++) {
+		tinfo = ip_vs_sync_thread_data_alloc(state, id);
+		if (IS_ERR(tinfo)) {
+			result = PTR_ERR(tinfo);
+			goto outthreads;
+		}
 
-	task = kthread_run(threadfn, tinfo, name);
-	if (IS_ERR(task)) {
-		result = PTR_ERR(task);
-		goto outtinfo;
+		task = kthread_create(threadfn, tinfo, "%s:%d", name, id);
+		if (IS_ERR(task)) {
+			result = PTR_ERR(task);
+			sock_release(tinfo->sock);
+			if (tinfo->rsock)
+				sock_release(tinfo->rsock);
+			kfree(tinfo->buf);
+			kfree(tinfo);
+			goto outthreads;
+		}
+		tasks[id] = task;
+		if (state == IP_VS_STATE_MASTER)
+			ip_vs_sync_queues[id].task = task;
+		wake_up_process(task);
 	}
 
 	/* mark as active */
-	*realtask = task;
+	spin_lock_bh(&ip_vs_sync_lock);
 	ip_vs_sync_state |= state;
+	spin_unlock_bh(&ip_vs_sync_lock);
 
 	/* increase the module use count */
 	ip_vs_use_count_inc();
 
 	return 0;
 
-outtinfo:
-	kfree(tinfo);
-outbuf:
-	kfree(buf);
-outsocket:
-	sock_release(sock);
-out:
+outthreads:
+	while (--id >= 0) {
+		kthread_stop(tasks[id]);
+		tasks[id] = NULL;
+	}
+	*nthreads = 0;
 	return result;
 }
 
 
 int stop_sync_thread(int state)
 {
+	struct task_struct **tasks;
+	int *nthreads;
+	int id;
+
 	IP_VS_DBG(7, "%s(): pid %d\n", __func__, task_pid_nr(current));
 
 	if (state == IP_VS_STATE_MASTER) {
-		if (!sync_master_thread)
+		if (!sync_master_nthreads)
 			return -ESRCH;
 
-		pr_info("stopping master sync thread %d ...\n",
-			task_pid_nr(sync_master_thread));
-
-		/*
-		 * The lock synchronizes with sb_queue_tail(), so that we don't
-		 * add sync buffers to the queue, when we are already in
-		 * progress of stopping the master sync daemon.
-		 */
-
-		spin_lock_bh(&ip_vs_sync_lock);
-		ip_vs_sync_state &= ~IP_VS_STATE_MASTER;
-		spin_unlock_bh(&ip_vs_sync_lock);
-		kthread_stop(sync_master_thread);
-		sync_master_thread = NULL;
+		tasks = sync_master_threads;
+		nthreads = &sync_master_nthreads;
 	} else if (state == IP_VS_STATE_BACKUP) {
-		if (!sync_backup_thread)
+		if (!sync_backup_nthreads)
 			return -ESRCH;
 
-		pr_info("stopping backup sync thread %d ...\n",
-			task_pid_nr(sync_backup_thread));
-
-		ip_vs_sync_state &= ~IP_VS_STATE_BACKUP;
-		kthread_stop(sync_backup_thread);
-		sync_backup_thread = NULL;
+		tasks = sync_backup_threads;
+		nthreads = &sync_backup_nthreads;
 	} else {
 		return -EINVAL;
 	}
 
+	pr_info("stopping %d %s sync threads ...\n", *nthreads,
+		state == IP_VS_STATE_MASTER ? "master" : "backup");
+
+	/*
+	 * The lock synchronizes with sb_queue_tail(), so that we don't
+	 * add sync buffers to the queues, when we are already in
+	 * progress of stopping the master sync daemon.
+	 */
+	spin_lock_bh(&ip_vs_sync_lock);
+	ip_vs_sync_state &= ~state;
+	spin_unlock_bh(&ip_vs_sync_lock);
+
+	for (id = 0; id < *nthreads; id++) {
+		kthread_stop(tasks[id]);
+		tasks[id] = NULL;
+	}
+
+	/* nothing is added to the CPU buffers any more */
+	if (state == IP_VS_STATE_MASTER)
+		ip_vs_sync_release_cpus();
+	*nthreads = 0;
+
 	/* decrease the module use count */
 	ip_vs_use_count_dec();
 
@@ -0,0 +1,331 @@
+/*
+ * Software flow table for established, forwarded connections.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/types.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/netdevice.h>
+#include <linux/workqueue.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_acct.h>
+#include <net/netfilter/nf_flow_table.h>
+
+static unsigned int nf_flow_htable_size __read_mostly = 4096;
+module_param_named(hashsize, nf_flow_htable_size, uint, 0400);
+MODULE_PARM_DESC(hashsize, "number of flow table buckets");
+
+static unsigned int nf_flow_max __read_mostly = 65536;
+module_param_named(max, nf_flow_max, uint, 0600);
+MODULE_PARM_DESC(max, "maximum number of offloaded connections");
+
+static struct hlist_head *nf_flow_hash __read_mostly;
+static unsigned int nf_flow_hash_rnd __read_mostly;
+static struct kmem_cache *nf_flow_cachep __read_mostly;
+static atomic_t nf_flow_count = ATOMIC_INIT(0);
+
+/* protects the hash chains, lookups are lockless under RCU */
+static DEFINE_SPINLOCK(nf_flow_lock);
+
+static struct delayed_work nf_flow_gc_work;
+
+static unsigned int flow_offload_hash(const struct flow_offload_tuple *tuple)
+{
+	u32 h = jhash(tuple, FLOW_OFFLOAD_TUPLE_KEYLEN, nf_flow_hash_rnd);
+
+	return ((u64)h * nf_flow_htable_size) >> 32;
+}
+
+/* Caller holds rcu_read_lock(); the tuple must be zeroed before it is
+ * filled in, it is compared with memcmp(). */
+struct flow_offload_tuple_hash *
+flow_offload_lookup(const struct flow_offload_tuple *tuple)
+{
+	struct flow_offload_tuple_hash *thash;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(thash, n,
+				 &nf_flow_hash[flow_offload_hash(tuple)], node) {
+		if (!memcmp(&thash->tuple, tuple, FLOW_OFFLOAD_TUPLE_KEYLEN))
+			return thash;
+	}
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(flow_offload_lookup);
+
+static void flow_offload_fill_dir(struct flow_offload *flow,
+				  const struct nf_conn *ct,
+				  const struct nf_flow_route *route,
+				  enum ip_conntrack_dir dir)
+{
+	struct flow_offload_tuple_hash *thash = &flow->tuplehash[dir];
+	const struct nf_conntrack_tuple *t = &ct->tuplehash[dir].tuple;
+	struct dst_entry *dst = route->tuple[dir].dst;
+
+	thash->tuple.src_v4	= t->src.u3.ip;
+	thash->tuple.dst_v4	= t->dst.u3.ip;
+	thash->tuple.src_port	= t->src.u.all;
+	thash->tuple.dst_port	= t->dst.u.all;
+	thash->tuple.iifidx	= route->tuple[dir].ifindex;
+	thash->tuple.l3proto	= t->src.l3num;
+	thash->tuple.l4proto	= t->dst.protonum;
+	thash->tuple.dir	= dir;
+
+	dst_hold(dst);
+	thash->dst_cache = dst;
+	thash->mtu = dst_mtu(dst);
+}
+
+/* The fast path does not track TCP windows, so packets that come back
+ * to conntrack after the flow is torn down (FIN, RST) would fail the
+ * window check against stale state.  Let conntrack accept them. */
+static void flow_offload_fixup_tcp(struct nf_conn *ct)
+{
+	struct ip_ct_tcp *tcp = &ct->proto.tcp;
+
+	spin_lock_bh(&ct->lock);
+	tcp->seen[0].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+	tcp->seen[1].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+	spin_unlock_bh(&ct->lock);
+}
+
+/* Offload both directions of an established connection.  The caller
+ * holds a reference on ct and on both routes. */
+int flow_offload_add(struct nf_conn *ct, const struct nf_flow_route *route)
+{
+	struct flow_offload *flow;
+	int dir;
+
+	if (nf_flow_max && atomic_read(&nf_flow_count) >= nf_flow_max)
+		return -ENOSPC;
+
+	/* one flow per connection */
+	if (test_and_set_bit(IPS_OFFLOAD_BIT, &ct->status))
+		return -EEXIST;
+
+	flow = kmem_cache_zalloc(nf_flow_cachep, GFP_ATOMIC);
+	if (flow == NULL) {
+		clear_bit(IPS_OFFLOAD_BIT, &ct->status);
+		return -ENOMEM;
+	}
+
+	if (nf_ct_protonum(ct) == IPPROTO_TCP)
+		flow_offload_fixup_tcp(ct);
+
+	nf_conntrack_get(&ct->ct_general);
+	flow->ct = ct;
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++)
+		flow_offload_fill_dir(flow, ct, route, dir);
+
+	flow->timeout = nfct_time_stamp + NF_FLOW_TIMEOUT;
+	flow->ct_timeout = nf_ct_expires(ct);
+
+	spin_lock_bh(&nf_flow_lock);
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++)
+		hlist_add_head_rcu(&flow->tuplehash[dir].node,
+			&nf_flow_hash[flow_offload_hash(&flow->tuplehash[dir].tuple)]);
+	atomic_inc(&nf_flow_count);
+	spin_unlock_bh(&nf_flow_lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(flow_offload_add);
+
+static void flow_offload_free_rcu(struct rcu_head *head)
+{
+	struct flow_offload *flow = container_of(head, struct flow_offload,
+						 rcu_head);
+	int dir;
+
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++)
+		dst_release(flow->tuplehash[dir].dst_cache);
+	nf_ct_put(flow->ct);
+	kmem_cache_free(nf_flow_cachep, flow);
+}
+
+/* Hand the fast path packet counts over to conntrack and push its
+ * timeout forward as if it had seen the packets itself. */
+static void flow_offload_sync(struct flow_offload *flow)
+{
+	struct nf_conn *ct = flow->ct;
+	struct nf_conn_counter *acct;
+	u64 packets[IP_CT_DIR_MAX], bytes[IP_CT_DIR_MAX];
+	int dir;
+
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++) {
+		packets[dir] = atomic64_xchg(&flow->counter[dir].packets, 0);
+		bytes[dir] = atomic64_xchg(&flow->counter[dir].bytes, 0);
+	}
+	if (!packets[IP_CT_DIR_ORIGINAL] && !packets[IP_CT_DIR_REPLY])
+		return;
+
+	acct = nf_conn_acct_find(ct);
+	if (acct) {
+		spin_lock(&ct->lock);
+		for (dir = 0; dir < IP_CT_DIR_MAX; dir++) {
+			acct[dir].packets += packets[dir];
+			acct[dir].bytes += bytes[dir];
+		}
+		spin_unlock(&ct->lock);
+	}
+
+	if (!test_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status))
+		ct->timeout = flow->timeout - NF_FLOW_TIMEOUT + flow->ct_timeout;
+}
+
+/* must be called with nf_flow_lock held */
+static void flow_offload_del(struct flow_offload *flow)
+{
+	int dir;
+
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++)
+		hlist_del_rcu(&flow->tuplehash[dir].node);
+	atomic_dec(&nf_flow_count);
+
+	flow_offload_sync(flow);
+	clear_bit(IPS_OFFLOAD_BIT, &flow->ct->status);
+	call_rcu(&flow->rcu_head, flow_offload_free_rcu);
+}
+
+static bool flow_offload_expired(const struct flow_offload *flow)
+{
+	return (__s32)(flow->timeout - nfct_time_stamp) <= 0 ||
+	       test_bit(NF_FLOW_TEARDOWN, &flow->flags) ||
+	       nf_ct_is_dying(flow->ct);
+}
+
+/* Walk the whole table, calling fn() once per flow (via its original
+ * direction entry).  Flows for which fn() returns true are removed. */
+static void nf_flow_table_iterate(bool (*fn)(struct flow_offload *flow,
+					     void *data),
+				  void *data)
+{
+	struct flow_offload_tuple_hash *thash;
+	struct hlist_node *n, *tmp;
+	struct flow_offload *flow;
+	unsigned int i;
+
+	for (i = 0; i < nf_flow_htable_size; i++) {
+		spin_lock_bh(&nf_flow_lock);
+		hlist_for_each_entry_safe(thash, n, tmp, &nf_flow_hash[i],
+					  node) {
+			if (thash->tuple.dir != IP_CT_DIR_ORIGINAL)
+				continue;
+			flow = flow_offload_from_hash(thash);
+			if (fn(flow, data))
+				flow_offload_del(flow);
+		}
+		spin_unlock_bh(&nf_flow_lock);
+	}
+}
+
+static bool nf_flow_gc_one(struct flow_offload *flow, void *data)
+{
+	if (flow_offload_expired(flow))
+		return true;
+
+	flow_offload_sync(flow);
+	return false;
+}
+
+static void nf_flow_offload_gc(struct work_struct *work)
+{
+	nf_flow_table_iterate(nf_flow_gc_one, NULL);
+	schedule_delayed_work(&nf_flow_gc_work, HZ);
+}
+
+static bool nf_flow_uses_dev(struct flow_offload *flow, void *data)
+{
+	const struct net_device *dev = data;
+	int dir;
+
+	if (dev == NULL)
+		return true;
+	if (!net_eq(nf_ct_net(flow->ct), dev_net(dev)))
+		return false;
+
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++) {
+		if (flow->tuplehash[dir].dst_cache->dev == dev ||
+		    flow->tuplehash[dir].tuple.iifidx == dev->ifindex)
+			return true;
+	}
+	return false;
+}
+
+/* The cached routes pin their devices, drop them before they go away */
+static int nf_flow_netdev_event(struct notifier_block *this,
+				unsigned long event, void *ptr)
+{
+	struct net_device *dev = ptr;
+
+	if (event == NETDEV_DOWN || event == NETDEV_UNREGISTER)
+		nf_flow_table_iterate(nf_flow_uses_dev, dev);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block nf_flow_netdev_notifier = {
+	.notifier_call	= nf_flow_netdev_event,
+};
+
+static int __init nf_flow_table_init(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (!nf_flow_htable_size)
+		return -EINVAL;
+
+	get_random_bytes(&nf_flow_hash_rnd, sizeof(nf_flow_hash_rnd));
+
+	nf_flow_hash = vmalloc(nf_flow_htable_size * sizeof(struct hlist_head));
+	if (nf_flow_hash == NULL)
+		return -ENOMEM;
+	for (i = 0; i < nf_flow_htable_size; i++)
+		INIT_HLIST_HEAD(&nf_flow_hash[i]);
+
+	nf_flow_cachep = kmem_cache_create("nf_flow_offload",
+					   sizeof(struct flow_offload), 0,
+					   0, NULL);
+	if (nf_flow_cachep == NULL) {
+		ret = -ENOMEM;
+		goto err_cache;
+	}
+
+	ret = register_netdevice_notifier(&nf_flow_netdev_notifier);
+	if (ret < 0)
+		goto err_notifier;
+
+	INIT_DELAYED_WORK(&nf_flow_gc_work, nf_flow_offload_gc);
+	schedule_delayed_work(&nf_flow_gc_work, HZ);
+	return 0;
+
+err_notifier:
+	kmem_cache_destroy(nf_flow_cachep);
+err_cache:
+	vfree(nf_flow_hash);
+	return ret;
+}
+
+static void __exit nf_flow_table_fini(void)
+{
+	cancel_delayed_work_sync(&nf_flow_gc_work);
+	unregister_netdevice_notifier(&nf_flow_netdev_notifier);
+	nf_flow_table_iterate(nf_flow_uses_dev, NULL);
+	rcu_barrier();
+	kmem_cache_destroy(nf_flow_cachep);
+	vfree(nf_flow_hash);
+}
+
+module_init(nf_flow_table_init);
+module_exit(nf_flow_table_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Netfilter flow offload table");
@@ -229,6 +229,21 @@ int nf_queue(struct sk_buff *skb,
 	return 1;
 }
 
+/* Called on hook removal, once no new packet can be queued at it. */
+void nf_queue_nf_hook_drop(const struct nf_hook_ops *ops)
+{
+	const struct nf_queue_handler *qh;
+	u_int8_t pf;
+
+	rcu_read_lock();
+	for (pf = 0; pf < ARRAY_SIZE(queue_handler); pf++) {
+		qh = rcu_dereference(queue_handler[pf]);
+		if (qh && qh->nf_hook_drop)
+			qh->nf_hook_drop(ops);
+	}
+	rcu_read_unlock();
+}
+
 void nf_reinject(struct nf_queue_entry *entry, unsigned int verdict)
 {
 	struct sk_buff *skb = entry->skb;
@@ -253,7 +268,8 @@ void nf_reinject(struct nf_queue_entry *entry, unsigned int verdict)
 
 	if (verdict == NF_ACCEPT) {
 	next_hook:
-		verdict = nf_iterate(&nf_hooks[entry->pf][entry->hook],
+		verdict = nf_iterate(&nf_hook_net(entry->indev, entry->outdev)
+					->nf.hooks[entry->pf][entry->hook],
 				     skb, entry->hook,
 				     entry->indev, entry->outdev, &elem,
 				     entry->okfn, INT_MIN);
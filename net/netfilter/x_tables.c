@@ -22,6 +22,8 @@
 #include <linux/vmalloc.h>
 #include <linux/mutex.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
 #include <net/net_namespace.h>
 
 #include <linux/netfilter/x_tables.h>
@@ -655,10 +657,315 @@ void xt_free_table_info(struct xt_table_info *info)
 		else
 			vfree(info->entries[cpu]);
 	}
+	if (info->cls)
+		xt_cls_free(info->cls);
 	kfree(info);
 }
 EXPORT_SYMBOL(xt_free_table_info);
 
+struct xt_cls_rule {
+	unsigned int		offset;
+	unsigned int		next;	/* offset of the following entry */
+	unsigned int		last;	/* index of the last rule of the run */
+};
+
+struct xt_cls_node {
+	struct xt_cls_node	*next;
+	unsigned int		nrules;
+	unsigned int		size;
+	unsigned int		*rules;	/* ascending rule indices */
+	u32			key[XT_CLS_MAX_WORDS];
+};
+
+struct xt_cls_group {
+	u32			mask[XT_CLS_MAX_WORDS];
+	unsigned int		nkeys;
+	unsigned int		hsize;
+	struct xt_cls_node	**hash;
+};
+
+struct xt_cls {
+	unsigned int		words;
+	unsigned int		nrules;
+	unsigned int		size;
+	unsigned int		run_start;
+	struct xt_cls_rule	*rules;
+	unsigned int		ngroups;
+	struct xt_cls_group	groups[XT_CLS_MAX_GROUPS];
+};
+
+static void xt_cls_kvfree(void *p, size_t size)
+{
+	if (size <= PAGE_SIZE)
+		kfree(p);
+	else
+		vfree(p);
+}
+
+static void *xt_cls_realloc(void *old, size_t oldsize, size_t newsize)
+{
+	void *p;
+
+	if (newsize <= PAGE_SIZE)
+		p = kmalloc(newsize, GFP_KERNEL);
+	else
+		p = vmalloc(newsize);
+	if (p == NULL)
+		return NULL;
+	if (old != NULL) {
+		memcpy(p, old, oldsize);
+		xt_cls_kvfree(old, oldsize);
+	}
+	return p;
+}
+
+static inline u32 xt_cls_hash(const struct xt_cls *cls,
+			      const struct xt_cls_group *grp, const u32 *key)
+{
+	return jhash2(key, cls->words, 0) & (grp->hsize - 1);
+}
+
+struct xt_cls *xt_cls_alloc(unsigned int words)
+{
+	struct xt_cls *cls;
+
+	if (words == 0 || words > XT_CLS_MAX_WORDS)
+		return NULL;
+
+	cls = kzalloc(sizeof(*cls), GFP_KERNEL);
+	if (cls != NULL)
+		cls->words = words;
+	return cls;
+}
+EXPORT_SYMBOL_GPL(xt_cls_alloc);
+
+void xt_cls_free(struct xt_cls *cls)
+{
+	struct xt_cls_node *node, *next;
+	unsigned int g, h;
+
+	for (g = 0; g < cls->ngroups; g++) {
+		struct xt_cls_group *grp = &cls->groups[g];
+
+		for (h = 0; h < grp->hsize; h++) {
+			for (node = grp->hash[h]; node != NULL; node = next) {
+				next = node->next;
+				if (node->rules != NULL)
+					xt_cls_kvfree(node->rules, node->size *
+						      sizeof(unsigned int));
+				kfree(node);
+			}
+		}
+		xt_cls_kvfree(grp->hash, grp->hsize * sizeof(grp->hash[0]));
+	}
+	if (cls->rules != NULL)
+		xt_cls_kvfree(cls->rules, cls->size * sizeof(cls->rules[0]));
+	kfree(cls);
+}
+EXPORT_SYMBOL_GPL(xt_cls_free);
+
+static int xt_cls_grow_group(struct xt_cls *cls, struct xt_cls_group *grp)
+{
+	unsigned int hsize = grp->hsize ? grp->hsize * 2 : 16;
+	struct xt_cls_node **hash, **old = grp->hash;
+	struct xt_cls_node *node, *next;
+	unsigned int oldsize = grp->hsize, h;
+
+	hash = xt_cls_realloc(NULL, 0, hsize * sizeof(hash[0]));
+	if (hash == NULL)
+		return -ENOMEM;
+	memset(hash, 0, hsize * sizeof(hash[0]));
+
+	grp->hash = hash;
+	grp->hsize = hsize;
+	for (h = 0; h < oldsize; h++) {
+		for (node = old[h]; node != NULL; node = next) {
+			u32 bucket = xt_cls_hash(cls, grp, node->key);
+
+			next = node->next;
+			node->next = hash[bucket];
+			hash[bucket] = node;
+		}
+	}
+	if (old != NULL)
+		xt_cls_kvfree(old, oldsize * sizeof(old[0]));
+	return 0;
+}
+
+static struct xt_cls_group *xt_cls_find_group(struct xt_cls *cls,
+					      const u32 *mask)
+{
+	struct xt_cls_group *grp;
+	unsigned int g;
+
+	for (g = 0; g < cls->ngroups; g++) {
+		grp = &cls->groups[g];
+		if (!memcmp(grp->mask, mask, cls->words * sizeof(u32)))
+			return grp;
+	}
+	if (cls->ngroups == XT_CLS_MAX_GROUPS)
+		return ERR_PTR(-E2BIG);
+
+	grp = &cls->groups[cls->ngroups];
+	memcpy(grp->mask, mask, cls->words * sizeof(u32));
+	if (xt_cls_grow_group(cls, grp) < 0)
+		return ERR_PTR(-ENOMEM);
+	cls->ngroups++;
+	return grp;
+}
+
+static struct xt_cls_node *xt_cls_find_node(struct xt_cls *cls,
+					    struct xt_cls_group *grp,
+					    const u32 *key)
+{
+	struct xt_cls_node *node;
+	u32 bucket = xt_cls_hash(cls, grp, key);
+
+	for (node = grp->hash[bucket]; node != NULL; node = node->next)
+		if (!memcmp(node->key, key, cls->words * sizeof(u32)))
+			return node;
+
+	if (grp->nkeys >= grp->hsize) {
+		if (xt_cls_grow_group(cls, grp) < 0)
+			return NULL;
+		bucket = xt_cls_hash(cls, grp, key);
+	}
+
+	node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (node == NULL)
+		return NULL;
+	memcpy(node->key, key, cls->words * sizeof(u32));
+	node->next = grp->hash[bucket];
+	grp->hash[bucket] = node;
+	grp->nkeys++;
+	return node;
+}
+
+/*
+ * Append the entry at @offset to the current run.  Packets match it
+ * when (packet key & @mask) == @key, word by word.  Returns -E2BIG when
+ * the rule would need too many distinct masks; the caller should then
+ * end the run and leave the entry to linear evaluation.
+ */
+int xt_cls_add(struct xt_cls *cls, unsigned int offset, unsigned int next,
+	       const u32 *key, const u32 *mask)
+{
+	struct xt_cls_group *grp;
+	struct xt_cls_node *node;
+	unsigned int size;
+	void *p;
+
+	if (cls->nrules == cls->size) {
+		size = cls->size ? cls->size * 2 : 64;
+		p = xt_cls_realloc(cls->rules, cls->size * sizeof(cls->rules[0]),
+				   size * sizeof(cls->rules[0]));
+		if (p == NULL)
+			return -ENOMEM;
+		cls->rules = p;
+		cls->size = size;
+	}
+
+	grp = xt_cls_find_group(cls, mask);
+	if (IS_ERR(grp))
+		return PTR_ERR(grp);
+	node = xt_cls_find_node(cls, grp, key);
+	if (node == NULL)
+		return -ENOMEM;
+
+	if (node->nrules == node->size) {
+		size = node->size ? node->size * 2 : 4;
+		p = xt_cls_realloc(node->rules,
+				   node->size * sizeof(unsigned int),
+				   size * sizeof(unsigned int));
+		if (p == NULL)
+			return -ENOMEM;
+		node->rules = p;
+		node->size = size;
+	}
+	node->rules[node->nrules++] = cls->nrules;
+
+	cls->rules[cls->nrules].offset = offset;
+	cls->rules[cls->nrules].next = next;
+	cls->rules[cls->nrules].last = cls->nrules;
+	cls->nrules++;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(xt_cls_add);
+
+void xt_cls_end_run(struct xt_cls *cls)
+{
+	unsigned int i;
+
+	for (i = cls->run_start; i < cls->nrules; i++)
+		cls->rules[i].last = cls->nrules - 1;
+	cls->run_start = cls->nrules;
+}
+EXPORT_SYMBOL_GPL(xt_cls_end_run);
+
+/* index of the first element of @v not below @x */
+static inline unsigned int xt_cls_lower_bound(const unsigned int *v,
+					      unsigned int n, unsigned int x)
+{
+	unsigned int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (v[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * @offset must be the offset of a rule added to @cls.  Every rule between
+ * it and the returned offset is guaranteed not to match @key.
+ */
+unsigned int xt_cls_lookup(const struct xt_cls *cls, unsigned int offset,
+			   const u32 *key)
+{
+	const struct xt_cls_rule *rules = cls->rules;
+	unsigned int lo = 0, hi = cls->nrules, mid;
+	unsigned int first, last, best, g, w, i;
+	u32 masked[XT_CLS_MAX_WORDS];
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (rules[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	last = rules[first].last;
+	best = last + 1;
+
+	for (g = 0; g < cls->ngroups && best != first; g++) {
+		const struct xt_cls_group *grp = &cls->groups[g];
+		const struct xt_cls_node *node;
+
+		for (w = 0; w < cls->words; w++)
+			masked[w] = key[w] & grp->mask[w];
+
+		for (node = grp->hash[xt_cls_hash(cls, grp, masked)];
+		     node != NULL; node = node->next)
+			if (!memcmp(node->key, masked, cls->words * sizeof(u32)))
+				break;
+		if (node == NULL)
+			continue;
+
+		i = xt_cls_lower_bound(node->rules, node->nrules, first);
+		if (i < node->nrules && node->rules[i] < best)
+			best = node->rules[i];
+	}
+
+	if (best > last)
+		return rules[last].next;
+	return rules[best].offset;
+}
+EXPORT_SYMBOL_GPL(xt_cls_lookup);
+
 /* Find table by name, grabs mutex & ref.  Returns ERR_PTR() on error. */
 struct xt_table *xt_find_table_lock(struct net *net, u_int8_t af,
 				    const char *name)
@@ -803,6 +1110,31 @@ void *xt_unregister_table(struct xt_table *table)
 }
 EXPORT_SYMBOL_GPL(xt_unregister_table);
 
+/* Attach the hooks of a table in its namespace unless already done.
+ * Tables without rules need not see any packet, so only the initial
+ * namespace hooks them at registration, others wait for a ruleset. */
+int xt_hook_table(struct net *net, struct xt_table *table)
+{
+	int ret;
+
+	if (table->ops == NULL || table->hooked)
+		return 0;
+	ret = nf_register_net_hooks(net, table->ops, table->num_ops);
+	if (ret == 0)
+		table->hooked = true;
+	return ret;
+}
+EXPORT_SYMBOL_GPL(xt_hook_table);
+
+void xt_unhook_table(struct net *net, struct xt_table *table)
+{
+	if (!table->hooked)
+		return;
+	nf_unregister_net_hooks(net, table->ops, table->num_ops);
+	table->hooked = false;
+}
+EXPORT_SYMBOL_GPL(xt_unhook_table);
+
 #ifdef CONFIG_PROC_FS
 struct xt_names_priv {
 	struct seq_net_private p;
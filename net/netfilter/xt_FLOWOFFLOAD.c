@@ -0,0 +1,140 @@
+/*
+ * "FLOWOFFLOAD" target: hand established, forwarded IPv4 connections
+ * over to the flow offload fast path.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/x_tables.h>
+#include <net/ip.h>
+#include <net/route.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+#include <net/netfilter/nf_conntrack_l3proto.h>
+#include <net/netfilter/nf_flow_table.h>
+
+MODULE_DESCRIPTION("Xtables: offload established connections to the flow table");
+MODULE_LICENSE("GPL");
+MODULE_ALIAS("ipt_FLOWOFFLOAD");
+
+static bool flowoffload_suitable(const struct nf_conn *ct)
+{
+	/* helpers and sequence adjustment need to see every packet */
+	if (nfct_help(ct) || test_bit(IPS_SEQ_ADJUST_BIT, &ct->status))
+		return false;
+
+	switch (nf_ct_protonum(ct)) {
+	case IPPROTO_TCP:
+		return ct->proto.tcp.state == TCP_CONNTRACK_ESTABLISHED;
+	case IPPROTO_UDP:
+		return true;
+	}
+	return false;
+}
+
+/* The route of this packet serves its own direction, the other one
+ * needs an output route back to this packet's sender.  Asymmetric
+ * routing is left to the slow path. */
+static int flowoffload_route(struct sk_buff *skb, const struct nf_conn *ct,
+			     const struct xt_target_param *par,
+			     enum ip_conntrack_dir dir,
+			     struct nf_flow_route *route)
+{
+	struct dst_entry *this_dst = skb_dst(skb);
+	struct flowi fl = {
+		.nl_u = {
+			.ip4_u = {
+				.daddr = ct->tuplehash[dir].tuple.src.u3.ip,
+				.tos = RT_TOS(ip_hdr(skb)->tos),
+			},
+		},
+	};
+	struct rtable *rt;
+
+	if (this_dst == NULL || this_dst->xfrm != NULL)
+		return -EINVAL;
+
+	if (ip_route_output_key(dev_net(par->in), &rt, &fl) != 0)
+		return -ENOENT;
+	if (rt->u.dst.dev != par->in || rt->u.dst.xfrm != NULL) {
+		ip_rt_put(rt);
+		return -EINVAL;
+	}
+
+	route->tuple[dir].dst = this_dst;
+	route->tuple[dir].ifindex = par->in->ifindex;
+	route->tuple[!dir].dst = &rt->u.dst;
+	route->tuple[!dir].ifindex = par->out->ifindex;
+	return 0;
+}
+
+static unsigned int
+flowoffload_tg(struct sk_buff *skb, const struct xt_target_param *par)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_flow_route route;
+	enum ip_conntrack_dir dir;
+	struct nf_conn *ct;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL || ct == &nf_conntrack_untracked)
+		return XT_CONTINUE;
+	if (ctinfo != IP_CT_ESTABLISHED &&
+	    ctinfo != IP_CT_ESTABLISHED + IP_CT_IS_REPLY)
+		return XT_CONTINUE;
+	if (test_bit(IPS_OFFLOAD_BIT, &ct->status) ||
+	    !flowoffload_suitable(ct))
+		return XT_CONTINUE;
+
+	dir = CTINFO2DIR(ctinfo);
+	if (flowoffload_route(skb, ct, par, dir, &route) < 0)
+		return XT_CONTINUE;
+
+	flow_offload_add(ct, &route);
+	dst_release(route.tuple[!dir].dst);
+	return XT_CONTINUE;
+}
+
+static bool flowoffload_tg_check(const struct xt_tgchk_param *par)
+{
+	if (nf_ct_l3proto_try_module_get(par->family) < 0) {
+		printk(KERN_WARNING "cannot load conntrack support for "
+		       "proto=%u\n", par->family);
+		return false;
+	}
+	return true;
+}
+
+static void flowoffload_tg_destroy(const struct xt_tgdtor_param *par)
+{
+	nf_ct_l3proto_module_put(par->family);
+}
+
+static struct xt_target flowoffload_tg_reg __read_mostly = {
+	.name		= "FLOWOFFLOAD",
+	.revision	= 0,
+	.family		= NFPROTO_IPV4,
+	.hooks		= 1 << NF_INET_FORWARD,
+	.target		= flowoffload_tg,
+	.checkentry	= flowoffload_tg_check,
+	.destroy	= flowoffload_tg_destroy,
+	.me		= THIS_MODULE,
+};
+
+static int __init flowoffload_tg_init(void)
+{
+	return xt_register_target(&flowoffload_tg_reg);
+}
+
+static void __exit flowoffload_tg_exit(void)
+{
+	xt_unregister_target(&flowoffload_tg_reg);
+}
+
+module_init(flowoffload_tg_init);
+module_exit(flowoffload_tg_exit);
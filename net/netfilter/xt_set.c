@@ -0,0 +1,152 @@
+/*
+ * "set" match and "SET" target: match packets against IP sets and
+ * add/delete packet elements to/from them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/xt_set.h>
+
+MODULE_DESCRIPTION("Xtables: IP set match and target module");
+MODULE_LICENSE("GPL");
+MODULE_ALIAS("ipt_set");
+MODULE_ALIAS("ipt_SET");
+
+static bool
+set_match(const struct sk_buff *skb, const struct xt_match_param *par)
+{
+	const struct xt_set_info_match *info = par->matchinfo;
+	const struct xt_set_info *set = &info->match_set;
+	bool ret;
+
+	ret = ip_set_test(set->index, skb, par->family, set->dim, set->flags);
+	return ret ^ !!(set->flags & IPSET_INV_MATCH);
+}
+
+/* Resolve the name to the set index and hold a reference on the set */
+static bool set_info_get(struct xt_set_info *set, const char *what)
+{
+	if (set->dim == IPSET_DIM_ZERO || set->dim > IPSET_DIM_MAX) {
+		printk(KERN_WARNING "xt_set: %s set %.*s: invalid dimension %u\n",
+		       what, IPSET_MAXNAMELEN, set->name, set->dim);
+		return false;
+	}
+
+	set->name[IPSET_MAXNAMELEN - 1] = '\0';
+	set->index = ip_set_get_byname(set->name);
+	if (set->index == IPSET_INVALID_ID) {
+		printk(KERN_WARNING "xt_set: cannot find %s set %s\n",
+		       what, set->name);
+		return false;
+	}
+	return true;
+}
+
+static bool set_match_checkentry(const struct xt_mtchk_param *par)
+{
+	struct xt_set_info_match *info = par->matchinfo;
+
+	return set_info_get(&info->match_set, "match");
+}
+
+static void set_match_destroy(const struct xt_mtdtor_param *par)
+{
+	const struct xt_set_info_match *info = par->matchinfo;
+
+	ip_set_put_byindex(info->match_set.index);
+}
+
+static unsigned int
+set_target(struct sk_buff *skb, const struct xt_target_param *par)
+{
+	const struct xt_set_info_target *info = par->targinfo;
+
+	if (info->add_set.index != IPSET_INVALID_ID)
+		ip_set_add(info->add_set.index, skb, par->family,
+			   info->add_set.dim, info->add_set.flags);
+	if (info->del_set.index != IPSET_INVALID_ID)
+		ip_set_del(info->del_set.index, skb, par->family,
+			   info->del_set.dim, info->del_set.flags);
+
+	return XT_CONTINUE;
+}
+
+static bool set_target_checkentry(const struct xt_tgchk_param *par)
+{
+	struct xt_set_info_target *info = par->targinfo;
+
+	info->add_set.index = IPSET_INVALID_ID;
+	info->del_set.index = IPSET_INVALID_ID;
+
+	if (info->add_set.name[0] != '\0' &&
+	    !set_info_get(&info->add_set, "add"))
+		return false;
+	if (info->del_set.name[0] != '\0' &&
+	    !set_info_get(&info->del_set, "del")) {
+		if (info->add_set.index != IPSET_INVALID_ID)
+			ip_set_put_byindex(info->add_set.index);
+		return false;
+	}
+	return true;
+}
+
+static void set_target_destroy(const struct xt_tgdtor_param *par)
+{
+	const struct xt_set_info_target *info = par->targinfo;
+
+	if (info->add_set.index != IPSET_INVALID_ID)
+		ip_set_put_byindex(info->add_set.index);
+	if (info->del_set.index != IPSET_INVALID_ID)
+		ip_set_put_byindex(info->del_set.index);
+}
+
+static struct xt_match set_match_reg __read_mostly = {
+	.name		= "set",
+	.revision	= 0,
+	.family		= NFPROTO_IPV4,
+	.match		= set_match,
+	.matchsize	= sizeof(struct xt_set_info_match),
+	.checkentry	= set_match_checkentry,
+	.destroy	= set_match_destroy,
+	.me		= THIS_MODULE,
+};
+
+static struct xt_target set_target_reg __read_mostly = {
+	.name		= "SET",
+	.revision	= 0,
+	.family		= NFPROTO_IPV4,
+	.target		= set_target,
+	.targetsize	= sizeof(struct xt_set_info_target),
+	.checkentry	= set_target_checkentry,
+	.destroy	= set_target_destroy,
+	.me		= THIS_MODULE,
+};
+
+static int __init xt_set_init(void)
+{
+	int ret;
+
+	ret = xt_register_match(&set_match_reg);
+	if (ret < 0)
+		return ret;
+
+	ret = xt_register_target(&set_target_reg);
+	if (ret < 0)
+		xt_unregister_match(&set_match_reg);
+	return ret;
+}
+
+static void __exit xt_set_fini(void)
+{
+	xt_unregister_target(&set_target_reg);
+	xt_unregister_match(&set_match_reg);
+}
+
+module_init(xt_set_init);
+module_exit(xt_set_fini);
@@ -79,6 +79,10 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/mutex.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 
 #ifdef CONFIG_INET
 #include <net/inet_common.h>
@@ -156,9 +160,36 @@ struct packet_mreq_max {
 };
 
 #ifdef CONFIG_PACKET_MMAP
-static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
+static int packet_set_ring(struct sock *sk, union tpacket_req_u *req_u,
 		int closing, int tx_ring);
 
+/* Block state of a TPACKET_V3 rx ring */
+struct tpacket_kbdq_core {
+	unsigned int		blk_size;
+	unsigned int		blk_nr;
+	unsigned int		blk_hdrlen;	/* block header and priv area */
+	unsigned int		feature_req_word;
+
+	unsigned int		active;		/* block being filled */
+	unsigned int		blk_open:1,	/* ... is owned by the kernel */
+				frozen:1;	/* user space owns all blocks */
+	char			*nxt_offset;	/* where the next packet goes */
+	struct tpacket3_hdr	*prev;		/* last packet of the block */
+	atomic_t		fill_in_prog;	/* packets still being copied */
+	u64			seq_num;
+
+	unsigned long		tov;		/* retire timeout in jiffies */
+	unsigned long		retire_at;
+	struct timer_list	retire_timer;
+};
+
+/* used when tp_retire_blk_tov is not set */
+#define DEFAULT_PRB_RETIRE_TOV	8	/* msecs */
+
+#define V3_BLK_HDRLEN(sizeof_priv) \
+	(TPACKET_ALIGN(sizeof(struct tpacket_block_desc)) + \
+	 TPACKET_ALIGN(sizeof_priv))
+
 struct packet_ring_buffer {
 	char			**pg_vec;
 	unsigned int		head;
@@ -171,6 +202,8 @@ struct packet_ring_buffer {
 	unsigned int		pg_vec_len;
 
 	atomic_t		pending;
+
+	struct tpacket_kbdq_core	prb_bdqc;
 };
 
 struct packet_sock;
@@ -179,10 +212,31 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg);
 
 static void packet_flush_mclist(struct sock *sk);
 
+#define PACKET_FANOUT_MAX	256
+
+/*
+ * A fanout group: one prot_hook for all its sockets, each packet is
+ * handed to one of the members.
+ */
+struct packet_fanout {
+#ifdef CONFIG_NET_NS
+	struct net		*net;
+#endif
+	unsigned int		num_members;	/* members that are running */
+	u16			id;
+	u16			type_flags;
+	atomic_t		rr_cur;
+	struct list_head	list;
+	struct sock		*arr[PACKET_FANOUT_MAX];
+	spinlock_t		lock;
+	atomic_t		sk_ref;		/* members */
+	struct packet_type	prot_hook ____cacheline_aligned_in_smp;
+};
+
 struct packet_sock {
 	/* struct sock has to be the first member of packet_sock */
 	struct sock		sk;
-	struct tpacket_stats	stats;
+	struct tpacket_stats_v3	stats;
 #ifdef CONFIG_PACKET_MMAP
 	struct packet_ring_buffer	rx_ring;
 	struct packet_ring_buffer	tx_ring;
@@ -193,16 +247,19 @@ struct packet_sock {
 	struct mutex		pg_vec_lock;
 	unsigned int		running:1,	/* prot_hook is attached*/
 				auxdata:1,
-				origdev:1;
+				origdev:1,
+				qdisc_bypass:1;	/* straight to the driver */
 	int			ifindex;	/* bound device		*/
 	__be16			num;
 	struct packet_mclist	*mclist;
+	struct packet_fanout	*fanout;
 #ifdef CONFIG_PACKET_MMAP
 	atomic_t		mapped;
 	enum tpacket_versions	tp_version;
 	unsigned int		tp_hdrlen;
 	unsigned int		tp_reserve;
 	unsigned int		tp_loss:1;
+	struct tpacket_tx_stats	tx_stats;	/* under pg_vec_lock */
 #endif
 };
 
@@ -312,6 +369,176 @@ static inline void packet_increment_head(struct packet_ring_buffer *buff)
 	buff->head = buff->head != buff->frame_max ? buff->head+1 : 0;
 }
 
+/*
+ * TPACKET_V3 rx ring: packets are packed into the active block, which
+ * is opened by its first packet and retired to user space when the next
+ * packet does not fit or when retire_timer expires. All of this runs
+ * under the receive queue lock; the packet data is copied outside of it
+ * and fill_in_prog keeps a block from being retired during the copy.
+ */
+static inline struct tpacket_block_desc *
+prb_block(struct packet_ring_buffer *rb, unsigned int n)
+{
+	return (struct tpacket_block_desc *)rb->pg_vec[n];
+}
+
+static int prb_block_status(struct tpacket_block_desc *pbd)
+{
+	smp_rmb();
+	flush_dcache_page(virt_to_page(&pbd->hdr.bh1.block_status));
+	return pbd->hdr.bh1.block_status;
+}
+
+static void prb_flush_block(struct tpacket_block_desc *pbd, unsigned int len)
+{
+	struct page *p_start, *p_end;
+
+	p_start = virt_to_page(pbd);
+	p_end = virt_to_page((char *)pbd + len - 1);
+	while (p_start <= p_end) {
+		flush_dcache_page(p_start);
+		p_start++;
+	}
+}
+
+static void prb_retire_active_block(struct packet_sock *po, int status)
+{
+	struct tpacket_kbdq_core *pkc = &po->rx_ring.prb_bdqc;
+	struct tpacket_block_desc *pbd = prb_block(&po->rx_ring, pkc->active);
+	struct tpacket_hdr_v1 *h1 = &pbd->hdr.bh1;
+
+	/* no new packets can be added, wait for the ones being copied */
+	while (atomic_read(&pkc->fill_in_prog))
+		cpu_relax();
+	smp_rmb();
+
+	pkc->prev->tp_next_offset = 0;
+	h1->blk_len = pkc->nxt_offset - (char *)pbd;
+	prb_flush_block(pbd, h1->blk_len);
+	smp_wmb();
+
+	h1->block_status = TP_STATUS_USER | status;
+	flush_dcache_page(virt_to_page(&h1->block_status));
+	smp_wmb();
+
+	pkc->blk_open = 0;
+	if (++pkc->active == pkc->blk_nr)
+		pkc->active = 0;
+}
+
+static int prb_open_block(struct packet_sock *po, struct timespec *ts)
+{
+	struct tpacket_kbdq_core *pkc = &po->rx_ring.prb_bdqc;
+	struct tpacket_block_desc *pbd = prb_block(&po->rx_ring, pkc->active);
+	struct tpacket_hdr_v1 *h1 = &pbd->hdr.bh1;
+
+	if (prb_block_status(pbd) != TP_STATUS_KERNEL) {
+		if (!pkc->frozen) {
+			pkc->frozen = 1;
+			po->stats.tp_freeze_q_cnt++;
+		}
+		return 0;
+	}
+	pkc->frozen = 0;
+
+	pbd->version = TPACKET_V3;
+	pbd->offset_to_priv = TPACKET_ALIGN(sizeof(struct tpacket_block_desc));
+	h1->num_pkts = 0;
+	h1->offset_to_first_pkt = pkc->blk_hdrlen;
+	h1->blk_len = 0;
+	h1->seq_num = pkc->seq_num++;
+	h1->ts_first_pkt.ts_sec = ts->tv_sec;
+	h1->ts_first_pkt.ts_nsec = ts->tv_nsec;
+
+	pkc->nxt_offset = (char *)pbd + pkc->blk_hdrlen;
+	pkc->prev = NULL;
+	pkc->blk_open = 1;
+	pkc->retire_at = jiffies + pkc->tov;
+	mod_timer(&pkc->retire_timer, pkc->retire_at);
+	return 1;
+}
+
+/*
+ * Reserve len bytes for a packet in the active block, retiring it when
+ * the packet does not fit. Returns NULL when user space still owns the
+ * next block; *retired tells whether a block was handed to user space.
+ */
+static void *prb_reserve(struct packet_sock *po, unsigned int len,
+			 struct timespec *ts, int *retired)
+{
+	struct tpacket_kbdq_core *pkc = &po->rx_ring.prb_bdqc;
+	struct tpacket_block_desc *pbd;
+	struct tpacket3_hdr *ppd;
+
+	len = TPACKET_ALIGN(len);
+	if (pkc->blk_open) {
+		pbd = prb_block(&po->rx_ring, pkc->active);
+		if (pkc->nxt_offset + len <= (char *)pbd + pkc->blk_size)
+			goto reserve;
+		prb_retire_active_block(po, 0);
+		*retired = 1;
+	}
+	if (!prb_open_block(po, ts))
+		return NULL;
+	pbd = prb_block(&po->rx_ring, pkc->active);
+
+reserve:
+	ppd = (struct tpacket3_hdr *)pkc->nxt_offset;
+	ppd->tp_next_offset = len;
+	pkc->nxt_offset += len;
+	pkc->prev = ppd;
+	pbd->hdr.bh1.num_pkts++;
+	pbd->hdr.bh1.ts_last_pkt.ts_sec = ts->tv_sec;
+	pbd->hdr.bh1.ts_last_pkt.ts_nsec = ts->tv_nsec;
+	atomic_inc(&pkc->fill_in_prog);
+	return ppd;
+}
+
+/* the packet reserved by prb_reserve() is complete */
+static inline void prb_fill_done(struct packet_sock *po)
+{
+	smp_wmb();
+	atomic_dec(&po->rx_ring.prb_bdqc.fill_in_prog);
+}
+
+static void prb_retire_timer_expired(unsigned long data)
+{
+	struct packet_sock *po = (struct packet_sock *)data;
+	struct tpacket_kbdq_core *pkc = &po->rx_ring.prb_bdqc;
+	struct sock *sk = &po->sk;
+	int retired = 0;
+
+	spin_lock(&sk->sk_receive_queue.lock);
+	if (po->rx_ring.pg_vec && pkc->blk_open) {
+		if (time_after_eq(jiffies, pkc->retire_at)) {
+			prb_retire_active_block(po, TP_STATUS_BLK_TMO);
+			retired = 1;
+		} else
+			mod_timer(&pkc->retire_timer, pkc->retire_at);
+	}
+	spin_unlock(&sk->sk_receive_queue.lock);
+
+	if (retired)
+		sk->sk_data_ready(sk, 0);
+}
+
+/* is there a block for user space? */
+static int prb_user_blocks(struct packet_sock *po)
+{
+	struct tpacket_kbdq_core *pkc = &po->rx_ring.prb_bdqc;
+	unsigned int prev;
+
+	if (!pkc->blk_open &&
+	    prb_block_status(prb_block(&po->rx_ring, pkc->active)) !=
+	    TP_STATUS_KERNEL)
+		return 1;
+
+	/* user space consumes the blocks in order */
+	prev = pkc->active ? pkc->active - 1 : pkc->blk_nr - 1;
+	return prb_block_status(prb_block(&po->rx_ring, prev)) !=
+		TP_STATUS_KERNEL;
+}
+
 #endif
 
 static inline struct packet_sock *pkt_sk(struct sock *sk)
@@ -509,6 +736,76 @@ out_unlock:
 	return err;
 }
 
+static u32 packet_hashrnd __read_mostly;
+
+/*
+ * A hash over the addresses, protocol and ports of IP packets, zero for
+ * other packets.
+ */
+static u32 packet_flow_hash(const struct sk_buff *skb)
+{
+	int nhoff = skb_network_offset(skb);
+	u32 saddr, daddr, ports = 0;
+	__be32 _ports;
+	const __be32 *pp;
+	u8 proto;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+	{
+		const struct iphdr *iph;
+		struct iphdr _iph;
+
+		iph = skb_header_pointer(skb, nhoff, sizeof(_iph), &_iph);
+		if (iph == NULL || iph->ihl < 5)
+			return 0;
+		saddr = (__force u32)iph->saddr;
+		daddr = (__force u32)iph->daddr;
+		proto = iph->protocol;
+		if (iph->frag_off & htons(IP_MF | IP_OFFSET))
+			proto = 0;
+		nhoff += iph->ihl * 4;
+		break;
+	}
+	case htons(ETH_P_IPV6):
+	{
+		const struct ipv6hdr *ip6h;
+		struct ipv6hdr _ip6h;
+
+		ip6h = skb_header_pointer(skb, nhoff, sizeof(_ip6h), &_ip6h);
+		if (ip6h == NULL)
+			return 0;
+		saddr = (__force u32)(ip6h->saddr.s6_addr32[0] ^
+				      ip6h->saddr.s6_addr32[1] ^
+				      ip6h->saddr.s6_addr32[2] ^
+				      ip6h->saddr.s6_addr32[3]);
+		daddr = (__force u32)(ip6h->daddr.s6_addr32[0] ^
+				      ip6h->daddr.s6_addr32[1] ^
+				      ip6h->daddr.s6_addr32[2] ^
+				      ip6h->daddr.s6_addr32[3]);
+		proto = ip6h->nexthdr;
+		nhoff += sizeof(*ip6h);
+		break;
+	}
+	default:
+		return 0;
+	}
+
+	switch (proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
+		pp = skb_header_pointer(skb, nhoff, sizeof(_ports), &_ports);
+		if (pp != NULL)
+			ports = (__force u32)*pp;
+		break;
+	}
+
+	return jhash_3words(saddr, daddr, ports, packet_hashrnd ^ proto);
+}
+
 static inline unsigned int run_filter(struct sk_buff *skb, struct sock *sk,
 				      unsigned int res)
 {
@@ -517,7 +814,7 @@ static inline unsigned int run_filter(struct sk_buff *skb, struct sock *sk,
 	rcu_read_lock_bh();
 	filter = rcu_dereference(sk->sk_filter);
 	if (filter != NULL)
-		res = sk_run_filter(skb, filter->insns, filter->len);
+		res = SK_RUN_FILTER(filter, skb);
 	rcu_read_unlock_bh();
 
 	return res;
@@ -646,6 +943,65 @@ drop:
 	return 0;
 }
 
+/*
+ * Hand a list of skbs straight to the driver, bypassing the qdisc. They
+ * all go to the TX queue of the current CPU, so that its lock is taken
+ * once for the whole list. Returns how many skbs were dropped.
+ */
+static unsigned int packet_direct_xmit(struct net_device *dev,
+				       struct sk_buff_head *list)
+{
+	struct netdev_queue *txq;
+	struct sk_buff *skb;
+	unsigned int dropped = 0;
+	u16 queue_index;
+	int cpu;
+
+	local_bh_disable();
+	cpu = smp_processor_id();
+	queue_index = cpu % dev->real_num_tx_queues;
+	txq = netdev_get_tx_queue(dev, queue_index);
+
+	if (!(dev->features & NETIF_F_LLTX))
+		__netif_tx_lock(txq, cpu);
+	while ((skb = __skb_dequeue(list)) != NULL) {
+		skb_set_queue_mapping(skb, queue_index);
+
+		/*
+		 * dev_queue_xmit() would linearize for devices without
+		 * scatter/gather. Ring pages are never highmem, so that
+		 * is the only fixup needed.
+		 */
+		if ((skb_shinfo(skb)->nr_frags &&
+		     !(dev->features & NETIF_F_SG) &&
+		     __skb_linearize(skb)) ||
+		    netif_tx_queue_stopped(txq) ||
+		    netif_tx_queue_frozen(txq) ||
+		    dev_hard_start_xmit(skb, dev, txq) != NETDEV_TX_OK) {
+			kfree_skb(skb);
+			dropped++;
+		}
+	}
+	if (!(dev->features & NETIF_F_LLTX))
+		__netif_tx_unlock(txq);
+	local_bh_enable();
+
+	return dropped;
+}
+
+static int packet_xmit(struct packet_sock *po, struct sk_buff *skb)
+{
+	struct sk_buff_head list;
+
+	if (!po->qdisc_bypass)
+		return dev_queue_xmit(skb);
+
+	__skb_queue_head_init(&list);
+	__skb_queue_tail(&list, skb);
+	return packet_direct_xmit(skb->dev, &list) ?
+	       NET_XMIT_DROP : NET_XMIT_SUCCESS;
+}
+
 #ifdef CONFIG_PACKET_MMAP
 static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 		       struct packet_type *pt, struct net_device *orig_dev)
@@ -656,16 +1012,18 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 	union {
 		struct tpacket_hdr *h1;
 		struct tpacket2_hdr *h2;
+		struct tpacket3_hdr *h3;
 		void *raw;
 	} h;
 	u8 *skb_head = skb->data;
 	int skb_len = skb->len;
-	unsigned int snaplen, res;
+	unsigned int snaplen, res, max_len;
 	unsigned long status = TP_STATUS_LOSING|TP_STATUS_USER;
 	unsigned short macoff, netoff, hdrlen;
 	struct sk_buff *copy_skb = NULL;
 	struct timeval tv;
 	struct timespec ts;
+	int retired = 0;
 
 	if (skb->pkt_type == PACKET_LOOPBACK)
 		goto drop;
@@ -707,7 +1065,13 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 		macoff = netoff - maclen;
 	}
 
-	if (macoff + snaplen > po->rx_ring.frame_size) {
+	if (po->tp_version == TPACKET_V3)
+		max_len = po->rx_ring.prb_bdqc.blk_size -
+			po->rx_ring.prb_bdqc.blk_hdrlen;
+	else
+		max_len = po->rx_ring.frame_size;
+
+	if (macoff + snaplen > max_len) {
 		if (po->copy_thresh &&
 		    atomic_read(&sk->sk_rmem_alloc) + skb->truesize <
 		    (unsigned)sk->sk_rcvbuf) {
@@ -720,16 +1084,30 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 			if (copy_skb)
 				skb_set_owner_r(copy_skb, sk);
 		}
-		snaplen = po->rx_ring.frame_size - macoff;
+		snaplen = max_len - macoff;
 		if ((int)snaplen < 0)
 			snaplen = 0;
 	}
 
+	if (po->tp_version == TPACKET_V3) {
+		if (skb->tstamp.tv64)
+			ts = ktime_to_timespec(skb->tstamp);
+		else
+			getnstimeofday(&ts);
+	}
+
 	spin_lock(&sk->sk_receive_queue.lock);
-	h.raw = packet_current_frame(po, &po->rx_ring, TP_STATUS_KERNEL);
-	if (!h.raw)
-		goto ring_is_full;
-	packet_increment_head(&po->rx_ring);
+	if (po->tp_version == TPACKET_V3) {
+		h.raw = prb_reserve(po, macoff + snaplen, &ts, &retired);
+		if (!h.raw)
+			goto ring_is_full;
+	} else {
+		h.raw = packet_current_frame(po, &po->rx_ring,
+					     TP_STATUS_KERNEL);
+		if (!h.raw)
+			goto ring_is_full;
+		packet_increment_head(&po->rx_ring);
+	}
 	po->stats.tp_packets++;
 	if (copy_skb) {
 		status |= TP_STATUS_COPY;
@@ -770,6 +1148,25 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 		h.h2->tp_padding = 0;
 		hdrlen = sizeof(*h.h2);
 		break;
+	case TPACKET_V3:
+		/* tp_next_offset is set by prb_reserve() */
+		h.h3->tp_len = skb->len;
+		h.h3->tp_snaplen = snaplen;
+		h.h3->tp_mac = macoff;
+		h.h3->tp_net = netoff;
+		h.h3->tp_sec = ts.tv_sec;
+		h.h3->tp_nsec = ts.tv_nsec;
+		if (po->rx_ring.prb_bdqc.feature_req_word &
+		    TP_FT_REQ_FILL_RXHASH)
+			h.h3->hv1.tp_rxhash = packet_flow_hash(skb);
+		else
+			h.h3->hv1.tp_rxhash = 0;
+		h.h3->hv1.tp_vlan_tci = skb->vlan_tci;
+		if (skb->vlan_tci)
+			status |= TP_STATUS_VLAN_VALID;
+		h.h3->tp_status = status;
+		hdrlen = sizeof(*h.h3);
+		break;
 	default:
 		BUG();
 	}
@@ -785,6 +1182,14 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 	else
 		sll->sll_ifindex = dev->ifindex;
 
+	if (po->tp_version == TPACKET_V3) {
+		/* the pages are flushed when the block is retired */
+		prb_fill_done(po);
+		if (retired)
+			sk->sk_data_ready(sk, 0);
+		goto drop_n_restore;
+	}
+
 	__packet_set_status(po, h.raw, status);
 	smp_mb();
 	{
@@ -819,21 +1224,34 @@ ring_is_full:
 	goto drop_n_restore;
 }
 
+/* TX ring frames turned into skbs before they are sent */
+#define TX_RING_BATCH	32
+
 static void tpacket_destruct_skb(struct sk_buff *skb)
 {
 	struct packet_sock *po = pkt_sk(skb->sk);
 	void *ph;
+	int pending = 0;
 
 	BUG_ON(skb == NULL);
 
 	if (likely(po->tx_ring.pg_vec)) {
 		ph = skb_shinfo(skb)->destructor_arg;
-		BUG_ON(atomic_read(&po->tx_ring.pending) == 0);
-		atomic_dec(&po->tx_ring.pending);
+		pending = atomic_dec_return(&po->tx_ring.pending);
+		BUG_ON(pending < 0);
 		__packet_set_status(po, ph, TP_STATUS_AVAILABLE);
 	}
 
-	sock_wfree(skb);
+	/*
+	 * Wake the writer once per batch of released frames and for the
+	 * last one. The shortcut must not release the last byte of
+	 * sk_wmem_alloc: the socket may already be closed and waiting for
+	 * it, so that case goes through sock_wfree() to free the socket.
+	 */
+	if (!pending || !(pending % TX_RING_BATCH) ||
+	    !atomic_add_unless(&skb->sk->sk_wmem_alloc, -skb->truesize,
+			       skb->truesize))
+		sock_wfree(skb);
 }
 
 static int tpacket_fill_skb(struct packet_sock *po, struct sk_buff *skb,
@@ -934,6 +1352,39 @@ static int tpacket_fill_skb(struct packet_sock *po, struct sk_buff *skb,
 	return tp_len;
 }
 
+/* Send the skbs of a batch, returns the first error */
+static int tpacket_xmit_batch(struct packet_sock *po, struct net_device *dev,
+			      struct sk_buff_head *batch)
+{
+	unsigned int n = skb_queue_len(batch), dropped = 0;
+	struct sk_buff *skb;
+	int err, first_err = 0;
+
+	if (!n)
+		return 0;
+
+	if (po->qdisc_bypass) {
+		dropped = packet_direct_xmit(dev, batch);
+		if (dropped)
+			first_err = -ENOBUFS;
+	} else {
+		while ((skb = __skb_dequeue(batch)) != NULL) {
+			err = dev_queue_xmit(skb);
+			if (err > 0)
+				err = net_xmit_errno(err);
+			if (unlikely(err)) {
+				dropped++;
+				if (!first_err)
+					first_err = err;
+			}
+		}
+	}
+
+	po->tx_stats.tp_sent += n - dropped;
+	po->tx_stats.tp_dropped += dropped;
+	return first_err;
+}
+
 static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 {
 	struct socket *sock;
@@ -947,6 +1398,7 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 	unsigned char *addr;
 	int len_sum = 0;
 	int status = 0;
+	struct sk_buff_head batch;
 
 	sock = po->sk.sk_socket;
 
@@ -987,11 +1439,15 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 	if (size_max > dev->mtu + reserve)
 		size_max = dev->mtu + reserve;
 
+	__skb_queue_head_init(&batch);
 	do {
 		ph = packet_current_frame(po, &po->tx_ring,
 				TP_STATUS_SEND_REQUEST);
 
 		if (unlikely(ph == NULL)) {
+			err = tpacket_xmit_batch(po, dev, &batch);
+			if (unlikely(err) && !po->tp_loss)
+				goto out_put;
 			schedule();
 			continue;
 		}
@@ -1000,15 +1456,24 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 		skb = sock_alloc_send_skb(&po->sk,
 				LL_ALLOCATED_SPACE(dev)
 				+ sizeof(struct sockaddr_ll),
-				0, &err);
-
-		if (unlikely(skb == NULL))
+				!skb_queue_empty(&batch), &err);
+
+		if (unlikely(skb == NULL)) {
+			/* the batch holds the send buffer, send it first */
+			if (err == -EAGAIN && !skb_queue_empty(&batch)) {
+				err = tpacket_xmit_batch(po, dev, &batch);
+				if (unlikely(err) && !po->tp_loss)
+					goto out_put;
+				continue;
+			}
 			goto out_status;
+		}
 
 		tp_len = tpacket_fill_skb(po, skb, ph, dev, size_max, proto,
 				addr);
 
 		if (unlikely(tp_len < 0)) {
+			po->tx_stats.tp_wrong_format++;
 			if (po->tp_loss) {
 				__packet_set_status(po, ph,
 						TP_STATUS_AVAILABLE);
@@ -1025,35 +1490,32 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 		skb->destructor = tpacket_destruct_skb;
 		__packet_set_status(po, ph, TP_STATUS_SENDING);
 		atomic_inc(&po->tx_ring.pending);
-
-		status = TP_STATUS_SEND_REQUEST;
-		err = dev_queue_xmit(skb);
-		if (unlikely(err > 0)) {
-			err = net_xmit_errno(err);
-			if (err && __packet_get_status(po, ph) ==
-				   TP_STATUS_AVAILABLE) {
-				/* skb was destructed already */
-				skb = NULL;
-				goto out_status;
-			}
-			/*
-			 * skb was dropped but not destructed yet;
-			 * let's treat it like congestion or err < 0
-			 */
-			err = 0;
-		}
 		packet_increment_head(&po->tx_ring);
 		len_sum += tp_len;
+
+		/*
+		 * Frames are handed on in batches, a failed send releases
+		 * them like a sent one and shows in tx_stats.
+		 */
+		__skb_queue_tail(&batch, skb);
+		if (skb_queue_len(&batch) >= TX_RING_BATCH) {
+			err = tpacket_xmit_batch(po, dev, &batch);
+			if (unlikely(err) && !po->tp_loss)
+				goto out_put;
+		}
 	} while (likely((ph != NULL) || ((!(msg->msg_flags & MSG_DONTWAIT))
 					&& (atomic_read(&po->tx_ring.pending))))
 	      );
 
-	err = len_sum;
+	err = tpacket_xmit_batch(po, dev, &batch);
+	if (likely(!err) || po->tp_loss)
+		err = len_sum;
 	goto out_put;
 
 out_status:
 	__packet_set_status(po, ph, status);
 	kfree_skb(skb);
+	tpacket_xmit_batch(po, dev, &batch);
 out_put:
 	dev_put(dev);
 out:
@@ -1136,7 +1598,7 @@ static int packet_snd(struct socket *sock,
 	 *	Now send it
 	 */
 
-	err = dev_queue_xmit(skb);
+	err = packet_xmit(pkt_sk(sk), skb);
 	if (err > 0 && (err = net_xmit_errno(err)) != 0)
 		goto out_unlock;
 
@@ -1171,13 +1633,341 @@ static int packet_sendmsg(struct kiocb *iocb, struct socket *sock,
  *	to 'closed' state and remove our protocol entry in the device list.
  */
 
+/*
+ *	Fanout groups.
+ *
+ *	Sockets bound to the same device and protocol may join a group with
+ *	PACKET_FANOUT. The group registers a single prot_hook and hands each
+ *	packet to one running member, picked by flow hash, round robin or
+ *	receiving CPU. With rollover a member whose buffer is full passes
+ *	the packet on to the next one.
+ */
+
+static LIST_HEAD(fanout_list);
+static DEFINE_MUTEX(fanout_mutex);
+
+/*
+ * Whether the socket can take the packet right now. This is a hint read
+ * without the queue lock: it only steers rollover.
+ */
+static int packet_rcv_has_room(struct packet_sock *po, struct sk_buff *skb)
+{
+	struct sock *sk = &po->sk;
+
+#ifdef CONFIG_PACKET_MMAP
+	if (po->rx_ring.pg_vec) {
+		if (po->tp_version == TPACKET_V3) {
+			struct tpacket_kbdq_core *pkc = &po->rx_ring.prb_bdqc;
+
+			return pkc->blk_open ||
+			       prb_block_status(prb_block(&po->rx_ring,
+							  pkc->active)) ==
+			       TP_STATUS_KERNEL;
+		}
+		return packet_current_frame(po, &po->rx_ring,
+					    TP_STATUS_KERNEL) != NULL;
+	}
+#endif
+	return atomic_read(&sk->sk_rmem_alloc) + skb->truesize <=
+	       (unsigned)sk->sk_rcvbuf;
+}
+
+static unsigned int fanout_demux_hash(struct packet_fanout *f,
+				      struct sk_buff *skb, unsigned int num)
+{
+	return ((u64)packet_flow_hash(skb) * num) >> 32;
+}
+
+static unsigned int fanout_demux_lb(struct packet_fanout *f,
+				    struct sk_buff *skb, unsigned int num)
+{
+	return (unsigned int)atomic_inc_return(&f->rr_cur) % num;
+}
+
+static unsigned int fanout_demux_cpu(struct packet_fanout *f,
+				     struct sk_buff *skb, unsigned int num)
+{
+	return smp_processor_id() % num;
+}
+
+/* first member from idx on that has room, idx itself when none has */
+static unsigned int fanout_demux_rollover(struct packet_fanout *f,
+					  struct sk_buff *skb,
+					  unsigned int idx, unsigned int num)
+{
+	unsigned int i, j = idx;
+
+	for (i = 0; i < num; i++) {
+		if (packet_rcv_has_room(pkt_sk(f->arr[j]), skb))
+			return j;
+		if (++j == num)
+			j = 0;
+	}
+	return idx;
+}
+
+/*
+ * Fragments of a datagram only carry the ports in the first one, so
+ * reassemble them before hashing to keep a flow on one member.
+ * Returns NULL when the skb was queued for reassembly.
+ */
+static struct sk_buff *fanout_check_defrag(struct sk_buff *skb)
+{
+#ifdef CONFIG_INET
+	const struct iphdr *iph;
+	u32 len;
+
+	if (skb->protocol != htons(ETH_P_IP))
+		return skb;
+	if (!pskb_may_pull(skb, sizeof(struct iphdr)))
+		return skb;
+	iph = ip_hdr(skb);
+	if (iph->ihl < 5 || iph->version != 4)
+		return skb;
+	if (!pskb_may_pull(skb, iph->ihl * 4))
+		return skb;
+	iph = ip_hdr(skb);
+	len = ntohs(iph->tot_len);
+	if (skb->len < len || len < (iph->ihl * 4))
+		return skb;
+
+	if (iph->frag_off & htons(IP_MF | IP_OFFSET)) {
+		skb = skb_share_check(skb, GFP_ATOMIC);
+		if (skb) {
+			if (pskb_trim_rcsum(skb, len))
+				return skb;
+			memset(IPCB(skb), 0, sizeof(struct inet_skb_parm));
+			if (ip_defrag(skb, IP_DEFRAG_AF_PACKET))
+				return NULL;
+		}
+	}
+#endif
+	return skb;
+}
+
+static int packet_rcv_fanout(struct sk_buff *skb, struct net_device *dev,
+			     struct packet_type *pt,
+			     struct net_device *orig_dev)
+{
+	struct packet_fanout *f = pt->af_packet_priv;
+	unsigned int num = f->num_members;
+	struct packet_sock *po;
+	unsigned int idx;
+
+	if (!net_eq(dev_net(dev), read_pnet(&f->net)) || !num) {
+		kfree_skb(skb);
+		return 0;
+	}
+
+	if (f->type_flags & PACKET_FANOUT_FLAG_DEFRAG) {
+		skb = fanout_check_defrag(skb);
+		if (!skb)
+			return 0;
+	}
+
+	switch (f->type_flags & 0xff) {
+	case PACKET_FANOUT_HASH:
+	default:
+		idx = fanout_demux_hash(f, skb, num);
+		break;
+	case PACKET_FANOUT_LB:
+		idx = fanout_demux_lb(f, skb, num);
+		break;
+	case PACKET_FANOUT_CPU:
+		idx = fanout_demux_cpu(f, skb, num);
+		break;
+	case PACKET_FANOUT_ROLLOVER:
+		idx = 0;
+		break;
+	}
+	if ((f->type_flags & 0xff) == PACKET_FANOUT_ROLLOVER ||
+	    (f->type_flags & PACKET_FANOUT_FLAG_ROLLOVER))
+		idx = fanout_demux_rollover(f, skb, idx, num);
+
+	po = pkt_sk(f->arr[idx]);
+	return po->prot_hook.func(skb, dev, &po->prot_hook, orig_dev);
+}
+
+static void __fanout_link(struct sock *sk, struct packet_sock *po)
+{
+	struct packet_fanout *f = po->fanout;
+
+	spin_lock(&f->lock);
+	f->arr[f->num_members] = sk;
+	smp_wmb();
+	f->num_members++;
+	spin_unlock(&f->lock);
+}
+
+static void __fanout_unlink(struct sock *sk, struct packet_sock *po)
+{
+	struct packet_fanout *f = po->fanout;
+	int i;
+
+	spin_lock(&f->lock);
+	for (i = 0; i < f->num_members; i++) {
+		if (f->arr[i] == sk)
+			break;
+	}
+	BUG_ON(i >= f->num_members);
+	f->arr[i] = f->arr[f->num_members - 1];
+	f->num_members--;
+	spin_unlock(&f->lock);
+}
+
+/* caller holds po->bind_lock */
+static void register_prot_hook(struct sock *sk)
+{
+	struct packet_sock *po = pkt_sk(sk);
+
+	if (!po->running) {
+		if (po->fanout)
+			__fanout_link(sk, po);
+		else
+			dev_add_pack(&po->prot_hook);
+		sock_hold(sk);
+		po->running = 1;
+	}
+}
+
+/*
+ * Caller holds po->bind_lock. With sync the lock is dropped while
+ * waiting for the receivers that may still see the hook.
+ */
+static void __unregister_prot_hook(struct sock *sk, int sync)
+{
+	struct packet_sock *po = pkt_sk(sk);
+
+	po->running = 0;
+	if (po->fanout)
+		__fanout_unlink(sk, po);
+	else
+		__dev_remove_pack(&po->prot_hook);
+	__sock_put(sk);
+
+	if (sync) {
+		spin_unlock(&po->bind_lock);
+		synchronize_net();
+		spin_lock(&po->bind_lock);
+	}
+}
+
+static int fanout_add(struct sock *sk, u16 id, u16 type_flags)
+{
+	struct packet_sock *po = pkt_sk(sk);
+	struct packet_fanout *f, *match = NULL;
+	int err;
+
+	switch (type_flags & 0xff) {
+	case PACKET_FANOUT_HASH:
+	case PACKET_FANOUT_LB:
+	case PACKET_FANOUT_CPU:
+	case PACKET_FANOUT_ROLLOVER:
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (type_flags & ~(0xff | PACKET_FANOUT_FLAG_ROLLOVER |
+			   PACKET_FANOUT_FLAG_DEFRAG))
+		return -EINVAL;
+
+	lock_sock(sk);
+	err = -EALREADY;
+	if (po->fanout)
+		goto out_release;
+
+	mutex_lock(&fanout_mutex);
+	err = -EINVAL;
+	if (!po->running)
+		goto out;
+
+	list_for_each_entry(f, &fanout_list, list) {
+		if (f->id == id && net_eq(read_pnet(&f->net), sock_net(sk))) {
+			match = f;
+			break;
+		}
+	}
+	if (!match) {
+		err = -ENOMEM;
+		match = kzalloc(sizeof(*match), GFP_KERNEL);
+		if (!match)
+			goto out;
+		write_pnet(&match->net, sock_net(sk));
+		match->id = id;
+		match->type_flags = type_flags;
+		atomic_set(&match->rr_cur, 0);
+		INIT_LIST_HEAD(&match->list);
+		spin_lock_init(&match->lock);
+		atomic_set(&match->sk_ref, 0);
+		match->prot_hook.type = po->prot_hook.type;
+		match->prot_hook.dev = po->prot_hook.dev;
+		match->prot_hook.func = packet_rcv_fanout;
+		match->prot_hook.af_packet_priv = match;
+		dev_add_pack(&match->prot_hook);
+		list_add(&match->list, &fanout_list);
+	}
+
+	err = -EINVAL;
+	if (match->type_flags != type_flags ||
+	    match->prot_hook.type != po->prot_hook.type ||
+	    match->prot_hook.dev != po->prot_hook.dev)
+		goto out;
+
+	err = -ENOSPC;
+	if (atomic_read(&match->sk_ref) >= PACKET_FANOUT_MAX)
+		goto out;
+
+	/* move the socket from its own hook to the group */
+	spin_lock(&po->bind_lock);
+	if (po->running) {
+		__dev_remove_pack(&po->prot_hook);
+		po->fanout = match;
+		atomic_inc(&match->sk_ref);
+		__fanout_link(sk, po);
+		err = 0;
+	} else
+		err = -EINVAL;
+	spin_unlock(&po->bind_lock);
+out:
+	if (match && !atomic_read(&match->sk_ref)) {
+		list_del(&match->list);
+		dev_remove_pack(&match->prot_hook);
+		kfree(match);
+	}
+	mutex_unlock(&fanout_mutex);
+out_release:
+	release_sock(sk);
+	return err;
+}
+
+/* the socket is not running any more */
+static void fanout_release(struct sock *sk)
+{
+	struct packet_sock *po = pkt_sk(sk);
+	struct packet_fanout *f;
+
+	f = po->fanout;
+	if (!f)
+		return;
+
+	po->fanout = NULL;
+
+	mutex_lock(&fanout_mutex);
+	if (atomic_dec_and_test(&f->sk_ref)) {
+		list_del(&f->list);
+		dev_remove_pack(&f->prot_hook);
+		kfree(f);
+	}
+	mutex_unlock(&fanout_mutex);
+}
+
 static int packet_release(struct socket *sock)
 {
 	struct sock *sk = sock->sk;
 	struct packet_sock *po;
 	struct net *net;
 #ifdef CONFIG_PACKET_MMAP
-	struct tpacket_req req;
+	union tpacket_req_u req_u;
 #endif
 
 	if (!sk)
@@ -1195,26 +1985,25 @@ static int packet_release(struct socket *sock)
 	 *	Unhook packet receive handler.
 	 */
 
-	if (po->running) {
-		/*
-		 *	Remove the protocol hook
-		 */
-		dev_remove_pack(&po->prot_hook);
-		po->running = 0;
-		po->num = 0;
-		__sock_put(sk);
-	}
+	spin_lock(&po->bind_lock);
+	if (po->running)
+		__unregister_prot_hook(sk, 0);
+	po->num = 0;
+	spin_unlock(&po->bind_lock);
+
+	fanout_release(sk);
+	synchronize_net();
 
 	packet_flush_mclist(sk);
 
 #ifdef CONFIG_PACKET_MMAP
-	memset(&req, 0, sizeof(req));
+	memset(&req_u, 0, sizeof(req_u));
 
 	if (po->rx_ring.pg_vec)
-		packet_set_ring(sk, &req, 1, 0);
+		packet_set_ring(sk, &req_u, 1, 0);
 
 	if (po->tx_ring.pg_vec)
-		packet_set_ring(sk, &req, 1, 1);
+		packet_set_ring(sk, &req_u, 1, 1);
 #endif
 
 	/*
@@ -1246,14 +2035,16 @@ static int packet_do_bind(struct sock *sk, struct net_device *dev, __be16 protoc
 
 	lock_sock(sk);
 
+	/* the members of a fanout group share the hook of the group */
+	if (po->fanout) {
+		release_sock(sk);
+		return -EINVAL;
+	}
+
 	spin_lock(&po->bind_lock);
 	if (po->running) {
-		__sock_put(sk);
-		po->running = 0;
 		po->num = 0;
-		spin_unlock(&po->bind_lock);
-		dev_remove_pack(&po->prot_hook);
-		spin_lock(&po->bind_lock);
+		__unregister_prot_hook(sk, 1);
 	}
 
 	po->num = protocol;
@@ -1266,9 +2057,7 @@ static int packet_do_bind(struct sock *sk, struct net_device *dev, __be16 protoc
 		goto out_unlock;
 
 	if (!dev || (dev->flags & IFF_UP)) {
-		dev_add_pack(&po->prot_hook);
-		sock_hold(sk);
-		po->running = 1;
+		register_prot_hook(sk);
 	} else {
 		sk->sk_err = ENETDOWN;
 		if (!sock_flag(sk, SOCK_DEAD))
@@ -1389,6 +2178,10 @@ static int packet_create(struct net *net, struct socket *sock, int protocol)
 
 	spin_lock_init(&po->bind_lock);
 	mutex_init(&po->pg_vec_lock);
+#ifdef CONFIG_PACKET_MMAP
+	setup_timer(&po->rx_ring.prb_bdqc.retire_timer,
+		    prb_retire_timer_expired, (unsigned long)po);
+#endif
 	po->prot_hook.func = packet_rcv;
 
 	if (sock->type == SOCK_PACKET)
@@ -1742,13 +2535,19 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 	case PACKET_RX_RING:
 	case PACKET_TX_RING:
 	{
-		struct tpacket_req req;
+		union tpacket_req_u req_u;
+		int len;
 
-		if (optlen < sizeof(req))
+		if (po->tp_version == TPACKET_V3)
+			len = sizeof(req_u.req3);
+		else
+			len = sizeof(req_u.req);
+		if (optlen < len)
 			return -EINVAL;
-		if (copy_from_user(&req, optval, sizeof(req)))
+		if (copy_from_user(&req_u, optval, len))
 			return -EFAULT;
-		return packet_set_ring(sk, &req, 0, optname == PACKET_TX_RING);
+		return packet_set_ring(sk, &req_u, 0,
+				       optname == PACKET_TX_RING);
 	}
 	case PACKET_COPY_THRESH:
 	{
@@ -1775,6 +2574,7 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 		switch (val) {
 		case TPACKET_V1:
 		case TPACKET_V2:
+		case TPACKET_V3:
 			po->tp_version = val;
 			return 0;
 		default:
@@ -1808,6 +2608,29 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 		return 0;
 	}
 #endif
+	case PACKET_FANOUT:
+	{
+		int val;
+
+		if (optlen != sizeof(val))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+
+		return fanout_add(sk, val & 0xffff, val >> 16);
+	}
+	case PACKET_QDISC_BYPASS:
+	{
+		int val;
+
+		if (optlen != sizeof(val))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+
+		po->qdisc_bypass = !!val;
+		return 0;
+	}
 	case PACKET_AUXDATA:
 	{
 		int val;
@@ -1845,7 +2668,10 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 	struct sock *sk = sock->sk;
 	struct packet_sock *po = pkt_sk(sk);
 	void *data;
-	struct tpacket_stats st;
+	struct tpacket_stats_v3 st;
+#ifdef CONFIG_PACKET_MMAP
+	struct tpacket_tx_stats tx_st;
+#endif
 
 	if (level != SOL_PACKET)
 		return -ENOPROTOOPT;
@@ -1858,6 +2684,12 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 
 	switch (optname) {
 	case PACKET_STATISTICS:
+#ifdef CONFIG_PACKET_MMAP
+		if (po->tp_version == TPACKET_V3) {
+			if (len > sizeof(struct tpacket_stats_v3))
+				len = sizeof(struct tpacket_stats_v3);
+		} else
+#endif
 		if (len > sizeof(struct tpacket_stats))
 			len = sizeof(struct tpacket_stats);
 		spin_lock_bh(&sk->sk_receive_queue.lock);
@@ -1901,6 +2733,9 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 		case TPACKET_V2:
 			val = sizeof(struct tpacket2_hdr);
 			break;
+		case TPACKET_V3:
+			val = sizeof(struct tpacket3_hdr);
+			break;
 		default:
 			return -EINVAL;
 		}
@@ -1918,7 +2753,31 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 		val = po->tp_loss;
 		data = &val;
 		break;
+	case PACKET_TX_STATISTICS:
+		if (len > sizeof(struct tpacket_tx_stats))
+			len = sizeof(struct tpacket_tx_stats);
+		mutex_lock(&po->pg_vec_lock);
+		tx_st = po->tx_stats;
+		memset(&po->tx_stats, 0, sizeof(tx_st));
+		mutex_unlock(&po->pg_vec_lock);
+		data = &tx_st;
+		break;
 #endif
+	case PACKET_QDISC_BYPASS:
+		if (len > sizeof(int))
+			len = sizeof(int);
+		val = po->qdisc_bypass;
+		data = &val;
+		break;
+	case PACKET_FANOUT:
+		if (len > sizeof(int))
+			len = sizeof(int);
+		val = (po->fanout ?
+		       ((u32)po->fanout->id |
+			((u32)po->fanout->type_flags << 16)) :
+		       0);
+		data = &val;
+		break;
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -1952,9 +2811,7 @@ static int packet_notifier(struct notifier_block *this, unsigned long msg, void
 			if (dev->ifindex == po->ifindex) {
 				spin_lock(&po->bind_lock);
 				if (po->running) {
-					__dev_remove_pack(&po->prot_hook);
-					__sock_put(sk);
-					po->running = 0;
+					__unregister_prot_hook(sk, 0);
 					sk->sk_err = ENETDOWN;
 					if (!sock_flag(sk, SOCK_DEAD))
 						sk->sk_error_report(sk);
@@ -1968,12 +2825,8 @@ static int packet_notifier(struct notifier_block *this, unsigned long msg, void
 			break;
 		case NETDEV_UP:
 			spin_lock(&po->bind_lock);
-			if (dev->ifindex == po->ifindex && po->num &&
-			    !po->running) {
-				dev_add_pack(&po->prot_hook);
-				sock_hold(sk);
-				po->running = 1;
-			}
+			if (dev->ifindex == po->ifindex && po->num)
+				register_prot_hook(sk);
 			spin_unlock(&po->bind_lock);
 			break;
 		}
@@ -2052,7 +2905,11 @@ static unsigned int packet_poll(struct file *file, struct socket *sock,
 
 	spin_lock_bh(&sk->sk_receive_queue.lock);
 	if (po->rx_ring.pg_vec) {
-		if (!packet_previous_frame(po, &po->rx_ring, TP_STATUS_KERNEL))
+		if (po->tp_version == TPACKET_V3) {
+			if (prb_user_blocks(po))
+				mask |= POLLIN | POLLRDNORM;
+		} else if (!packet_previous_frame(po, &po->rx_ring,
+						  TP_STATUS_KERNEL))
 			mask |= POLLIN | POLLRDNORM;
 	}
 	spin_unlock_bh(&sk->sk_receive_queue.lock);
@@ -2138,9 +2995,10 @@ out_free_pgvec:
 	goto out;
 }
 
-static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
+static int packet_set_ring(struct sock *sk, union tpacket_req_u *req_u,
 		int closing, int tx_ring)
 {
+	struct tpacket_req *req = &req_u->req;
 	char **pg_vec = NULL;
 	struct packet_sock *po = pkt_sk(sk);
 	int was_running, order = 0;
@@ -2173,6 +3031,9 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
 		case TPACKET_V2:
 			po->tp_hdrlen = TPACKET2_HDRLEN;
 			break;
+		case TPACKET_V3:
+			po->tp_hdrlen = TPACKET3_HDRLEN;
+			break;
 		}
 
 		err = -EINVAL;
@@ -2180,6 +3041,18 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
 			goto out;
 		if (unlikely(req->tp_block_size & (PAGE_SIZE - 1)))
 			goto out;
+		if (po->tp_version == TPACKET_V3) {
+			/* block mode is receive only */
+			if (unlikely(tx_ring))
+				goto out;
+			if (unlikely(req_u->req3.tp_sizeof_priv >=
+				     req->tp_block_size))
+				goto out;
+			if (unlikely(V3_BLK_HDRLEN(req_u->req3.tp_sizeof_priv) +
+				     po->tp_hdrlen + po->tp_reserve >
+				     req->tp_block_size))
+				goto out;
+		}
 		if (unlikely(req->tp_frame_size < po->tp_hdrlen +
 					po->tp_reserve))
 			goto out;
@@ -2213,14 +3086,14 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
 	was_running = po->running;
 	num = po->num;
 	if (was_running) {
-		__dev_remove_pack(&po->prot_hook);
 		po->num = 0;
-		po->running = 0;
-		__sock_put(sk);
+		__unregister_prot_hook(sk, 0);
 	}
 	spin_unlock(&po->bind_lock);
 
 	synchronize_net();
+	if (!tx_ring)
+		del_timer_sync(&po->rx_ring.prb_bdqc.retire_timer);
 
 	err = -EBUSY;
 	mutex_lock(&po->pg_vec_lock);
@@ -2232,6 +3105,23 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
 		rb->frame_max = (req->tp_frame_nr - 1);
 		rb->head = 0;
 		rb->frame_size = req->tp_frame_size;
+		if (!tx_ring && po->tp_version == TPACKET_V3 && rb->pg_vec) {
+			struct tpacket_kbdq_core *pkc = &rb->prb_bdqc;
+			unsigned int tov = req_u->req3.tp_retire_blk_tov;
+
+			pkc->blk_size = req->tp_block_size;
+			pkc->blk_nr = req->tp_block_nr;
+			pkc->blk_hdrlen =
+				V3_BLK_HDRLEN(req_u->req3.tp_sizeof_priv);
+			pkc->feature_req_word = req_u->req3.tp_feature_req_word;
+			pkc->active = 0;
+			pkc->blk_open = 0;
+			pkc->frozen = 0;
+			pkc->seq_num = 0;
+			atomic_set(&pkc->fill_in_prog, 0);
+			pkc->tov = max_t(unsigned long, 1,
+				msecs_to_jiffies(tov ? : DEFAULT_PRB_RETIRE_TOV));
+		}
 		spin_unlock_bh(&rb_queue->lock);
 
 		order = XC(rb->pg_vec_order, order);
@@ -2249,11 +3139,9 @@ static int packet_set_ring(struct sock *sk, struct tpacket_req *req,
 	mutex_unlock(&po->pg_vec_lock);
 
 	spin_lock(&po->bind_lock);
-	if (was_running && !po->running) {
-		sock_hold(sk);
-		po->running = 1;
+	if (was_running) {
 		po->num = num;
-		dev_add_pack(&po->prot_hook);
+		register_prot_hook(sk);
 	}
 	spin_unlock(&po->bind_lock);
 
@@ -2500,6 +3388,7 @@ static int __init packet_init(void)
 	if (rc != 0)
 		goto out;
 
+	get_random_bytes(&packet_hashrnd, sizeof(packet_hashrnd));
 	sock_register(&packet_family_ops);
 	register_pernet_subsys(&packet_net_ops);
 	register_netdevice_notifier(&packet_netdev_notifier);
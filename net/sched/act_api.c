@@ -25,6 +25,14 @@
 #include <net/act_api.h>
 #include <net/netlink.h>
 
+static void tcf_common_free_rcu(struct rcu_head *head)
+{
+	struct tcf_common *p = container_of(head, struct tcf_common, tcfc_rcu);
+
+	free_percpu(p->tcfc_cpu_stats);
+	kfree(p);
+}
+
 void tcf_hash_destroy(struct tcf_common *p, struct tcf_hashinfo *hinfo)
 {
 	unsigned int h = tcf_hash(p->tcfc_index, hinfo->hmask);
@@ -37,7 +45,8 @@ void tcf_hash_destroy(struct tcf_common *p, struct tcf_hashinfo *hinfo)
 			write_unlock_bh(hinfo->lock);
 			gen_kill_estimator(&p->tcfc_bstats,
 					   &p->tcfc_rate_est);
-			kfree(p);
+			/* The packet path may still be running the action. */
+			call_rcu_bh(&p->tcfc_rcu, tcf_common_free_rcu);
 			return;
 		}
 	}
@@ -237,6 +246,13 @@ struct tcf_common *tcf_hash_create(u32 index, struct nlattr *est,
 			kfree(p);
 			return ERR_PTR(err);
 		}
+	} else {
+		/* The estimator samples tcfc_bstats, so it keeps them live. */
+		p->tcfc_cpu_stats = alloc_percpu(struct tcf_cpu_stats);
+		if (unlikely(!p->tcfc_cpu_stats)) {
+			kfree(p);
+			return ERR_PTR(-ENOMEM);
+		}
 	}
 
 	a->priv = (void *) p;
@@ -255,6 +271,61 @@ void tcf_hash_insert(struct tcf_common *p, struct tcf_hashinfo *hinfo)
 }
 EXPORT_SYMBOL(tcf_hash_insert);
 
+/* Caller holds tcfc_lock. */
+static void tcf_cpu_stats_fold(struct tcf_common *p,
+			       struct tcf_cpu_stats *stats)
+{
+	u64 bytes = 0;
+	u32 packets = 0, drops = 0, overlimits = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct tcf_cpu_stats *cs = per_cpu_ptr(stats, cpu);
+
+		bytes += cs->bytes;
+		packets += cs->packets;
+		drops += cs->drops;
+		overlimits += cs->overlimits;
+	}
+	p->tcfc_bstats.bytes = bytes;
+	p->tcfc_bstats.packets = packets;
+	p->tcfc_qstats.drops = drops;
+	p->tcfc_qstats.overlimits = overlimits;
+}
+
+/*
+ * Switch an action back to the shared, tcfc_lock protected counters, e.g.
+ * before a rate estimator is attached to it.  Must be called from process
+ * context without tcfc_lock held.
+ */
+void tcf_cpu_stats_disable(struct tcf_common *p)
+{
+	struct tcf_cpu_stats *stats = p->tcfc_cpu_stats;
+
+	if (stats == NULL)
+		return;
+	rcu_assign_pointer(p->tcfc_cpu_stats, NULL);
+	synchronize_rcu_bh();
+
+	spin_lock_bh(&p->tcfc_lock);
+	tcf_cpu_stats_fold(p, stats);
+	spin_unlock_bh(&p->tcfc_lock);
+	free_percpu(stats);
+}
+EXPORT_SYMBOL(tcf_cpu_stats_disable);
+
+static void tcf_params_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tcf_params, rcu));
+}
+
+void tcf_params_free(struct tcf_params *p)
+{
+	if (p)
+		call_rcu_bh(&p->rcu, tcf_params_free_rcu);
+}
+EXPORT_SYMBOL(tcf_params_free);
+
 static struct tc_action_ops *act_base = NULL;
 static DEFINE_RWLOCK(act_mod_lock);
 
@@ -613,6 +684,9 @@ int tcf_action_copy_stats(struct sk_buff *skb, struct tc_action *a,
 	if (err < 0)
 		goto errout;
 
+	if (h->tcf_cpu_stats)
+		tcf_cpu_stats_fold(&h->common, h->tcf_cpu_stats);
+
 	if (a->ops != NULL && a->ops->get_stats != NULL)
 		if (a->ops->get_stats(skb, a) < 0)
 			goto errout;
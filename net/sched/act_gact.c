@@ -35,21 +35,24 @@ static struct tcf_hashinfo gact_hash_info = {
 };
 
 #ifdef CONFIG_GACT_PROB
-static int gact_net_rand(struct tcf_gact *gact)
+static int gact_net_rand(struct tcf_gact *gact,
+			 const struct tcf_gact_params *p)
 {
-	if (!gact->tcfg_pval || net_random() % gact->tcfg_pval)
-		return gact->tcf_action;
-	return gact->tcfg_paction;
+	if (!p->pval || net_random() % p->pval)
+		return p->action;
+	return p->paction;
 }
 
-static int gact_determ(struct tcf_gact *gact)
+static int gact_determ(struct tcf_gact *gact,
+		       const struct tcf_gact_params *p)
 {
-	if (!gact->tcfg_pval || gact->tcf_bstats.packets % gact->tcfg_pval)
-		return gact->tcf_action;
-	return gact->tcfg_paction;
+	if (!p->pval ||
+	    (u32)(atomic_inc_return(&gact->packets) - 1) % p->pval)
+		return p->action;
+	return p->paction;
 }
 
-typedef int (*g_rand)(struct tcf_gact *gact);
+typedef int (*g_rand)(struct tcf_gact *gact, const struct tcf_gact_params *p);
 static g_rand gact_rand[MAX_RAND]= { NULL, gact_net_rand, gact_determ };
 #endif /* CONFIG_GACT_PROB */
 
@@ -64,6 +67,7 @@ static int tcf_gact_init(struct nlattr *nla, struct nlattr *est,
 	struct nlattr *tb[TCA_GACT_MAX + 1];
 	struct tc_gact *parm;
 	struct tcf_gact *gact;
+	struct tcf_gact_params *params, *old;
 	struct tcf_common *pc;
 	int ret = 0;
 	int err;
@@ -93,32 +97,48 @@ static int tcf_gact_init(struct nlattr *nla, struct nlattr *est,
 	}
 #endif
 
+	params = kzalloc(sizeof(*params), GFP_KERNEL);
+	if (params == NULL)
+		return -ENOMEM;
+
 	pc = tcf_hash_check(parm->index, a, bind, &gact_hash_info);
 	if (!pc) {
 		pc = tcf_hash_create(parm->index, est, a, sizeof(*gact),
 				     bind, &gact_idx_gen, &gact_hash_info);
-		if (IS_ERR(pc))
-		    return PTR_ERR(pc);
+		if (IS_ERR(pc)) {
+			kfree(params);
+			return PTR_ERR(pc);
+		}
 		ret = ACT_P_CREATED;
 	} else {
 		if (!ovr) {
+			kfree(params);
 			tcf_hash_release(pc, bind, &gact_hash_info);
 			return -EEXIST;
 		}
 	}
 
 	gact = to_gact(pc);
+	old = gact->params;
 
-	spin_lock_bh(&gact->tcf_lock);
-	gact->tcf_action = parm->action;
+	params->action = parm->action;
 #ifdef CONFIG_GACT_PROB
 	if (p_parm) {
-		gact->tcfg_paction = p_parm->paction;
-		gact->tcfg_pval    = p_parm->pval;
-		gact->tcfg_ptype   = p_parm->ptype;
+		params->paction = p_parm->paction;
+		params->pval    = p_parm->pval;
+		params->ptype   = p_parm->ptype;
+	} else if (old) {
+		params->paction = old->paction;
+		params->pval    = old->pval;
+		params->ptype   = old->ptype;
 	}
 #endif
+	spin_lock_bh(&gact->tcf_lock);
+	gact->tcf_action = parm->action;
+	rcu_assign_pointer(gact->params, params);
 	spin_unlock_bh(&gact->tcf_lock);
+	if (old)
+		tcf_params_free(&old->common);
 	if (ret == ACT_P_CREATED)
 		tcf_hash_insert(pc, &gact_hash_info);
 	return ret;
@@ -128,31 +148,35 @@ static int tcf_gact_cleanup(struct tc_action *a, int bind)
 {
 	struct tcf_gact *gact = a->priv;
 
-	if (gact)
-		return tcf_hash_release(&gact->common, bind, &gact_hash_info);
+	if (gact) {
+		struct tcf_gact_params *params = gact->params;
+
+		if (tcf_hash_release(&gact->common, bind, &gact_hash_info)) {
+			tcf_params_free(&params->common);
+			return 1;
+		}
+	}
 	return 0;
 }
 
 static int tcf_gact(struct sk_buff *skb, struct tc_action *a, struct tcf_result *res)
 {
 	struct tcf_gact *gact = a->priv;
-	int action = TC_ACT_SHOT;
+	const struct tcf_gact_params *p = rcu_dereference(gact->params);
+	int action;
 
-	spin_lock(&gact->tcf_lock);
 #ifdef CONFIG_GACT_PROB
-	if (gact->tcfg_ptype)
-		action = gact_rand[gact->tcfg_ptype](gact);
+	if (p->ptype)
+		action = gact_rand[p->ptype](gact, p);
 	else
-		action = gact->tcf_action;
+		action = p->action;
 #else
-	action = gact->tcf_action;
+	action = p->action;
 #endif
-	gact->tcf_bstats.bytes += qdisc_pkt_len(skb);
-	gact->tcf_bstats.packets++;
+	tcf_stats_update(&gact->common, qdisc_pkt_len(skb));
 	if (action == TC_ACT_SHOT)
-		gact->tcf_qstats.drops++;
-	gact->tcf_tm.lastuse = jiffies;
-	spin_unlock(&gact->tcf_lock);
+		tcf_stats_drop(&gact->common);
+	tcf_lastuse_update(&gact->common);
 
 	return action;
 }
@@ -167,19 +191,22 @@ static int tcf_gact_dump(struct sk_buff *skb, struct tc_action *a, int bind, int
 		.bindcnt = gact->tcf_bindcnt - bind,
 		.action  = gact->tcf_action,
 	};
+#ifdef CONFIG_GACT_PROB
+	const struct tcf_gact_params *p;
+	struct tc_gact_p p_opt;
+#endif
 	struct tcf_t t;
 
 	NLA_PUT(skb, TCA_GACT_PARMS, sizeof(opt), &opt);
 #ifdef CONFIG_GACT_PROB
-	if (gact->tcfg_ptype) {
-		struct tc_gact_p p_opt = {
-			.paction = gact->tcfg_paction,
-			.pval    = gact->tcfg_pval,
-			.ptype   = gact->tcfg_ptype,
-		};
-
+	rcu_read_lock_bh();
+	p = rcu_dereference(gact->params);
+	p_opt.paction = p->paction;
+	p_opt.pval    = p->pval;
+	p_opt.ptype   = p->ptype;
+	rcu_read_unlock_bh();
+	if (p_opt.ptype)
 		NLA_PUT(skb, TCA_GACT_PROB, sizeof(p_opt), &p_opt);
-	}
 #endif
 	t.install = jiffies_to_clock_t(jiffies - gact->tcf_tm.install);
 	t.lastuse = jiffies_to_clock_t(jiffies - gact->tcf_tm.lastuse);
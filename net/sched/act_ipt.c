@@ -183,7 +183,10 @@ err3:
 err2:
 	kfree(tname);
 err1:
-	kfree(pc);
+	if (ret == ACT_P_CREATED) {
+		free_percpu(pc->tcfc_cpu_stats);
+		kfree(pc);
+	}
 	return err;
 }
 
@@ -205,11 +208,11 @@ static int tcf_ipt(struct sk_buff *skb, struct tc_action *a,
 			return TC_ACT_UNSPEC;
 	}
 
+	tcf_stats_update(&ipt->common, qdisc_pkt_len(skb));
+
 	spin_lock(&ipt->tcf_lock);
 
 	ipt->tcf_tm.lastuse = jiffies;
-	ipt->tcf_bstats.bytes += qdisc_pkt_len(skb);
-	ipt->tcf_bstats.packets++;
 
 	/* yes, we have to worry about both in and out dev
 	 worry later - danger - this API seems to have changed
@@ -227,7 +230,6 @@ static int tcf_ipt(struct sk_buff *skb, struct tc_action *a,
 		break;
 	case NF_DROP:
 		result = TC_ACT_SHOT;
-		ipt->tcf_qstats.drops++;
 		break;
 	case IPT_CONTINUE:
 		result = TC_ACT_PIPE;
@@ -239,6 +241,9 @@ static int tcf_ipt(struct sk_buff *skb, struct tc_action *a,
 		break;
 	}
 	spin_unlock(&ipt->tcf_lock);
+
+	if (result == TC_ACT_SHOT)
+		tcf_stats_drop(&ipt->common);
 	return result;
 
 }
@@ -39,6 +39,20 @@ static struct tcf_hashinfo mirred_hash_info = {
 	.lock	=	&mirred_lock,
 };
 
+static void tcf_mirred_params_free_rcu(struct rcu_head *head)
+{
+	struct tcf_mirred_params *p;
+
+	p = container_of(head, struct tcf_mirred_params, common.rcu);
+	dev_put(p->dev);
+	kfree(p);
+}
+
+static void tcf_mirred_params_free(struct tcf_mirred_params *p)
+{
+	call_rcu_bh(&p->common.rcu, tcf_mirred_params_free_rcu);
+}
+
 static inline int tcf_mirred_release(struct tcf_mirred *m, int bind)
 {
 	if (m) {
@@ -46,7 +60,7 @@ static inline int tcf_mirred_release(struct tcf_mirred *m, int bind)
 			m->tcf_bindcnt--;
 		m->tcf_refcnt--;
 		if(!m->tcf_bindcnt && m->tcf_refcnt <= 0) {
-			dev_put(m->tcfm_dev);
+			tcf_mirred_params_free(m->params);
 			tcf_hash_destroy(&m->common, &mirred_hash_info);
 			return 1;
 		}
@@ -64,6 +78,7 @@ static int tcf_mirred_init(struct nlattr *nla, struct nlattr *est,
 	struct nlattr *tb[TCA_MIRRED_MAX + 1];
 	struct tc_mirred *parm;
 	struct tcf_mirred *m;
+	struct tcf_mirred_params *params, *old;
 	struct tcf_common *pc;
 	struct net_device *dev = NULL;
 	int ret = 0, err;
@@ -99,35 +114,51 @@ static int tcf_mirred_init(struct nlattr *nla, struct nlattr *est,
 		}
 	}
 
+	params = kzalloc(sizeof(*params), GFP_KERNEL);
+	if (params == NULL)
+		return -ENOMEM;
+
 	pc = tcf_hash_check(parm->index, a, bind, &mirred_hash_info);
 	if (!pc) {
-		if (!parm->ifindex)
+		if (!parm->ifindex) {
+			kfree(params);
 			return -EINVAL;
+		}
 		pc = tcf_hash_create(parm->index, est, a, sizeof(*m), bind,
 				     &mirred_idx_gen, &mirred_hash_info);
-		if (IS_ERR(pc))
-		    return PTR_ERR(pc);
+		if (IS_ERR(pc)) {
+			kfree(params);
+			return PTR_ERR(pc);
+		}
 		ret = ACT_P_CREATED;
 	} else {
 		if (!ovr) {
+			kfree(params);
 			tcf_mirred_release(to_mirred(pc), bind);
 			return -EEXIST;
 		}
 	}
 	m = to_mirred(pc);
+	old = m->params;
 
-	spin_lock_bh(&m->tcf_lock);
-	m->tcf_action = parm->action;
-	m->tcfm_eaction = parm->eaction;
+	params->eaction = parm->eaction;
 	if (parm->ifindex) {
-		m->tcfm_ifindex = parm->ifindex;
-		if (ret != ACT_P_CREATED)
-			dev_put(m->tcfm_dev);
-		m->tcfm_dev = dev;
-		dev_hold(dev);
-		m->tcfm_ok_push = ok_push;
+		params->ifindex = parm->ifindex;
+		params->dev = dev;
+		params->ok_push = ok_push;
+	} else {
+		params->ifindex = old->ifindex;
+		params->dev = old->dev;
+		params->ok_push = old->ok_push;
 	}
+	dev_hold(params->dev);
+
+	spin_lock_bh(&m->tcf_lock);
+	m->tcf_action = parm->action;
+	rcu_assign_pointer(m->params, params);
 	spin_unlock_bh(&m->tcf_lock);
+	if (old)
+		tcf_mirred_params_free(old);
 	if (ret == ACT_P_CREATED)
 		tcf_hash_insert(pc, &mirred_hash_info);
 
@@ -147,14 +178,12 @@ static int tcf_mirred(struct sk_buff *skb, struct tc_action *a,
 		      struct tcf_result *res)
 {
 	struct tcf_mirred *m = a->priv;
-	struct net_device *dev;
+	const struct tcf_mirred_params *p = rcu_dereference(m->params);
+	struct net_device *dev = p->dev;
 	struct sk_buff *skb2 = NULL;
 	u32 at = G_TC_AT(skb->tc_verd);
 
-	spin_lock(&m->tcf_lock);
-
-	dev = m->tcfm_dev;
-	m->tcf_tm.lastuse = jiffies;
+	tcf_lastuse_update(&m->common);
 
 	if (!(dev->flags&IFF_UP) ) {
 		if (net_ratelimit())
@@ -163,10 +192,8 @@ static int tcf_mirred(struct sk_buff *skb, struct tc_action *a,
 bad_mirred:
 		if (skb2 != NULL)
 			kfree_skb(skb2);
-		m->tcf_qstats.overlimits++;
-		m->tcf_bstats.bytes += qdisc_pkt_len(skb);
-		m->tcf_bstats.packets++;
-		spin_unlock(&m->tcf_lock);
+		tcf_stats_overlimit(&m->common);
+		tcf_stats_update(&m->common, qdisc_pkt_len(skb));
 		/* should we be asking for packet to be dropped?
 		 * may make sense for redirect case only
 		*/
@@ -176,28 +203,26 @@ bad_mirred:
 	skb2 = skb_act_clone(skb, GFP_ATOMIC);
 	if (skb2 == NULL)
 		goto bad_mirred;
-	if (m->tcfm_eaction != TCA_EGRESS_MIRROR &&
-	    m->tcfm_eaction != TCA_EGRESS_REDIR) {
+	if (p->eaction != TCA_EGRESS_MIRROR &&
+	    p->eaction != TCA_EGRESS_REDIR) {
 		if (net_ratelimit())
 			printk("tcf_mirred unknown action %d\n",
-			       m->tcfm_eaction);
+			       p->eaction);
 		goto bad_mirred;
 	}
 
-	m->tcf_bstats.bytes += qdisc_pkt_len(skb2);
-	m->tcf_bstats.packets++;
+	tcf_stats_update(&m->common, qdisc_pkt_len(skb2));
 	if (!(at & AT_EGRESS))
-		if (m->tcfm_ok_push)
+		if (p->ok_push)
 			skb_push(skb2, skb2->dev->hard_header_len);
 
 	/* mirror is always swallowed */
-	if (m->tcfm_eaction != TCA_EGRESS_MIRROR)
+	if (p->eaction != TCA_EGRESS_MIRROR)
 		skb2->tc_verd = SET_TC_FROM(skb2->tc_verd, at);
 
 	skb2->dev = dev;
 	skb2->iif = skb->dev->ifindex;
 	dev_queue_xmit(skb2);
-	spin_unlock(&m->tcf_lock);
 	return m->tcf_action;
 }
 
@@ -205,16 +230,21 @@ static int tcf_mirred_dump(struct sk_buff *skb, struct tc_action *a, int bind, i
 {
 	unsigned char *b = skb_tail_pointer(skb);
 	struct tcf_mirred *m = a->priv;
+	const struct tcf_mirred_params *p;
 	struct tc_mirred opt = {
 		.index   = m->tcf_index,
 		.action  = m->tcf_action,
 		.refcnt  = m->tcf_refcnt - ref,
 		.bindcnt = m->tcf_bindcnt - bind,
-		.eaction = m->tcfm_eaction,
-		.ifindex = m->tcfm_ifindex,
 	};
 	struct tcf_t t;
 
+	rcu_read_lock_bh();
+	p = rcu_dereference(m->params);
+	opt.eaction = p->eaction;
+	opt.ifindex = p->ifindex;
+	rcu_read_unlock_bh();
+
 	NLA_PUT(skb, TCA_MIRRED_PARMS, sizeof(opt), &opt);
 	t.install = jiffies_to_clock_t(jiffies - m->tcf_tm.install);
 	t.lastuse = jiffies_to_clock_t(jiffies - m->tcf_tm.lastuse);
@@ -254,6 +284,7 @@ static int __init mirred_init_module(void)
 static void __exit mirred_cleanup_module(void)
 {
 	tcf_unregister_action(&act_mirred_ops);
+	rcu_barrier_bh();
 }
 
 module_init(mirred_init_module);
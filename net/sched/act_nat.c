@@ -51,6 +51,7 @@ static int tcf_nat_init(struct nlattr *nla, struct nlattr *est,
 	struct tc_nat *parm;
 	int ret = 0, err;
 	struct tcf_nat *p;
+	struct tcf_nat_params *params, *old;
 	struct tcf_common *pc;
 
 	if (nla == NULL)
@@ -64,31 +65,42 @@ static int tcf_nat_init(struct nlattr *nla, struct nlattr *est,
 		return -EINVAL;
 	parm = nla_data(tb[TCA_NAT_PARMS]);
 
+	params = kmalloc(sizeof(*params), GFP_KERNEL);
+	if (params == NULL)
+		return -ENOMEM;
+	params->old_addr = parm->old_addr;
+	params->new_addr = parm->new_addr;
+	params->mask = parm->mask;
+	params->flags = parm->flags;
+
 	pc = tcf_hash_check(parm->index, a, bind, &nat_hash_info);
 	if (!pc) {
 		pc = tcf_hash_create(parm->index, est, a, sizeof(*p), bind,
 				     &nat_idx_gen, &nat_hash_info);
-		if (IS_ERR(pc))
-		    return PTR_ERR(pc);
+		if (IS_ERR(pc)) {
+			kfree(params);
+			return PTR_ERR(pc);
+		}
 		p = to_tcf_nat(pc);
 		ret = ACT_P_CREATED;
 	} else {
 		p = to_tcf_nat(pc);
 		if (!ovr) {
+			kfree(params);
 			tcf_hash_release(pc, bind, &nat_hash_info);
 			return -EEXIST;
 		}
 	}
 
 	spin_lock_bh(&p->tcf_lock);
-	p->old_addr = parm->old_addr;
-	p->new_addr = parm->new_addr;
-	p->mask = parm->mask;
-	p->flags = parm->flags;
-
+	old = p->params;
+	rcu_assign_pointer(p->params, params);
 	p->tcf_action = parm->action;
 	spin_unlock_bh(&p->tcf_lock);
 
+	if (old)
+		tcf_params_free(&old->common);
+
 	if (ret == ACT_P_CREATED)
 		tcf_hash_insert(pc, &nat_hash_info);
 
@@ -98,14 +110,20 @@ static int tcf_nat_init(struct nlattr *nla, struct nlattr *est,
 static int tcf_nat_cleanup(struct tc_action *a, int bind)
 {
 	struct tcf_nat *p = a->priv;
+	struct tcf_nat_params *params = p->params;
 
-	return tcf_hash_release(&p->common, bind, &nat_hash_info);
+	if (tcf_hash_release(&p->common, bind, &nat_hash_info)) {
+		tcf_params_free(&params->common);
+		return 1;
+	}
+	return 0;
 }
 
 static int tcf_nat(struct sk_buff *skb, struct tc_action *a,
 		   struct tcf_result *res)
 {
 	struct tcf_nat *p = a->priv;
+	const struct tcf_nat_params *parm = rcu_dereference(p->params);
 	struct iphdr *iph;
 	__be32 old_addr;
 	__be32 new_addr;
@@ -115,19 +133,14 @@ static int tcf_nat(struct sk_buff *skb, struct tc_action *a,
 	int action;
 	int ihl;
 
-	spin_lock(&p->tcf_lock);
-
-	p->tcf_tm.lastuse = jiffies;
-	old_addr = p->old_addr;
-	new_addr = p->new_addr;
-	mask = p->mask;
-	egress = p->flags & TCA_NAT_FLAG_EGRESS;
+	tcf_lastuse_update(&p->common);
+	old_addr = parm->old_addr;
+	new_addr = parm->new_addr;
+	mask = parm->mask;
+	egress = parm->flags & TCA_NAT_FLAG_EGRESS;
 	action = p->tcf_action;
 
-	p->tcf_bstats.bytes += qdisc_pkt_len(skb);
-	p->tcf_bstats.packets++;
-
-	spin_unlock(&p->tcf_lock);
+	tcf_stats_update(&p->common, qdisc_pkt_len(skb));
 
 	if (unlikely(action == TC_ACT_SHOT))
 		goto drop;
@@ -250,9 +263,7 @@ static int tcf_nat(struct sk_buff *skb, struct tc_action *a,
 	return action;
 
 drop:
-	spin_lock(&p->tcf_lock);
-	p->tcf_qstats.drops++;
-	spin_unlock(&p->tcf_lock);
+	tcf_stats_drop(&p->common);
 	return TC_ACT_SHOT;
 }
 
@@ -261,12 +272,8 @@ static int tcf_nat_dump(struct sk_buff *skb, struct tc_action *a,
 {
 	unsigned char *b = skb_tail_pointer(skb);
 	struct tcf_nat *p = a->priv;
+	const struct tcf_nat_params *parm;
 	struct tc_nat opt = {
-		.old_addr = p->old_addr,
-		.new_addr = p->new_addr,
-		.mask     = p->mask,
-		.flags    = p->flags,
-
 		.index    = p->tcf_index,
 		.action   = p->tcf_action,
 		.refcnt   = p->tcf_refcnt - ref,
@@ -274,6 +281,14 @@ static int tcf_nat_dump(struct sk_buff *skb, struct tc_action *a,
 	};
 	struct tcf_t t;
 
+	rcu_read_lock_bh();
+	parm = rcu_dereference(p->params);
+	opt.old_addr = parm->old_addr;
+	opt.new_addr = parm->new_addr;
+	opt.mask     = parm->mask;
+	opt.flags    = parm->flags;
+	rcu_read_unlock_bh();
+
 	NLA_PUT(skb, TCA_NAT_PARMS, sizeof(opt), &opt);
 	t.install = jiffies_to_clock_t(jiffies - p->tcf_tm.install);
 	t.lastuse = jiffies_to_clock_t(jiffies - p->tcf_tm.lastuse);
@@ -44,8 +44,8 @@ static int tcf_pedit_init(struct nlattr *nla, struct nlattr *est,
 	struct tc_pedit *parm;
 	int ret = 0, err;
 	struct tcf_pedit *p;
+	struct tcf_pedit_params *params, *old;
 	struct tcf_common *pc;
-	struct tc_pedit_key *keys = NULL;
 	int ksize;
 
 	if (nla == NULL)
@@ -62,44 +62,44 @@ static int tcf_pedit_init(struct nlattr *nla, struct nlattr *est,
 	if (nla_len(tb[TCA_PEDIT_PARMS]) < sizeof(*parm) + ksize)
 		return -EINVAL;
 
+	params = kmalloc(sizeof(*params) + ksize, GFP_KERNEL);
+	if (params == NULL)
+		return -ENOMEM;
+	params->tcfp_nkeys = parm->nkeys;
+	params->tcfp_flags = parm->flags;
+	memcpy(params->tcfp_keys, parm->keys, ksize);
+
 	pc = tcf_hash_check(parm->index, a, bind, &pedit_hash_info);
 	if (!pc) {
-		if (!parm->nkeys)
+		if (!parm->nkeys) {
+			kfree(params);
 			return -EINVAL;
+		}
 		pc = tcf_hash_create(parm->index, est, a, sizeof(*p), bind,
 				     &pedit_idx_gen, &pedit_hash_info);
-		if (IS_ERR(pc))
-		    return PTR_ERR(pc);
-		p = to_pedit(pc);
-		keys = kmalloc(ksize, GFP_KERNEL);
-		if (keys == NULL) {
-			kfree(pc);
-			return -ENOMEM;
+		if (IS_ERR(pc)) {
+			kfree(params);
+			return PTR_ERR(pc);
 		}
+		p = to_pedit(pc);
 		ret = ACT_P_CREATED;
 	} else {
 		p = to_pedit(pc);
 		if (!ovr) {
+			kfree(params);
 			tcf_hash_release(pc, bind, &pedit_hash_info);
 			return -EEXIST;
 		}
-		if (p->tcfp_nkeys && p->tcfp_nkeys != parm->nkeys) {
-			keys = kmalloc(ksize, GFP_KERNEL);
-			if (keys == NULL)
-				return -ENOMEM;
-		}
 	}
 
 	spin_lock_bh(&p->tcf_lock);
-	p->tcfp_flags = parm->flags;
+	old = p->params;
+	rcu_assign_pointer(p->params, params);
 	p->tcf_action = parm->action;
-	if (keys) {
-		kfree(p->tcfp_keys);
-		p->tcfp_keys = keys;
-		p->tcfp_nkeys = parm->nkeys;
-	}
-	memcpy(p->tcfp_keys, parm->keys, ksize);
 	spin_unlock_bh(&p->tcf_lock);
+
+	if (old)
+		tcf_params_free(&old->common);
 	if (ret == ACT_P_CREATED)
 		tcf_hash_insert(pc, &pedit_hash_info);
 	return ret;
@@ -110,9 +110,9 @@ static int tcf_pedit_cleanup(struct tc_action *a, int bind)
 	struct tcf_pedit *p = a->priv;
 
 	if (p) {
-		struct tc_pedit_key *keys = p->tcfp_keys;
+		struct tcf_pedit_params *params = p->params;
 		if (tcf_hash_release(&p->common, bind, &pedit_hash_info)) {
-			kfree(keys);
+			tcf_params_free(&params->common);
 			return 1;
 		}
 	}
@@ -123,6 +123,7 @@ static int tcf_pedit(struct sk_buff *skb, struct tc_action *a,
 		     struct tcf_result *res)
 {
 	struct tcf_pedit *p = a->priv;
+	const struct tcf_pedit_params *parm;
 	int i, munged = 0;
 	u8 *pptr;
 
@@ -135,14 +136,13 @@ static int tcf_pedit(struct sk_buff *skb, struct tc_action *a,
 
 	pptr = skb_network_header(skb);
 
-	spin_lock(&p->tcf_lock);
+	parm = rcu_dereference(p->params);
+	tcf_lastuse_update(&p->common);
 
-	p->tcf_tm.lastuse = jiffies;
+	if (parm->tcfp_nkeys > 0) {
+		const struct tc_pedit_key *tkey = parm->tcfp_keys;
 
-	if (p->tcfp_nkeys > 0) {
-		struct tc_pedit_key *tkey = p->tcfp_keys;
-
-		for (i = p->tcfp_nkeys; i > 0; i--, tkey++) {
+		for (i = parm->tcfp_nkeys; i > 0; i--, tkey++) {
 			u32 *ptr;
 			int offset = tkey->off;
 
@@ -180,11 +180,9 @@ static int tcf_pedit(struct sk_buff *skb, struct tc_action *a,
 	}
 
 bad:
-	p->tcf_qstats.overlimits++;
+	tcf_stats_overlimit(&p->common);
 done:
-	p->tcf_bstats.bytes += qdisc_pkt_len(skb);
-	p->tcf_bstats.packets++;
-	spin_unlock(&p->tcf_lock);
+	tcf_stats_update(&p->common, qdisc_pkt_len(skb));
 	return p->tcf_action;
 }
 
@@ -193,22 +191,28 @@ static int tcf_pedit_dump(struct sk_buff *skb, struct tc_action *a,
 {
 	unsigned char *b = skb_tail_pointer(skb);
 	struct tcf_pedit *p = a->priv;
+	const struct tcf_pedit_params *parm;
 	struct tc_pedit *opt;
 	struct tcf_t t;
 	int s;
 
-	s = sizeof(*opt) + p->tcfp_nkeys * sizeof(struct tc_pedit_key);
+	rcu_read_lock_bh();
+	parm = rcu_dereference(p->params);
+	s = sizeof(*opt) + parm->tcfp_nkeys * sizeof(struct tc_pedit_key);
 
 	/* netlink spinlocks held above us - must use ATOMIC */
 	opt = kzalloc(s, GFP_ATOMIC);
-	if (unlikely(!opt))
+	if (unlikely(!opt)) {
+		rcu_read_unlock_bh();
 		return -ENOBUFS;
+	}
 
-	memcpy(opt->keys, p->tcfp_keys,
-	       p->tcfp_nkeys * sizeof(struct tc_pedit_key));
+	memcpy(opt->keys, parm->tcfp_keys,
+	       parm->tcfp_nkeys * sizeof(struct tc_pedit_key));
+	opt->nkeys = parm->tcfp_nkeys;
+	opt->flags = parm->tcfp_flags;
+	rcu_read_unlock_bh();
 	opt->index = p->tcf_index;
-	opt->nkeys = p->tcfp_nkeys;
-	opt->flags = p->tcfp_flags;
 	opt->action = p->tcf_action;
 	opt->refcnt = p->tcf_refcnt - ref;
 	opt->bindcnt = p->tcf_bindcnt - bind;
@@ -47,7 +47,7 @@ struct tc_police_compat
 	struct tc_ratespec	peakrate;
 };
 
-/* Each policer is serialized by its individual spinlock */
+/* Policers with a peak rate are serialized by their individual spinlock */
 
 static int tcf_act_police_walker(struct sk_buff *skb, struct netlink_callback *cb,
 			      int type, struct tc_action *a)
@@ -98,25 +98,16 @@ nla_put_failure:
 
 static void tcf_police_destroy(struct tcf_police *p)
 {
-	unsigned int h = tcf_hash(p->tcf_index, POL_TAB_MASK);
-	struct tcf_common **p1p;
-
-	for (p1p = &tcf_police_ht[h]; *p1p; p1p = &(*p1p)->tcfc_next) {
-		if (*p1p == &p->common) {
-			write_lock_bh(&police_lock);
-			*p1p = p->tcf_next;
-			write_unlock_bh(&police_lock);
-			gen_kill_estimator(&p->tcf_bstats,
-					   &p->tcf_rate_est);
-			if (p->tcfp_R_tab)
-				qdisc_put_rtab(p->tcfp_R_tab);
-			if (p->tcfp_P_tab)
-				qdisc_put_rtab(p->tcfp_P_tab);
-			kfree(p);
-			return;
-		}
-	}
-	WARN_ON(1);
+	struct tcf_police_params *params = p->params;
+
+	tcf_hash_destroy(&p->common, &police_hash_info);
+
+	/* Wait for packets still policing against the tables, the rtab
+	 * references are RTNL protected and can't be dropped from RCU. */
+	synchronize_rcu_bh();
+	qdisc_put_rtab(params->tcfp_R_tab);
+	qdisc_put_rtab(params->tcfp_P_tab);
+	kfree(params);
 }
 
 static const struct nla_policy police_policy[TCA_POLICE_MAX + 1] = {
@@ -134,6 +125,7 @@ static int tcf_act_police_locate(struct nlattr *nla, struct nlattr *est,
 	struct nlattr *tb[TCA_POLICE_MAX + 1];
 	struct tc_police *parm;
 	struct tcf_police *police;
+	struct tcf_police_params *params, *old;
 	struct qdisc_rate_table *R_tab = NULL, *P_tab = NULL;
 	int size;
 
@@ -171,14 +163,24 @@ static int tcf_act_police_locate(struct nlattr *nla, struct nlattr *est,
 	police = kzalloc(sizeof(*police), GFP_KERNEL);
 	if (police == NULL)
 		return -ENOMEM;
+	if (est == NULL) {
+		police->tcf_cpu_stats = alloc_percpu(struct tcf_cpu_stats);
+		if (police->tcf_cpu_stats == NULL) {
+			kfree(police);
+			return -ENOMEM;
+		}
+	}
 	ret = ACT_P_CREATED;
 	police->tcf_refcnt = 1;
 	spin_lock_init(&police->tcf_lock);
 	if (bind)
 		police->tcf_bindcnt = 1;
 override:
+	err = -ENOMEM;
+	params = kzalloc(sizeof(*params), GFP_KERNEL);
+	if (params == NULL)
+		goto failure;
 	if (parm->rate.rate) {
-		err = -ENOMEM;
 		R_tab = qdisc_get_rtab(&parm->rate, tb[TCA_POLICE_RATE]);
 		if (R_tab == NULL)
 			goto failure;
@@ -191,6 +193,10 @@ override:
 		}
 	}
 
+	/* The estimator samples tcf_bstats, so stop counting per cpu. */
+	if (est)
+		tcf_cpu_stats_disable(&police->common);
+
 	spin_lock_bh(&police->tcf_lock);
 	if (est) {
 		err = gen_replace_estimator(&police->tcf_bstats,
@@ -207,36 +213,54 @@ override:
 	}
 
 	/* No failure allowed after this point */
-	if (R_tab != NULL) {
-		qdisc_put_rtab(police->tcfp_R_tab);
-		police->tcfp_R_tab = R_tab;
+	old = police->params;
+	if (R_tab == NULL && old != NULL && old->tcfp_R_tab != NULL) {
+		R_tab = old->tcfp_R_tab;
+		R_tab->refcnt++;
 	}
-	if (P_tab != NULL) {
-		qdisc_put_rtab(police->tcfp_P_tab);
-		police->tcfp_P_tab = P_tab;
+	if (P_tab == NULL && old != NULL && old->tcfp_P_tab != NULL) {
+		P_tab = old->tcfp_P_tab;
+		P_tab->refcnt++;
 	}
+	params->tcfp_R_tab = R_tab;
+	params->tcfp_P_tab = P_tab;
 
 	if (tb[TCA_POLICE_RESULT])
-		police->tcfp_result = nla_get_u32(tb[TCA_POLICE_RESULT]);
-	police->tcfp_toks = police->tcfp_burst = parm->burst;
-	police->tcfp_mtu = parm->mtu;
-	if (police->tcfp_mtu == 0) {
-		police->tcfp_mtu = ~0;
-		if (police->tcfp_R_tab)
-			police->tcfp_mtu = 255<<police->tcfp_R_tab->rate.cell_log;
+		params->tcfp_result = nla_get_u32(tb[TCA_POLICE_RESULT]);
+	else if (old != NULL)
+		params->tcfp_result = old->tcfp_result;
+	params->tcfp_burst = parm->burst;
+	params->tcfp_mtu = parm->mtu;
+	if (params->tcfp_mtu == 0) {
+		params->tcfp_mtu = ~0;
+		if (params->tcfp_R_tab)
+			params->tcfp_mtu = 255<<params->tcfp_R_tab->rate.cell_log;
 	}
-	if (police->tcfp_P_tab)
-		police->tcfp_ptoks = L2T_P(police, police->tcfp_mtu);
-	police->tcf_action = parm->action;
-
 	if (tb[TCA_POLICE_AVRATE])
-		police->tcfp_ewma_rate = nla_get_u32(tb[TCA_POLICE_AVRATE]);
+		params->tcfp_ewma_rate = nla_get_u32(tb[TCA_POLICE_AVRATE]);
+	else if (old != NULL)
+		params->tcfp_ewma_rate = old->tcfp_ewma_rate;
+
+	atomic_long_set(&police->tcfp_toks, params->tcfp_burst);
+	police->tcfp_ptoks = 0;
+	if (params->tcfp_P_tab)
+		police->tcfp_ptoks = L2T_P(params, params->tcfp_mtu);
+	police->tcf_action = parm->action;
+	rcu_assign_pointer(police->params, params);
 
 	spin_unlock_bh(&police->tcf_lock);
+
+	if (old != NULL) {
+		/* Wait for packets still policing against the old tables. */
+		synchronize_rcu_bh();
+		qdisc_put_rtab(old->tcfp_R_tab);
+		qdisc_put_rtab(old->tcfp_P_tab);
+		kfree(old);
+	}
 	if (ret != ACT_P_CREATED)
 		return ret;
 
-	police->tcfp_t_c = psched_get_time();
+	atomic_long_set(&police->tcfp_t_c, (long)psched_get_time());
 	police->tcf_index = parm->index ? parm->index :
 		tcf_hash_new_index(&police_idx_gen, &police_hash_info);
 	h = tcf_hash(police->tcf_index, POL_TAB_MASK);
@@ -255,8 +279,11 @@ failure:
 		qdisc_put_rtab(P_tab);
 	if (R_tab)
 		qdisc_put_rtab(R_tab);
-	if (ret == ACT_P_CREATED)
+	kfree(params);
+	if (ret == ACT_P_CREATED) {
+		free_percpu(police->tcf_cpu_stats);
 		kfree(police);
+	}
 	return err;
 }
 
@@ -278,60 +305,105 @@ static int tcf_act_police_cleanup(struct tc_action *a, int bind)
 	return ret;
 }
 
-static int tcf_act_police(struct sk_buff *skb, struct tc_action *a,
-			  struct tcf_result *res)
+/* Time since the bucket was last credited, in psched ticks. */
+static inline long tcf_police_elapsed(long now, long last, u32 burst)
 {
-	struct tcf_police *police = a->priv;
-	psched_time_t now;
-	long toks;
-	long ptoks = 0;
-
-	spin_lock(&police->tcf_lock);
+	long elapsed = now - last;
 
-	police->tcf_bstats.bytes += qdisc_pkt_len(skb);
-	police->tcf_bstats.packets++;
+	if (elapsed < 0)
+		return 0;
+	return min_t(long, elapsed, burst);
+}
 
-	if (police->tcfp_ewma_rate &&
-	    police->tcf_rate_est.bps >= police->tcfp_ewma_rate) {
-		police->tcf_qstats.overlimits++;
-		if (police->tcf_action == TC_ACT_SHOT)
-			police->tcf_qstats.drops++;
-		spin_unlock(&police->tcf_lock);
-		return police->tcf_action;
+/*
+ * Single rate bucket without tcf_lock.  Whoever moves tcfp_t_c forward
+ * credits the elapsed time; the debit is a cmpxchg loop.  Concurrent
+ * credits may briefly overfill the bucket, which is clamped to the burst
+ * size when tokens are taken.
+ */
+static bool tcf_police_conform(struct tcf_police *police,
+			       const struct tcf_police_params *p,
+			       unsigned int len)
+{
+	long now = (long)psched_get_time();
+	long last = atomic_long_read(&police->tcfp_t_c);
+	long cost = L2T(p, len);
+	long toks, old;
+
+	if (now != last &&
+	    atomic_long_cmpxchg(&police->tcfp_t_c, last, now) == last)
+		atomic_long_add(tcf_police_elapsed(now, last, p->tcfp_burst),
+				&police->tcfp_toks);
+
+	old = atomic_long_read(&police->tcfp_toks);
+	for (;;) {
+		toks = min_t(long, old, p->tcfp_burst) - cost;
+		if (toks < 0)
+			return false;
+		toks = atomic_long_cmpxchg(&police->tcfp_toks, old, toks);
+		if (toks == old)
+			return true;
+		old = toks;
 	}
+}
 
-	if (qdisc_pkt_len(skb) <= police->tcfp_mtu) {
-		if (police->tcfp_R_tab == NULL) {
-			spin_unlock(&police->tcf_lock);
-			return police->tcfp_result;
-		}
+/* Rate and peak rate buckets, updated together under tcf_lock. */
+static bool tcf_police_conform_peak(struct tcf_police *police,
+				    const struct tcf_police_params *p,
+				    unsigned int len)
+{
+	long now, toks, ptoks;
+	bool conform = false;
 
-		now = psched_get_time();
-		toks = psched_tdiff_bounded(now, police->tcfp_t_c,
-					    police->tcfp_burst);
-		if (police->tcfp_P_tab) {
-			ptoks = toks + police->tcfp_ptoks;
-			if (ptoks > (long)L2T_P(police, police->tcfp_mtu))
-				ptoks = (long)L2T_P(police, police->tcfp_mtu);
-			ptoks -= L2T_P(police, qdisc_pkt_len(skb));
-		}
-		toks += police->tcfp_toks;
-		if (toks > (long)police->tcfp_burst)
-			toks = police->tcfp_burst;
-		toks -= L2T(police, qdisc_pkt_len(skb));
-		if ((toks|ptoks) >= 0) {
-			police->tcfp_t_c = now;
-			police->tcfp_toks = toks;
-			police->tcfp_ptoks = ptoks;
-			spin_unlock(&police->tcf_lock);
-			return police->tcfp_result;
-		}
+	spin_lock(&police->tcf_lock);
+	now = (long)psched_get_time();
+	toks = tcf_police_elapsed(now, atomic_long_read(&police->tcfp_t_c),
+				  p->tcfp_burst);
+	ptoks = toks + police->tcfp_ptoks;
+	if (ptoks > (long)L2T_P(p, p->tcfp_mtu))
+		ptoks = (long)L2T_P(p, p->tcfp_mtu);
+	ptoks -= L2T_P(p, len);
+	toks += atomic_long_read(&police->tcfp_toks);
+	if (toks > (long)p->tcfp_burst)
+		toks = p->tcfp_burst;
+	toks -= L2T(p, len);
+	if ((toks|ptoks) >= 0) {
+		atomic_long_set(&police->tcfp_t_c, now);
+		atomic_long_set(&police->tcfp_toks, toks);
+		police->tcfp_ptoks = ptoks;
+		conform = true;
 	}
+	spin_unlock(&police->tcf_lock);
+	return conform;
+}
 
-	police->tcf_qstats.overlimits++;
+static int tcf_act_police(struct sk_buff *skb, struct tc_action *a,
+			  struct tcf_result *res)
+{
+	struct tcf_police *police = a->priv;
+	const struct tcf_police_params *p = rcu_dereference(police->params);
+	unsigned int len = qdisc_pkt_len(skb);
+
+	tcf_stats_update(&police->common, len);
+
+	if (p->tcfp_ewma_rate &&
+	    police->tcf_rate_est.bps >= p->tcfp_ewma_rate)
+		goto overlimit;
+
+	if (len <= p->tcfp_mtu) {
+		if (p->tcfp_R_tab == NULL)
+			return p->tcfp_result;
+		if (p->tcfp_P_tab == NULL) {
+			if (tcf_police_conform(police, p, len))
+				return p->tcfp_result;
+		} else if (tcf_police_conform_peak(police, p, len))
+			return p->tcfp_result;
+	}
+
+overlimit:
+	tcf_stats_overlimit(&police->common);
 	if (police->tcf_action == TC_ACT_SHOT)
-		police->tcf_qstats.drops++;
-	spin_unlock(&police->tcf_lock);
+		tcf_stats_drop(&police->common);
 	return police->tcf_action;
 }
 
@@ -340,24 +412,33 @@ tcf_act_police_dump(struct sk_buff *skb, struct tc_action *a, int bind, int ref)
 {
 	unsigned char *b = skb_tail_pointer(skb);
 	struct tcf_police *police = a->priv;
+	const struct tcf_police_params *p;
 	struct tc_police opt = {
 		.index = police->tcf_index,
 		.action = police->tcf_action,
-		.mtu = police->tcfp_mtu,
-		.burst = police->tcfp_burst,
 		.refcnt = police->tcf_refcnt - ref,
 		.bindcnt = police->tcf_bindcnt - bind,
 	};
+	int result;
+	u32 ewma_rate;
+
+	rcu_read_lock_bh();
+	p = rcu_dereference(police->params);
+	opt.mtu = p->tcfp_mtu;
+	opt.burst = p->tcfp_burst;
+	if (p->tcfp_R_tab)
+		opt.rate = p->tcfp_R_tab->rate;
+	if (p->tcfp_P_tab)
+		opt.peakrate = p->tcfp_P_tab->rate;
+	result = p->tcfp_result;
+	ewma_rate = p->tcfp_ewma_rate;
+	rcu_read_unlock_bh();
 
-	if (police->tcfp_R_tab)
-		opt.rate = police->tcfp_R_tab->rate;
-	if (police->tcfp_P_tab)
-		opt.peakrate = police->tcfp_P_tab->rate;
 	NLA_PUT(skb, TCA_POLICE_TBF, sizeof(opt), &opt);
-	if (police->tcfp_result)
-		NLA_PUT_U32(skb, TCA_POLICE_RESULT, police->tcfp_result);
-	if (police->tcfp_ewma_rate)
-		NLA_PUT_U32(skb, TCA_POLICE_AVRATE, police->tcfp_ewma_rate);
+	if (result)
+		NLA_PUT_U32(skb, TCA_POLICE_RESULT, result);
+	if (ewma_rate)
+		NLA_PUT_U32(skb, TCA_POLICE_AVRATE, ewma_rate);
 	return skb->len;
 
 nla_put_failure:
@@ -39,17 +39,17 @@ static int tcf_simp(struct sk_buff *skb, struct tc_action *a, struct tcf_result
 {
 	struct tcf_defact *d = a->priv;
 
+	tcf_stats_update(&d->common, qdisc_pkt_len(skb));
+
 	spin_lock(&d->tcf_lock);
 	d->tcf_tm.lastuse = jiffies;
-	d->tcf_bstats.bytes += qdisc_pkt_len(skb);
-	d->tcf_bstats.packets++;
 
 	/* print policy string followed by _ then packet count
 	 * Example if this was the 3rd packet and the string was "hello"
 	 * then it would look like "hello_3" (without quotes)
 	 **/
 	printk("simple: %s_%d\n",
-	       (char *)d->tcfd_defdata, d->tcf_bstats.packets);
+	       (char *)d->tcfd_defdata, ++d->tcfd_packets);
 	spin_unlock(&d->tcf_lock);
 	return d->tcf_action;
 }
@@ -130,6 +130,7 @@ static int tcf_simp_init(struct nlattr *nla, struct nlattr *est,
 		d = to_defact(pc);
 		ret = alloc_defdata(d, defdata);
 		if (ret < 0) {
+			free_percpu(pc->tcfc_cpu_stats);
 			kfree(pc);
 			return ret;
 		}
@@ -43,19 +43,17 @@ static int tcf_skbedit(struct sk_buff *skb, struct tc_action *a,
 		       struct tcf_result *res)
 {
 	struct tcf_skbedit *d = a->priv;
+	const struct tcf_skbedit_params *p = rcu_dereference(d->params);
 
-	spin_lock(&d->tcf_lock);
-	d->tcf_tm.lastuse = jiffies;
-	d->tcf_bstats.bytes += qdisc_pkt_len(skb);
-	d->tcf_bstats.packets++;
+	tcf_lastuse_update(&d->common);
+	tcf_stats_update(&d->common, qdisc_pkt_len(skb));
 
-	if (d->flags & SKBEDIT_F_PRIORITY)
-		skb->priority = d->priority;
-	if (d->flags & SKBEDIT_F_QUEUE_MAPPING &&
-	    skb->dev->real_num_tx_queues > d->queue_mapping)
-		skb_set_queue_mapping(skb, d->queue_mapping);
+	if (p->flags & SKBEDIT_F_PRIORITY)
+		skb->priority = p->priority;
+	if (p->flags & SKBEDIT_F_QUEUE_MAPPING &&
+	    skb->dev->real_num_tx_queues > p->queue_mapping)
+		skb_set_queue_mapping(skb, p->queue_mapping);
 
-	spin_unlock(&d->tcf_lock);
 	return d->tcf_action;
 }
 
@@ -71,6 +69,7 @@ static int tcf_skbedit_init(struct nlattr *nla, struct nlattr *est,
 	struct nlattr *tb[TCA_SKBEDIT_MAX + 1];
 	struct tc_skbedit *parm;
 	struct tcf_skbedit *d;
+	struct tcf_skbedit_params *params, *old;
 	struct tcf_common *pc;
 	u32 flags = 0, *priority = NULL;
 	u16 *queue_mapping = NULL;
@@ -100,34 +99,44 @@ static int tcf_skbedit_init(struct nlattr *nla, struct nlattr *est,
 
 	parm = nla_data(tb[TCA_SKBEDIT_PARMS]);
 
+	params = kzalloc(sizeof(*params), GFP_KERNEL);
+	if (params == NULL)
+		return -ENOMEM;
+	params->flags = flags;
+	if (flags & SKBEDIT_F_PRIORITY)
+		params->priority = *priority;
+	if (flags & SKBEDIT_F_QUEUE_MAPPING)
+		params->queue_mapping = *queue_mapping;
+
 	pc = tcf_hash_check(parm->index, a, bind, &skbedit_hash_info);
 	if (!pc) {
 		pc = tcf_hash_create(parm->index, est, a, sizeof(*d), bind,
 				     &skbedit_idx_gen, &skbedit_hash_info);
-		if (IS_ERR(pc))
-		    return PTR_ERR(pc);
+		if (IS_ERR(pc)) {
+			kfree(params);
+			return PTR_ERR(pc);
+		}
 
 		d = to_skbedit(pc);
 		ret = ACT_P_CREATED;
 	} else {
 		d = to_skbedit(pc);
 		if (!ovr) {
+			kfree(params);
 			tcf_hash_release(pc, bind, &skbedit_hash_info);
 			return -EEXIST;
 		}
 	}
 
 	spin_lock_bh(&d->tcf_lock);
-
-	d->flags = flags;
-	if (flags & SKBEDIT_F_PRIORITY)
-		d->priority = *priority;
-	if (flags & SKBEDIT_F_QUEUE_MAPPING)
-		d->queue_mapping = *queue_mapping;
+	old = d->params;
+	rcu_assign_pointer(d->params, params);
 	d->tcf_action = parm->action;
-
 	spin_unlock_bh(&d->tcf_lock);
 
+	if (old)
+		tcf_params_free(&old->common);
+
 	if (ret == ACT_P_CREATED)
 		tcf_hash_insert(pc, &skbedit_hash_info);
 	return ret;
@@ -137,8 +146,14 @@ static inline int tcf_skbedit_cleanup(struct tc_action *a, int bind)
 {
 	struct tcf_skbedit *d = a->priv;
 
-	if (d)
-		return tcf_hash_release(&d->common, bind, &skbedit_hash_info);
+	if (d) {
+		struct tcf_skbedit_params *params = d->params;
+
+		if (tcf_hash_release(&d->common, bind, &skbedit_hash_info)) {
+			tcf_params_free(&params->common);
+			return 1;
+		}
+	}
 	return 0;
 }
 
@@ -147,21 +162,31 @@ static inline int tcf_skbedit_dump(struct sk_buff *skb, struct tc_action *a,
 {
 	unsigned char *b = skb_tail_pointer(skb);
 	struct tcf_skbedit *d = a->priv;
+	const struct tcf_skbedit_params *p;
 	struct tc_skbedit opt = {
 		.index   = d->tcf_index,
 		.refcnt  = d->tcf_refcnt - ref,
 		.bindcnt = d->tcf_bindcnt - bind,
 		.action  = d->tcf_action,
 	};
+	u32 flags, priority;
+	u16 queue_mapping;
 	struct tcf_t t;
 
+	rcu_read_lock_bh();
+	p = rcu_dereference(d->params);
+	flags = p->flags;
+	priority = p->priority;
+	queue_mapping = p->queue_mapping;
+	rcu_read_unlock_bh();
+
 	NLA_PUT(skb, TCA_SKBEDIT_PARMS, sizeof(opt), &opt);
-	if (d->flags & SKBEDIT_F_PRIORITY)
-		NLA_PUT(skb, TCA_SKBEDIT_PRIORITY, sizeof(d->priority),
-			&d->priority);
-	if (d->flags & SKBEDIT_F_QUEUE_MAPPING)
+	if (flags & SKBEDIT_F_PRIORITY)
+		NLA_PUT(skb, TCA_SKBEDIT_PRIORITY, sizeof(priority),
+			&priority);
+	if (flags & SKBEDIT_F_QUEUE_MAPPING)
 		NLA_PUT(skb, TCA_SKBEDIT_QUEUE_MAPPING,
-			sizeof(d->queue_mapping), &d->queue_mapping);
+			sizeof(queue_mapping), &queue_mapping);
 	t.install = jiffies_to_clock_t(jiffies - d->tcf_tm.install);
 	t.lastuse = jiffies_to_clock_t(jiffies - d->tcf_tm.lastuse);
 	t.expires = jiffies_to_clock_t(d->tcf_tm.expires);
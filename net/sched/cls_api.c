@@ -120,7 +120,6 @@ static int tc_ctl_tfilter(struct sk_buff *skb, struct nlmsghdr *n, void *arg)
 {
 	struct net *net = sock_net(skb->sk);
 	struct nlattr *tca[TCA_MAX + 1];
-	spinlock_t *root_lock;
 	struct tcmsg *t;
 	u32 protocol;
 	u32 prio;
@@ -208,8 +207,6 @@ replay:
 		}
 	}
 
-	root_lock = qdisc_root_sleeping_lock(q);
-
 	if (tp == NULL) {
 		/* Proto-tcf does not exist, create new one */
 
@@ -278,9 +275,9 @@ replay:
 
 	if (fh == 0) {
 		if (n->nlmsg_type == RTM_DELTFILTER && t->tcm_handle == 0) {
-			spin_lock_bh(root_lock);
+			sch_tree_lock(q);
 			*back = tp->next;
-			spin_unlock_bh(root_lock);
+			sch_tree_unlock(q);
 
 			tfilter_notify(skb, n, tp, fh, RTM_DELTFILTER);
 			tcf_destroy(tp);
@@ -319,10 +316,10 @@ replay:
 	err = tp->ops->change(tp, cl, t->tcm_handle, tca, &fh);
 	if (err == 0) {
 		if (tp_created) {
-			spin_lock_bh(root_lock);
+			sch_tree_lock(q);
 			tp->next = *back;
 			*back = tp;
-			spin_unlock_bh(root_lock);
+			sch_tree_unlock(q);
 		}
 		tfilter_notify(skb, n, tp, fh, RTM_NEWTFILTER);
 	} else {
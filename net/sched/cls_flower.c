@@ -0,0 +1,1008 @@
+/*
+ * net/sched/cls_flower.c	Exact match flow classifier
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * The packet is parsed once into a struct fl_flow_key.  Filters sharing
+ * the same mask live in one hash table keyed by the masked key, so a
+ * lookup costs one hash probe per distinct mask (tuple space search)
+ * regardless of the number of filters.
+ *
+ * Locking: classification runs under the qdisc root lock (or the ingress
+ * reader lock) with BHs disabled.  New filters, masks and filter list
+ * entries are published with RCU and do not stop classification.
+ * Deleting a filter, moving it to another mask and growing a hash table
+ * are done under tcf_tree_lock(), which excludes all readers, so the
+ * memory can be released right after the lock is dropped.  All updates
+ * are serialized by the RTNL.
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/rtnetlink.h>
+#include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/idr.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+
+#include <net/netlink.h>
+#include <net/act_api.h>
+#include <net/pkt_cls.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+
+struct fl_flow_key {
+	int			indev_ifindex;
+	u8			eth_dst[ETH_ALEN];
+	u8			eth_src[ETH_ALEN];
+	__be16			eth_type;	/* outermost, 802.1Q if tagged */
+	u16			vlan_id;
+	u8			vlan_prio;
+	u8			ip_proto;
+	__be16			vlan_eth_type;
+	__be16			tcp_flags;
+	__be16			src_port;
+	__be16			dst_port;
+	__be32			ipv4_src;
+	__be32			ipv4_dst;
+	struct in6_addr		ipv6_src;
+	struct in6_addr		ipv6_dst;
+} __attribute__((aligned(sizeof(long))));
+
+struct fl_table {
+	unsigned int		size;		/* power of two */
+	struct hlist_head	buckets[0];
+};
+
+#define FL_TABLE_MIN	16
+#define FL_TABLE_MAX	(1 << 18)
+
+struct fl_mask {
+	struct list_head	list;
+	struct fl_flow_key	key;
+	unsigned short		start;		/* key bytes covered by the mask */
+	unsigned short		end;
+	unsigned int		count;		/* filters using this mask */
+	struct fl_table		*table;
+};
+
+struct fl_stats {
+	u64			packets;
+	u64			bytes;
+};
+
+struct fl_filter {
+	struct hlist_node	node;
+	struct list_head	list;
+	struct fl_mask		*mask;
+	struct fl_flow_key	mkey;		/* key & mask->key */
+	u32			handle;
+	struct tcf_result	res;
+	struct tcf_exts		exts;
+	struct fl_stats		*stats;
+};
+
+struct fl_head {
+	struct list_head	masks;
+	struct list_head	filters;
+	struct idr		handle_idr;
+	u32			hash_rnd;
+};
+
+static const struct tcf_ext_map fl_ext_map = {
+	.action = TCA_FLOWER_ACT,
+};
+
+static inline const void *fl_key_start(const struct fl_flow_key *key,
+				       const struct fl_mask *mask)
+{
+	return (const u8 *)key + mask->start;
+}
+
+static void fl_set_masked_key(struct fl_flow_key *mkey,
+			      const struct fl_flow_key *key,
+			      const struct fl_mask *mask)
+{
+	const long *lkey = fl_key_start(key, mask);
+	const long *lmask = fl_key_start(&mask->key, mask);
+	long *lmkey = (long *)fl_key_start(mkey, mask);
+	int i;
+
+	for (i = mask->start; i < mask->end; i += sizeof(long))
+		*lmkey++ = *lkey++ & *lmask++;
+}
+
+static inline int fl_key_equal(const struct fl_flow_key *a,
+			       const struct fl_flow_key *b,
+			       const struct fl_mask *mask)
+{
+	return !memcmp(fl_key_start(a, mask), fl_key_start(b, mask),
+		       mask->end - mask->start);
+}
+
+static inline struct hlist_head *fl_bucket(const struct fl_head *head,
+					   const struct fl_table *t,
+					   const struct fl_mask *mask,
+					   const struct fl_flow_key *mkey)
+{
+	u32 hash = jhash2(fl_key_start(mkey, mask),
+			  (mask->end - mask->start) / sizeof(u32),
+			  head->hash_rnd);
+
+	return &t->buckets[hash & (t->size - 1)];
+}
+
+static struct fl_filter *fl_lookup(const struct fl_head *head,
+				   const struct fl_mask *mask,
+				   const struct fl_flow_key *mkey)
+{
+	const struct fl_table *t = rcu_dereference(mask->table);
+	struct hlist_node *pos;
+	struct fl_filter *f;
+
+	hlist_for_each_entry_rcu(f, pos, fl_bucket(head, t, mask, mkey), node)
+		if (fl_key_equal(&f->mkey, mkey, mask))
+			return f;
+	return NULL;
+}
+
+static void fl_flow_dissect(const struct sk_buff *skb, struct fl_flow_key *key)
+{
+	int nhoff = skb_network_offset(skb);
+	__be16 proto = skb->protocol;
+	int thoff;
+	u16 tci;
+
+	memset(key, 0, sizeof(*key));
+	key->indev_ifindex = skb->iif;
+
+	if (skb->dev && skb->dev->type == ARPHRD_ETHER &&
+	    skb_mac_header_was_set(skb)) {
+		const struct ethhdr *eth = eth_hdr(skb);
+
+		memcpy(key->eth_dst, eth->h_dest, ETH_ALEN);
+		memcpy(key->eth_src, eth->h_source, ETH_ALEN);
+	}
+
+	if (vlan_tx_tag_present(skb)) {
+		tci = vlan_tx_tag_get(skb);
+		key->eth_type = htons(ETH_P_8021Q);
+	} else if (proto == htons(ETH_P_8021Q)) {
+		const struct vlan_hdr *vh;
+		struct vlan_hdr _vh;
+
+		key->eth_type = proto;
+		vh = skb_header_pointer(skb, nhoff, sizeof(_vh), &_vh);
+		if (vh == NULL)
+			return;
+		tci = ntohs(vh->h_vlan_TCI);
+		proto = vh->h_vlan_encapsulated_proto;
+		nhoff += sizeof(*vh);
+	} else {
+		key->eth_type = proto;
+		goto network;
+	}
+	key->vlan_id = tci & VLAN_VID_MASK;
+	key->vlan_prio = tci >> 13;
+	key->vlan_eth_type = proto;
+
+network:
+	switch (proto) {
+	case htons(ETH_P_IP): {
+		const struct iphdr *iph;
+		struct iphdr _iph;
+
+		iph = skb_header_pointer(skb, nhoff, sizeof(_iph), &_iph);
+		if (iph == NULL || iph->ihl < 5)
+			return;
+		key->ipv4_src = iph->saddr;
+		key->ipv4_dst = iph->daddr;
+		key->ip_proto = iph->protocol;
+		if (iph->frag_off & htons(IP_OFFSET))
+			return;
+		thoff = nhoff + iph->ihl * 4;
+		break;
+	}
+	case htons(ETH_P_IPV6): {
+		const struct ipv6hdr *iph;
+		struct ipv6hdr _iph;
+		u8 nexthdr;
+
+		iph = skb_header_pointer(skb, nhoff, sizeof(_iph), &_iph);
+		if (iph == NULL)
+			return;
+		ipv6_addr_copy(&key->ipv6_src, &iph->saddr);
+		ipv6_addr_copy(&key->ipv6_dst, &iph->daddr);
+		nexthdr = iph->nexthdr;
+		thoff = ipv6_skip_exthdr(skb, nhoff + sizeof(_iph), &nexthdr);
+		if (thoff < 0)
+			return;
+		key->ip_proto = nexthdr;
+		break;
+	}
+	default:
+		return;
+	}
+
+	switch (key->ip_proto) {
+	case IPPROTO_TCP: {
+		const struct tcphdr *th;
+		struct tcphdr _th;
+
+		th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+		if (th == NULL)
+			return;
+		key->src_port = th->source;
+		key->dst_port = th->dest;
+		key->tcp_flags = *(__be16 *)&tcp_flag_word(th) & htons(0x0FFF);
+		break;
+	}
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP: {
+		const __be16 *ports;
+		__be16 _ports[2];
+
+		ports = skb_header_pointer(skb, thoff, sizeof(_ports), _ports);
+		if (ports == NULL)
+			return;
+		key->src_port = ports[0];
+		key->dst_port = ports[1];
+		break;
+	}
+	}
+}
+
+static int fl_classify(struct sk_buff *skb, struct tcf_proto *tp,
+		       struct tcf_result *res)
+{
+	struct fl_head *head = tp->root;
+	struct fl_flow_key key, mkey;
+	struct fl_mask *mask;
+	struct fl_filter *f;
+	struct fl_stats *stats;
+	int r;
+
+	fl_flow_dissect(skb, &key);
+
+	list_for_each_entry_rcu(mask, &head->masks, list) {
+		fl_set_masked_key(&mkey, &key, mask);
+		f = fl_lookup(head, mask, &mkey);
+		if (f == NULL)
+			continue;
+
+		stats = per_cpu_ptr(f->stats, smp_processor_id());
+		stats->packets++;
+		stats->bytes += skb->len;
+
+		*res = f->res;
+		r = tcf_exts_exec(skb, &f->exts, res);
+		if (r < 0)
+			continue;
+		return r;
+	}
+	return -1;
+}
+
+static struct fl_table *fl_table_alloc(unsigned int size)
+{
+	size_t sz = sizeof(struct fl_table) + size * sizeof(struct hlist_head);
+	struct fl_table *t;
+
+	if (sz <= PAGE_SIZE)
+		t = kzalloc(sz, GFP_KERNEL);
+	else {
+		t = vmalloc(sz);
+		if (t != NULL)
+			memset(t, 0, sz);
+	}
+	if (t != NULL)
+		t->size = size;
+	return t;
+}
+
+static void fl_table_free(struct fl_table *t)
+{
+	if (is_vmalloc_addr(t))
+		vfree(t);
+	else
+		kfree(t);
+}
+
+/* Double the table of a mask once its chains average two entries. */
+static void fl_table_grow(struct tcf_proto *tp, struct fl_head *head,
+			  struct fl_mask *mask)
+{
+	struct fl_table *old = mask->table, *new;
+	struct hlist_node *pos, *n;
+	struct fl_filter *f;
+	unsigned int i;
+
+	if (mask->count < 2 * old->size || old->size >= FL_TABLE_MAX)
+		return;
+
+	/* On failure just keep using the longer chains. */
+	new = fl_table_alloc(old->size * 2);
+	if (new == NULL)
+		return;
+
+	tcf_tree_lock(tp);
+	for (i = 0; i < old->size; i++) {
+		hlist_for_each_entry_safe(f, pos, n, &old->buckets[i], node) {
+			hlist_del(&f->node);
+			hlist_add_head(&f->node,
+				       fl_bucket(head, new, mask, &f->mkey));
+		}
+	}
+	rcu_assign_pointer(mask->table, new);
+	tcf_tree_unlock(tp);
+
+	fl_table_free(old);
+}
+
+static struct fl_mask *fl_mask_lookup(struct fl_head *head,
+				      const struct fl_flow_key *key)
+{
+	struct fl_mask *mask;
+
+	list_for_each_entry(mask, &head->masks, list)
+		if (!memcmp(&mask->key, key, sizeof(*key)))
+			return mask;
+	return NULL;
+}
+
+static struct fl_mask *fl_mask_create(const struct fl_flow_key *key)
+{
+	const u8 *bytes = (const u8 *)key;
+	unsigned int i, first = sizeof(*key), last = 0;
+	struct fl_mask *mask;
+
+	mask = kzalloc(sizeof(*mask), GFP_KERNEL);
+	if (mask == NULL)
+		return NULL;
+	mask->table = fl_table_alloc(FL_TABLE_MIN);
+	if (mask->table == NULL) {
+		kfree(mask);
+		return NULL;
+	}
+	mask->key = *key;
+
+	/* Only the long words the mask touches are hashed and compared. */
+	for (i = 0; i < sizeof(*key); i++) {
+		if (bytes[i] == 0)
+			continue;
+		if (first == sizeof(*key))
+			first = i;
+		last = i;
+	}
+	if (first < sizeof(*key)) {
+		mask->start = first & ~(sizeof(long) - 1);
+		mask->end = roundup(last + 1, sizeof(long));
+	}
+	return mask;
+}
+
+static void fl_mask_free(struct fl_mask *mask)
+{
+	fl_table_free(mask->table);
+	kfree(mask);
+}
+
+/* Caller holds tcf_tree_lock(); returns the mask if it became unused. */
+static struct fl_mask *fl_unlink_filter(struct fl_filter *f)
+{
+	struct fl_mask *mask = f->mask;
+
+	hlist_del_rcu(&f->node);
+	if (--mask->count == 0) {
+		list_del_rcu(&mask->list);
+		return mask;
+	}
+	return NULL;
+}
+
+static void fl_destroy_filter(struct tcf_proto *tp, struct fl_filter *f)
+{
+	tcf_unbind_filter(tp, &f->res);
+	tcf_exts_destroy(tp, &f->exts);
+	free_percpu(f->stats);
+	kfree(f);
+}
+
+static unsigned long fl_get(struct tcf_proto *tp, u32 handle)
+{
+	struct fl_head *head = tp->root;
+
+	if (head == NULL || handle > INT_MAX)
+		return 0UL;
+	return (unsigned long)idr_find(&head->handle_idr, handle);
+}
+
+static void fl_put(struct tcf_proto *tp, unsigned long f)
+{
+}
+
+static int fl_init(struct tcf_proto *tp)
+{
+	struct fl_head *head;
+
+	head = kzalloc(sizeof(*head), GFP_KERNEL);
+	if (head == NULL)
+		return -ENOBUFS;
+	INIT_LIST_HEAD(&head->masks);
+	INIT_LIST_HEAD(&head->filters);
+	idr_init(&head->handle_idr);
+	get_random_bytes(&head->hash_rnd, sizeof(head->hash_rnd));
+	tp->root = head;
+	return 0;
+}
+
+static void fl_destroy(struct tcf_proto *tp)
+{
+	struct fl_head *head = tp->root;
+	struct fl_filter *f, *next_f;
+	struct fl_mask *mask, *next_m;
+
+	list_for_each_entry_safe(f, next_f, &head->filters, list) {
+		list_del(&f->list);
+		fl_destroy_filter(tp, f);
+	}
+	list_for_each_entry_safe(mask, next_m, &head->masks, list) {
+		list_del(&mask->list);
+		fl_mask_free(mask);
+	}
+	idr_remove_all(&head->handle_idr);
+	idr_destroy(&head->handle_idr);
+	kfree(head);
+}
+
+static int fl_delete(struct tcf_proto *tp, unsigned long arg)
+{
+	struct fl_head *head = tp->root;
+	struct fl_filter *f = (struct fl_filter *)arg;
+	struct fl_mask *mask;
+
+	tcf_tree_lock(tp);
+	mask = fl_unlink_filter(f);
+	list_del_rcu(&f->list);
+	tcf_tree_unlock(tp);
+
+	idr_remove(&head->handle_idr, f->handle);
+	if (mask != NULL)
+		fl_mask_free(mask);
+	fl_destroy_filter(tp, f);
+	return 0;
+}
+
+static const struct nla_policy fl_policy[TCA_FLOWER_MAX + 1] = {
+	[TCA_FLOWER_CLASSID]		= { .type = NLA_U32 },
+	[TCA_FLOWER_INDEV]		= { .type = NLA_STRING,
+					    .len = IFNAMSIZ },
+	[TCA_FLOWER_KEY_ETH_DST]	= { .len = ETH_ALEN },
+	[TCA_FLOWER_KEY_ETH_DST_MASK]	= { .len = ETH_ALEN },
+	[TCA_FLOWER_KEY_ETH_SRC]	= { .len = ETH_ALEN },
+	[TCA_FLOWER_KEY_ETH_SRC_MASK]	= { .len = ETH_ALEN },
+	[TCA_FLOWER_KEY_ETH_TYPE]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_IP_PROTO]	= { .type = NLA_U8 },
+	[TCA_FLOWER_KEY_IPV4_SRC]	= { .type = NLA_U32 },
+	[TCA_FLOWER_KEY_IPV4_SRC_MASK]	= { .type = NLA_U32 },
+	[TCA_FLOWER_KEY_IPV4_DST]	= { .type = NLA_U32 },
+	[TCA_FLOWER_KEY_IPV4_DST_MASK]	= { .type = NLA_U32 },
+	[TCA_FLOWER_KEY_IPV6_SRC]	= { .len = sizeof(struct in6_addr) },
+	[TCA_FLOWER_KEY_IPV6_SRC_MASK]	= { .len = sizeof(struct in6_addr) },
+	[TCA_FLOWER_KEY_IPV6_DST]	= { .len = sizeof(struct in6_addr) },
+	[TCA_FLOWER_KEY_IPV6_DST_MASK]	= { .len = sizeof(struct in6_addr) },
+	[TCA_FLOWER_KEY_TCP_SRC]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_TCP_DST]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_UDP_SRC]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_UDP_DST]	= { .type = NLA_U16 },
+	[TCA_FLOWER_FLAGS]		= { .type = NLA_U32 },
+	[TCA_FLOWER_KEY_VLAN_ID]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_VLAN_PRIO]	= { .type = NLA_U8 },
+	[TCA_FLOWER_KEY_VLAN_ETH_TYPE]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_TCP_SRC_MASK]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_TCP_DST_MASK]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_UDP_SRC_MASK]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_UDP_DST_MASK]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_SCTP_SRC_MASK]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_SCTP_DST_MASK]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_SCTP_SRC]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_SCTP_DST]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_TCP_FLAGS]	= { .type = NLA_U16 },
+	[TCA_FLOWER_KEY_TCP_FLAGS_MASK]	= { .type = NLA_U16 },
+};
+
+/* The upstream port attributes are per protocol; all feed the same key. */
+struct fl_port_attr {
+	u8			proto;
+	int			src;
+	int			src_mask;
+	int			dst;
+	int			dst_mask;
+};
+
+static const struct fl_port_attr fl_port_attrs[] = {
+	{ IPPROTO_TCP,  TCA_FLOWER_KEY_TCP_SRC, TCA_FLOWER_KEY_TCP_SRC_MASK,
+			TCA_FLOWER_KEY_TCP_DST, TCA_FLOWER_KEY_TCP_DST_MASK },
+	{ IPPROTO_UDP,  TCA_FLOWER_KEY_UDP_SRC, TCA_FLOWER_KEY_UDP_SRC_MASK,
+			TCA_FLOWER_KEY_UDP_DST, TCA_FLOWER_KEY_UDP_DST_MASK },
+	{ IPPROTO_SCTP, TCA_FLOWER_KEY_SCTP_SRC, TCA_FLOWER_KEY_SCTP_SRC_MASK,
+			TCA_FLOWER_KEY_SCTP_DST, TCA_FLOWER_KEY_SCTP_DST_MASK },
+};
+
+static int fl_has_keys(struct nlattr **tb)
+{
+	int i;
+
+	if (tb[TCA_FLOWER_INDEV])
+		return 1;
+	for (i = TCA_FLOWER_KEY_ETH_DST; i <= TCA_FLOWER_KEY_TCP_FLAGS_MASK; i++)
+		if (tb[i])
+			return 1;
+	return 0;
+}
+
+/*
+ * Every attribute handled here has a policy entry; anything else in the
+ * upstream range is a key we cannot match on and must not be ignored.
+ */
+static int fl_check_attrs(struct nlattr **tb)
+{
+	int i;
+
+	for (i = TCA_FLOWER_KEY_ETH_DST; i <= TCA_FLOWER_KEY_TCP_FLAGS_MASK; i++)
+		if (tb[i] && !fl_policy[i].type && !fl_policy[i].len)
+			return -EOPNOTSUPP;
+
+	/* Only the software path exists. */
+	if (tb[TCA_FLOWER_FLAGS] &&
+	    nla_get_u32(tb[TCA_FLOWER_FLAGS]) & ~TCA_CLS_FLAGS_SKIP_HW)
+		return -EOPNOTSUPP;
+	return 0;
+}
+
+/* A key attribute without its mask attribute is matched exactly. */
+static void fl_set_key_val(struct nlattr **tb, void *val, int val_type,
+			   void *mask, int mask_type, int len)
+{
+	if (!tb[val_type])
+		return;
+	memcpy(val, nla_data(tb[val_type]), len);
+	if (mask_type == TCA_FLOWER_UNSPEC || !tb[mask_type])
+		memset(mask, 0xff, len);
+	else
+		memcpy(mask, nla_data(tb[mask_type]), len);
+}
+
+static int fl_set_key_indev(struct tcf_proto *tp, struct nlattr *tb,
+			    struct fl_flow_key *key, struct fl_flow_key *mask)
+{
+	struct net_device *dev;
+	char indev[IFNAMSIZ];
+
+	if (nla_strlcpy(indev, tb, IFNAMSIZ) >= IFNAMSIZ)
+		return -EINVAL;
+	dev = __dev_get_by_name(dev_net(qdisc_dev(tp->q)), indev);
+	if (dev == NULL)
+		return -ENODEV;
+	key->indev_ifindex = dev->ifindex;
+	mask->indev_ifindex = ~0;
+	return 0;
+}
+
+static int fl_set_key(struct tcf_proto *tp, struct nlattr **tb,
+		      struct fl_flow_key *key, struct fl_flow_key *mask)
+{
+	const struct fl_port_attr *pa;
+	int err;
+
+	if (tb[TCA_FLOWER_INDEV]) {
+		err = fl_set_key_indev(tp, tb[TCA_FLOWER_INDEV], key, mask);
+		if (err < 0)
+			return err;
+	}
+	fl_set_key_val(tb, key->eth_dst, TCA_FLOWER_KEY_ETH_DST,
+		       mask->eth_dst, TCA_FLOWER_KEY_ETH_DST_MASK,
+		       sizeof(key->eth_dst));
+	fl_set_key_val(tb, key->eth_src, TCA_FLOWER_KEY_ETH_SRC,
+		       mask->eth_src, TCA_FLOWER_KEY_ETH_SRC_MASK,
+		       sizeof(key->eth_src));
+	fl_set_key_val(tb, &key->eth_type, TCA_FLOWER_KEY_ETH_TYPE,
+		       &mask->eth_type, TCA_FLOWER_UNSPEC,
+		       sizeof(key->eth_type));
+	if (tb[TCA_FLOWER_KEY_VLAN_ID]) {
+		key->vlan_id = nla_get_u16(tb[TCA_FLOWER_KEY_VLAN_ID]);
+		if (key->vlan_id > VLAN_VID_MASK)
+			return -EINVAL;
+		mask->vlan_id = VLAN_VID_MASK;
+	}
+	if (tb[TCA_FLOWER_KEY_VLAN_PRIO]) {
+		key->vlan_prio = nla_get_u8(tb[TCA_FLOWER_KEY_VLAN_PRIO]);
+		if (key->vlan_prio > 7)
+			return -EINVAL;
+		mask->vlan_prio = 7;
+	}
+	fl_set_key_val(tb, &key->vlan_eth_type, TCA_FLOWER_KEY_VLAN_ETH_TYPE,
+		       &mask->vlan_eth_type, TCA_FLOWER_UNSPEC,
+		       sizeof(key->vlan_eth_type));
+	fl_set_key_val(tb, &key->ip_proto, TCA_FLOWER_KEY_IP_PROTO,
+		       &mask->ip_proto, TCA_FLOWER_UNSPEC,
+		       sizeof(key->ip_proto));
+	fl_set_key_val(tb, &key->ipv4_src, TCA_FLOWER_KEY_IPV4_SRC,
+		       &mask->ipv4_src, TCA_FLOWER_KEY_IPV4_SRC_MASK,
+		       sizeof(key->ipv4_src));
+	fl_set_key_val(tb, &key->ipv4_dst, TCA_FLOWER_KEY_IPV4_DST,
+		       &mask->ipv4_dst, TCA_FLOWER_KEY_IPV4_DST_MASK,
+		       sizeof(key->ipv4_dst));
+	fl_set_key_val(tb, &key->ipv6_src, TCA_FLOWER_KEY_IPV6_SRC,
+		       &mask->ipv6_src, TCA_FLOWER_KEY_IPV6_SRC_MASK,
+		       sizeof(key->ipv6_src));
+	fl_set_key_val(tb, &key->ipv6_dst, TCA_FLOWER_KEY_IPV6_DST,
+		       &mask->ipv6_dst, TCA_FLOWER_KEY_IPV6_DST_MASK,
+		       sizeof(key->ipv6_dst));
+
+	/* Port and TCP flag keys require a matching IP protocol key. */
+	for (pa = fl_port_attrs;
+	     pa < fl_port_attrs + ARRAY_SIZE(fl_port_attrs); pa++) {
+		if (!tb[pa->src] && !tb[pa->dst])
+			continue;
+		if (!mask->ip_proto || key->ip_proto != pa->proto)
+			return -EINVAL;
+		fl_set_key_val(tb, &key->src_port, pa->src,
+			       &mask->src_port, pa->src_mask,
+			       sizeof(key->src_port));
+		fl_set_key_val(tb, &key->dst_port, pa->dst,
+			       &mask->dst_port, pa->dst_mask,
+			       sizeof(key->dst_port));
+	}
+	if (tb[TCA_FLOWER_KEY_TCP_FLAGS]) {
+		if (!mask->ip_proto || key->ip_proto != IPPROTO_TCP)
+			return -EINVAL;
+		fl_set_key_val(tb, &key->tcp_flags, TCA_FLOWER_KEY_TCP_FLAGS,
+			       &mask->tcp_flags, TCA_FLOWER_KEY_TCP_FLAGS_MASK,
+			       sizeof(key->tcp_flags));
+	}
+	return 0;
+}
+
+static int fl_alloc_handle(struct fl_head *head, struct fl_filter *f,
+			   u32 handle)
+{
+	int err, id;
+
+	if (handle > INT_MAX)
+		return -EINVAL;
+
+	do {
+		if (!idr_pre_get(&head->handle_idr, GFP_KERNEL))
+			return -ENOMEM;
+		err = idr_get_new_above(&head->handle_idr, f,
+					handle ? handle : 1, &id);
+	} while (err == -EAGAIN);
+	if (err < 0)
+		return err;
+
+	if (handle && id != handle) {
+		idr_remove(&head->handle_idr, id);
+		return -EEXIST;
+	}
+	f->handle = id;
+	return 0;
+}
+
+static int fl_change(struct tcf_proto *tp, unsigned long base, u32 handle,
+		     struct nlattr **tca, unsigned long *arg)
+{
+	struct fl_head *head = tp->root;
+	struct fl_filter *f = (struct fl_filter *)*arg;
+	struct nlattr *tb[TCA_FLOWER_MAX + 1];
+	struct fl_mask *mask = NULL, *new_mask = NULL, *old_mask;
+	struct fl_flow_key key, mask_key, mkey;
+	struct fl_filter *dup;
+	struct tcf_exts e;
+	int err;
+
+	if (tca[TCA_OPTIONS] == NULL)
+		return -EINVAL;
+
+	err = nla_parse_nested(tb, TCA_FLOWER_MAX, tca[TCA_OPTIONS],
+			       fl_policy);
+	if (err < 0)
+		return err;
+
+	if (f != NULL && handle && f->handle != handle)
+		return -EINVAL;
+
+	err = fl_check_attrs(tb);
+	if (err < 0)
+		return err;
+
+	err = tcf_exts_validate(tp, tb, tca[TCA_RATE], &e, &fl_ext_map);
+	if (err < 0)
+		return err;
+
+	if (f == NULL || fl_has_keys(tb)) {
+		memset(&key, 0, sizeof(key));
+		memset(&mask_key, 0, sizeof(mask_key));
+		err = fl_set_key(tp, tb, &key, &mask_key);
+		if (err < 0)
+			goto errout;
+
+		mask = fl_mask_lookup(head, &mask_key);
+		if (mask == NULL) {
+			err = -ENOBUFS;
+			new_mask = fl_mask_create(&mask_key);
+			if (new_mask == NULL)
+				goto errout;
+			mask = new_mask;
+		}
+
+		memset(&mkey, 0, sizeof(mkey));
+		fl_set_masked_key(&mkey, &key, mask);
+
+		err = -EEXIST;
+		dup = new_mask ? NULL : fl_lookup(head, mask, &mkey);
+		if (dup != NULL && dup != f)
+			goto errout;
+	}
+
+	if (f == NULL) {
+		err = -ENOBUFS;
+		f = kzalloc(sizeof(*f), GFP_KERNEL);
+		if (f == NULL)
+			goto errout;
+		f->stats = alloc_percpu(struct fl_stats);
+		if (f->stats == NULL)
+			goto errout_filter;
+		err = fl_alloc_handle(head, f, handle);
+		if (err < 0)
+			goto errout_filter;
+	}
+
+	if (tb[TCA_FLOWER_CLASSID]) {
+		f->res.classid = nla_get_u32(tb[TCA_FLOWER_CLASSID]);
+		tcf_bind_filter(tp, &f->res, base);
+	}
+	tcf_exts_change(tp, &f->exts, &e);
+
+	if (mask == NULL)
+		goto out;
+
+	if (new_mask != NULL)
+		list_add_tail_rcu(&new_mask->list, &head->masks);
+
+	if (*arg != 0UL) {
+		/* Readers must not see the filter while it is rehashed. */
+		tcf_tree_lock(tp);
+		mask->count++;
+		old_mask = fl_unlink_filter(f);
+		f->mkey = mkey;
+		f->mask = mask;
+		hlist_add_head_rcu(&f->node,
+				   fl_bucket(head, mask->table, mask, &f->mkey));
+		tcf_tree_unlock(tp);
+		if (old_mask != NULL)
+			fl_mask_free(old_mask);
+	} else {
+		f->mkey = mkey;
+		f->mask = mask;
+		mask->count++;
+		hlist_add_head_rcu(&f->node,
+				   fl_bucket(head, mask->table, mask, &f->mkey));
+		list_add_tail_rcu(&f->list, &head->filters);
+	}
+	fl_table_grow(tp, head, mask);
+out:
+	*arg = (unsigned long)f;
+	return 0;
+
+errout_filter:
+	free_percpu(f->stats);
+	kfree(f);
+errout:
+	if (new_mask != NULL)
+		fl_mask_free(new_mask);
+	tcf_exts_destroy(tp, &e);
+	return err;
+}
+
+static void fl_walk(struct tcf_proto *tp, struct tcf_walker *arg)
+{
+	struct fl_head *head = tp->root;
+	struct fl_filter *f;
+
+	list_for_each_entry(f, &head->filters, list) {
+		if (arg->count < arg->skip)
+			goto skip;
+		if (arg->fn(tp, (unsigned long)f, arg) < 0) {
+			arg->stop = 1;
+			break;
+		}
+skip:
+		arg->count++;
+	}
+}
+
+static int fl_is_zero(const void *p, int len)
+{
+	const u8 *bytes = p;
+
+	while (len--)
+		if (*bytes++)
+			return 0;
+	return 1;
+}
+
+static int fl_dump_key_val(struct sk_buff *skb, const void *val, int val_type,
+			   const void *mask, int mask_type, int len)
+{
+	if (fl_is_zero(mask, len))
+		return 0;
+	NLA_PUT(skb, val_type, len, val);
+	if (mask_type != TCA_FLOWER_UNSPEC)
+		NLA_PUT(skb, mask_type, len, mask);
+	return 0;
+
+nla_put_failure:
+	return -1;
+}
+
+static int fl_dump_key(struct sk_buff *skb, const struct fl_flow_key *key,
+		       const struct fl_flow_key *mask)
+{
+	const struct fl_port_attr *pa;
+
+	if (fl_dump_key_val(skb, key->eth_dst, TCA_FLOWER_KEY_ETH_DST,
+			    mask->eth_dst, TCA_FLOWER_KEY_ETH_DST_MASK,
+			    sizeof(key->eth_dst)) ||
+	    fl_dump_key_val(skb, key->eth_src, TCA_FLOWER_KEY_ETH_SRC,
+			    mask->eth_src, TCA_FLOWER_KEY_ETH_SRC_MASK,
+			    sizeof(key->eth_src)) ||
+	    fl_dump_key_val(skb, &key->eth_type, TCA_FLOWER_KEY_ETH_TYPE,
+			    &mask->eth_type, TCA_FLOWER_UNSPEC,
+			    sizeof(key->eth_type)) ||
+	    fl_dump_key_val(skb, &key->vlan_id, TCA_FLOWER_KEY_VLAN_ID,
+			    &mask->vlan_id, TCA_FLOWER_UNSPEC,
+			    sizeof(key->vlan_id)) ||
+	    fl_dump_key_val(skb, &key->vlan_prio, TCA_FLOWER_KEY_VLAN_PRIO,
+			    &mask->vlan_prio, TCA_FLOWER_UNSPEC,
+			    sizeof(key->vlan_prio)) ||
+	    fl_dump_key_val(skb, &key->vlan_eth_type,
+			    TCA_FLOWER_KEY_VLAN_ETH_TYPE,
+			    &mask->vlan_eth_type, TCA_FLOWER_UNSPEC,
+			    sizeof(key->vlan_eth_type)) ||
+	    fl_dump_key_val(skb, &key->ip_proto, TCA_FLOWER_KEY_IP_PROTO,
+			    &mask->ip_proto, TCA_FLOWER_UNSPEC,
+			    sizeof(key->ip_proto)) ||
+	    fl_dump_key_val(skb, &key->ipv4_src, TCA_FLOWER_KEY_IPV4_SRC,
+			    &mask->ipv4_src, TCA_FLOWER_KEY_IPV4_SRC_MASK,
+			    sizeof(key->ipv4_src)) ||
+	    fl_dump_key_val(skb, &key->ipv4_dst, TCA_FLOWER_KEY_IPV4_DST,
+			    &mask->ipv4_dst, TCA_FLOWER_KEY_IPV4_DST_MASK,
+			    sizeof(key->ipv4_dst)) ||
+	    fl_dump_key_val(skb, &key->ipv6_src, TCA_FLOWER_KEY_IPV6_SRC,
+			    &mask->ipv6_src, TCA_FLOWER_KEY_IPV6_SRC_MASK,
+			    sizeof(key->ipv6_src)) ||
+	    fl_dump_key_val(skb, &key->ipv6_dst, TCA_FLOWER_KEY_IPV6_DST,
+			    &mask->ipv6_dst, TCA_FLOWER_KEY_IPV6_DST_MASK,
+			    sizeof(key->ipv6_dst)) ||
+	    fl_dump_key_val(skb, &key->tcp_flags, TCA_FLOWER_KEY_TCP_FLAGS,
+			    &mask->tcp_flags, TCA_FLOWER_KEY_TCP_FLAGS_MASK,
+			    sizeof(key->tcp_flags)))
+		return -1;
+
+	for (pa = fl_port_attrs;
+	     pa < fl_port_attrs + ARRAY_SIZE(fl_port_attrs); pa++) {
+		if (!mask->ip_proto || key->ip_proto != pa->proto)
+			continue;
+		if (fl_dump_key_val(skb, &key->src_port, pa->src,
+				    &mask->src_port, pa->src_mask,
+				    sizeof(key->src_port)) ||
+		    fl_dump_key_val(skb, &key->dst_port, pa->dst,
+				    &mask->dst_port, pa->dst_mask,
+				    sizeof(key->dst_port)))
+			return -1;
+	}
+	return 0;
+}
+
+static int fl_dump(struct tcf_proto *tp, unsigned long fh,
+		   struct sk_buff *skb, struct tcmsg *t)
+{
+	struct fl_filter *f = (struct fl_filter *)fh;
+	struct tc_flower_pcnt pcnt = { 0 };
+	struct nlattr *nest;
+	int cpu;
+
+	if (f == NULL)
+		return skb->len;
+
+	t->tcm_handle = f->handle;
+
+	nest = nla_nest_start(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+
+	if (f->res.classid)
+		NLA_PUT_U32(skb, TCA_FLOWER_CLASSID, f->res.classid);
+
+	if (f->mkey.indev_ifindex) {
+		struct net_device *dev;
+
+		dev = __dev_get_by_index(dev_net(qdisc_dev(tp->q)),
+					 f->mkey.indev_ifindex);
+		if (dev != NULL)
+			NLA_PUT_STRING(skb, TCA_FLOWER_INDEV, dev->name);
+	}
+
+	if (fl_dump_key(skb, &f->mkey, &f->mask->key) < 0)
+		goto nla_put_failure;
+
+	for_each_possible_cpu(cpu) {
+		const struct fl_stats *stats = per_cpu_ptr(f->stats, cpu);
+
+		pcnt.packets += stats->packets;
+		pcnt.bytes += stats->bytes;
+	}
+	NLA_PUT(skb, TCA_FLOWER_PCNT, sizeof(pcnt), &pcnt);
+
+	if (tcf_exts_dump(skb, &f->exts, &fl_ext_map) < 0)
+		goto nla_put_failure;
+
+	nla_nest_end(skb, nest);
+
+	if (tcf_exts_dump_stats(skb, &f->exts, &fl_ext_map) < 0)
+		goto nla_put_failure;
+
+	return skb->len;
+
+nla_put_failure:
+	nlmsg_trim(skb, nest);
+	return -1;
+}
+
+static struct tcf_proto_ops cls_fl_ops __read_mostly = {
+	.kind		= "flower",
+	.classify	= fl_classify,
+	.init		= fl_init,
+	.destroy	= fl_destroy,
+	.get		= fl_get,
+	.put		= fl_put,
+	.change		= fl_change,
+	.delete		= fl_delete,
+	.walk		= fl_walk,
+	.dump		= fl_dump,
+	.owner		= THIS_MODULE,
+};
+
+static int __init cls_fl_init(void)
+{
+	return register_tcf_proto_ops(&cls_fl_ops);
+}
+
+static void __exit cls_fl_exit(void)
+{
+	unregister_tcf_proto_ops(&cls_fl_ops);
+}
+
+module_init(cls_fl_init);
+module_exit(cls_fl_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("TC exact match flow classifier");
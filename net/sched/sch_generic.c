@@ -380,6 +380,88 @@ static struct netdev_queue noop_netdev_queue = {
 	.qdisc_sleeping	=	&noop_qdisc,
 };
 
+DEFINE_PER_CPU(struct ingress_lock, ingress_locks) = {
+	.lock = __SPIN_LOCK_UNLOCKED(ingress_locks.lock),
+};
+EXPORT_PER_CPU_SYMBOL(ingress_locks);
+
+DEFINE_SPINLOCK(ingress_writer_lock);
+EXPORT_SYMBOL(ingress_writer_lock);
+int ingress_writer;
+EXPORT_SYMBOL(ingress_writer);
+
+/*
+ * Called with the ingress qdisc's root lock held and BHs disabled. Rather
+ * than holding the locks of all CPUs at once, which would overflow the
+ * preempt count on large machines, wait for each of them to be released
+ * while ingress_writer keeps classifiers from taking them again.
+ */
+void ingress_wrlock_all(void)
+{
+	int cpu;
+
+	spin_lock(&ingress_writer_lock);
+	ingress_writer = 1;
+	smp_mb();
+
+	for_each_possible_cpu(cpu)
+		spin_unlock_wait(&per_cpu(ingress_locks, cpu).lock);
+}
+EXPORT_SYMBOL(ingress_wrlock_all);
+
+void ingress_wrunlock_all(void)
+{
+	smp_mb();
+	ingress_writer = 0;
+	spin_unlock(&ingress_writer_lock);
+}
+EXPORT_SYMBOL(ingress_wrunlock_all);
+
+/*
+ * Changing the shared state of TCQ_F_MQSHARED qdiscs has to exclude every
+ * TX queue, not just the one whose lock is the root lock. Holding all
+ * their locks at once would overflow the preempt count on devices with
+ * many queues, so only wait for each queue to leave its shared lock while
+ * the writer flag keeps it from taking it again. Called with the root
+ * lock held and BHs disabled.
+ */
+void qdisc_shared_lock_all(struct Qdisc *root)
+{
+	struct net_device *dev = qdisc_dev(root);
+	struct qdisc_shared_lock *sl;
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = netdev_get_tx_queue(dev, ntx)->qdisc_sleeping;
+		if (qdisc == root || !(qdisc->flags & TCQ_F_MQSHARED))
+			continue;
+		sl = qdisc_priv(qdisc);
+		sl->writer = 1;
+		smp_mb();
+		spin_unlock_wait(&sl->lock);
+	}
+}
+EXPORT_SYMBOL(qdisc_shared_lock_all);
+
+void qdisc_shared_unlock_all(struct Qdisc *root)
+{
+	struct net_device *dev = qdisc_dev(root);
+	struct qdisc_shared_lock *sl;
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+
+	smp_mb();
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = netdev_get_tx_queue(dev, ntx)->qdisc_sleeping;
+		if (qdisc == root || !(qdisc->flags & TCQ_F_MQSHARED))
+			continue;
+		sl = qdisc_priv(qdisc);
+		sl->writer = 0;
+	}
+}
+EXPORT_SYMBOL(qdisc_shared_unlock_all);
+
 struct Qdisc noop_qdisc = {
 	.enqueue	=	noop_enqueue,
 	.dequeue	=	noop_dequeue,
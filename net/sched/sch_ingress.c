@@ -10,14 +10,23 @@
 #include <linux/module.h>
 #include <linux/types.h>
 #include <linux/list.h>
+#include <linux/percpu.h>
 #include <linux/skbuff.h>
 #include <linux/rtnetlink.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 
 
+/* All receiving CPUs run the qdisc at once, so it counts per CPU */
+struct ingress_stats {
+	u64			bytes;
+	u32			packets;
+	u32			drops;
+};
+
 struct ingress_qdisc_data {
 	struct tcf_proto	*filter_list;
+	struct ingress_stats	*stats;
 };
 
 /* ------------------------- Class/flow operations ------------------------- */
@@ -59,17 +68,19 @@ static struct tcf_proto **ingress_find_tcf(struct Qdisc *sch, unsigned long cl)
 static int ingress_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 {
 	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	struct ingress_stats *st;
 	struct tcf_result res;
 	int result;
 
 	result = tc_classify(skb, p->filter_list, &res);
 
-	sch->bstats.packets++;
-	sch->bstats.bytes += qdisc_pkt_len(skb);
+	st = per_cpu_ptr(p->stats, smp_processor_id());
+	st->packets++;
+	st->bytes += qdisc_pkt_len(skb);
 	switch (result) {
 	case TC_ACT_SHOT:
 		result = TC_ACT_SHOT;
-		sch->qstats.drops++;
+		st->drops++;
 		break;
 	case TC_ACT_STOLEN:
 	case TC_ACT_QUEUED:
@@ -88,11 +99,22 @@ static int ingress_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 
 /* ------------------------------------------------------------- */
 
+static int ingress_init(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+
+	p->stats = alloc_percpu(struct ingress_stats);
+	if (p->stats == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
 static void ingress_destroy(struct Qdisc *sch)
 {
 	struct ingress_qdisc_data *p = qdisc_priv(sch);
 
 	tcf_destroy_chain(&p->filter_list);
+	free_percpu(p->stats);
 }
 
 static int ingress_dump(struct Qdisc *sch, struct sk_buff *skb)
@@ -110,6 +132,27 @@ nla_put_failure:
 	return -1;
 }
 
+/* Fold the per cpu counters into the qdisc stats that get dumped */
+static int ingress_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct ingress_qdisc_data *p = qdisc_priv(sch);
+	u64 bytes = 0;
+	u32 packets = 0, drops = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct ingress_stats *st = per_cpu_ptr(p->stats, cpu);
+
+		bytes += st->bytes;
+		packets += st->packets;
+		drops += st->drops;
+	}
+	sch->bstats.bytes = bytes;
+	sch->bstats.packets = packets;
+	sch->qstats.drops = drops;
+	return 0;
+}
+
 static const struct Qdisc_class_ops ingress_class_ops = {
 	.leaf		=	ingress_leaf,
 	.get		=	ingress_get,
@@ -125,8 +168,10 @@ static struct Qdisc_ops ingress_qdisc_ops __read_mostly = {
 	.id		=	"ingress",
 	.priv_size	=	sizeof(struct ingress_qdisc_data),
 	.enqueue	=	ingress_enqueue,
+	.init		=	ingress_init,
 	.destroy	=	ingress_destroy,
 	.dump		=	ingress_dump,
+	.dump_stats	=	ingress_dump_stats,
 	.owner		=	THIS_MODULE,
 };
 
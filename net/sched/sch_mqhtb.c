@@ -0,0 +1,1105 @@
+/*
+ * net/sched/sch_mqhtb.c	Multiqueue hierarchical token bucket
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * HTB's class tree for multiqueue devices.  Like mq, the root grafts a
+ * child qdisc onto every TX queue, but the children share one class tree:
+ * each leaf has a packet queue per TX queue, while the rate and ceil
+ * buckets of every class are shared and updated with atomic operations.
+ * Enqueue and dequeue therefore only take the locks of their own TX queue.
+ *
+ * Whoever moves a class checkpoint forward credits the elapsed time to
+ * both buckets; a dequeued packet is charged to the ceil buckets of its
+ * leaf and all ancestors and to the rate buckets from the lending class
+ * up, as HTB does.  A leaf that is out of rate tokens borrows from its
+ * nearest ancestor that is not, unless a ceiling on the way is exhausted.
+ * Classes and filters are changed under sch_tree_lock(), which keeps the
+ * packet path of every TX queue out for TCQ_F_MQSHARED children: each
+ * holds the qdisc_shared_lock at the start of its private data meanwhile.
+ *
+ * Unlike HTB, a leaf has no child qdisc: its per TX queue instances are
+ * plain FIFOs bounded by the device's tx_queue_len, and qdiscs cannot be
+ * grafted onto classes.
+ *
+ * It is configured with the HTB netlink attributes.
+ */
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/skbuff.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <net/netlink.h>
+#include <net/pkt_sched.h>
+
+#define MQHTB_VER 0x30011	/* same tc protocol as sch_htb */
+
+#if MQHTB_VER >> 16 != TC_HTB_PROTOVER
+#error "Mismatched sch_mqhtb.c and pkt_sch.h"
+#endif
+
+enum mqhtb_cmode {
+	MQHTB_CANT_SEND,	/* ceil exhausted */
+	MQHTB_MAY_BORROW,	/* rate exhausted, may borrow */
+	MQHTB_CAN_SEND		/* within rate */
+};
+
+/*
+ * instance of a leaf on one TX queue, protected by that queue's lock;
+ * while backlogged it is either on an active list or on the wait queue
+ */
+struct mqhtb_leaf {
+	struct sk_buff_head	q;
+	struct list_head	alist;	/* on the queue's active list */
+	struct rb_node		pq_node; /* on the queue's wait queue */
+	psched_time_t		pq_key;	/* when it may be able to send */
+	int			deficit;
+	struct mqhtb_class	*cl;
+};
+
+struct mqhtb_cpu_stats {
+	u64			bytes;
+	u32			packets;
+	u32			drops;
+	u32			lends;
+	u32			borrows;
+};
+
+struct mqhtb_class {
+	struct Qdisc_class_common common;
+	int			refcnt;
+
+	/* topology, levels as in HTB */
+	int			level;
+	unsigned int		children;
+	struct mqhtb_class	*parent;
+
+	u32			prio;
+	int			quantum;
+
+	struct tcf_proto	*filter_list;
+	int			filter_cnt;
+
+	struct qdisc_rate_table	*rate;
+	struct qdisc_rate_table	*ceil;
+	long			buffer, cbuffer;
+	long			mbuffer;
+
+	struct mqhtb_cpu_stats	*cpu_stats;
+	struct mqhtb_leaf	*leaf;	/* one per TX queue */
+
+	/* shared by all TX queues */
+	atomic_long_t		tokens ____cacheline_aligned_in_smp;
+	atomic_long_t		ctokens;
+	atomic_long_t		t_c;
+};
+
+struct mqhtb_sched {
+	struct Qdisc		**qdiscs;	/* until attached */
+	struct Qdisc_class_hash	clhash;
+	struct tcf_proto	*filter_list;
+	int			defcls;
+	int			rate2quantum;
+};
+
+/* private data of the per TX queue children */
+struct mqhtb_queue {
+	struct qdisc_shared_lock shared;	/* must be first */
+	struct Qdisc		*root;
+	unsigned int		ntx;
+	u32			limit;
+	struct list_head	active[TC_HTB_NUMPRIO];
+	struct rb_root		wait_pq;	/* leaves that can't send */
+	struct sk_buff_head	direct_queue;
+	long			direct_pkts;
+	struct qdisc_watchdog	watchdog;
+};
+
+static inline struct mqhtb_class *mqhtb_find(u32 handle, struct Qdisc *sch)
+{
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct Qdisc_class_common *clc;
+
+	clc = qdisc_class_find(&q->clhash, handle);
+	if (clc == NULL)
+		return NULL;
+	return container_of(clc, struct mqhtb_class, common);
+}
+
+/* The child of TX queue @ntx; only valid while the root is attached. */
+static inline struct Qdisc *mqhtb_child(struct Qdisc *sch, unsigned int ntx)
+{
+	return netdev_get_tx_queue(qdisc_dev(sch), ntx)->qdisc_sleeping;
+}
+
+#define MQHTB_DIRECT (struct mqhtb_class *)-1
+
+/* Same rules as htb_classify(); @sch is the root. */
+static struct mqhtb_class *mqhtb_classify(struct sk_buff *skb,
+					  struct Qdisc *sch, int *qerr)
+{
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct mqhtb_class *cl;
+	struct tcf_result res;
+	struct tcf_proto *tcf;
+	int result;
+
+	if (skb->priority == sch->handle)
+		return MQHTB_DIRECT;
+	cl = mqhtb_find(skb->priority, sch);
+	if (cl && cl->level == 0)
+		return cl;
+
+	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
+	tcf = q->filter_list;
+	while (tcf && (result = tc_classify(skb, tcf, &res)) >= 0) {
+#ifdef CONFIG_NET_CLS_ACT
+		switch (result) {
+		case TC_ACT_QUEUED:
+		case TC_ACT_STOLEN:
+			*qerr = NET_XMIT_SUCCESS | __NET_XMIT_STOLEN;
+		case TC_ACT_SHOT:
+			return NULL;
+		}
+#endif
+		cl = (void *)res.class;
+		if (cl == NULL) {
+			if (res.classid == sch->handle)
+				return MQHTB_DIRECT;
+			cl = mqhtb_find(res.classid, sch);
+			if (cl == NULL)
+				break;
+		}
+		if (!cl->level)
+			return cl;
+		tcf = cl->filter_list;
+	}
+	cl = mqhtb_find(TC_H_MAKE(TC_H_MAJ(sch->handle), q->defcls), sch);
+	if (!cl || cl->level)
+		return MQHTB_DIRECT;
+	return cl;
+}
+
+/*
+ * Add @diff to a bucket and keep it within [1 - mbuffer, @max] as HTB
+ * does, so that a class charged far below zero does not stay throttled
+ * for longer than mbuffer.
+ */
+static void mqhtb_account(atomic_long_t *v, long diff, long mbuffer, long max)
+{
+	long old = atomic_long_read(v);
+	long toks, prev;
+
+	for (;;) {
+		toks = clamp_t(long, old + diff, 1 - mbuffer, max);
+		prev = atomic_long_cmpxchg(v, old, toks);
+		if (prev == old)
+			return;
+		old = prev;
+	}
+}
+
+/* Only the CPU that moves the checkpoint forward credits the elapsed time. */
+static void mqhtb_refill(struct mqhtb_class *cl, long now)
+{
+	long last = atomic_long_read(&cl->t_c);
+	long diff = now - last;
+
+	if (diff <= 0 || atomic_long_cmpxchg(&cl->t_c, last, now) != last)
+		return;
+	if (diff > cl->mbuffer)
+		diff = cl->mbuffer;
+	mqhtb_account(&cl->tokens, diff, cl->mbuffer, cl->buffer);
+	mqhtb_account(&cl->ctokens, diff, cl->mbuffer, cl->cbuffer);
+}
+
+static enum mqhtb_cmode mqhtb_class_mode(struct mqhtb_class *cl, long now,
+					 long *wait)
+{
+	long toks;
+
+	mqhtb_refill(cl, now);
+
+	toks = atomic_long_read(&cl->ctokens);
+	if (toks < 0) {
+		*wait = min(*wait, -toks);
+		return MQHTB_CANT_SEND;
+	}
+	toks = atomic_long_read(&cl->tokens);
+	if (toks >= 0)
+		return MQHTB_CAN_SEND;
+	*wait = min(*wait, -toks);
+	return MQHTB_MAY_BORROW;
+}
+
+/*
+ * Return the class that pays the rate for the next packet of @cl: @cl
+ * itself when it is within its rate, otherwise its nearest ancestor that
+ * is, or NULL if a ceiling on the way is exhausted.  *wait is lowered to
+ * the time until one of the visited classes changes its mode.
+ */
+static struct mqhtb_class *mqhtb_lender(struct mqhtb_class *cl, long now,
+					long *wait)
+{
+	for (; cl; cl = cl->parent) {
+		switch (mqhtb_class_mode(cl, now, wait)) {
+		case MQHTB_CAN_SEND:
+			return cl;
+		case MQHTB_CANT_SEND:
+			return NULL;
+		case MQHTB_MAY_BORROW:
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Charge a dequeued packet to the ceil buckets of @cl and its ancestors
+ * and to the rate buckets of @lender and its ancestors.
+ */
+static void mqhtb_charge(struct mqhtb_class *cl, struct mqhtb_class *lender,
+			 struct sk_buff *skb)
+{
+	unsigned int len = qdisc_pkt_len(skb);
+	u32 packets = skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+	int cpu = smp_processor_id();
+	struct mqhtb_cpu_stats *st;
+	bool borrowing = true;
+	long toks;
+
+	for (; cl; cl = cl->parent) {
+		st = per_cpu_ptr(cl->cpu_stats, cpu);
+		if (cl == lender) {
+			st->lends++;
+			borrowing = false;
+		} else if (borrowing)
+			st->borrows++;
+
+		if (!borrowing) {
+			toks = qdisc_l2t(cl->rate, len);
+			mqhtb_account(&cl->tokens, -toks, cl->mbuffer,
+				      cl->buffer);
+		}
+		toks = qdisc_l2t(cl->ceil, len);
+		mqhtb_account(&cl->ctokens, -toks, cl->mbuffer, cl->cbuffer);
+
+		st->bytes += len;
+		st->packets += packets;
+	}
+}
+
+/*
+ * Take @leaf off its active list until @when, the earliest time at which
+ * one of the classes that stopped it can change its mode.  The wait
+ * queue is ordered by that time, like HTB's event queue.
+ */
+static void mqhtb_leaf_wait(struct mqhtb_queue *qq, struct mqhtb_leaf *leaf,
+			    psched_time_t when)
+{
+	struct rb_node **p = &qq->wait_pq.rb_node, *parent = NULL;
+	struct mqhtb_leaf *c;
+
+	list_del_init(&leaf->alist);
+	leaf->pq_key = when;
+	while (*p) {
+		parent = *p;
+		c = rb_entry(parent, struct mqhtb_leaf, pq_node);
+		if (when >= c->pq_key)
+			p = &parent->rb_right;
+		else
+			p = &parent->rb_left;
+	}
+	rb_link_node(&leaf->pq_node, parent, p);
+	rb_insert_color(&leaf->pq_node, &qq->wait_pq);
+}
+
+static void mqhtb_leaf_unwait(struct mqhtb_queue *qq, struct mqhtb_leaf *leaf)
+{
+	if (RB_EMPTY_NODE(&leaf->pq_node))
+		return;
+	rb_erase(&leaf->pq_node, &qq->wait_pq);
+	RB_CLEAR_NODE(&leaf->pq_node);
+}
+
+/*
+ * Put the leaves whose wait is over back on their active lists and
+ * return the time the next one is due, or 0 if none is waiting.
+ */
+static psched_time_t mqhtb_wake_leaves(struct mqhtb_queue *qq,
+				       psched_time_t now)
+{
+	struct mqhtb_leaf *leaf;
+	struct rb_node *p;
+
+	while ((p = rb_first(&qq->wait_pq)) != NULL) {
+		leaf = rb_entry(p, struct mqhtb_leaf, pq_node);
+		if (leaf->pq_key > now)
+			return leaf->pq_key;
+		mqhtb_leaf_unwait(qq, leaf);
+		list_add_tail(&leaf->alist, &qq->active[leaf->cl->prio]);
+	}
+	return 0;
+}
+
+static int __mqhtb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	int uninitialized_var(ret);
+	struct mqhtb_queue *qq = qdisc_priv(sch);
+	struct mqhtb_class *cl = mqhtb_classify(skb, qq->root, &ret);
+	struct mqhtb_leaf *leaf;
+
+	if (cl == MQHTB_DIRECT) {
+		if (skb_queue_len(&qq->direct_queue) >= qq->limit)
+			goto drop;
+		__skb_queue_tail(&qq->direct_queue, skb);
+		qq->direct_pkts++;
+#ifdef CONFIG_NET_CLS_ACT
+	} else if (!cl) {
+		if (ret & __NET_XMIT_BYPASS)
+			sch->qstats.drops++;
+		kfree_skb(skb);
+		return ret;
+#endif
+	} else {
+		leaf = &cl->leaf[qq->ntx];
+		if (skb_queue_len(&leaf->q) >= qq->limit) {
+			per_cpu_ptr(cl->cpu_stats, smp_processor_id())->drops++;
+			goto drop;
+		}
+		__skb_queue_tail(&leaf->q, skb);
+		if (list_empty(&leaf->alist) && RB_EMPTY_NODE(&leaf->pq_node))
+			list_add_tail(&leaf->alist, &qq->active[cl->prio]);
+	}
+
+	sch->q.qlen++;
+	sch->qstats.backlog += qdisc_pkt_len(skb);
+	sch->bstats.packets += skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+	sch->bstats.bytes += qdisc_pkt_len(skb);
+	return NET_XMIT_SUCCESS;
+
+drop:
+	sch->qstats.drops++;
+	kfree_skb(skb);
+	return NET_XMIT_DROP;
+}
+
+/*
+ * Leaves within their own rate are served before leaves that have to
+ * borrow, each group in priority order and round robin with HTB's
+ * quantum within a priority.  A leaf that can neither send nor borrow
+ * is moved to the wait queue until the earliest mode change seen on its
+ * way up; tokens only grow with time, so the other TX queues can delay
+ * that point but never advance it.  When nothing may be sent the
+ * watchdog is armed for the first leaf on the wait queue.
+ */
+static struct sk_buff *__mqhtb_dequeue(struct Qdisc *sch)
+{
+	struct mqhtb_queue *qq = qdisc_priv(sch);
+	struct mqhtb_leaf *leaf, *next, *borrower = NULL;
+	struct mqhtb_class *lender = NULL, *cl;
+	psched_time_t now, next_event;
+	struct sk_buff *skb;
+	long wait;
+	int prio;
+
+	skb = __skb_dequeue(&qq->direct_queue);
+	if (skb != NULL)
+		goto ok;
+
+	if (!sch->q.qlen)
+		return NULL;
+
+	now = psched_get_time();
+	mqhtb_wake_leaves(qq, now);
+	for (prio = 0; prio < TC_HTB_NUMPRIO; prio++) {
+		list_for_each_entry_safe(leaf, next, &qq->active[prio], alist) {
+			wait = LONG_MAX;
+			cl = mqhtb_lender(leaf->cl, (long)now, &wait);
+			if (cl == leaf->cl) {
+				lender = cl;
+				goto found;
+			}
+			if (cl == NULL)
+				mqhtb_leaf_wait(qq, leaf, now + wait);
+			else if (!borrower) {
+				borrower = leaf;
+				lender = cl;
+			}
+		}
+	}
+	if (borrower == NULL) {
+		sch->qstats.overlimits++;
+		next_event = mqhtb_wake_leaves(qq, now);
+		if (next_event)
+			qdisc_watchdog_schedule(&qq->watchdog, next_event);
+		return NULL;
+	}
+	leaf = borrower;
+
+found:
+	skb = __skb_dequeue(&leaf->q);
+	mqhtb_charge(leaf->cl, lender, skb);
+
+	leaf->deficit -= qdisc_pkt_len(skb);
+	if (skb_queue_empty(&leaf->q))
+		list_del_init(&leaf->alist);
+	else if (leaf->deficit < 0) {
+		leaf->deficit += leaf->cl->quantum;
+		list_move_tail(&leaf->alist, &qq->active[leaf->cl->prio]);
+	}
+ok:
+	sch->flags &= ~TCQ_F_THROTTLED;
+	sch->q.qlen--;
+	sch->qstats.backlog -= qdisc_pkt_len(skb);
+	return skb;
+}
+
+static int mqhtb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	struct mqhtb_queue *qq = qdisc_priv(sch);
+	int ret;
+
+	qdisc_shared_rdlock(&qq->shared);
+	ret = __mqhtb_enqueue(skb, sch);
+	qdisc_shared_rdunlock(&qq->shared);
+	return ret;
+}
+
+static struct sk_buff *mqhtb_dequeue(struct Qdisc *sch)
+{
+	struct mqhtb_queue *qq = qdisc_priv(sch);
+	struct sk_buff *skb;
+
+	qdisc_shared_rdlock(&qq->shared);
+	skb = __mqhtb_dequeue(sch);
+	qdisc_shared_rdunlock(&qq->shared);
+	return skb;
+}
+
+/* Drop what @leaf holds on the TX queue of @qdisc; under its lock. */
+static void mqhtb_purge_leaf(struct Qdisc *qdisc, struct mqhtb_leaf *leaf)
+{
+	struct sk_buff *skb;
+
+	while ((skb = __skb_dequeue(&leaf->q)) != NULL) {
+		qdisc->q.qlen--;
+		qdisc->qstats.backlog -= qdisc_pkt_len(skb);
+		qdisc->qstats.drops++;
+		kfree_skb(skb);
+	}
+	list_del_init(&leaf->alist);
+	mqhtb_leaf_unwait(qdisc_priv(qdisc), leaf);
+	leaf->deficit = 0;
+}
+
+/* Drop what @cl holds on all TX queues; under sch_tree_lock(). */
+static void mqhtb_purge_class(struct Qdisc *sch, struct mqhtb_class *cl)
+{
+	unsigned int ntx;
+
+	for (ntx = 0; ntx < qdisc_dev(sch)->num_tx_queues; ntx++)
+		mqhtb_purge_leaf(mqhtb_child(sch, ntx), &cl->leaf[ntx]);
+}
+
+static void mqhtb_queue_reset(struct Qdisc *sch)
+{
+	struct mqhtb_queue *qq = qdisc_priv(sch);
+	struct mqhtb_sched *q = qdisc_priv(qq->root);
+	struct mqhtb_class *cl;
+	struct hlist_node *n;
+	unsigned int i;
+
+	qdisc_shared_rdlock(&qq->shared);
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode)
+			mqhtb_purge_leaf(sch, &cl->leaf[qq->ntx]);
+	}
+	qdisc_shared_rdunlock(&qq->shared);
+	__skb_queue_purge(&qq->direct_queue);
+	sch->q.qlen = 0;
+	sch->qstats.backlog = 0;
+	qdisc_watchdog_cancel(&qq->watchdog);
+}
+
+static int mqhtb_queue_init(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct mqhtb_queue *qq = qdisc_priv(sch);
+	int prio;
+
+	spin_lock_init(&qq->shared.lock);
+	for (prio = 0; prio < TC_HTB_NUMPRIO; prio++)
+		INIT_LIST_HEAD(&qq->active[prio]);
+	qq->wait_pq = RB_ROOT;
+	skb_queue_head_init(&qq->direct_queue);
+	qdisc_watchdog_init(&qq->watchdog, sch);
+
+	qq->limit = qdisc_dev(sch)->tx_queue_len;
+	if (qq->limit < 2)	/* some devices have zero tx_queue_len */
+		qq->limit = 2;
+	return 0;
+}
+
+static void mqhtb_queue_destroy(struct Qdisc *sch)
+{
+	struct mqhtb_queue *qq = qdisc_priv(sch);
+
+	qdisc_watchdog_cancel(&qq->watchdog);
+}
+
+/*
+ * Never registered and without an owner: the children are created by the
+ * root, always destroyed before it, and pinned by its module reference.
+ */
+static struct Qdisc_ops mqhtb_queue_ops __read_mostly = {
+	.id		= "mqhtb_queue",
+	.priv_size	= sizeof(struct mqhtb_queue),
+	.enqueue	= mqhtb_enqueue,
+	.dequeue	= mqhtb_dequeue,
+	.peek		= qdisc_peek_dequeued,
+	.init		= mqhtb_queue_init,
+	.reset		= mqhtb_queue_reset,
+	.destroy	= mqhtb_queue_destroy,
+};
+
+static const struct nla_policy mqhtb_policy[TCA_HTB_MAX + 1] = {
+	[TCA_HTB_PARMS]	= { .len = sizeof(struct tc_htb_opt) },
+	[TCA_HTB_INIT]	= { .len = sizeof(struct tc_htb_glob) },
+	[TCA_HTB_CTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+	[TCA_HTB_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+};
+
+static void mqhtb_destroy_class(struct Qdisc *sch, struct mqhtb_class *cl)
+{
+	qdisc_put_rtab(cl->rate);
+	qdisc_put_rtab(cl->ceil);
+	tcf_destroy_chain(&cl->filter_list);
+	free_percpu(cl->cpu_stats);
+	kfree(cl->leaf);
+	kfree(cl);
+}
+
+static void mqhtb_destroy(struct Qdisc *sch)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct hlist_node *n, *next;
+	struct mqhtb_class *cl;
+	unsigned int i;
+
+	if (q->qdiscs) {
+		for (i = 0; i < dev->num_tx_queues && q->qdiscs[i]; i++)
+			qdisc_destroy(q->qdiscs[i]);
+		kfree(q->qdiscs);
+	}
+
+	tcf_destroy_chain(&q->filter_list);
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode)
+			tcf_destroy_chain(&cl->filter_list);
+	}
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry_safe(cl, n, next, &q->clhash.hash[i],
+					  common.hnode)
+			mqhtb_destroy_class(sch, cl);
+	}
+	qdisc_class_hash_destroy(&q->clhash);
+}
+
+static int mqhtb_init(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct nlattr *tb[TCA_HTB_INIT + 1];
+	struct tc_htb_glob *gopt;
+	struct mqhtb_queue *qq;
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+	int err;
+
+	if (sch->parent != TC_H_ROOT)
+		return -EOPNOTSUPP;
+
+	if (!netif_is_multiqueue(dev))
+		return -EOPNOTSUPP;
+
+	if (!opt)
+		return -EINVAL;
+
+	err = nla_parse_nested(tb, TCA_HTB_INIT, opt, mqhtb_policy);
+	if (err < 0)
+		return err;
+
+	if (tb[TCA_HTB_INIT] == NULL)
+		return -EINVAL;
+	gopt = nla_data(tb[TCA_HTB_INIT]);
+	if (gopt->version != MQHTB_VER >> 16)
+		return -EINVAL;
+
+	err = qdisc_class_hash_init(&q->clhash);
+	if (err < 0)
+		return err;
+
+	q->rate2quantum = gopt->rate2quantum;
+	if (q->rate2quantum < 1)
+		q->rate2quantum = 1;
+	q->defcls = gopt->defcls;
+
+	/* pre-allocate qdiscs, attachment can't fail */
+	q->qdiscs = kcalloc(dev->num_tx_queues, sizeof(q->qdiscs[0]),
+			    GFP_KERNEL);
+	if (q->qdiscs == NULL)
+		goto err;
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = qdisc_create_dflt(dev, netdev_get_tx_queue(dev, ntx),
+					  &mqhtb_queue_ops, sch->handle);
+		if (qdisc == NULL)
+			goto err;
+		qq = qdisc_priv(qdisc);
+		qq->root = sch;
+		qq->ntx = ntx;
+		qdisc->flags |= TCQ_F_MQSHARED;
+		q->qdiscs[ntx] = qdisc;
+	}
+
+	sch->flags |= TCQ_F_MQROOT;
+	return 0;
+
+err:
+	mqhtb_destroy(sch);
+	return -ENOMEM;
+}
+
+static void mqhtb_attach(struct Qdisc *sch)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = q->qdiscs[ntx];
+		qdisc = dev_graft_qdisc(qdisc->dev_queue, qdisc);
+		if (qdisc)
+			qdisc_destroy(qdisc);
+	}
+	kfree(q->qdiscs);
+	q->qdiscs = NULL;
+}
+
+static int mqhtb_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct mqhtb_queue *qq;
+	struct tc_htb_glob gopt;
+	struct nlattr *nest;
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+
+	memset(&gopt, 0, sizeof(gopt));
+	sch->q.qlen = 0;
+	memset(&sch->bstats, 0, sizeof(sch->bstats));
+	memset(&sch->qstats, 0, sizeof(sch->qstats));
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = mqhtb_child(sch, ntx);
+		qq = qdisc_priv(qdisc);
+		spin_lock_bh(qdisc_lock(qdisc));
+		sch->q.qlen		+= qdisc->q.qlen;
+		sch->bstats.bytes	+= qdisc->bstats.bytes;
+		sch->bstats.packets	+= qdisc->bstats.packets;
+		sch->qstats.qlen	+= qdisc->q.qlen;
+		sch->qstats.backlog	+= qdisc->qstats.backlog;
+		sch->qstats.drops	+= qdisc->qstats.drops;
+		sch->qstats.requeues	+= qdisc->qstats.requeues;
+		sch->qstats.overlimits	+= qdisc->qstats.overlimits;
+		gopt.direct_pkts	+= qq->direct_pkts;
+		spin_unlock_bh(qdisc_lock(qdisc));
+	}
+
+	gopt.version = MQHTB_VER;
+	gopt.rate2quantum = q->rate2quantum;
+	gopt.defcls = q->defcls;
+
+	nest = nla_nest_start(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+	NLA_PUT(skb, TCA_HTB_INIT, sizeof(gopt), &gopt);
+	nla_nest_end(skb, nest);
+	return skb->len;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -1;
+}
+
+static int mqhtb_dump_class(struct Qdisc *sch, unsigned long arg,
+			    struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct mqhtb_class *cl = (struct mqhtb_class *)arg;
+	spinlock_t *root_lock = qdisc_root_sleeping_lock(sch);
+	struct nlattr *nest;
+	struct tc_htb_opt opt;
+
+	spin_lock_bh(root_lock);
+	tcm->tcm_parent = cl->parent ? cl->parent->common.classid : TC_H_ROOT;
+	tcm->tcm_handle = cl->common.classid;
+
+	nest = nla_nest_start(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+
+	memset(&opt, 0, sizeof(opt));
+
+	opt.rate = cl->rate->rate;
+	opt.buffer = cl->buffer;
+	opt.ceil = cl->ceil->rate;
+	opt.cbuffer = cl->cbuffer;
+	opt.quantum = cl->quantum;
+	opt.prio = cl->prio;
+	opt.level = cl->level;
+	NLA_PUT(skb, TCA_HTB_PARMS, sizeof(opt), &opt);
+
+	nla_nest_end(skb, nest);
+	spin_unlock_bh(root_lock);
+	return skb->len;
+
+nla_put_failure:
+	spin_unlock_bh(root_lock);
+	nla_nest_cancel(skb, nest);
+	return -1;
+}
+
+static int mqhtb_dump_class_stats(struct Qdisc *sch, unsigned long arg,
+				  struct gnet_dump *d)
+{
+	struct mqhtb_class *cl = (struct mqhtb_class *)arg;
+	struct gnet_stats_basic_packed bstats;
+	struct gnet_stats_queue qstats;
+	struct tc_htb_xstats xstats;
+	const struct mqhtb_cpu_stats *st;
+	unsigned int ntx;
+	int cpu;
+
+	memset(&bstats, 0, sizeof(bstats));
+	memset(&qstats, 0, sizeof(qstats));
+	memset(&xstats, 0, sizeof(xstats));
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(cl->cpu_stats, cpu);
+		bstats.bytes += st->bytes;
+		bstats.packets += st->packets;
+		qstats.drops += st->drops;
+		xstats.lends += st->lends;
+		xstats.borrows += st->borrows;
+	}
+	for (ntx = 0; ntx < qdisc_dev(sch)->num_tx_queues; ntx++)
+		qstats.qlen += skb_queue_len(&cl->leaf[ntx].q);
+	xstats.tokens = atomic_long_read(&cl->tokens);
+	xstats.ctokens = atomic_long_read(&cl->ctokens);
+
+	if (gnet_stats_copy_basic(d, &bstats) < 0 ||
+	    gnet_stats_copy_queue(d, &qstats) < 0)
+		return -1;
+
+	return gnet_stats_copy_app(d, &xstats, sizeof(xstats));
+}
+
+static struct Qdisc *mqhtb_leaf(struct Qdisc *sch, unsigned long arg)
+{
+	return NULL;
+}
+
+static unsigned long mqhtb_get(struct Qdisc *sch, u32 classid)
+{
+	struct mqhtb_class *cl = mqhtb_find(classid, sch);
+
+	if (cl)
+		cl->refcnt++;
+	return (unsigned long)cl;
+}
+
+static void mqhtb_put(struct Qdisc *sch, unsigned long arg)
+{
+	struct mqhtb_class *cl = (struct mqhtb_class *)arg;
+
+	if (--cl->refcnt == 0)
+		mqhtb_destroy_class(sch, cl);
+}
+
+static void mqhtb_set_full(struct mqhtb_class *cl)
+{
+	atomic_long_set(&cl->tokens, cl->buffer);
+	atomic_long_set(&cl->ctokens, cl->cbuffer);
+	atomic_long_set(&cl->t_c, (long)psched_get_time());
+}
+
+static int mqhtb_delete(struct Qdisc *sch, unsigned long arg)
+{
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct mqhtb_class *cl = (struct mqhtb_class *)arg;
+	struct mqhtb_class *parent = cl->parent;
+
+	if (cl->children || cl->filter_cnt)
+		return -EBUSY;
+
+	sch_tree_lock(sch);
+
+	mqhtb_purge_class(sch, cl);
+	qdisc_class_hash_remove(&q->clhash, &cl->common);
+
+	/* the last child gone, the parent becomes a leaf again */
+	if (parent && --parent->children == 0) {
+		parent->level = 0;
+		mqhtb_set_full(parent);
+	}
+
+	BUG_ON(--cl->refcnt == 0);
+	sch_tree_unlock(sch);
+	return 0;
+}
+
+static struct mqhtb_class *mqhtb_alloc_class(struct Qdisc *sch)
+{
+	unsigned int ntx, num_tx = qdisc_dev(sch)->num_tx_queues;
+	struct mqhtb_class *cl;
+
+	cl = kzalloc(sizeof(*cl), GFP_KERNEL);
+	if (cl == NULL)
+		return NULL;
+
+	cl->leaf = kcalloc(num_tx, sizeof(cl->leaf[0]), GFP_KERNEL);
+	cl->cpu_stats = alloc_percpu(struct mqhtb_cpu_stats);
+	if (cl->leaf == NULL || cl->cpu_stats == NULL) {
+		free_percpu(cl->cpu_stats);
+		kfree(cl->leaf);
+		kfree(cl);
+		return NULL;
+	}
+
+	for (ntx = 0; ntx < num_tx; ntx++) {
+		skb_queue_head_init(&cl->leaf[ntx].q);
+		INIT_LIST_HEAD(&cl->leaf[ntx].alist);
+		RB_CLEAR_NODE(&cl->leaf[ntx].pq_node);
+		cl->leaf[ntx].cl = cl;
+	}
+	cl->refcnt = 1;
+	return cl;
+}
+
+static int mqhtb_change_class(struct Qdisc *sch, u32 classid,
+			      u32 parentid, struct nlattr **tca,
+			      unsigned long *arg)
+{
+	int err = -EINVAL;
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct mqhtb_class *cl = (struct mqhtb_class *)*arg, *parent;
+	struct nlattr *opt = tca[TCA_OPTIONS];
+	struct qdisc_rate_table *rtab = NULL, *ctab = NULL;
+	struct nlattr *tb[TCA_HTB_RTAB + 1];
+	struct tc_htb_opt *hopt;
+	unsigned int ntx, num_tx = qdisc_dev(sch)->num_tx_queues;
+	u32 prio;
+
+	if (!opt)
+		goto failure;
+
+	/* the buckets are not counted in one place an estimator could read */
+	err = -EOPNOTSUPP;
+	if (tca[TCA_RATE])
+		goto failure;
+
+	err = nla_parse_nested(tb, TCA_HTB_RTAB, opt, mqhtb_policy);
+	if (err < 0)
+		goto failure;
+
+	err = -EINVAL;
+	if (tb[TCA_HTB_PARMS] == NULL)
+		goto failure;
+
+	parent = parentid == TC_H_ROOT ? NULL : mqhtb_find(parentid, sch);
+
+	hopt = nla_data(tb[TCA_HTB_PARMS]);
+
+	rtab = qdisc_get_rtab(&hopt->rate, tb[TCA_HTB_RTAB]);
+	ctab = qdisc_get_rtab(&hopt->ceil, tb[TCA_HTB_CTAB]);
+	if (!rtab || !ctab)
+		goto failure;
+
+	if (!cl) {
+		if (!classid || TC_H_MAJ(classid ^ sch->handle) ||
+		    mqhtb_find(classid, sch))
+			goto failure;
+
+		if (parent && parent->parent && parent->parent->level < 2)
+			goto failure;
+
+		err = -ENOBUFS;
+		cl = mqhtb_alloc_class(sch);
+		if (cl == NULL)
+			goto failure;
+
+		sch_tree_lock(sch);
+		if (parent && !parent->level) {
+			/* turn parent into inner node */
+			mqhtb_purge_class(sch, parent);
+			parent->level = (parent->parent ? parent->parent->level
+					 : TC_HTB_MAXDEPTH) - 1;
+		}
+
+		cl->common.classid = classid;
+		cl->parent = parent;
+		cl->buffer = hopt->buffer;
+		cl->cbuffer = hopt->cbuffer;
+		cl->mbuffer = 60 * PSCHED_TICKS_PER_SEC;	/* 1min */
+		cl->prio = TC_HTB_NUMPRIO - 1;
+		mqhtb_set_full(cl);
+
+		qdisc_class_hash_insert(&q->clhash, &cl->common);
+		if (parent)
+			parent->children++;
+	} else
+		sch_tree_lock(sch);
+
+	if (!cl->level) {
+		cl->quantum = rtab->rate.rate / q->rate2quantum;
+		if (!hopt->quantum && cl->quantum < 1000)
+			cl->quantum = 1000;
+		if (!hopt->quantum && cl->quantum > 200000)
+			cl->quantum = 200000;
+		if (hopt->quantum)
+			cl->quantum = hopt->quantum;
+
+		/* move the backlogged instances to their new active lists */
+		prio = min_t(u32, hopt->prio, TC_HTB_NUMPRIO - 1);
+		for (ntx = 0; prio != cl->prio && ntx < num_tx; ntx++) {
+			struct mqhtb_queue *qq;
+
+			if (list_empty(&cl->leaf[ntx].alist))
+				continue;
+			qq = qdisc_priv(mqhtb_child(sch, ntx));
+			list_move_tail(&cl->leaf[ntx].alist, &qq->active[prio]);
+		}
+		cl->prio = prio;
+	}
+
+	cl->buffer = hopt->buffer;
+	cl->cbuffer = hopt->cbuffer;
+	if (cl->rate)
+		qdisc_put_rtab(cl->rate);
+	cl->rate = rtab;
+	if (cl->ceil)
+		qdisc_put_rtab(cl->ceil);
+	cl->ceil = ctab;
+	sch_tree_unlock(sch);
+
+	qdisc_class_hash_grow(sch, &q->clhash);
+
+	*arg = (unsigned long)cl;
+	return 0;
+
+failure:
+	if (rtab)
+		qdisc_put_rtab(rtab);
+	if (ctab)
+		qdisc_put_rtab(ctab);
+	return err;
+}
+
+static struct tcf_proto **mqhtb_find_tcf(struct Qdisc *sch, unsigned long arg)
+{
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct mqhtb_class *cl = (struct mqhtb_class *)arg;
+
+	return cl ? &cl->filter_list : &q->filter_list;
+}
+
+static unsigned long mqhtb_bind_filter(struct Qdisc *sch, unsigned long parent,
+				       u32 classid)
+{
+	struct mqhtb_class *cl = mqhtb_find(classid, sch);
+
+	if (cl)
+		cl->filter_cnt++;
+	return (unsigned long)cl;
+}
+
+static void mqhtb_unbind_filter(struct Qdisc *sch, unsigned long arg)
+{
+	struct mqhtb_class *cl = (struct mqhtb_class *)arg;
+
+	if (cl)
+		cl->filter_cnt--;
+}
+
+static void mqhtb_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+	struct mqhtb_sched *q = qdisc_priv(sch);
+	struct mqhtb_class *cl;
+	struct hlist_node *n;
+	unsigned int i;
+
+	if (arg->stop)
+		return;
+
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode) {
+			if (arg->count < arg->skip) {
+				arg->count++;
+				continue;
+			}
+			if (arg->fn(sch, (unsigned long)cl, arg) < 0) {
+				arg->stop = 1;
+				return;
+			}
+			arg->count++;
+		}
+	}
+}
+
+static const struct Qdisc_class_ops mqhtb_class_ops = {
+	.leaf		=	mqhtb_leaf,
+	.get		=	mqhtb_get,
+	.put		=	mqhtb_put,
+	.change		=	mqhtb_change_class,
+	.delete		=	mqhtb_delete,
+	.walk		=	mqhtb_walk,
+	.tcf_chain	=	mqhtb_find_tcf,
+	.bind_tcf	=	mqhtb_bind_filter,
+	.unbind_tcf	=	mqhtb_unbind_filter,
+	.dump		=	mqhtb_dump_class,
+	.dump_stats	=	mqhtb_dump_class_stats,
+};
+
+static struct Qdisc_ops mqhtb_qdisc_ops __read_mostly = {
+	.cl_ops		=	&mqhtb_class_ops,
+	.id		=	"mqhtb",
+	.priv_size	=	sizeof(struct mqhtb_sched),
+	.init		=	mqhtb_init,
+	.destroy	=	mqhtb_destroy,
+	.attach		=	mqhtb_attach,
+	.dump		=	mqhtb_dump,
+	.owner		=	THIS_MODULE,
+};
+
+static int __init mqhtb_module_init(void)
+{
+	return register_qdisc(&mqhtb_qdisc_ops);
+}
+static void __exit mqhtb_module_exit(void)
+{
+	unregister_qdisc(&mqhtb_qdisc_ops);
+}
+
+module_init(mqhtb_module_init)
+module_exit(mqhtb_module_exit)
+MODULE_LICENSE("GPL");
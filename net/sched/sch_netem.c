@@ -19,11 +19,13 @@
 #include <linux/errno.h>
 #include <linux/skbuff.h>
 #include <linux/rtnetlink.h>
+#include <linux/rbtree.h>
+#include <linux/reciprocal_div.h>
 
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 
-#define VERSION "1.2"
+#define VERSION "1.3"
 
 /*	Network Emulation Queuing algorithm.
 	====================================
@@ -43,13 +45,18 @@
 	 duplication, and reordering can also be emulated.
 
 	 This qdisc does not do classification that can be handled in
-	 layering other disciplines.  It does not need to do bandwidth
-	 control either since that can be handled by using token
-	 bucket or other rate control.
+	 layering other disciplines.  It can emulate the serialisation
+	 delay of a link of a given bandwidth; more elaborate rate control
+	 can be handled by using token bucket or other disciplines.
+
+	 Delayed packets are kept in an rbtree ordered by their time to
+	 send, so that jitter does not turn enqueue into a list walk.
+	 Reordered packets go to the head of sch->q, which is served
+	 before the tree; sch->q.qlen counts the packets of both.
 */
 
 struct netem_sched_data {
-	struct Qdisc	*qdisc;
+	struct rb_root	t_root;
 	struct qdisc_watchdog watchdog;
 
 	psched_tdiff_t latency;
@@ -62,6 +69,11 @@ struct netem_sched_data {
 	u32 duplicate;
 	u32 reorder;
 	u32 corrupt;
+	u32 rate;
+	s32 packet_overhead;
+	u32 cell_size;
+	u32 cell_size_reciprocal;
+	s32 cell_overhead;
 
 	struct crndstate {
 		u32 last;
@@ -74,9 +86,10 @@ struct netem_sched_data {
 	} *delay_dist;
 };
 
-/* Time stamp put into socket buffer control block */
+/* Time stamp and tree linkage put into socket buffer control block */
 struct netem_skb_cb {
 	psched_time_t	time_to_send;
+	struct rb_node	node;
 };
 
 static inline struct netem_skb_cb *netem_skb_cb(struct sk_buff *skb)
@@ -86,6 +99,14 @@ static inline struct netem_skb_cb *netem_skb_cb(struct sk_buff *skb)
 	return (struct netem_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
+static inline struct sk_buff *netem_rb_to_skb(struct rb_node *rb)
+{
+	struct netem_skb_cb *cb = rb_entry(rb, struct netem_skb_cb, node);
+
+	return (struct sk_buff *)((char *)cb - offsetof(struct sk_buff, cb) -
+				  offsetof(struct qdisc_skb_cb, data));
+}
+
 /* init_crandom - initialize correlated random number generator
  * Use entropy source for initial seed.
  */
@@ -145,6 +166,62 @@ static psched_tdiff_t tabledist(psched_tdiff_t mu, psched_tdiff_t sigma,
 	return  x / NETEM_DIST_SCALE + (sigma / NETEM_DIST_SCALE) * t + mu;
 }
 
+/* Time the emulated link needs to serialise a packet of @len bytes */
+static psched_tdiff_t packet_len_2_sched_time(unsigned int len,
+					      const struct netem_sched_data *q)
+{
+	u64 ticks;
+
+	len += q->packet_overhead;
+	if ((int)len <= 0)
+		return 0;
+	if (q->cell_size) {
+		u32 cells = reciprocal_divide(len, q->cell_size_reciprocal);
+
+		if (len > cells * q->cell_size)	/* partial last cell */
+			cells++;
+		len = cells * (q->cell_size + q->cell_overhead);
+	}
+	ticks = (u64)len * NSEC_PER_SEC;
+	do_div(ticks, q->rate);
+	return PSCHED_NS2TICKS(ticks);
+}
+
+/* Insert into the time ordered tree; equal times keep arrival order. */
+static void tfifo_enqueue(struct sk_buff *nskb, struct Qdisc *sch)
+{
+	struct netem_sched_data *q = qdisc_priv(sch);
+	psched_time_t tnext = netem_skb_cb(nskb)->time_to_send;
+	struct rb_node **p = &q->t_root.rb_node, *parent = NULL;
+
+	while (*p) {
+		struct sk_buff *skb;
+
+		parent = *p;
+		skb = netem_rb_to_skb(parent);
+		if (tnext >= netem_skb_cb(skb)->time_to_send)
+			p = &parent->rb_right;
+		else
+			p = &parent->rb_left;
+	}
+	rb_link_node(&netem_skb_cb(nskb)->node, parent, p);
+	rb_insert_color(&netem_skb_cb(nskb)->node, &q->t_root);
+	sch->q.qlen++;
+}
+
+static void tfifo_reset(struct Qdisc *sch)
+{
+	struct netem_sched_data *q = qdisc_priv(sch);
+	struct rb_node *p;
+
+	while ((p = rb_first(&q->t_root)) != NULL) {
+		struct sk_buff *skb = netem_rb_to_skb(p);
+
+		rb_erase(p, &q->t_root);
+		kfree_skb(skb);
+	}
+}
+
 /*
  * Insert one skb into qdisc.
  * Note: parent depends on return value to account for queue length.
@@ -157,7 +234,6 @@ static int netem_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 	/* We don't fill cb now as skb_unshare() may invalidate it */
 	struct netem_skb_cb *cb;
 	struct sk_buff *skb2;
-	int ret;
 	int count = 1;
 
 	pr_debug("netem_enqueue skb=%p\n", skb);
@@ -207,6 +283,9 @@ static int netem_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 		skb->data[net_random() % skb_headlen(skb)] ^= 1<<(net_random() % 8);
 	}
 
+	if (unlikely(sch->q.qlen >= q->limit))
+		return qdisc_reshape_fail(skb, sch);
+
 	cb = netem_skb_cb(skb);
 	if (q->gap == 0 		/* not doing reordering */
 	    || q->counter < q->gap 	/* inside last reordering gap */
@@ -219,8 +298,26 @@ static int netem_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 
 		now = psched_get_time();
 		cb->time_to_send = now + delay;
+
+		if (q->rate) {
+			struct rb_node *last = rb_last(&q->t_root);
+
+			/*
+			 * The link is busy until the last queued packet
+			 * has left; this one is serialised after it.
+			 */
+			if (last) {
+				const struct netem_skb_cb *prev;
+
+				prev = netem_skb_cb(netem_rb_to_skb(last));
+				if (prev->time_to_send > cb->time_to_send)
+					cb->time_to_send = prev->time_to_send;
+			}
+			cb->time_to_send +=
+				packet_len_2_sched_time(qdisc_pkt_len(skb), q);
+		}
 		++q->counter;
-		ret = qdisc_enqueue(skb, q->qdisc);
+		tfifo_enqueue(skb, sch);
 	} else {
 		/*
 		 * Do re-ordering by putting one out of N packets at the front
@@ -229,33 +326,39 @@ static int netem_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 		cb->time_to_send = psched_get_time();
 		q->counter = 0;
 
-		__skb_queue_head(&q->qdisc->q, skb);
-		q->qdisc->qstats.backlog += qdisc_pkt_len(skb);
-		q->qdisc->qstats.requeues++;
-		ret = NET_XMIT_SUCCESS;
+		__skb_queue_head(&sch->q, skb);
+		sch->qstats.requeues++;
 	}
 
-	if (likely(ret == NET_XMIT_SUCCESS)) {
-		sch->q.qlen++;
-		sch->bstats.bytes += qdisc_pkt_len(skb);
-		sch->bstats.packets++;
-	} else if (net_xmit_drop_count(ret)) {
-		sch->qstats.drops++;
-	}
+	sch->qstats.backlog += qdisc_pkt_len(skb);
+	sch->bstats.bytes += qdisc_pkt_len(skb);
+	sch->bstats.packets++;
 
-	pr_debug("netem: enqueue ret %d\n", ret);
-	return ret;
+	return NET_XMIT_SUCCESS;
 }
 
 static unsigned int netem_drop(struct Qdisc* sch)
 {
 	struct netem_sched_data *q = qdisc_priv(sch);
-	unsigned int len = 0;
+	unsigned int len;
 
-	if (q->qdisc->ops->drop && (len = q->qdisc->ops->drop(q->qdisc)) != 0) {
-		sch->q.qlen--;
-		sch->qstats.drops++;
+	len = qdisc_queue_drop(sch);
+	if (!len) {
+		/* drop the packet due last */
+		struct rb_node *p = rb_last(&q->t_root);
+
+		if (p) {
+			struct sk_buff *skb = netem_rb_to_skb(p);
+
+			rb_erase(p, &q->t_root);
+			sch->q.qlen--;
+			len = qdisc_pkt_len(skb);
+			sch->qstats.backlog -= len;
+			kfree_skb(skb);
+		}
 	}
+	if (len)
+		sch->qstats.drops++;
 	return len;
 }
 
@@ -263,45 +366,55 @@ static struct sk_buff *netem_dequeue(struct Qdisc *sch)
 {
 	struct netem_sched_data *q = qdisc_priv(sch);
 	struct sk_buff *skb;
+	struct rb_node *p;
 
 	if (sch->flags & TCQ_F_THROTTLED)
 		return NULL;
 
-	skb = q->qdisc->ops->peek(q->qdisc);
-	if (skb) {
-		const struct netem_skb_cb *cb = netem_skb_cb(skb);
-		psched_time_t now = psched_get_time();
+	/* reordered packets are due immediately */
+	skb = __skb_dequeue(&sch->q);
+	if (skb)
+		goto deliver;
 
-		/* if more time remaining? */
-		if (cb->time_to_send <= now) {
-			skb = qdisc_dequeue_peeked(q->qdisc);
-			if (unlikely(!skb))
-				return NULL;
+	p = rb_first(&q->t_root);
+	if (p) {
+		const struct netem_skb_cb *cb;
 
-#ifdef CONFIG_NET_CLS_ACT
-			/*
-			 * If it's at ingress let's pretend the delay is
-			 * from the network (tstamp will be updated).
-			 */
-			if (G_TC_FROM(skb->tc_verd) & AT_INGRESS)
-				skb->tstamp.tv64 = 0;
-#endif
-			pr_debug("netem_dequeue: return skb=%p\n", skb);
+		skb = netem_rb_to_skb(p);
+		cb = netem_skb_cb(skb);
+
+		/* if more time remaining? */
+		if (cb->time_to_send <= psched_get_time()) {
+			rb_erase(p, &q->t_root);
 			sch->q.qlen--;
-			return skb;
+			goto deliver;
 		}
 
 		qdisc_watchdog_schedule(&q->watchdog, cb->time_to_send);
 	}
 
 	return NULL;
+
+deliver:
+	sch->qstats.backlog -= qdisc_pkt_len(skb);
+#ifdef CONFIG_NET_CLS_ACT
+	/*
+	 * If it's at ingress let's pretend the delay is
+	 * from the network (tstamp will be updated).
+	 */
+	if (G_TC_FROM(skb->tc_verd) & AT_INGRESS)
+		skb->tstamp.tv64 = 0;
+#endif
+	pr_debug("netem_dequeue: return skb=%p\n", skb);
+	return skb;
 }
 
 static void netem_reset(struct Qdisc *sch)
 {
 	struct netem_sched_data *q = qdisc_priv(sch);
 
-	qdisc_reset(q->qdisc);
+	qdisc_reset_queue(sch);
+	tfifo_reset(sch);
 	sch->q.qlen = 0;
 	qdisc_watchdog_cancel(&q->watchdog);
 }
@@ -367,10 +480,25 @@ static void get_corrupt(struct Qdisc *sch, const struct nlattr *attr)
 	init_crandom(&q->corrupt_cor, r->correlation);
 }
 
+static void get_rate(struct Qdisc *sch, const struct nlattr *attr)
+{
+	struct netem_sched_data *q = qdisc_priv(sch);
+	const struct tc_netem_rate *r = nla_data(attr);
+
+	q->rate = r->rate;
+	q->packet_overhead = r->packet_overhead;
+	q->cell_size = r->cell_size;
+	if (q->cell_size)
+		q->cell_size_reciprocal = reciprocal_value(q->cell_size);
+	q->cell_overhead = r->cell_overhead;
+}
+
 static const struct nla_policy netem_policy[TCA_NETEM_MAX + 1] = {
 	[TCA_NETEM_CORR]	= { .len = sizeof(struct tc_netem_corr) },
 	[TCA_NETEM_REORDER]	= { .len = sizeof(struct tc_netem_reorder) },
 	[TCA_NETEM_CORRUPT]	= { .len = sizeof(struct tc_netem_corrupt) },
+	/* TCA_NETEM_LOSS: loss models are not supported, it is ignored */
+	[TCA_NETEM_RATE]	= { .len = sizeof(struct tc_netem_rate) },
 };
 
 static int parse_attr(struct nlattr *tb[], int maxtype, struct nlattr *nla,
@@ -403,12 +531,6 @@ static int netem_change(struct Qdisc *sch, struct nlattr *opt)
 	if (ret < 0)
 		return ret;
 
-	ret = fifo_set_limit(q->qdisc, qopt->limit);
-	if (ret) {
-		pr_debug("netem: can't set fifo limit\n");
-		return ret;
-	}
-
 	q->latency = qopt->latency;
 	q->jitter = qopt->jitter;
 	q->limit = qopt->limit;
@@ -438,93 +560,12 @@ static int netem_change(struct Qdisc *sch, struct nlattr *opt)
 	if (tb[TCA_NETEM_CORRUPT])
 		get_corrupt(sch, tb[TCA_NETEM_CORRUPT]);
 
-	return 0;
-}
-
-/*
- * Special case version of FIFO queue for use by netem.
- * It queues in order based on timestamps in skb's
- */
-struct fifo_sched_data {
-	u32 limit;
-	psched_time_t oldest;
-};
-
-static int tfifo_enqueue(struct sk_buff *nskb, struct Qdisc *sch)
-{
-	struct fifo_sched_data *q = qdisc_priv(sch);
-	struct sk_buff_head *list = &sch->q;
-	psched_time_t tnext = netem_skb_cb(nskb)->time_to_send;
-	struct sk_buff *skb;
-
-	if (likely(skb_queue_len(list) < q->limit)) {
-		/* Optimize for add at tail */
-		if (likely(skb_queue_empty(list) || tnext >= q->oldest)) {
-			q->oldest = tnext;
-			return qdisc_enqueue_tail(nskb, sch);
-		}
-
-		skb_queue_reverse_walk(list, skb) {
-			const struct netem_skb_cb *cb = netem_skb_cb(skb);
-
-			if (tnext >= cb->time_to_send)
-				break;
-		}
+	if (tb[TCA_NETEM_RATE])
+		get_rate(sch, tb[TCA_NETEM_RATE]);
 
-		__skb_queue_after(list, skb, nskb);
-
-		sch->qstats.backlog += qdisc_pkt_len(nskb);
-		sch->bstats.bytes += qdisc_pkt_len(nskb);
-		sch->bstats.packets++;
-
-		return NET_XMIT_SUCCESS;
-	}
-
-	return qdisc_reshape_fail(nskb, sch);
-}
-
-static int tfifo_init(struct Qdisc *sch, struct nlattr *opt)
-{
-	struct fifo_sched_data *q = qdisc_priv(sch);
-
-	if (opt) {
-		struct tc_fifo_qopt *ctl = nla_data(opt);
-		if (nla_len(opt) < sizeof(*ctl))
-			return -EINVAL;
-
-		q->limit = ctl->limit;
-	} else
-		q->limit = max_t(u32, qdisc_dev(sch)->tx_queue_len, 1);
-
-	q->oldest = PSCHED_PASTPERFECT;
 	return 0;
 }
 
-static int tfifo_dump(struct Qdisc *sch, struct sk_buff *skb)
-{
-	struct fifo_sched_data *q = qdisc_priv(sch);
-	struct tc_fifo_qopt opt = { .limit = q->limit };
-
-	NLA_PUT(skb, TCA_OPTIONS, sizeof(opt), &opt);
-	return skb->len;
-
-nla_put_failure:
-	return -1;
-}
-
-static struct Qdisc_ops tfifo_qdisc_ops __read_mostly = {
-	.id		=	"tfifo",
-	.priv_size	=	sizeof(struct fifo_sched_data),
-	.enqueue	=	tfifo_enqueue,
-	.dequeue	=	qdisc_dequeue_head,
-	.peek		=	qdisc_peek_head,
-	.drop		=	qdisc_queue_drop,
-	.init		=	tfifo_init,
-	.reset		=	qdisc_reset_queue,
-	.change		=	tfifo_init,
-	.dump		=	tfifo_dump,
-};
-
 static int netem_init(struct Qdisc *sch, struct nlattr *opt)
 {
 	struct netem_sched_data *q = qdisc_priv(sch);
@@ -534,20 +575,11 @@ static int netem_init(struct Qdisc *sch, struct nlattr *opt)
 		return -EINVAL;
 
 	qdisc_watchdog_init(&q->watchdog, sch);
-
-	q->qdisc = qdisc_create_dflt(qdisc_dev(sch), sch->dev_queue,
-				     &tfifo_qdisc_ops,
-				     TC_H_MAKE(sch->handle, 1));
-	if (!q->qdisc) {
-		pr_debug("netem: qdisc create failed\n");
-		return -ENOMEM;
-	}
+	q->t_root = RB_ROOT;
 
 	ret = netem_change(sch, opt);
-	if (ret) {
+	if (ret)
 		pr_debug("netem: change failed\n");
-		qdisc_destroy(q->qdisc);
-	}
 	return ret;
 }
 
@@ -556,7 +588,6 @@ static void netem_destroy(struct Qdisc *sch)
 	struct netem_sched_data *q = qdisc_priv(sch);
 
 	qdisc_watchdog_cancel(&q->watchdog);
-	qdisc_destroy(q->qdisc);
 	kfree(q->delay_dist);
 }
 
@@ -569,6 +600,7 @@ static int netem_dump(struct Qdisc *sch, struct sk_buff *skb)
 	struct tc_netem_corr cor;
 	struct tc_netem_reorder reorder;
 	struct tc_netem_corrupt corrupt;
+	struct tc_netem_rate rate;
 
 	qopt.latency = q->latency;
 	qopt.jitter = q->jitter;
@@ -591,6 +623,12 @@ static int netem_dump(struct Qdisc *sch, struct sk_buff *skb)
 	corrupt.correlation = q->corrupt_cor.rho;
 	NLA_PUT(skb, TCA_NETEM_CORRUPT, sizeof(corrupt), &corrupt);
 
+	rate.rate = q->rate;
+	rate.packet_overhead = q->packet_overhead;
+	rate.cell_size = q->cell_size;
+	rate.cell_overhead = q->cell_overhead;
+	NLA_PUT(skb, TCA_NETEM_RATE, sizeof(rate), &rate);
+
 	nla->nla_len = skb_tail_pointer(skb) - b;
 
 	return skb->len;